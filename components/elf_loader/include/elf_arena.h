@@ -0,0 +1,51 @@
+#ifndef ELF_ARENA_H
+#define ELF_ARENA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ELF_ARENA_DEFAULT_SIZE	(16 * 1024)
+#define ELF_ARENA_GROW_SIZE		(8 * 1024)
+#define ELF_ARENA_BUCKETS		10		// <=16, <=32, ... <=4096, larger
+
+#define ELF_PSRAM_THRESHOLD		(4 * 1024)	// blocks this big may go to PSRAM
+#define ELF_INTERNAL_RESERVE	(32 * 1024)	// internal RAM left for the firmware
+
+typedef enum {
+	ELF_PLACE_AUTO = 0,		// internal while there's room, big blocks to PSRAM
+	ELF_PLACE_INTERNAL,
+	ELF_PLACE_PSRAM,
+} elf_placement_t;
+
+typedef struct elf_arena elf_arena_t;
+
+typedef struct {
+	size_t capacity;
+	size_t free_bytes;
+	size_t largest_free;
+	size_t live_bytes;
+	size_t peak_bytes;
+	uint32_t alloc_count;
+	uint32_t free_count;
+	uint32_t failed_count;
+	uint32_t pool_count;
+	size_t psram_capacity;
+	uint32_t histogram[ELF_ARENA_BUCKETS];
+} elf_arena_stats_t;
+
+elf_arena_t* elf_arena_create(size_t size, size_t grow_size, elf_placement_t placement);
+void elf_arena_destroy(elf_arena_t* arena);
+
+void* elf_arena_malloc(elf_arena_t* arena, size_t size);
+void* elf_arena_calloc(elf_arena_t* arena, size_t num, size_t size);
+void* elf_arena_realloc(elf_arena_t* arena, void* ptr, size_t size);
+void elf_arena_free(elf_arena_t* arena, void* ptr);
+int elf_arena_owns(elf_arena_t* arena, const void* ptr);
+
+int elf_psram_available(void);
+int elf_internal_is_tight(size_t size);
+
+void elf_arena_get_stats(elf_arena_t* arena, elf_arena_stats_t* out);
+void elf_arena_print_stats(elf_arena_t* arena);
+
+#endif
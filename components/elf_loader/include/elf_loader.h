@@ -2,7 +2,19 @@
 #define ELF_LOADER_H
 
 #include "guest_api.h"
+#include "elf_arena.h"
+#include <stdio.h>
 #include <stddef.h>
+#include <stdbool.h>
+
+#define ELF_TLS_INDEX 1
+
+#define ELF_OVERLAY_TRAMPOLINES	128
+#define ELF_OVERLAY_MIN_SLOTS	4
+#define ELF_MAX_FLASH_MAPS		8		// .rodata sections and assets mapped per module
+#define ELF_MAX_FILES			4		// guest FILEs open per module
+#define ELF_RTC_POOL_SIZE		4096	// RTC fast memory reserved for hot code
+#define ELF_RTC_MAX_BLOCKS		8
 
 typedef enum {
 	ELF_OK = 0,
@@ -14,17 +26,156 @@ typedef enum {
 	ELF_ERR_INVALID_FORMAT = -6,
 } elf_error_t;
 
+typedef struct {
+	uint32_t addr;
+	uint32_t size;
+	uint32_t name;		// offset into symbol_names
+} elf_symbol_t;
+
+typedef enum {
+	ELF_REGION_IRAM,
+	ELF_REGION_DRAM,
+	ELF_REGION_PSRAM,
+	ELF_REGION_OVERLAY,		// addr is the offset inside the overlay group
+	ELF_REGION_FLASH,		// mapped from the flash store
+	ELF_REGION_RTC,			// RTC fast memory, PRO CPU only
+} elf_region_t;
+
+typedef struct {
+	char name[24];
+	uint32_t addr;
+	uint32_t size;
+	elf_region_t region;
+} elf_section_info_t;
+
+typedef enum {
+	ELF_OVERLAY_AUTO = 0,		// only when .text doesn't fit in one IRAM block
+	ELF_OVERLAY_OFF,
+	ELF_OVERLAY_FORCE,
+} elf_overlay_mode_t;
+
+typedef enum {
+	ELF_HOT_AUTO = 0,			// IRAM, RTC fast memory when code doesn't fit
+	ELF_HOT_OFF,
+	ELF_HOT_RTC,
+} elf_hot_mode_t;
+
+typedef struct {
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t evictions;
+	uint32_t bytes_loaded;
+	int64_t load_us;
+	uint32_t group_count;
+	uint32_t resident_groups;
+	uint32_t slot_count;
+	uint32_t slot_size;
+	uint32_t stub_count;
+	uint32_t backing_size;
+} elf_overlay_stats_t;
+
+struct elf_overlay;
+struct elf_image;
+struct elf_fixup;
+
 typedef struct {
 	void* text_mem;
 	void* data_mem;
 	size_t text_size;
 	size_t data_size;
+	void* psram_mem;			// data sections placed in PSRAM
+	size_t psram_size;
+	void* rodata_mem;			// instances: read-only data, usually the image's
+	size_t rodata_size;
 	guest_entry_t entry_point;
+
+	elf_symbol_t* symbols;		// defined symbols, sorted by address
+	size_t symbol_count;
+	char* symbol_names;
+
+	elf_arena_t* arena;			// guest malloc/free go here
+	struct elf_overlay* overlay;	// NULL unless .text is paged
+
+	elf_section_info_t* sections;	// where each loaded section landed
+	size_t section_count;
+
+	struct elf_image* image;	// set for instances, which borrow its code and symbols
+
+	int flash_maps[ELF_MAX_FLASH_MAPS];	// flash store map ids, dropped on unload
+	int flash_map_count;
+
+	FILE* files[ELF_MAX_FILES];	// open guest FILEs, closed on unload
+	void* file_tasks[ELF_MAX_FILES];	// and on a fault of the task that opened them
+
+	void* file_mem;				// input buffer holding in-place sections
+	size_t file_size;
+
+	void* rtc_mem;				// .iram.hot.* sections placed in RTC fast memory
+	size_t rtc_size;
+
+	int movable;				// loaded with fixups kept, see elf_defrag()
+	struct elf_fixup* fixups;
+	uint32_t fixup_count;
+	uint32_t data_crc;			// of .data/.bss as relocated, to tell it's untouched
 } elf_module_t;
 
 typedef struct {
 	const char* entry_name;
 	int debug_level;
+	size_t heap_size;			// initial arena size, 0 = ELF_ARENA_DEFAULT_SIZE
+	size_t heap_grow;			// arena growth step, 0 = fixed size
+
+	/*
+	 * Where .data/.bss and the heap arena go. Under ELF_PLACE_AUTO sections
+	 * named .ext_ram.* always go to PSRAM, and sections of at least
+	 * psram_threshold bytes follow them, largest first, while internal RAM
+	 * is short.
+	 */
+	elf_placement_t placement;
+	size_t psram_threshold;		// 0 = ELF_PSRAM_THRESHOLD
+
+	/*
+	 * Overlays page function groups through an IRAM window. Guests have to be
+	 * built with -ffunction-sections, and calls between groups can pass at
+	 * most six argument words (nothing on the stack).
+	 */
+	elf_overlay_mode_t overlay;
+	size_t overlay_window;		// IRAM budget, 0 = half the largest free block
+	const char* overlay_backing;	// file for group images, NULL = keep in RAM
+
+	/*
+	 * Read-only data sections of at least this many bytes are written to the
+	 * flash store once and mapped from there instead of copied to RAM;
+	 * 0 = never. Sections with relocations of their own (pointer tables)
+	 * can't be patched in flash and are always loaded. Not used for images.
+	 */
+	size_t flash_rodata;
+
+	/*
+	 * The loader takes over elf_data (malloc'd, freed on failure too) and
+	 * leaves .data/.rodata where they are instead of copying them; only .bss
+	 * is allocated. Once loaded, those sections are packed to the front of
+	 * the buffer and the rest of the file is cut off with realloc. Sections
+	 * that are misaligned in the file, or belong in the other kind of RAM,
+	 * are copied as usual. Not used for images.
+	 */
+	int in_place;
+
+	/*
+	 * Keep the absolute fixups (as for images) so elf_defrag() can move the
+	 * module later. Rules out in_place and flash_rodata; dropped again when
+	 * the module ends up with overlays.
+	 */
+	int movable;
+
+	/*
+	 * Executable sections named .iram.hot.* can go to RTC fast memory (a
+	 * small pool, ELF_RTC_POOL_SIZE) when IRAM is short, so they don't end up
+	 * paged by overlays. Only the PRO CPU can run that code: guest_run() pins
+	 * such modules to core 0, and work for the task pool must not call into
+	 * it. Not used with images or movable modules.
+	 */
+	elf_hot_mode_t hot;
 } elf_load_options_t;
 
 int elf_load(const uint8_t* elf_data, size_t elf_size, elf_module_t* out_module);
@@ -35,6 +186,78 @@ void elf_unload(elf_module_t* module);
 
 void* elf_find_symbol(elf_module_t* module, const char* name);
 
+const char* elf_symbolize(const elf_module_t* module, uint32_t addr, uint32_t* out_offset);
+
+// The module's own code: text, RTC fast memory or its overlay window
+bool elf_module_owns_pc(const elf_module_t* module, uint32_t pc);
+// Whether a fault at `pc` (with return address `a0`) may be recovered as the module's
+bool elf_module_owns_fault(const elf_module_t* module, uint32_t pc, uint32_t a0);
+// Closes what the guest left open, only the files `task` opened unless it is NULL
+void elf_module_close_files(elf_module_t* module, void* task);
+
 const char* elf_strerror(int err);
+const char* elf_region_name(elf_region_t region);
+void elf_rtc_get_usage(size_t* used, size_t* total);
+
+void elf_overlay_get_stats(const struct elf_overlay* ovl, elf_overlay_stats_t* out);
+// The file the overlay pages from is `path`; it stays open until the module goes
+bool elf_overlay_uses_backing(const struct elf_overlay* ovl, const char* path);
+
+/*
+ * Load once, instantiate many. An image is relocated once and keeps its
+ * initial data as a template; each instance gets fresh .data/.bss and the
+ * recorded absolute fixups are moved by the difference in addresses. .text
+ * and read-only data are shared by all instances unless they hold addresses
+ * of .data/.bss (a literal or a const table pointing at a global), in which
+ * case every instance gets its own patched copy. Overlays are not supported
+ * for images.
+ */
+typedef struct elf_image elf_image_t;
+
+typedef struct {
+	int text_shared;
+	int rodata_shared;
+	uint32_t instances;
+	size_t text_size;
+	size_t rodata_size;
+	size_t data_size;			// DRAM + PSRAM per instance
+	size_t template_size;		// kept by the image for new instances
+	uint32_t fixup_count;
+} elf_image_info_t;
+
+int elf_image_load(const uint8_t* elf_data, size_t elf_size, const elf_load_options_t* options, elf_image_t** out_image);
+int elf_image_instantiate(elf_image_t* image, elf_module_t* out_module);
+// Drops the caller's reference; instances keep the image alive until unloaded
+void elf_image_release(elf_image_t* image);
+void elf_image_get_info(const elf_image_t* image, elf_image_info_t* out);
+int elf_image_shares_text(const elf_module_t* module);
+int elf_image_shares_rodata(const elf_module_t* module);
+
+/*
+ * Packs IRAM (and DRAM when PSRAM can hold the copies meanwhile): the
+ * blocks of all given modules are copied out and freed together, then
+ * allocated again largest first and patched through their fixups. Only
+ * modules for which elf_module_pinned() says nothing are moved. A module
+ * that can't get its memory back has entry_point cleared and must be
+ * unloaded.
+ */
+typedef struct {
+	int moved;
+	int data_packed;			// DRAM blocks were moved too
+	size_t iram_largest_before;
+	size_t iram_largest_after;
+	size_t dram_largest_before;
+	size_t dram_largest_after;
+} elf_defrag_result_t;
+
+// Why the module can't be moved right now, NULL if it can
+const char* elf_module_pinned(const elf_module_t* module);
+int elf_defrag(elf_module_t** modules, int count, elf_defrag_result_t* out);
+
+// Maps a flash store file for the module's lifetime
+const void* elf_asset_map(elf_module_t* module, const char* name, size_t* out_size);
+
+void elf_module_bind(elf_module_t* module);
+elf_module_t* elf_module_current(void);
 
 #endif
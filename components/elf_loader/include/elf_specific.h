@@ -4,12 +4,33 @@
 #include <elf.h>
 #include <stdint.h>
 #include <stddef.h>
+#include "elf_loader.h"
 
 #define R_XTENSA_NONE       0
 #define R_XTENSA_32         1
 #define R_XTENSA_SLOT0_OP   20
 #define R_XTENSA_ASM_EXPAND 11
 
+typedef struct elf_overlay elf_overlay_t;
+
+// Blocks a module is loaded into, as seen by image fixups
+#define ELF_BLOCK_TEXT		0
+#define ELF_BLOCK_DRAM		1
+#define ELF_BLOCK_PSRAM		2
+#define ELF_BLOCK_RODATA	3	// images only, see elf_image.c
+#define ELF_BLOCK_COUNT		4
+
+#define ELF_FIXUP_ABS		0	// word += delta of the block it points into
+#define ELF_FIXUP_CALL		1	// CALLn out of the module, re-encoded when .text moves
+
+typedef struct elf_fixup {
+	uint32_t offset;			// inside `block`
+	uint32_t target;			// ELF_FIXUP_CALL: absolute callee
+	uint8_t block;
+	uint8_t to;					// ELF_FIXUP_ABS: block the value points into
+	uint8_t type;
+} elf_fixup_t;
+
 typedef struct {
 	uint8_t* elf_data;			// sources
 	size_t elf_size;			// source size
@@ -28,6 +49,27 @@ typedef struct {
 	size_t iram_size;			// IRAM size
 	void* dram_block;			// block of Data RAM
 	size_t dram_size;			// DRAM size
+	void* psram_block;			// data sections placed in PSRAM
+	size_t psram_size;			// PSRAM size
+	void* rodata_block;			// read-only data, when shared_rodata is set
+	size_t rodata_size;
+	uint8_t* external;			// per section, set when it goes to PSRAM
+	uint8_t* in_flash;			// per section, set when it's mapped from the flash store
+	uint8_t* in_place;			// per section, set when it stays in elf_data
+	uint8_t* in_rtc;			// per section, set when it goes to RTC fast memory
+	void* rtc_block;			// instruction bus address
+	size_t rtc_size;
+	size_t in_place_size;		// of elf_data once those are packed
+	int flash_maps[ELF_MAX_FLASH_MAPS];
+	int flash_map_count;
+
+	elf_overlay_t* overlay;		// set when code is paged through an IRAM window
+
+	int record_fixups;			// building an image, see elf_image.c
+	int shared_rodata;			// image: read-only data gets a block of its own
+	elf_fixup_t* fixups;
+	uint32_t fixup_count;
+	uint32_t fixup_cap;
 	
 	int debug;
 } elf_context_t;
@@ -44,4 +86,34 @@ int elf_apply_relocations(elf_context_t* ctx);
 uint32_t elf_resolve_symbol(elf_context_t* ctx, uint32_t sym_idx);
 void* elf_lookup_export(const char* name);
 
+int elf_overlay_plan(elf_context_t* ctx, size_t window);
+int elf_overlay_section_group(elf_context_t* ctx, uint32_t shndx);
+int elf_overlay_relocate(elf_context_t* ctx, uint32_t target_idx, const Elf32_Rela* rela, uint32_t* symbol_address);
+int elf_overlay_finish(elf_context_t* ctx, const char* backing_path);
+void* elf_overlay_entry(elf_context_t* ctx, uint32_t shndx, uint32_t value);
+void elf_overlay_destroy(elf_overlay_t* ovl);
+bool elf_overlay_owns_pc(const elf_overlay_t* ovl, uint32_t pc);
+uint32_t elf_overlay_symbol_key(const elf_overlay_t* ovl, uint32_t pc);
+
+// Overlaid symbols are kept by group and offset inside it, below any real address
+#define ELF_OVERLAY_SYMBOL(group, offset)	((((uint32_t)(group) + 1) << 17) | (offset))
+#define ELF_OVERLAY_SYMBOL_GROUPS			0x1F00
+#define ELF_OVERLAY_SYMBOL_END				ELF_OVERLAY_SYMBOL(ELF_OVERLAY_SYMBOL_GROUPS, 0)
+
+int elf_prepare(elf_context_t* ctx, const elf_load_options_t* opts, guest_entry_t* entry);
+void elf_release_context(elf_context_t* ctx);
+void elf_retain_symbols(elf_context_t* ctx, elf_module_t* out);
+void elf_retain_sections(elf_context_t* ctx, elf_module_t* out);
+
+int elf_image_record(elf_context_t* ctx, uint32_t target_idx, const Elf32_Rela* rela, uint32_t symbol_address);
+void elf_fixup_apply(const elf_fixup_t* fix, uint8_t* p, const uint32_t* mem, const int32_t* delta);
+void elf_iram_read(void* dst, const void* src, size_t len);
+uint32_t elf_module_data_crc(const elf_module_t* module);
+void* elf_rtc_alloc(size_t size);
+void elf_rtc_free(void* mem);
+size_t elf_rtc_largest_free(void);
+void elf_rtc_write(void* dst, const void* src, size_t len);
+
+uint32_t elf_image_translate(const elf_module_t* module, uint32_t addr, int to_instance);
+
 #endif
@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_heap_caps.h"
+#include "multi_heap.h"
+
+#include "elf_arena.h"
+
+typedef struct elf_pool {
+	struct elf_pool* next;
+	multi_heap_handle_t heap;
+	uint8_t* start;
+	uint8_t* end;
+	size_t size;
+	int external;
+} elf_pool_t;
+
+struct elf_arena {
+	elf_pool_t* pools;
+	size_t grow_size;
+	elf_placement_t placement;
+	portMUX_TYPE lock;
+
+	size_t live_bytes;
+	size_t peak_bytes;
+	uint32_t alloc_count;
+	uint32_t free_count;
+	uint32_t failed_count;
+	uint32_t histogram[ELF_ARENA_BUCKETS];
+};
+
+static int size_bucket(size_t size) {
+	int bucket = 0;
+	size_t limit = 16;
+	while (size > limit && bucket < ELF_ARENA_BUCKETS - 1) {
+		limit <<= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+int elf_psram_available(void) {
+	return heap_caps_get_total_size(MALLOC_CAP_SPIRAM) > 0;
+}
+
+// Whether taking `size` more bytes would eat into what the firmware needs
+int elf_internal_is_tight(size_t size) {
+	size_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+	return size + ELF_INTERNAL_RESERVE > largest;
+}
+
+static int wants_psram(elf_placement_t placement, size_t size) {
+	switch (placement) {
+		case ELF_PLACE_INTERNAL:	return 0;
+		case ELF_PLACE_PSRAM:		return 1;
+		default:					return size >= ELF_PSRAM_THRESHOLD && elf_internal_is_tight(size);
+	}
+}
+
+static elf_pool_t* pool_create(size_t size, elf_placement_t placement) {
+	size = (size + 3) & ~3;
+	size_t total = sizeof(elf_pool_t) + size;
+
+	int external = wants_psram(placement, size) && elf_psram_available();
+	uint8_t* block = heap_caps_malloc(total, (external ? MALLOC_CAP_SPIRAM : MALLOC_CAP_INTERNAL) | MALLOC_CAP_8BIT);
+	if (!block && placement != ELF_PLACE_INTERNAL) {
+		// Fall back to whichever memory is left
+		external = !external;
+		block = heap_caps_malloc(total, (external ? MALLOC_CAP_SPIRAM : MALLOC_CAP_INTERNAL) | MALLOC_CAP_8BIT);
+	}
+	if (!block) {
+		return NULL;
+	}
+
+	elf_pool_t* pool = (elf_pool_t*)block;
+	pool->next = NULL;
+	pool->external = external;
+	pool->start = block + sizeof(elf_pool_t);
+	pool->end = pool->start + size;
+	pool->size = size;
+	pool->heap = multi_heap_register(pool->start, size);
+	if (!pool->heap) {
+		heap_caps_free(block);
+		return NULL;
+	}
+	return pool;
+}
+
+static elf_pool_t* find_pool(elf_arena_t* arena, const void* ptr) {
+	for (elf_pool_t* pool = arena->pools; pool; pool = pool->next) {
+		if ((const uint8_t*)ptr >= pool->start && (const uint8_t*)ptr < pool->end) {
+			return pool;
+		}
+	}
+	return NULL;
+}
+
+elf_arena_t* elf_arena_create(size_t size, size_t grow_size, elf_placement_t placement) {
+	elf_arena_t* arena = calloc(1, sizeof(elf_arena_t));
+	if (!arena) {
+		return NULL;
+	}
+
+	arena->placement = placement;
+	arena->pools = pool_create(size ? size : ELF_ARENA_DEFAULT_SIZE, placement);
+	if (!arena->pools) {
+		free(arena);
+		return NULL;
+	}
+	arena->grow_size = grow_size;
+	portMUX_INITIALIZE(&arena->lock);
+
+	return arena;
+}
+
+void elf_arena_destroy(elf_arena_t* arena) {
+	if (!arena) return;
+
+	elf_pool_t* pool = arena->pools;
+	while (pool) {
+		elf_pool_t* next = pool->next;
+		heap_caps_free(pool);
+		pool = next;
+	}
+	free(arena);
+}
+
+static void* arena_alloc_locked(elf_arena_t* arena, size_t size) {
+	for (elf_pool_t* pool = arena->pools; pool; pool = pool->next) {
+		void* ptr = multi_heap_malloc(pool->heap, size);
+		if (ptr) return ptr;
+	}
+	return NULL;
+}
+
+static void account_alloc(elf_arena_t* arena, void* ptr, size_t size) {
+	if (!ptr) {
+		arena->failed_count++;
+		return;
+	}
+	elf_pool_t* pool = find_pool(arena, ptr);
+	arena->live_bytes += multi_heap_get_allocated_size(pool->heap, ptr);
+	if (arena->live_bytes > arena->peak_bytes) {
+		arena->peak_bytes = arena->live_bytes;
+	}
+	arena->alloc_count++;
+	arena->histogram[size_bucket(size)]++;
+}
+
+static int arena_grow(elf_arena_t* arena, size_t size) {
+	if (!arena->grow_size) return 0;
+
+	// Leave room for the pool's own control structure and block header
+	size_t want = size + size / 8 + 512;
+	elf_pool_t* pool = pool_create(want > arena->grow_size ? want : arena->grow_size, arena->placement);
+	if (!pool) return 0;
+
+	taskENTER_CRITICAL(&arena->lock);
+	pool->next = arena->pools;
+	arena->pools = pool;
+	taskEXIT_CRITICAL(&arena->lock);
+	return 1;
+}
+
+void* elf_arena_malloc(elf_arena_t* arena, size_t size) {
+	taskENTER_CRITICAL(&arena->lock);
+	void* ptr = arena_alloc_locked(arena, size);
+	taskEXIT_CRITICAL(&arena->lock);
+
+	if (!ptr && arena_grow(arena, size)) {
+		taskENTER_CRITICAL(&arena->lock);
+		ptr = arena_alloc_locked(arena, size);
+		taskEXIT_CRITICAL(&arena->lock);
+	}
+
+	taskENTER_CRITICAL(&arena->lock);
+	account_alloc(arena, ptr, size);
+	taskEXIT_CRITICAL(&arena->lock);
+	return ptr;
+}
+
+void* elf_arena_calloc(elf_arena_t* arena, size_t num, size_t size) {
+	if (size && num > SIZE_MAX / size) {
+		return NULL;
+	}
+	void* ptr = elf_arena_malloc(arena, num * size);
+	if (ptr) {
+		memset(ptr, 0, num * size);
+	}
+	return ptr;
+}
+
+void elf_arena_free(elf_arena_t* arena, void* ptr) {
+	if (!ptr) return;
+
+	taskENTER_CRITICAL(&arena->lock);
+	elf_pool_t* pool = find_pool(arena, ptr);
+	if (pool) {
+		arena->live_bytes -= multi_heap_get_allocated_size(pool->heap, ptr);
+		arena->free_count++;
+		multi_heap_free(pool->heap, ptr);
+	}
+	taskEXIT_CRITICAL(&arena->lock);
+
+	// Never the system heap's to take: a stray guest pointer would corrupt it
+	if (!pool) {
+		printf("[arena] ERROR: free(%p) of memory not from this module's heap\n", ptr);
+	}
+}
+
+void* elf_arena_realloc(elf_arena_t* arena, void* ptr, size_t size) {
+	if (!ptr) {
+		return elf_arena_malloc(arena, size);
+	}
+	if (!size) {
+		elf_arena_free(arena, ptr);
+		return NULL;
+	}
+
+	taskENTER_CRITICAL(&arena->lock);
+	elf_pool_t* pool = find_pool(arena, ptr);
+	void* out = NULL;
+	size_t old_size = 0;
+	if (pool) {
+		old_size = multi_heap_get_allocated_size(pool->heap, ptr);
+		out = multi_heap_realloc(pool->heap, ptr, size);
+		if (out) {
+			arena->live_bytes -= old_size;
+			account_alloc(arena, out, size);
+		}
+	}
+	taskEXIT_CRITICAL(&arena->lock);
+
+	if (!pool) {
+		printf("[arena] ERROR: realloc(%p) of memory not from this module's heap\n", ptr);
+		return NULL;
+	}
+	if (out) {
+		return out;
+	}
+
+	// Didn't fit in its own pool, move it to another one
+	out = elf_arena_malloc(arena, size);
+	if (out) {
+		memcpy(out, ptr, old_size < size ? old_size : size);
+		elf_arena_free(arena, ptr);
+	}
+	return out;
+}
+
+int elf_arena_owns(elf_arena_t* arena, const void* ptr) {
+	taskENTER_CRITICAL(&arena->lock);
+	int owns = find_pool(arena, ptr) != NULL;
+	taskEXIT_CRITICAL(&arena->lock);
+	return owns;
+}
+
+void elf_arena_get_stats(elf_arena_t* arena, elf_arena_stats_t* out) {
+	memset(out, 0, sizeof(*out));
+
+	taskENTER_CRITICAL(&arena->lock);
+	for (elf_pool_t* pool = arena->pools; pool; pool = pool->next) {
+		multi_heap_info_t info;
+		multi_heap_get_info(pool->heap, &info);
+		out->capacity += pool->size;
+		if (pool->external) {
+			out->psram_capacity += pool->size;
+		}
+		out->free_bytes += info.total_free_bytes;
+		if (info.largest_free_block > out->largest_free) {
+			out->largest_free = info.largest_free_block;
+		}
+		out->pool_count++;
+	}
+	out->live_bytes = arena->live_bytes;
+	out->peak_bytes = arena->peak_bytes;
+	out->alloc_count = arena->alloc_count;
+	out->free_count = arena->free_count;
+	out->failed_count = arena->failed_count;
+	memcpy(out->histogram, arena->histogram, sizeof(out->histogram));
+	taskEXIT_CRITICAL(&arena->lock);
+}
+
+void elf_arena_print_stats(elf_arena_t* arena) {
+	elf_arena_stats_t stats;
+	elf_arena_get_stats(arena, &stats);
+
+	printf("Arena: %u bytes in %lu pool(s), %u free (largest %u)\n",
+		   stats.capacity, stats.pool_count, stats.free_bytes, stats.largest_free);
+	if (stats.psram_capacity) {
+		printf("PSRAM: %u of %u bytes\n", stats.psram_capacity, stats.capacity);
+	}
+	printf("Live: %u bytes, peak: %u bytes\n", stats.live_bytes, stats.peak_bytes);
+	printf("Allocs: %lu, frees: %lu, failed: %lu\n",
+		   stats.alloc_count, stats.free_count, stats.failed_count);
+
+	size_t limit = 16;
+	for (int i = 0; i < ELF_ARENA_BUCKETS; i++) {
+		if (stats.histogram[i]) {
+			if (i < ELF_ARENA_BUCKETS - 1) {
+				printf("  <= %5u: %lu\n", limit, stats.histogram[i]);
+			} else {
+				printf("  >  %5u: %lu\n", limit / 2, stats.histogram[i]);
+			}
+		}
+		limit <<= 1;
+	}
+}
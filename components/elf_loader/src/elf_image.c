@@ -0,0 +1,419 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_heap_caps.h"
+#include "esp32/rom/cache.h"
+
+#include <elf.h>
+#include "elf_specific.h"
+#include "elf_loader.h"
+
+/*
+ * Shared images.
+ *
+ * The image is relocated once at real addresses, then its blocks become
+ * templates: `base` keeps the addresses the relocation was done against,
+ * `templ` the bytes. An instance copies the templates into fresh blocks and
+ * adds base differences to the recorded absolute fixups. PC-relative code
+ * inside .text doesn't care where it lands, only calls out into the
+ * firmware are re-encoded.
+ *
+ * .text and the read-only data block aren't copied at all as long as they
+ * hold no address of a block that is.
+ */
+
+struct elf_image {
+	int refs;					// the owner plus every instance
+	int text_shared;
+	int rodata_shared;
+	void* shared[ELF_BLOCK_COUNT];	// used by all instances as is, NULL when they clone
+
+	uint32_t base[ELF_BLOCK_COUNT];
+	uint32_t size[ELF_BLOCK_COUNT];
+	uint8_t* templ[ELF_BLOCK_COUNT];
+
+	uint32_t entry;
+	elf_fixup_t* fixups;
+	uint32_t fixup_count;
+
+	elf_symbol_t* symbols;
+	size_t symbol_count;
+	char* symbol_names;
+	elf_section_info_t* sections;
+	size_t section_count;
+
+	size_t heap_size;
+	size_t heap_grow;
+	elf_placement_t placement;
+};
+
+static uint32_t block_base(elf_context_t* ctx, int block) {
+	const uint32_t base[ELF_BLOCK_COUNT] = {
+		(uint32_t)ctx->iram_block, (uint32_t)ctx->dram_block, (uint32_t)ctx->psram_block,
+		(uint32_t)ctx->rodata_block
+	};
+	return base[block];
+}
+
+static int block_of(elf_context_t* ctx, uint32_t addr) {
+	const uint32_t size[ELF_BLOCK_COUNT] = { ctx->iram_size, ctx->dram_size, ctx->psram_size, ctx->rodata_size };
+
+	for (int b = 0; b < ELF_BLOCK_COUNT; b++) {
+		uint32_t base = block_base(ctx, b);
+		if (base && addr >= base && addr < base + size[b]) return b;
+	}
+	return -1;
+}
+
+static int add_fixup(elf_context_t* ctx, elf_fixup_t fixup) {
+	if (ctx->fixup_count == ctx->fixup_cap) {
+		uint32_t cap = ctx->fixup_cap ? ctx->fixup_cap * 2 : 64;
+		elf_fixup_t* fixups = realloc(ctx->fixups, cap * sizeof(elf_fixup_t));
+		if (!fixups) return -1;
+		ctx->fixups = fixups;
+		ctx->fixup_cap = cap;
+	}
+	ctx->fixups[ctx->fixup_count++] = fixup;
+	return 0;
+}
+
+// Called for every relocation while an image is built
+int elf_image_record(elf_context_t* ctx, uint32_t target_idx, const Elf32_Rela* rela, uint32_t symbol_address) {
+	int type = rela->r_info & 0xFF;
+	if (type != R_XTENSA_32 && type != R_XTENSA_SLOT0_OP) return 0;
+	if (!(ctx->shdrs[target_idx].sh_flags & SHF_ALLOC)) return 0;
+
+	uint32_t where = ctx->shdrs[target_idx].sh_addr + rela->r_offset;
+	int block = block_of(ctx, where);
+	if (block < 0) return 0;
+
+	const Elf32_Sym* sym = &ctx->symtab[rela->r_info >> 8];
+	int internal = sym->st_shndx != SHN_UNDEF && sym->st_shndx < ctx->section_count;
+
+	elf_fixup_t fixup = {
+		.offset = where - block_base(ctx, block),
+		.block = block,
+	};
+
+	if (type == R_XTENSA_32) {
+		if (!internal) return 0;
+		int to = block_of(ctx, ctx->shdrs[sym->st_shndx].sh_addr);
+		if (to < 0) return 0;
+		fixup.type = ELF_FIXUP_ABS;
+		fixup.to = to;
+		return add_fixup(ctx, fixup);
+	}
+
+	// L32R and calls inside .text move with it
+	const uint8_t* p = ctx->elf_data + ctx->shdrs[target_idx].sh_offset + rela->r_offset;
+	if (internal || (p[0] & 0x0F) != 0x05) return 0;
+
+	fixup.type = ELF_FIXUP_CALL;
+	fixup.target = symbol_address + rela->r_addend;
+	return add_fixup(ctx, fixup);
+}
+
+// Templates aren't executed or written, PSRAM is good enough for them
+static uint8_t* template_alloc(size_t size) {
+	return heap_caps_malloc_prefer(size, 2, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, MALLOC_CAP_8BIT);
+}
+
+// IRAM only takes 32-bit loads
+void elf_iram_read(void* dst, const void* src, size_t len) {
+	const volatile uint32_t* s = (const volatile uint32_t*)src;
+	uint8_t* d = (uint8_t*)dst;
+	for (size_t i = 0; i < len; i += 4) {
+		uint32_t word = s[i / 4];
+		memcpy(d + i, &word, len - i < 4 ? len - i : 4);
+	}
+}
+
+static void free_image(elf_image_t* image) {
+	for (int b = 0; b < ELF_BLOCK_COUNT; b++) {
+		heap_caps_free(image->shared[b]);
+		heap_caps_free(image->templ[b]);
+	}
+	free(image->fixups);
+	free(image->symbols);
+	free(image->symbol_names);
+	free(image->sections);
+	free(image);
+}
+
+int elf_image_load(const uint8_t* elf_data, size_t elf_size, const elf_load_options_t* options, elf_image_t** out_image) {
+	if (!elf_data || !out_image) {
+		return ELF_ERR_INVALID_FORMAT;
+	}
+	*out_image = NULL;
+
+	elf_load_options_t opts = {0};
+	if (options) {
+		opts = *options;
+	} else {
+		opts.debug_level = 1;
+	}
+	opts.overlay = ELF_OVERLAY_OFF;
+
+	elf_image_t* image = calloc(1, sizeof(elf_image_t));
+	if (!image) {
+		return ELF_ERR_NO_MEMORY;
+	}
+
+	elf_context_t ctx = {0};
+	ctx.elf_data = elf_data;
+	ctx.elf_size = elf_size;
+	ctx.debug = opts.debug_level;
+	ctx.record_fixups = 1;
+	ctx.shared_rodata = 1;
+
+	guest_entry_t entry;
+	int err = elf_prepare(&ctx, &opts, &entry);
+	if (err != ELF_OK) goto cleanup;
+
+	image->base[ELF_BLOCK_TEXT] = (uint32_t)ctx.iram_block;
+	image->base[ELF_BLOCK_DRAM] = (uint32_t)ctx.dram_block;
+	image->base[ELF_BLOCK_PSRAM] = (uint32_t)ctx.psram_block;
+	image->base[ELF_BLOCK_RODATA] = (uint32_t)ctx.rodata_block;
+	image->size[ELF_BLOCK_TEXT] = ctx.iram_size;
+	image->size[ELF_BLOCK_DRAM] = ctx.dram_size;
+	image->size[ELF_BLOCK_PSRAM] = ctx.psram_size;
+	image->size[ELF_BLOCK_RODATA] = ctx.rodata_size;
+	image->entry = (uint32_t)entry;
+
+	// .data and .bss are per instance; whatever holds their addresses has to be as well
+	int cloned[ELF_BLOCK_COUNT] = { [ELF_BLOCK_DRAM] = 1, [ELF_BLOCK_PSRAM] = 1 };
+	for (int changed = 1; changed;) {
+		changed = 0;
+		for (uint32_t i = 0; i < ctx.fixup_count; i++) {
+			const elf_fixup_t* fix = &ctx.fixups[i];
+			if (fix->type == ELF_FIXUP_ABS && !cloned[fix->block] && cloned[fix->to]) {
+				cloned[fix->block] = 1;
+				changed = 1;
+			}
+		}
+	}
+	image->text_shared = !cloned[ELF_BLOCK_TEXT];
+	image->rodata_shared = !cloned[ELF_BLOCK_RODATA];
+
+	if (image->text_shared) {
+		image->shared[ELF_BLOCK_TEXT] = ctx.iram_block;
+	} else if (ctx.iram_size) {
+		image->templ[ELF_BLOCK_TEXT] = template_alloc(ctx.iram_size);
+		if (!image->templ[ELF_BLOCK_TEXT]) {
+			err = ELF_ERR_NO_MEMORY;
+			goto cleanup;
+		}
+		elf_iram_read(image->templ[ELF_BLOCK_TEXT], ctx.iram_block, ctx.iram_size);
+		heap_caps_free(ctx.iram_block);
+	}
+	ctx.iram_block = NULL;
+
+	// Move the initial data out of the way, internal RAM is for instances
+	void** blocks[] = { NULL, &ctx.dram_block, &ctx.psram_block, &ctx.rodata_block };
+	for (int b = ELF_BLOCK_DRAM; b < ELF_BLOCK_COUNT; b++) {
+		if (!image->size[b]) continue;
+		if (!cloned[b]) {
+			image->shared[b] = *blocks[b];
+			*blocks[b] = NULL;
+			continue;
+		}
+		image->templ[b] = template_alloc(image->size[b]);
+		if (!image->templ[b]) {
+			err = ELF_ERR_NO_MEMORY;
+			goto cleanup;
+		}
+		memcpy(image->templ[b], *blocks[b], image->size[b]);
+		heap_caps_free(*blocks[b]);
+		*blocks[b] = NULL;
+	}
+
+	elf_module_t proto = {0};
+	elf_retain_symbols(&ctx, &proto);
+	elf_retain_sections(&ctx, &proto);
+	image->symbols = proto.symbols;
+	image->symbol_count = proto.symbol_count;
+	image->symbol_names = proto.symbol_names;
+	image->sections = proto.sections;
+	image->section_count = proto.section_count;
+
+	image->fixups = ctx.fixups;
+	image->fixup_count = ctx.fixup_count;
+	ctx.fixups = NULL;
+
+	image->heap_size = opts.heap_size;
+	image->heap_grow = opts.heap_grow;
+	image->placement = opts.placement;
+	image->refs = 1;
+
+	if (ctx.debug >= 1) {
+		printf("[img] %u fixups, text %s, read-only data %s\n", image->fixup_count,
+			   image->text_shared ? "shared" : "cloned per instance",
+			   image->rodata_shared ? "shared" : "cloned per instance");
+	}
+
+	elf_release_context(&ctx);
+	*out_image = image;
+	return ELF_OK;
+
+cleanup:
+	elf_release_context(&ctx);
+	free_image(image);
+	return err;
+}
+
+// `p` is where the fixup's word is now, `mem` where the blocks will be
+void elf_fixup_apply(const elf_fixup_t* fix, uint8_t* p, const uint32_t* mem, const int32_t* delta) {
+	if (fix->type == ELF_FIXUP_ABS) {
+		elf_write32(p, elf_read32(p) + delta[fix->to]);
+	} else {
+		uint32_t pc = mem[ELF_BLOCK_TEXT] + fix->offset;
+		int32_t offset_words = (int32_t)(fix->target - ((pc + 4) & ~3)) >> 2;
+		uint32_t inst = elf_read24(p);
+		inst = (inst & 0x3F) | ((offset_words & 0x3FFFF) << 6);
+		elf_write24(p, inst);
+	}
+}
+
+int elf_image_instantiate(elf_image_t* image, elf_module_t* out) {
+	if (!image || !out) {
+		return ELF_ERR_INVALID_FORMAT;
+	}
+	memset(out, 0, sizeof(*out));
+
+	void* mem[ELF_BLOCK_COUNT] = {0};
+	uint8_t* staging = NULL;
+	const uint32_t caps[ELF_BLOCK_COUNT] = {
+		MALLOC_CAP_EXEC | MALLOC_CAP_32BIT,
+		MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT,
+		MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT,
+		MALLOC_CAP_8BIT,
+	};
+
+	for (int b = 0; b < ELF_BLOCK_COUNT; b++) {
+		mem[b] = image->shared[b];
+		if (!image->size[b] || mem[b]) continue;
+		mem[b] = heap_caps_malloc(image->size[b], caps[b]);
+		if (!mem[b]) goto no_memory;
+	}
+
+	if (!image->text_shared && image->size[ELF_BLOCK_TEXT]) {
+		// Patched in RAM, IRAM can't take the byte writes
+		staging = malloc(image->size[ELF_BLOCK_TEXT]);
+		if (!staging) goto no_memory;
+		memcpy(staging, image->templ[ELF_BLOCK_TEXT], image->size[ELF_BLOCK_TEXT]);
+	}
+	for (int b = ELF_BLOCK_DRAM; b < ELF_BLOCK_COUNT; b++) {
+		if (image->templ[b]) memcpy(mem[b], image->templ[b], image->size[b]);
+	}
+
+	uint32_t addr[ELF_BLOCK_COUNT];
+	int32_t delta[ELF_BLOCK_COUNT];
+	for (int b = 0; b < ELF_BLOCK_COUNT; b++) {
+		addr[b] = (uint32_t)mem[b];
+		delta[b] = mem[b] ? (int32_t)(addr[b] - image->base[b]) : 0;
+	}
+
+	for (uint32_t i = 0; i < image->fixup_count; i++) {
+		const elf_fixup_t* fix = &image->fixups[i];
+		// Shared blocks only point at blocks that don't move either
+		if (image->shared[fix->block]) continue;
+		if (fix->block == ELF_BLOCK_TEXT) {
+			elf_fixup_apply(fix, staging + fix->offset, addr, delta);
+		} else {
+			elf_fixup_apply(fix, (uint8_t*)mem[fix->block] + fix->offset, addr, delta);
+		}
+	}
+
+	if (staging) {
+		elf_iram_memcpy(mem[ELF_BLOCK_TEXT], staging, image->size[ELF_BLOCK_TEXT]);
+		free(staging);
+		staging = NULL;
+		Cache_Flush(0);
+	}
+
+	if (image->section_count) {
+		out->sections = malloc(image->section_count * sizeof(elf_section_info_t));
+		if (!out->sections) goto no_memory;
+		memcpy(out->sections, image->sections, image->section_count * sizeof(elf_section_info_t));
+		out->section_count = image->section_count;
+	}
+
+	out->arena = elf_arena_create(image->heap_size, image->heap_grow, image->placement);
+	if (!out->arena) goto no_memory;
+
+	out->text_mem = mem[ELF_BLOCK_TEXT];
+	out->text_size = image->size[ELF_BLOCK_TEXT];
+	out->data_mem = mem[ELF_BLOCK_DRAM];
+	out->data_size = image->size[ELF_BLOCK_DRAM];
+	out->psram_mem = mem[ELF_BLOCK_PSRAM];
+	out->psram_size = image->size[ELF_BLOCK_PSRAM];
+	out->rodata_mem = mem[ELF_BLOCK_RODATA];
+	out->rodata_size = image->size[ELF_BLOCK_RODATA];
+	out->entry_point = (guest_entry_t)(image->entry + delta[ELF_BLOCK_TEXT]);
+	out->symbols = image->symbols;
+	out->symbol_count = image->symbol_count;
+	out->symbol_names = image->symbol_names;
+	out->image = image;
+	image->refs++;
+
+	for (size_t i = 0; i < out->section_count; i++) {
+		out->sections[i].addr = elf_image_translate(out, out->sections[i].addr, 1);
+	}
+	return ELF_OK;
+
+no_memory:
+	printf("[img] ERROR: Out of memory for the instance\n");
+	free(staging);
+	free(out->sections);
+	for (int b = 0; b < ELF_BLOCK_COUNT; b++) {
+		if (mem[b] && mem[b] != image->shared[b]) heap_caps_free(mem[b]);
+	}
+	memset(out, 0, sizeof(*out));
+	return ELF_ERR_NO_MEMORY;
+}
+
+void elf_image_release(elf_image_t* image) {
+	if (image && --image->refs == 0) {
+		free_image(image);
+	}
+}
+
+int elf_image_shares_text(const elf_module_t* module) {
+	return module->image && module->text_mem == module->image->shared[ELF_BLOCK_TEXT];
+}
+
+int elf_image_shares_rodata(const elf_module_t* module) {
+	return module->image && module->rodata_mem == module->image->shared[ELF_BLOCK_RODATA];
+}
+
+// Maps an address between the image's layout and the instance's blocks
+uint32_t elf_image_translate(const elf_module_t* module, uint32_t addr, int to_instance) {
+	const elf_image_t* image = module->image;
+	if (!image) return addr;
+
+	const uint32_t mem[ELF_BLOCK_COUNT] = {
+		(uint32_t)module->text_mem, (uint32_t)module->data_mem, (uint32_t)module->psram_mem,
+		(uint32_t)module->rodata_mem
+	};
+	for (int b = 0; b < ELF_BLOCK_COUNT; b++) {
+		if (!image->size[b]) continue;
+		uint32_t from = to_instance ? image->base[b] : mem[b];
+		uint32_t to = to_instance ? mem[b] : image->base[b];
+		if (addr >= from && addr < from + image->size[b]) return addr - from + to;
+	}
+	return addr;
+}
+
+void elf_image_get_info(const elf_image_t* image, elf_image_info_t* out) {
+	memset(out, 0, sizeof(*out));
+	out->text_shared = image->text_shared;
+	out->rodata_shared = image->rodata_shared;
+	out->instances = image->refs - 1;
+	out->text_size = image->size[ELF_BLOCK_TEXT];
+	out->rodata_size = image->size[ELF_BLOCK_RODATA];
+	out->data_size = image->size[ELF_BLOCK_DRAM] + image->size[ELF_BLOCK_PSRAM];
+	for (int b = 0; b < ELF_BLOCK_COUNT; b++) {
+		if (image->templ[b]) out->template_size += image->size[b];
+	}
+	out->fixup_count = image->fixup_count;
+}
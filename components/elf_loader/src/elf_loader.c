@@ -1,7 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "freertos/FreeRTOS.h"
 #include "esp_heap_caps.h"
+#include "esp_memory_utils.h"
+#include "esp_rom_crc.h"
+#include "esp_attr.h"
 #include "esp32/rom/cache.h"
 #include "xtensa_context.h"
 
@@ -9,6 +13,13 @@
 #include "elf_loader.h"
 #include "elf_specific.h"
 #include "guest_api.h"
+#include "task_pool.h"
+#include "trace.h"
+#include "guest_hooks.h"
+#include "guest_perf.h"
+#include "guest_coro.h"
+#include "guest_string.h"
+#include "flash_store.h"
 
 extern int elf_is_iram_section(const Elf32_Shdr* sh, const char* name);
 extern int elf_apply_relocations(elf_context_t* ctx);
@@ -84,7 +95,11 @@ typedef enum {
 	SEC_SKIP,
 	SEC_IRAM,
 	SEC_DRAM,
-	SEC_NULL
+	SEC_NULL,
+	SEC_OVERLAY,
+	SEC_FLASH,
+	SEC_IN_PLACE,
+	SEC_RTC
 } section_load_type_t;
 
 static section_load_type_t get_section_load_type(const Elf32_Shdr* shdr) {
@@ -95,15 +110,185 @@ static section_load_type_t get_section_load_type(const Elf32_Shdr* shdr) {
 	return SEC_DRAM;
 }
 
+// Like get_section_load_type(), but knows about sections paged by the overlay manager
+static section_load_type_t get_placement(elf_context_t* ctx, uint32_t idx) {
+	if (elf_overlay_section_group(ctx, idx) >= 0) return SEC_OVERLAY;
+	if (ctx->in_flash && ctx->in_flash[idx]) return SEC_FLASH;
+	if (ctx->in_place && ctx->in_place[idx]) return SEC_IN_PLACE;
+	if (ctx->in_rtc && ctx->in_rtc[idx]) return SEC_RTC;
+	return get_section_load_type(&ctx->shdrs[idx]);
+}
+
+// Images keep read-only data apart so their instances can share it
+static int is_shared_rodata(elf_context_t* ctx, uint32_t idx) {
+	return ctx->shared_rodata && get_placement(ctx, idx) == SEC_DRAM && !(ctx->shdrs[idx].sh_flags & SHF_WRITE);
+}
+
+static int is_data_section(const Elf32_Shdr* shdr) {
+	section_load_type_t type = get_section_load_type(shdr);
+	return type == SEC_DRAM || type == SEC_NULL;
+}
+
+static int has_relocations(elf_context_t* ctx, uint32_t idx) {
+	for (uint32_t i = 0; i < ctx->section_count; i++) {
+		if (ctx->shdrs[i].sh_type == SHT_RELA && ctx->shdrs[i].sh_info == idx) return 1;
+	}
+	return 0;
+}
+
+// Content-addressed, so reloading the same module maps what's already there
+static int map_rodata(elf_context_t* ctx, uint32_t idx) {
+	const Elf32_Shdr* shdr = &ctx->shdrs[idx];
+	const uint8_t* src = ctx->elf_data + shdr->sh_offset;
+
+	char name[FLASH_STORE_NAME_LEN];
+	snprintf(name, sizeof(name), ".ro-%08lx-%lx", esp_rom_crc32_le(0, src, shdr->sh_size), shdr->sh_size);
+
+	const void* data;
+	int id = flash_store_mmap(name, &data, NULL);
+	if (id < 0) {
+		esp_err_t err = flash_store_write(name, src, shdr->sh_size);
+		if (err == ESP_ERR_NO_MEM) {
+			// Make room by dropping rodata of modules that aren't loaded
+			flash_store_remove_prefix(".ro-");
+			err = flash_store_write(name, src, shdr->sh_size);
+		}
+		if (err != ESP_OK) return -1;
+		id = flash_store_mmap(name, &data, NULL);
+		if (id < 0) return -1;
+	}
+
+	ctx->flash_maps[ctx->flash_map_count++] = id;
+	ctx->shdrs[idx].sh_addr = (uint32_t)data;
+	return 0;
+}
+
+static int choose_flash_sections(elf_context_t* ctx, const elf_load_options_t* opts) {
+	ctx->in_flash = calloc(ctx->section_count, 1);
+	if (!ctx->in_flash) {
+		return ELF_ERR_NO_MEMORY;
+	}
+
+	size_t threshold = opts ? opts->flash_rodata : 0;
+	if (!threshold || ctx->record_fixups) return ELF_OK;
+
+	for (uint32_t i = 0; i < ctx->section_count; i++) {
+		const Elf32_Shdr* shdr = &ctx->shdrs[i];
+		if (get_section_load_type(shdr) != SEC_DRAM || (shdr->sh_flags & SHF_WRITE)) continue;
+		if (shdr->sh_size < threshold || has_relocations(ctx, i)) continue;
+		if (ctx->flash_map_count == ELF_MAX_FLASH_MAPS) break;
+
+		// Anything that doesn't make it to flash is simply loaded as usual
+		if (map_rodata(ctx, i) == 0) {
+			ctx->in_flash[i] = 1;
+			if (ctx->debug >= 1) {
+				printf("[elf] %s: %lu bytes mapped from flash\n", ctx->shstrtab + shdr->sh_name, shdr->sh_size);
+			}
+		}
+	}
+	return ELF_OK;
+}
+
+static int choose_placement(elf_context_t* ctx, const elf_load_options_t* opts) {
+	ctx->external = calloc(ctx->section_count, 1);
+	if (!ctx->external) {
+		return ELF_ERR_NO_MEMORY;
+	}
+
+	elf_placement_t placement = opts ? opts->placement : ELF_PLACE_AUTO;
+	if (placement == ELF_PLACE_INTERNAL) return ELF_OK;
+
+	if (!elf_psram_available()) {
+		if (placement == ELF_PLACE_PSRAM) {
+			printf("[elf] WARNING: No PSRAM, data stays in internal RAM\n");
+		}
+		return ELF_OK;
+	}
+
+	size_t threshold = (opts && opts->psram_threshold) ? opts->psram_threshold : ELF_PSRAM_THRESHOLD;
+	size_t internal = 0;
+
+	for (uint32_t i = 0; i < ctx->section_count; i++) {
+		const Elf32_Shdr* shdr = &ctx->shdrs[i];
+		if (!is_data_section(shdr) || ctx->in_flash[i]) continue;
+
+		const char* name = ctx->shstrtab + shdr->sh_name;
+		if (placement == ELF_PLACE_PSRAM || strncmp(name, ".ext_ram", 8) == 0) {
+			ctx->external[i] = 1;
+		} else {
+			internal += shdr->sh_size;
+		}
+	}
+
+	// Move the biggest sections out until the rest fits next to the firmware
+	while (elf_internal_is_tight(internal)) {
+		int best = -1;
+		for (uint32_t i = 0; i < ctx->section_count; i++) {
+			const Elf32_Shdr* shdr = &ctx->shdrs[i];
+			if (!is_data_section(shdr) || ctx->external[i] || ctx->in_flash[i] || shdr->sh_size < threshold) continue;
+			if (best < 0 || shdr->sh_size > ctx->shdrs[best].sh_size) {
+				best = i;
+			}
+		}
+		if (best < 0) break;
+
+		ctx->external[best] = 1;
+		internal -= ctx->shdrs[best].sh_size;
+	}
+
+	return ELF_OK;
+}
+
+// Sections get their packed address now; relocations patch them where they are
+// in the file and compact_in_place() moves them down afterwards, in file order
+static int choose_in_place(elf_context_t* ctx, const elf_load_options_t* opts) {
+	if (!opts || !opts->in_place || ctx->record_fixups) return ELF_OK;
+
+	ctx->in_place = calloc(ctx->section_count, 1);
+	if (!ctx->in_place) {
+		return ELF_ERR_NO_MEMORY;
+	}
+
+	int external = esp_ptr_external_ram(ctx->elf_data);
+	uint32_t base = (uint32_t)ctx->elf_data;
+	uint32_t pos = base;
+	uint32_t file_end = 0;
+
+	for (uint32_t i = 0; i < ctx->section_count; i++) {
+		Elf32_Shdr* shdr = &ctx->shdrs[i];
+		if (get_placement(ctx, i) != SEC_DRAM || ctx->external[i] != external) continue;
+
+		// Moving down must never overwrite a section that hasn't moved yet
+		uint32_t align = shdr->sh_addralign ? shdr->sh_addralign : 1;
+		uint32_t src = base + shdr->sh_offset;
+		uint32_t dst = ALIGNUP(align, pos);
+		if (src % align || shdr->sh_offset < file_end || dst > src) continue;
+
+		ctx->in_place[i] = 1;
+		shdr->sh_addr = dst;
+		pos = dst + shdr->sh_size;
+		file_end = shdr->sh_offset + shdr->sh_size;
+	}
+
+	ctx->in_place_size = pos - base;
+	return ELF_OK;
+}
+
 static void assign_virtual_addresses(elf_context_t* ctx) {
 	uint32_t iramv = 0;
+	uint32_t rtcv = 0;
 	uint32_t dramv = 0;
+	uint32_t psramv = 0;
+	uint32_t rodatav = 0;
 
 	for (int i = 0; i < ctx->section_count; i++) {
 		Elf32_Shdr* shdr = &ctx->shdrs[i];
 
-		switch (get_section_load_type(shdr)) {
+		switch (get_placement(ctx, i)) {
 			case SEC_SKIP:
+			case SEC_OVERLAY:
+			case SEC_FLASH:
+			case SEC_IN_PLACE:
 				continue;
 			case SEC_IRAM: {
 				iramv = ALIGNUP(shdr->sh_addralign, iramv);
@@ -111,24 +296,107 @@ static void assign_virtual_addresses(elf_context_t* ctx) {
 				iramv += shdr->sh_size;
 				break;
 			}
+			case SEC_RTC: {
+				rtcv = ALIGNUP(shdr->sh_addralign, rtcv);
+				shdr->sh_addr = rtcv;
+				rtcv += shdr->sh_size;
+				break;
+			}
 			case SEC_NULL:
 			case SEC_DRAM: {
-				dramv = ALIGNUP(shdr->sh_addralign, dramv);
-				shdr->sh_addr = dramv;
-				dramv += shdr->sh_size;
+				uint32_t* v = is_shared_rodata(ctx, i) ? &rodatav : ctx->external[i] ? &psramv : &dramv;
+				*v = ALIGNUP(shdr->sh_addralign, *v);
+				shdr->sh_addr = *v;
+				*v += shdr->sh_size;
 				break;
 			}
 		}
 	}
 
 	ctx->iram_size = iramv;
+	ctx->rtc_size = rtcv;
 	ctx->dram_size = dramv;
+	ctx->psram_size = psramv;
+	ctx->rodata_size = rodatav;
+}
+
+// The literal section gets .literal in front or behind, depending on the assembler
+static int is_hot_section(elf_context_t* ctx, uint32_t idx) {
+	const Elf32_Shdr* shdr = &ctx->shdrs[idx];
+	return get_section_load_type(shdr) == SEC_IRAM && strstr(ctx->shstrtab + shdr->sh_name, ".iram.hot") != NULL;
+}
+
+// All hot sections or none: split up, code could end up away from its literals
+static int choose_rtc_sections(elf_context_t* ctx, const elf_load_options_t* opts) {
+	elf_hot_mode_t mode = opts ? opts->hot : ELF_HOT_AUTO;
+	if (mode == ELF_HOT_OFF || ctx->record_fixups || ctx->iram_size == 0) return ELF_OK;
+	if (mode == ELF_HOT_AUTO && ctx->iram_size <= heap_caps_get_largest_free_block(MALLOC_CAP_EXEC | MALLOC_CAP_32BIT)) {
+		return ELF_OK;
+	}
+
+	uint32_t size = 0;
+	for (uint32_t i = 0; i < ctx->section_count; i++) {
+		if (!is_hot_section(ctx, i)) continue;
+		size = ALIGNUP(ctx->shdrs[i].sh_addralign, size) + ctx->shdrs[i].sh_size;
+	}
+	if (!size) return ELF_OK;
+
+	size_t room = elf_rtc_largest_free();
+	if (size > room) {
+		if (ctx->debug >= 1) {
+			printf("[elf] Hot code is %lu bytes, RTC fast memory has %u: left in IRAM\n", size, room);
+		}
+		return ELF_OK;
+	}
+
+	ctx->in_rtc = calloc(ctx->section_count, 1);
+	if (!ctx->in_rtc) {
+		return ELF_ERR_NO_MEMORY;
+	}
+	for (uint32_t i = 0; i < ctx->section_count; i++) {
+		if (is_hot_section(ctx, i)) ctx->in_rtc[i] = 1;
+	}
+
+	assign_virtual_addresses(ctx);
+	if (ctx->debug >= 1) {
+		printf("[elf] Hot code: %u bytes to RTC fast memory, %u left for IRAM\n", ctx->rtc_size, ctx->iram_size);
+	}
+	return ELF_OK;
+}
+
+static int plan_overlays(elf_context_t* ctx, const elf_load_options_t* opts) {
+	elf_overlay_mode_t mode = opts ? opts->overlay : ELF_OVERLAY_AUTO;
+	if (mode == ELF_OVERLAY_OFF || ctx->iram_size == 0) return ELF_OK;
+
+	size_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_EXEC | MALLOC_CAP_32BIT);
+	if (mode == ELF_OVERLAY_AUTO && ctx->iram_size <= largest) return ELF_OK;
+
+	if (ctx->debug >= 1) {
+		printf("[elf] Code is %u bytes, largest IRAM block %u: using overlays\n", ctx->iram_size, largest);
+	}
+
+	int err = elf_overlay_plan(ctx, opts ? opts->overlay_window : 0);
+	if (err != ELF_OK) return err;
+
+	// The executable sections not in RTC now live in overlay groups and drop out
+	// of the IRAM block; the window comes later
+	assign_virtual_addresses(ctx);
+	return ELF_OK;
 }
 
 static int allocate_memory(elf_context_t* ctx) {
 	
 	if (ctx->debug >= 1) {
-		printf("[elf] Memory: IRAM=%u, DRAM=%u bytes\n", ctx->iram_size, ctx->dram_size);
+		printf("[elf] Memory: IRAM=%u, DRAM=%u, PSRAM=%u, shared RODATA=%u bytes\n",
+			   ctx->iram_size, ctx->dram_size, ctx->psram_size, ctx->rodata_size);
+	}
+
+	if (ctx->rtc_size > 0) {
+		ctx->rtc_block = elf_rtc_alloc(ctx->rtc_size);
+		if (!ctx->rtc_block) {
+			printf("[elf] ERROR: Failed to allocate RTC fast memory\n");
+			return ELF_ERR_NO_MEMORY;
+		}
 	}
 	
 	if (ctx->iram_size > 0) {
@@ -143,10 +411,9 @@ static int allocate_memory(elf_context_t* ctx) {
 	}
 	
 	if (ctx->dram_size > 0) {
-		ctx->dram_block = heap_caps_malloc(ctx->dram_size, MALLOC_CAP_8BIT);
+		ctx->dram_block = heap_caps_malloc(ctx->dram_size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
 		if (!ctx->dram_block) {
 			printf("[elf] ERROR: Failed to allocate DRAM\n");
-			if (ctx->iram_block) heap_caps_free(ctx->iram_block);
 			return ELF_ERR_NO_MEMORY;
 		}
 		memset(ctx->dram_block, 0, ctx->dram_size);
@@ -154,6 +421,31 @@ static int allocate_memory(elf_context_t* ctx) {
 			printf("[elf] DRAM block at 0x%08lx\n", (uint32_t)ctx->dram_block);
 		}
 	}
+
+	if (ctx->psram_size > 0) {
+		ctx->psram_block = heap_caps_malloc(ctx->psram_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+		if (!ctx->psram_block) {
+			printf("[elf] ERROR: Failed to allocate PSRAM\n");
+			return ELF_ERR_NO_MEMORY;
+		}
+		memset(ctx->psram_block, 0, ctx->psram_size);
+		if (ctx->debug >= 2) {
+			printf("[elf] PSRAM block at 0x%08lx\n", (uint32_t)ctx->psram_block);
+		}
+	}
+
+	if (ctx->rodata_size > 0) {
+		// One copy for every instance, so internal RAM is worth it while there is some
+		ctx->rodata_block = heap_caps_malloc_prefer(ctx->rodata_size, 2, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT,
+													MALLOC_CAP_8BIT);
+		if (!ctx->rodata_block) {
+			printf("[elf] ERROR: Failed to allocate read-only data\n");
+			return ELF_ERR_NO_MEMORY;
+		}
+		if (ctx->debug >= 2) {
+			printf("[elf] RODATA block at 0x%08lx\n", (uint32_t)ctx->rodata_block);
+		}
+	}
 	
 	return ELF_OK;
 }
@@ -162,15 +454,25 @@ static void assign_real_addresses(elf_context_t* ctx) {
 	for (int i = 0; i < ctx->section_count; i++) {
 		Elf32_Shdr* shdr = &ctx->shdrs[i];
 
-		switch (get_section_load_type(shdr)) {
+		switch (get_placement(ctx, i)) {
 			case SEC_IRAM:
 				shdr->sh_addr = (uint32_t)ctx->iram_block + shdr->sh_addr;
 				break;
+			case SEC_RTC:
+				shdr->sh_addr = (uint32_t)ctx->rtc_block + shdr->sh_addr;
+				break;
 			case SEC_DRAM:
 			case SEC_NULL:
-				shdr->sh_addr = (uint32_t)ctx->dram_block + shdr->sh_addr;
+				if (is_shared_rodata(ctx, i)) {
+					shdr->sh_addr = (uint32_t)ctx->rodata_block + shdr->sh_addr;
+				} else {
+					shdr->sh_addr = (uint32_t)(ctx->external[i] ? ctx->psram_block : ctx->dram_block) + shdr->sh_addr;
+				}
 				break;
 			case SEC_SKIP:
+			case SEC_OVERLAY:
+			case SEC_FLASH:
+			case SEC_IN_PLACE:
 				break;
 		}
 	}
@@ -182,7 +484,7 @@ static int load_sections(elf_context_t* ctx) {
 		Elf32_Shdr* shdr = &ctx->shdrs[i];
 		const char* name = ctx->shstrtab + shdr->sh_name;
 
-		switch (get_section_load_type(shdr)) {
+		switch (get_placement(ctx, i)) {
 			case SEC_IRAM: {
 				const void* src = ctx->elf_data + shdr->sh_offset;
 				elf_iram_memcpy((void*)shdr->sh_addr, src, shdr->sh_size);
@@ -192,24 +494,44 @@ static int load_sections(elf_context_t* ctx) {
 				}
 				break;
 			}
+			case SEC_RTC: {
+				const void* src = ctx->elf_data + shdr->sh_offset;
+				elf_rtc_write((void*)shdr->sh_addr, src, shdr->sh_size);
+				if (ctx->debug >= 2) {
+					printf("[sec] %s -> 0x%08lx (%lu bytes, RTC fast)\n",
+						   name, shdr->sh_addr, shdr->sh_size);
+				}
+				break;
+			}
 			case SEC_DRAM: {
 				const void* src = ctx->elf_data + shdr->sh_offset;
 				memcpy((void*)shdr->sh_addr, src, shdr->sh_size);
 				if (ctx->debug >= 2) {
-					printf("[sec] %s -> 0x%08lx (%lu bytes, DRAM)\n", 
-						   name, shdr->sh_addr, shdr->sh_size);
+					printf("[sec] %s -> 0x%08lx (%lu bytes, %s)\n", name, shdr->sh_addr, shdr->sh_size,
+						   is_shared_rodata(ctx, i) ? "shared RODATA" : ctx->external[i] ? "PSRAM" : "DRAM");
 				}
 				break;
 			}
 			case SEC_NULL: {
 				memset((void*)shdr->sh_addr, 0, shdr->sh_size);
 				if (ctx->debug >= 2) {
-					printf("[sec] %s -> 0x%08lx (%lu bytes, BSS)\n", 
-						   name, shdr->sh_addr, shdr->sh_size);
+					printf("[sec] %s -> 0x%08lx (%lu bytes, %s)\n", 
+						   name, shdr->sh_addr, shdr->sh_size, ctx->external[i] ? "BSS in PSRAM" : "BSS");
 				}
 				break;
 			}
+			case SEC_FLASH:
+				if (ctx->debug >= 2) {
+					printf("[sec] %s -> 0x%08lx (%lu bytes, flash)\n", name, shdr->sh_addr, shdr->sh_size);
+				}
+				break;
+			case SEC_IN_PLACE:
+				if (ctx->debug >= 2) {
+					printf("[sec] %s -> 0x%08lx (%lu bytes, in place)\n", name, shdr->sh_addr, shdr->sh_size);
+				}
+				break;
 			case SEC_SKIP:
+			case SEC_OVERLAY:
 				break;
 		}
 	}
@@ -240,7 +562,11 @@ static int find_entry(elf_context_t* ctx, const char* entry_name, guest_entry_t*
 			
 			if (shndx != SHN_UNDEF && shndx < ctx->section_count) {
 				const Elf32_Shdr* shdr = &ctx->shdrs[shndx];
-				*out = (guest_entry_t)(shdr->sh_addr + sym->st_value);
+				if (get_placement(ctx, shndx) == SEC_OVERLAY) {
+					*out = (guest_entry_t)elf_overlay_entry(ctx, shndx, sym->st_value);
+				} else {
+					*out = (guest_entry_t)(shdr->sh_addr + sym->st_value);
+				}
 				if (ctx->debug >= 1) {
 					printf("[elf] Entry '%s' at 0x%08lx\n", entry_name, (uint32_t)*out);
 				}
@@ -254,16 +580,256 @@ static int find_entry(elf_context_t* ctx, const char* entry_name, guest_entry_t*
 	return ELF_ERR_NO_ENTRY;
 }
 
+static int compare_symbols(const void* a, const void* b) {
+	const elf_symbol_t* sa = (const elf_symbol_t*)a;
+	const elf_symbol_t* sb = (const elf_symbol_t*)b;
+	if (sa->addr < sb->addr) return -1;
+	if (sa->addr > sb->addr) return 1;
+	return 0;
+}
+
+static int is_retained_symbol(elf_context_t* ctx, const Elf32_Sym* sym) {
+	int type = ELF32_ST_TYPE(sym->st_info);
+	if (type != STT_FUNC && type != STT_OBJECT) return 0;
+	if (sym->st_shndx == SHN_UNDEF || sym->st_shndx >= ctx->section_count) return 0;
+	if (ctx->strtab[sym->st_name] == '\0') return 0;
+	section_load_type_t placement = get_placement(ctx, sym->st_shndx);
+	if (placement == SEC_OVERLAY) {
+		// Overlaid code has no fixed address, only a group and an offset
+		return elf_overlay_section_group(ctx, sym->st_shndx) < ELF_OVERLAY_SYMBOL_GROUPS;
+	}
+	return placement != SEC_SKIP;
+}
+
+void elf_retain_symbols(elf_context_t* ctx, elf_module_t* out) {
+	if (!ctx->symtab || !ctx->strtab) return;
+
+	size_t count = 0;
+	size_t names_size = 0;
+	for (uint32_t i = 0; i < ctx->symtab_count; i++) {
+		const Elf32_Sym* sym = &ctx->symtab[i];
+		if (!is_retained_symbol(ctx, sym)) continue;
+		count++;
+		names_size += strlen(ctx->strtab + sym->st_name) + 1;
+	}
+	if (!count) return;
+
+	elf_symbol_t* symbols = malloc(count * sizeof(elf_symbol_t));
+	char* names = malloc(names_size);
+	if (!symbols || !names) {
+		printf("[elf] WARNING: No memory for symbols, faults won't be symbolized\n");
+		free(symbols);
+		free(names);
+		return;
+	}
+
+	size_t n = 0;
+	size_t pos = 0;
+	for (uint32_t i = 0; i < ctx->symtab_count; i++) {
+		const Elf32_Sym* sym = &ctx->symtab[i];
+		if (!is_retained_symbol(ctx, sym)) continue;
+
+		const char* name = ctx->strtab + sym->st_name;
+		size_t len = strlen(name) + 1;
+		memcpy(names + pos, name, len);
+
+		symbols[n].addr = ctx->shdrs[sym->st_shndx].sh_addr + sym->st_value;
+		if (get_placement(ctx, sym->st_shndx) == SEC_OVERLAY) {
+			symbols[n].addr = ELF_OVERLAY_SYMBOL(elf_overlay_section_group(ctx, sym->st_shndx), symbols[n].addr);
+		}
+		symbols[n].size = sym->st_size;
+		symbols[n].name = pos;
+		n++;
+		pos += len;
+	}
+	qsort(symbols, count, sizeof(elf_symbol_t), compare_symbols);
+
+	out->symbols = symbols;
+	out->symbol_count = count;
+	out->symbol_names = names;
+
+	if (ctx->debug >= 2) {
+		printf("[elf] Retained %u symbols (%u bytes of names)\n", count, names_size);
+	}
+}
+
+static elf_region_t section_region(elf_context_t* ctx, uint32_t idx) {
+	switch (get_placement(ctx, idx)) {
+		case SEC_IRAM:		return ELF_REGION_IRAM;
+		case SEC_RTC:		return ELF_REGION_RTC;
+		case SEC_OVERLAY:	return ELF_REGION_OVERLAY;
+		case SEC_FLASH:		return ELF_REGION_FLASH;
+		default:
+			if (is_shared_rodata(ctx, idx)) {
+				return esp_ptr_external_ram(ctx->rodata_block) ? ELF_REGION_PSRAM : ELF_REGION_DRAM;
+			}
+			return ctx->external[idx] ? ELF_REGION_PSRAM : ELF_REGION_DRAM;
+	}
+}
+
+void elf_retain_sections(elf_context_t* ctx, elf_module_t* out) {
+	size_t count = 0;
+	for (uint32_t i = 0; i < ctx->section_count; i++) {
+		if (get_placement(ctx, i) != SEC_SKIP) count++;
+	}
+	if (!count) return;
+
+	elf_section_info_t* sections = malloc(count * sizeof(elf_section_info_t));
+	if (!sections) {
+		printf("[elf] WARNING: No memory for the section map\n");
+		return;
+	}
+
+	size_t n = 0;
+	for (uint32_t i = 0; i < ctx->section_count; i++) {
+		if (get_placement(ctx, i) == SEC_SKIP) continue;
+
+		const Elf32_Shdr* shdr = &ctx->shdrs[i];
+		snprintf(sections[n].name, sizeof(sections[n].name), "%s", ctx->shstrtab + shdr->sh_name);
+		sections[n].addr = shdr->sh_addr;
+		sections[n].size = shdr->sh_size;
+		sections[n].region = section_region(ctx, i);
+		n++;
+	}
+
+	out->sections = sections;
+	out->section_count = count;
+}
+
 int elf_load(const uint8_t* elf_data, size_t elf_size, elf_module_t* out) {
 	elf_load_options_t opts = {
 		.entry_name = NULL,
-		.debug_level = 0
+		.debug_level = 0,
+		.heap_size = ELF_ARENA_DEFAULT_SIZE,
+		.heap_grow = ELF_ARENA_GROW_SIZE
 	};
 	return elf_load_ex(elf_data, elf_size, &opts, out);
 }
 
+// Everything up to relocated sections in memory; on failure the caller releases ctx
+int elf_prepare(elf_context_t* ctx, const elf_load_options_t* opts, guest_entry_t* entry) {
+	int err;
+	
+	// Each phase is closed before its error check so the trace stays balanced
+	trace_begin("elf_parse");
+	err = validate_elf(ctx);
+	if (err == ELF_OK) err = parse_sections(ctx);
+	if (err == ELF_OK) err = choose_flash_sections(ctx, opts);
+	if (err == ELF_OK) err = choose_placement(ctx, opts);
+	if (err == ELF_OK) err = choose_in_place(ctx, opts);
+	trace_end("elf_parse");
+	if (err != ELF_OK) return err;
+
+	assign_virtual_addresses(ctx);
+
+	err = choose_rtc_sections(ctx, opts);
+	if (err == ELF_OK) err = plan_overlays(ctx, opts);
+	if (err != ELF_OK) return err;
+	
+	trace_begin("elf_alloc");
+	err = allocate_memory(ctx);
+	trace_end("elf_alloc");
+	if (err != ELF_OK) return err;
+
+	assign_real_addresses(ctx);
+	
+	trace_begin("elf_relocate");
+	err = elf_apply_relocations(ctx);
+	trace_end("elf_relocate");
+	if (err != 0) return ELF_ERR_RELOC_FAILED;
+
+	if (ctx->overlay) {
+		err = elf_overlay_finish(ctx, opts ? opts->overlay_backing : NULL);
+		if (err != ELF_OK) return err;
+	}
+	
+	trace_begin("elf_copy");
+	err = load_sections(ctx);
+	if (err == ELF_OK) Cache_Flush(0);
+	trace_end("elf_copy");
+	if (err != ELF_OK) return err;
+	
+	return find_entry(ctx, opts ? opts->entry_name : NULL, entry);
+}
+
+void elf_release_context(elf_context_t* ctx) {
+	if (ctx->overlay) {
+		// The overlay owns the IRAM window
+		elf_overlay_destroy(ctx->overlay);
+	} else if (ctx->iram_block) {
+		heap_caps_free(ctx->iram_block);
+	}
+	if (ctx->dram_block) heap_caps_free(ctx->dram_block);
+	if (ctx->psram_block) heap_caps_free(ctx->psram_block);
+	if (ctx->rodata_block) heap_caps_free(ctx->rodata_block);
+	elf_rtc_free(ctx->rtc_block);
+	free(ctx->external);
+	free(ctx->in_flash);
+	free(ctx->in_place);
+	free(ctx->in_rtc);
+	free(ctx->fixups);
+	for (int i = 0; i < ctx->flash_map_count; i++) {
+		flash_store_munmap(ctx->flash_maps[i]);
+	}
+}
+
+typedef struct {
+	uint32_t dst;
+	uint32_t src;
+	uint32_t size;
+} section_move_t;
+
+// Section headers live in the buffer too, so the moves are listed first
+static int compact_in_place(elf_context_t* ctx, elf_module_t* out) {
+	size_t count = 0;
+	for (uint32_t i = 0; i < ctx->section_count; i++) {
+		if (get_placement(ctx, i) == SEC_IN_PLACE) count++;
+	}
+
+	section_move_t* moves = malloc((count ? count : 1) * sizeof(section_move_t));
+	if (!moves) {
+		return ELF_ERR_NO_MEMORY;
+	}
+	size_t n = 0;
+	for (uint32_t i = 0; i < ctx->section_count; i++) {
+		const Elf32_Shdr* shdr = &ctx->shdrs[i];
+		if (get_placement(ctx, i) != SEC_IN_PLACE) continue;
+		moves[n++] = (section_move_t){ shdr->sh_addr, (uint32_t)ctx->elf_data + shdr->sh_offset, shdr->sh_size };
+	}
+	for (size_t i = 0; i < n; i++) {
+		memmove((void*)moves[i].dst, (const void*)moves[i].src, moves[i].size);
+	}
+	free(moves);
+
+	if (!ctx->in_place_size) {
+		free(ctx->elf_data);
+		ctx->elf_data = NULL;
+		return ELF_OK;
+	}
+
+	// Shrinking never moves a block in TLSF; if it ever does, the relocated
+	// addresses are gone with the old one
+	uint8_t* kept = realloc(ctx->elf_data, ctx->in_place_size);
+	if (kept && kept != ctx->elf_data) {
+		printf("[elf] ERROR: Input buffer moved while shrinking\n");
+		free(kept);
+		ctx->elf_data = NULL;
+		return ELF_ERR_NO_MEMORY;
+	}
+
+	out->file_mem = ctx->elf_data;
+	out->file_size = kept ? ctx->in_place_size : ctx->elf_size;
+	ctx->elf_data = NULL;
+	if (ctx->debug >= 1) {
+		printf("[elf] Kept %u of %u input bytes in place\n", out->file_size, ctx->elf_size);
+	}
+	return ELF_OK;
+}
+
 int elf_load_ex(const uint8_t* elf_data, size_t elf_size, const elf_load_options_t* opts, elf_module_t* out) {
+	int in_place = opts && opts->in_place;
 	if (!elf_data || !out) {
+		if (in_place) free((void*)elf_data);
 		return ELF_ERR_INVALID_FORMAT;
 	}
 	
@@ -273,41 +839,66 @@ int elf_load_ex(const uint8_t* elf_data, size_t elf_size, const elf_load_options
 	ctx.elf_data = elf_data;
 	ctx.elf_size = elf_size;
 	ctx.debug = opts ? opts->debug_level : 1;
+	ctx.record_fixups = opts && opts->movable && !in_place;
 	
-	int err;
-	
-	err = validate_elf(&ctx);
-	if (err != ELF_OK) goto cleanup;
-	
-	err = parse_sections(&ctx);
-	if (err != ELF_OK) goto cleanup;
-
-	assign_virtual_addresses(&ctx);
-	
-	err = allocate_memory(&ctx);
-	if (err != ELF_OK) goto cleanup;
-
-	assign_real_addresses(&ctx);
-	
-	err = elf_apply_relocations(&ctx);
-	if (err != 0) {
-		err = ELF_ERR_RELOC_FAILED;
-		goto cleanup;
-	}
-	
-	err = load_sections(&ctx);
-	if (err != ELF_OK) goto cleanup;
-
-	Cache_Flush(0);
-	
-	const char* entry_name = opts ? opts->entry_name : NULL;
-	err = find_entry(&ctx, entry_name, &out->entry_point);
+	int err = elf_prepare(&ctx, opts, &out->entry_point);
 	if (err != ELF_OK) goto cleanup;
 	
 	out->text_mem = ctx.iram_block;
 	out->text_size = ctx.iram_size;
 	out->data_mem = ctx.dram_block;
 	out->data_size = ctx.dram_size;
+	out->psram_mem = ctx.psram_block;
+	out->psram_size = ctx.psram_size;
+	out->rtc_mem = ctx.rtc_block;
+	out->rtc_size = ctx.rtc_size;
+	out->overlay = ctx.overlay;
+
+	out->arena = elf_arena_create(opts ? opts->heap_size : 0,
+								  opts ? opts->heap_grow : ELF_ARENA_GROW_SIZE,
+								  opts ? opts->placement : ELF_PLACE_AUTO);
+	if (!out->arena) {
+		printf("[elf] ERROR: Failed to allocate module heap\n");
+		memset(out, 0, sizeof(*out));
+		err = ELF_ERR_NO_MEMORY;
+		goto cleanup;
+	}
+	if (ctx.debug >= 2) {
+		printf("[elf] Heap arena ready\n");
+	}
+
+	elf_retain_symbols(&ctx, out);
+	elf_retain_sections(&ctx, out);
+
+	if (in_place) {
+		err = compact_in_place(&ctx, out);
+		if (err != ELF_OK) {
+			free(out->symbols);
+			free(out->symbol_names);
+			free(out->sections);
+			elf_arena_destroy(out->arena);
+			memset(out, 0, sizeof(*out));
+			goto cleanup;
+		}
+	}
+	free(ctx.external);
+	free(ctx.in_flash);
+	free(ctx.in_place);
+	free(ctx.in_rtc);
+
+	// The module holds the mappings of its flash sections from now on
+	memcpy(out->flash_maps, ctx.flash_maps, sizeof(ctx.flash_maps));
+	out->flash_map_count = ctx.flash_map_count;
+
+	// Paged code has no single address to move
+	if (ctx.record_fixups && !ctx.overlay) {
+		out->movable = 1;
+		out->fixups = ctx.fixups;
+		out->fixup_count = ctx.fixup_count;
+		out->data_crc = elf_module_data_crc(out);
+		ctx.fixups = NULL;
+	}
+	free(ctx.fixups);
 
 	if (ctx.debug >= 1) {
 		printf("[elf] Module loaded successfully\n");
@@ -316,24 +907,153 @@ int elf_load_ex(const uint8_t* elf_data, size_t elf_size, const elf_load_options
 	return ELF_OK;
 
 cleanup:
-	if (ctx.iram_block) heap_caps_free(ctx.iram_block);
-	if (ctx.dram_block) heap_caps_free(ctx.dram_block);
+	elf_release_context(&ctx);
+	if (in_place) free(ctx.elf_data);
 	return err;
 }
 
+uint32_t elf_module_data_crc(const elf_module_t* module) {
+	uint32_t crc = 0;
+	if (module->data_mem) crc = esp_rom_crc32_le(crc, module->data_mem, module->data_size);
+	if (module->psram_mem) crc = esp_rom_crc32_le(crc, module->psram_mem, module->psram_size);
+	return crc;
+}
+
 void elf_unload(elf_module_t* module) {
 	if (!module) return;
 	
-	if (module->text_mem) {
+	// Timers, interrupts and workers may still call into the module
+	guest_hooks_release(module);
+	task_pool_cancel(module);
+	guest_perf_release(module);
+	guest_coro_release(module);
+	elf_module_close_files(module, NULL);
+
+	if (module->overlay) {
+		elf_overlay_destroy(module->overlay);
+	} else if (module->text_mem && !elf_image_shares_text(module)) {
 		heap_caps_free(module->text_mem);
 	}
 	if (module->data_mem) {
 		heap_caps_free(module->data_mem);
 	}
+	if (module->psram_mem) {
+		heap_caps_free(module->psram_mem);
+	}
+	if (module->rodata_mem && !elf_image_shares_rodata(module)) {
+		heap_caps_free(module->rodata_mem);
+	}
+	elf_rtc_free(module->rtc_mem);
+	free(module->sections);
+	free(module->file_mem);
+	free(module->fixups);
+	if (module->image) {
+		elf_image_release(module->image);
+	} else {
+		free(module->symbols);
+		free(module->symbol_names);
+	}
+	elf_arena_destroy(module->arena);
+	for (int i = 0; i < module->flash_map_count; i++) {
+		flash_store_munmap(module->flash_maps[i]);
+	}
 	
 	memset(module, 0, sizeof(*module));
 }
 
+static portMUX_TYPE flash_maps_lock = portMUX_INITIALIZER_UNLOCKED;
+
+const void* elf_asset_map(elf_module_t* module, const char* name, size_t* out_size) {
+	if (!module || !name) return NULL;
+
+	const void* data;
+	size_t size;
+	int id = flash_store_mmap(name, &data, &size);
+	if (id < 0) return NULL;
+
+	// Mapping the same file again only takes another reference
+	int keep = 0;
+	taskENTER_CRITICAL(&flash_maps_lock);
+	int known = 0;
+	for (int i = 0; i < module->flash_map_count; i++) {
+		if (module->flash_maps[i] == id) known = 1;
+	}
+	if (!known && module->flash_map_count < ELF_MAX_FLASH_MAPS) {
+		module->flash_maps[module->flash_map_count++] = id;
+		keep = 1;
+	}
+	taskEXIT_CRITICAL(&flash_maps_lock);
+
+	if (!keep) {
+		flash_store_munmap(id);
+		if (!known) return NULL;
+	}
+	if (out_size) *out_size = size;
+	return data;
+}
+
+void* elf_find_symbol(elf_module_t* module, const char* name) {
+	if (!module || !name) return NULL;
+
+	for (size_t i = 0; i < module->symbol_count; i++) {
+		if (module->symbols[i].addr < ELF_OVERLAY_SYMBOL_END) continue;
+		if (strcmp(module->symbol_names + module->symbols[i].name, name) == 0) {
+			return (void*)elf_image_translate(module, module->symbols[i].addr, 1);
+		}
+	}
+	return NULL;
+}
+
+// From the exception dispatcher, so it stays out of flash
+IRAM_ATTR bool elf_module_owns_pc(const elf_module_t* module, uint32_t pc) {
+	uint32_t text = (uint32_t)module->text_mem;
+	uint32_t rtc = (uint32_t)module->rtc_mem;
+	if (text && pc >= text && pc < text + module->text_size) return true;
+	if (rtc && pc >= rtc && pc < rtc + module->rtc_size) return true;
+	return module->overlay && elf_overlay_owns_pc(module->overlay, pc);
+}
+
+/*
+ * Only code that holds no firmware locks can be abandoned: the module's own,
+ * or a lock-free export the module called directly. A fault anywhere deeper
+ * in the firmware (heap, newlib, console) is not the guest's to recover.
+ */
+IRAM_ATTR bool elf_module_owns_fault(const elf_module_t* module, uint32_t pc, uint32_t a0) {
+	if (elf_module_owns_pc(module, pc)) return true;
+	if (!guest_string_owns_pc(pc)) return false;
+	uint32_t ret = (a0 & 0x3FFFFFFF) | (pc & 0xC0000000);
+	return elf_module_owns_pc(module, ret);
+}
+
+const char* elf_symbolize(const elf_module_t* module, uint32_t addr, uint32_t* out_offset) {
+	if (!module || !module->symbol_count) return NULL;
+
+	if (module->overlay && elf_overlay_owns_pc(module->overlay, addr)) {
+		addr = elf_overlay_symbol_key(module->overlay, addr);
+		if (!addr) return NULL;
+	} else {
+		// Instances share the image's table, which holds the image's addresses
+		addr = elf_image_translate(module, addr, 0);
+	}
+
+	size_t lo = 0;
+	size_t hi = module->symbol_count;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (module->symbols[mid].addr <= addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == 0) return NULL;
+
+	const elf_symbol_t* sym = &module->symbols[lo - 1];
+	if (sym->size && addr - sym->addr >= sym->size) return NULL;
+	if (out_offset) *out_offset = addr - sym->addr;
+	return module->symbol_names + sym->name;
+}
+
 const char* elf_strerror(int err) {
 	switch (err) {
 		case ELF_OK:				return "Success";
@@ -346,3 +1066,15 @@ const char* elf_strerror(int err) {
 		default:					return "Unknown error";
 	}
 }
+
+const char* elf_region_name(elf_region_t region) {
+	switch (region) {
+		case ELF_REGION_IRAM:		return "IRAM";
+		case ELF_REGION_DRAM:		return "DRAM";
+		case ELF_REGION_PSRAM:		return "PSRAM";
+		case ELF_REGION_OVERLAY:	return "overlay";
+		case ELF_REGION_FLASH:		return "flash";
+		case ELF_REGION_RTC:		return "RTC fast";
+		default:					return "unknown";
+	}
+}
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_heap_caps.h"
+#include "esp32/rom/cache.h"
+
+#include "elf_specific.h"
+#include "elf_loader.h"
+#include "guest_hooks.h"
+
+/*
+ * Moving modules.
+ *
+ * A movable module keeps the fixups an image would record: every absolute
+ * address it holds into its own blocks, and every call out of .text. Moving
+ * a block adds the difference to the words pointing into it, and calls are
+ * re-encoded for the new PC. Anything the guest stored at run time is not
+ * covered, so a module only moves while its data is as the loader left it
+ * and nothing outside holds its addresses.
+ */
+
+#define CAPS_TEXT	(MALLOC_CAP_EXEC | MALLOC_CAP_32BIT)
+#define CAPS_DRAM	(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+
+typedef struct {
+	elf_module_t* module;
+	uint8_t* copy[ELF_BLOCK_COUNT];		// contents while the block is away
+	uint32_t old[ELF_BLOCK_COUNT];
+	uint32_t size[ELF_BLOCK_COUNT];
+	void* mem[ELF_BLOCK_COUNT];			// new block
+} move_t;
+
+const char* elf_module_pinned(const elf_module_t* module) {
+	if (!module->entry_point) return "not loaded";
+	if (module->image) return "instance of an image";
+	if (!module->movable) return "not loaded movable";
+	if (guest_hooks_count(module)) return "has timers or interrupts";
+
+	elf_arena_stats_t arena;
+	elf_arena_get_stats(module->arena, &arena);
+	if (arena.live_bytes) return "holds heap blocks";
+	if (elf_module_data_crc(module) != module->data_crc) return "data changed since load";
+	return NULL;
+}
+
+static void largest_free(size_t* iram, size_t* dram) {
+	*iram = heap_caps_get_largest_free_block(CAPS_TEXT);
+	*dram = heap_caps_get_largest_free_block(CAPS_DRAM);
+}
+
+static uint8_t* copy_out(int block, const void* mem, size_t size) {
+	// Text copies are patched byte-wise, so they can't stay in IRAM either
+	uint8_t* copy = block == ELF_BLOCK_TEXT ?
+		heap_caps_malloc_prefer(size, 2, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, MALLOC_CAP_8BIT) :
+		heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+	if (!copy) return NULL;
+	if (block == ELF_BLOCK_TEXT) {
+		elf_iram_read(copy, mem, size);
+	} else {
+		memcpy(copy, mem, size);
+	}
+	return copy;
+}
+
+static void rebase_module(move_t* mv) {
+	elf_module_t* m = mv->module;
+	uint32_t addr[ELF_BLOCK_COUNT];
+	int32_t delta[ELF_BLOCK_COUNT];
+	for (int b = 0; b < ELF_BLOCK_COUNT; b++) {
+		addr[b] = mv->mem[b] ? (uint32_t)mv->mem[b] : mv->old[b];
+		delta[b] = addr[b] - mv->old[b];
+	}
+
+	// Words in blocks that are away are patched in their copies
+	for (uint32_t i = 0; i < m->fixup_count; i++) {
+		const elf_fixup_t* fix = &m->fixups[i];
+		if (fix->type == ELF_FIXUP_ABS && !delta[fix->to]) continue;
+		if (fix->type == ELF_FIXUP_CALL && !delta[ELF_BLOCK_TEXT]) continue;
+		uint8_t* base = mv->copy[fix->block] ? mv->copy[fix->block] : (uint8_t*)mv->old[fix->block];
+		elf_fixup_apply(fix, base + fix->offset, addr, delta);
+	}
+
+	for (int b = 0; b < ELF_BLOCK_COUNT; b++) {
+		if (!mv->copy[b]) continue;
+		if (b == ELF_BLOCK_TEXT) {
+			elf_iram_memcpy(mv->mem[b], mv->copy[b], mv->size[b]);
+		} else {
+			memcpy(mv->mem[b], mv->copy[b], mv->size[b]);
+		}
+	}
+
+	// Everything the module keeps about its own addresses
+	m->text_mem = mv->mem[ELF_BLOCK_TEXT] ? mv->mem[ELF_BLOCK_TEXT] : m->text_mem;
+	m->data_mem = mv->mem[ELF_BLOCK_DRAM] ? mv->mem[ELF_BLOCK_DRAM] : m->data_mem;
+	m->entry_point = (guest_entry_t)((uint32_t)m->entry_point + delta[ELF_BLOCK_TEXT]);
+	for (size_t i = 0; i < m->symbol_count; i++) {
+		elf_symbol_t* sym = &m->symbols[i];
+		for (int b = 0; b < ELF_BLOCK_COUNT; b++) {
+			if (sym->addr >= mv->old[b] && sym->addr < mv->old[b] + mv->size[b]) {
+				sym->addr += delta[b];
+				break;
+			}
+		}
+	}
+	for (size_t i = 0; i < m->section_count; i++) {
+		elf_section_info_t* sec = &m->sections[i];
+		if (sec->region == ELF_REGION_IRAM) sec->addr += delta[ELF_BLOCK_TEXT];
+		if (sec->region == ELF_REGION_DRAM) sec->addr += delta[ELF_BLOCK_DRAM];
+	}
+	m->data_crc = elf_module_data_crc(m);
+}
+
+// Only into a lower block, so the free space gathers at the top
+static void* place_block(int block, uint32_t old, size_t size) {
+	void* mem = heap_caps_malloc(size, block == ELF_BLOCK_TEXT ? CAPS_TEXT : CAPS_DRAM);
+	if (mem && (uint32_t)mem > old) {
+		heap_caps_free(mem);
+		mem = NULL;
+	}
+	return mem;
+}
+
+/*
+ * Each block gets its new place before the old one is let go, so a module
+ * that finds no room just stays where it is. Modules go one at a time and
+ * the blocks they leave are there for the next one.
+ */
+int elf_defrag(elf_module_t** modules, int count, elf_defrag_result_t* out) {
+	memset(out, 0, sizeof(*out));
+	largest_free(&out->iram_largest_before, &out->dram_largest_before);
+
+	// DRAM copies in DRAM would only shuffle the holes around
+	out->data_packed = elf_psram_available();
+	for (int i = 0; i < count; i++) {
+		if (elf_module_pinned(modules[i])) continue;
+
+		move_t mv = { .module = modules[i] };
+		mv.old[ELF_BLOCK_TEXT] = (uint32_t)modules[i]->text_mem;
+		mv.old[ELF_BLOCK_DRAM] = (uint32_t)modules[i]->data_mem;
+		mv.old[ELF_BLOCK_PSRAM] = (uint32_t)modules[i]->psram_mem;
+		mv.size[ELF_BLOCK_TEXT] = modules[i]->text_mem ? modules[i]->text_size : 0;
+		mv.size[ELF_BLOCK_DRAM] = modules[i]->data_mem ? modules[i]->data_size : 0;
+		mv.size[ELF_BLOCK_PSRAM] = modules[i]->psram_mem ? modules[i]->psram_size : 0;
+
+		int moving = 0;
+		for (int b = ELF_BLOCK_TEXT; b <= ELF_BLOCK_DRAM; b++) {
+			if (!mv.size[b] || (b == ELF_BLOCK_DRAM && !out->data_packed)) continue;
+			mv.mem[b] = place_block(b, mv.old[b], mv.size[b]);
+			if (!mv.mem[b]) continue;
+			mv.copy[b] = copy_out(b, (void*)mv.old[b], mv.size[b]);
+			if (!mv.copy[b]) {
+				heap_caps_free(mv.mem[b]);
+				mv.mem[b] = NULL;
+				continue;
+			}
+			moving++;
+		}
+		// Text that stays can't be patched in IRAM for data that moves
+		if (mv.size[ELF_BLOCK_TEXT] && !mv.mem[ELF_BLOCK_TEXT] && mv.mem[ELF_BLOCK_DRAM]) {
+			heap_caps_free(mv.mem[ELF_BLOCK_DRAM]);
+			heap_caps_free(mv.copy[ELF_BLOCK_DRAM]);
+			mv.mem[ELF_BLOCK_DRAM] = NULL;
+			mv.copy[ELF_BLOCK_DRAM] = NULL;
+			moving--;
+		}
+		if (!moving) continue;
+
+		rebase_module(&mv);
+		Cache_Flush(0);
+		for (int b = ELF_BLOCK_TEXT; b <= ELF_BLOCK_DRAM; b++) {
+			if (!mv.mem[b]) continue;
+			heap_caps_free((void*)mv.old[b]);
+			heap_caps_free(mv.copy[b]);
+		}
+		out->moved++;
+	}
+
+	largest_free(&out->iram_largest_after, &out->dram_largest_after);
+	return ELF_OK;
+}
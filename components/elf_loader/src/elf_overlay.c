@@ -0,0 +1,684 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+
+#include <elf.h>
+#include "elf_specific.h"
+#include "elf_loader.h"
+
+/*
+ * Code overlays.
+ *
+ * Executable sections are packed into groups (a .literal.X section always
+ * travels with its .text.X). Each group is relocated once against a base of
+ * zero and kept in a backing store; at run time groups are copied into
+ * fixed-size slots of an IRAM window on demand.
+ *
+ * Inside a group everything is PC-relative, so a group runs from any slot.
+ * Anything that can outlive a slot (function pointers, calls from other
+ * groups or from data) is pointed at a resident trampoline instead, which
+ * loads the target group, pins it while the call is in progress and
+ * forwards the six register arguments.
+ */
+
+#define FIX_ABS		0	// word += slot base
+#define FIX_CALL	1	// CALLn to an absolute target, re-encoded per slot
+
+typedef struct {
+	uint32_t offset;
+	uint32_t target;
+	uint8_t type;
+} ovl_fixup_t;
+
+typedef struct {
+	uint32_t size;
+	uint32_t backing_offset;
+	uint32_t fixup_start;
+	uint32_t fixup_count;
+	int slot;
+	uint32_t lru;
+	uint32_t active;
+} ovl_group_t;
+
+typedef struct {
+	uint16_t group;
+	uint16_t trampoline;
+	uint32_t offset;
+} ovl_stub_t;
+
+struct elf_overlay {
+	ovl_group_t* groups;
+	uint32_t group_count;
+	int16_t* section_group;		// per section, -1 when resident
+	uint32_t* section_offset;	// offset inside the group
+
+	ovl_stub_t* stubs;
+	uint32_t stub_count;
+	uint32_t stub_cap;
+
+	ovl_fixup_t* fixups;
+	uint32_t fixup_count;
+	uint32_t fixup_cap;
+
+	uint64_t* entries;			// section << 32 | value of every function, sorted; until finish
+	uint32_t entry_count;
+
+	uint8_t* window;
+	uint32_t slot_size;
+	uint32_t slot_count;
+	int* slot_group;
+	uint8_t* staging;
+
+	uint8_t* backing;			// in-memory backing store, or
+	FILE* backing_file;			// file backing store
+	char* backing_path;			// removed with the overlay
+	uint32_t backing_size;
+
+	uint32_t lru_clock;
+	SemaphoreHandle_t lock;
+	elf_overlay_stats_t stats;
+};
+
+/* ---------- Trampolines ---------- */
+
+uint64_t elf_overlay_dispatch(int n, uint32_t a, uint32_t b, uint32_t c, uint32_t d, uint32_t e, uint32_t f);
+
+#define OVL_TRAMPOLINE(b, k) \
+	static uint64_t ovl_tramp_##b##_##k(uint32_t a, uint32_t b_, uint32_t c, uint32_t d, uint32_t e, uint32_t f) { \
+		return elf_overlay_dispatch((b) * 8 + (k), a, b_, c, d, e, f); \
+	}
+#define OVL_TRAMPOLINES8(b) \
+	OVL_TRAMPOLINE(b, 0) OVL_TRAMPOLINE(b, 1) OVL_TRAMPOLINE(b, 2) OVL_TRAMPOLINE(b, 3) \
+	OVL_TRAMPOLINE(b, 4) OVL_TRAMPOLINE(b, 5) OVL_TRAMPOLINE(b, 6) OVL_TRAMPOLINE(b, 7)
+#define OVL_ENTRIES8(b) \
+	ovl_tramp_##b##_0, ovl_tramp_##b##_1, ovl_tramp_##b##_2, ovl_tramp_##b##_3, \
+	ovl_tramp_##b##_4, ovl_tramp_##b##_5, ovl_tramp_##b##_6, ovl_tramp_##b##_7,
+
+OVL_TRAMPOLINES8(0)  OVL_TRAMPOLINES8(1)  OVL_TRAMPOLINES8(2)  OVL_TRAMPOLINES8(3)
+OVL_TRAMPOLINES8(4)  OVL_TRAMPOLINES8(5)  OVL_TRAMPOLINES8(6)  OVL_TRAMPOLINES8(7)
+OVL_TRAMPOLINES8(8)  OVL_TRAMPOLINES8(9)  OVL_TRAMPOLINES8(10) OVL_TRAMPOLINES8(11)
+OVL_TRAMPOLINES8(12) OVL_TRAMPOLINES8(13) OVL_TRAMPOLINES8(14) OVL_TRAMPOLINES8(15)
+
+typedef uint64_t (*ovl_trampoline_t)(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t);
+
+static const ovl_trampoline_t s_trampolines[ELF_OVERLAY_TRAMPOLINES] = {
+	OVL_ENTRIES8(0)  OVL_ENTRIES8(1)  OVL_ENTRIES8(2)  OVL_ENTRIES8(3)
+	OVL_ENTRIES8(4)  OVL_ENTRIES8(5)  OVL_ENTRIES8(6)  OVL_ENTRIES8(7)
+	OVL_ENTRIES8(8)  OVL_ENTRIES8(9)  OVL_ENTRIES8(10) OVL_ENTRIES8(11)
+	OVL_ENTRIES8(12) OVL_ENTRIES8(13) OVL_ENTRIES8(14) OVL_ENTRIES8(15)
+};
+
+static elf_overlay_t* s_tramp_owner[ELF_OVERLAY_TRAMPOLINES];
+static uint16_t s_tramp_stub[ELF_OVERLAY_TRAMPOLINES];
+static portMUX_TYPE s_tramp_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static int trampoline_alloc(elf_overlay_t* ovl, uint16_t stub) {
+	int n = -1;
+	taskENTER_CRITICAL(&s_tramp_lock);
+	for (int i = 0; i < ELF_OVERLAY_TRAMPOLINES; i++) {
+		if (!s_tramp_owner[i]) {
+			s_tramp_owner[i] = ovl;
+			s_tramp_stub[i] = stub;
+			n = i;
+			break;
+		}
+	}
+	taskEXIT_CRITICAL(&s_tramp_lock);
+	return n;
+}
+
+static void trampoline_release_all(elf_overlay_t* ovl) {
+	taskENTER_CRITICAL(&s_tramp_lock);
+	for (int i = 0; i < ELF_OVERLAY_TRAMPOLINES; i++) {
+		if (s_tramp_owner[i] == ovl) s_tramp_owner[i] = NULL;
+	}
+	taskEXIT_CRITICAL(&s_tramp_lock);
+}
+
+/* ---------- Planning ---------- */
+
+static int is_exec_section(const Elf32_Shdr* shdr) {
+	return shdr->sh_size && (shdr->sh_flags & SHF_ALLOC) && (shdr->sh_flags & SHF_EXECINSTR);
+}
+
+// Hot code already placed in RTC fast memory stays out of the groups
+static int is_paged_section(elf_context_t* ctx, uint32_t idx) {
+	return is_exec_section(&ctx->shdrs[idx]) && !(ctx->in_rtc && ctx->in_rtc[idx]);
+}
+
+static int find_section(elf_context_t* ctx, const char* name) {
+	for (uint32_t i = 0; i < ctx->section_count; i++) {
+		if (strcmp(ctx->shstrtab + ctx->shdrs[i].sh_name, name) == 0) return i;
+	}
+	return -1;
+}
+
+// The .literal section paired with a .text section, or -1
+static int literal_for(elf_context_t* ctx, uint32_t text_idx) {
+	const char* name = ctx->shstrtab + ctx->shdrs[text_idx].sh_name;
+	if (strncmp(name, ".text", 5) != 0) return -1;
+
+	char literal[64];
+	snprintf(literal, sizeof(literal), ".literal%s", name + 5);
+	int idx = find_section(ctx, literal);
+	if (idx < 0 || !is_exec_section(&ctx->shdrs[idx])) return -1;
+	return idx;
+}
+
+static int is_paired_literal(elf_context_t* ctx, uint32_t idx) {
+	const char* name = ctx->shstrtab + ctx->shdrs[idx].sh_name;
+	if (strncmp(name, ".literal", 8) != 0) return 0;
+
+	char text[64];
+	snprintf(text, sizeof(text), ".text%s", name + 8);
+	int text_idx = find_section(ctx, text);
+	return text_idx >= 0 && is_exec_section(&ctx->shdrs[text_idx]);
+}
+
+static uint32_t unit_size(elf_context_t* ctx, uint32_t text_idx, uint32_t base) {
+	uint32_t pos = base;
+	int lit = literal_for(ctx, text_idx);
+	if (lit >= 0) {
+		pos = ALIGNUP(ctx->shdrs[lit].sh_addralign, pos);
+		pos += ctx->shdrs[lit].sh_size;
+	}
+	pos = ALIGNUP(ctx->shdrs[text_idx].sh_addralign, pos);
+	pos += ctx->shdrs[text_idx].sh_size;
+	return pos - base;
+}
+
+static void place_unit(elf_context_t* ctx, elf_overlay_t* ovl, uint32_t text_idx, uint32_t group, uint32_t* pos) {
+	int lit = literal_for(ctx, text_idx);
+	if (lit >= 0) {
+		*pos = ALIGNUP(ctx->shdrs[lit].sh_addralign, *pos);
+		ovl->section_group[lit] = group;
+		ovl->section_offset[lit] = *pos;
+		ctx->shdrs[lit].sh_addr = *pos;
+		*pos += ctx->shdrs[lit].sh_size;
+	}
+	*pos = ALIGNUP(ctx->shdrs[text_idx].sh_addralign, *pos);
+	ovl->section_group[text_idx] = group;
+	ovl->section_offset[text_idx] = *pos;
+	ctx->shdrs[text_idx].sh_addr = *pos;
+	*pos += ctx->shdrs[text_idx].sh_size;
+}
+
+static int compare_entries(const void* a, const void* b) {
+	uint64_t ea = *(const uint64_t*)a;
+	uint64_t eb = *(const uint64_t*)b;
+	return (ea > eb) - (ea < eb);
+}
+
+// Relocations ask whether they point at a function once each
+static int build_entry_table(elf_context_t* ctx, elf_overlay_t* ovl) {
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < ctx->symtab_count; i++) {
+		if (ELF32_ST_TYPE(ctx->symtab[i].st_info) == STT_FUNC) count++;
+	}
+	ovl->entries = malloc((count ? count : 1) * sizeof(uint64_t));
+	if (!ovl->entries) return ELF_ERR_NO_MEMORY;
+
+	for (uint32_t i = 0; i < ctx->symtab_count; i++) {
+		const Elf32_Sym* sym = &ctx->symtab[i];
+		if (ELF32_ST_TYPE(sym->st_info) != STT_FUNC) continue;
+		ovl->entries[ovl->entry_count++] = ((uint64_t)sym->st_shndx << 32) | sym->st_value;
+	}
+	qsort(ovl->entries, ovl->entry_count, sizeof(uint64_t), compare_entries);
+	return ELF_OK;
+}
+
+int elf_overlay_plan(elf_context_t* ctx, size_t window) {
+	elf_overlay_t* ovl = calloc(1, sizeof(elf_overlay_t));
+	if (!ovl) return ELF_ERR_NO_MEMORY;
+	ctx->overlay = ovl;
+
+	ovl->section_group = malloc(ctx->section_count * sizeof(int16_t));
+	ovl->section_offset = calloc(ctx->section_count, sizeof(uint32_t));
+	ovl->groups = calloc(ctx->section_count, sizeof(ovl_group_t));
+	ovl->lock = xSemaphoreCreateMutex();
+	if (!ovl->section_group || !ovl->section_offset || !ovl->groups || !ovl->lock) {
+		return ELF_ERR_NO_MEMORY;
+	}
+	for (uint32_t i = 0; i < ctx->section_count; i++) {
+		ovl->section_group[i] = -1;
+	}
+	if (build_entry_table(ctx, ovl) != ELF_OK) return ELF_ERR_NO_MEMORY;
+
+	uint32_t max_unit = 0;
+	for (uint32_t i = 0; i < ctx->section_count; i++) {
+		if (!is_paged_section(ctx, i) || is_paired_literal(ctx, i)) continue;
+		uint32_t size = unit_size(ctx, i, 0);
+		if (size > max_unit) max_unit = size;
+	}
+
+	if (!window) {
+		window = heap_caps_get_largest_free_block(MALLOC_CAP_EXEC | MALLOC_CAP_32BIT) / 2;
+	}
+	uint32_t slot_size = ALIGNUP(16, max_unit);
+	if (slot_size < window / ELF_OVERLAY_MIN_SLOTS) {
+		slot_size = (window / ELF_OVERLAY_MIN_SLOTS) & ~15;
+	}
+	if (!slot_size || window / slot_size < 2) {
+		printf("[ovl] ERROR: Largest function (%lu bytes) needs a window of at least %lu bytes\n",
+			   max_unit, 2 * ALIGNUP(16, max_unit));
+		return ELF_ERR_NO_MEMORY;
+	}
+	ovl->slot_size = slot_size;
+	ovl->slot_count = window / slot_size;
+
+	// Greedy packing in section order keeps neighbouring functions together
+	uint32_t group = 0;
+	uint32_t pos = 0;
+	for (uint32_t i = 0; i < ctx->section_count; i++) {
+		if (!is_paged_section(ctx, i) || is_paired_literal(ctx, i)) continue;
+		if (pos && pos + unit_size(ctx, i, pos) > slot_size) {
+			ovl->groups[group].size = pos;
+			group++;
+			pos = 0;
+		}
+		place_unit(ctx, ovl, i, group, &pos);
+	}
+	if (pos) {
+		ovl->groups[group].size = pos;
+		group++;
+	}
+	ovl->group_count = group;
+
+	for (uint32_t g = 0; g < ovl->group_count; g++) {
+		ovl->groups[g].slot = -1;
+	}
+
+	if (ctx->debug >= 1) {
+		printf("[ovl] %lu groups, %lu slots x %lu bytes\n", ovl->group_count, ovl->slot_count, ovl->slot_size);
+	}
+	return ELF_OK;
+}
+
+int elf_overlay_section_group(elf_context_t* ctx, uint32_t shndx) {
+	if (!ctx->overlay || shndx >= ctx->section_count) return -1;
+	return ctx->overlay->section_group[shndx];
+}
+
+/* ---------- Relocation ---------- */
+
+static int add_fixup(elf_overlay_t* ovl, uint32_t offset, uint8_t type, uint32_t target) {
+	if (ovl->fixup_count == ovl->fixup_cap) {
+		uint32_t cap = ovl->fixup_cap ? ovl->fixup_cap * 2 : 32;
+		ovl_fixup_t* fixups = realloc(ovl->fixups, cap * sizeof(ovl_fixup_t));
+		if (!fixups) return -1;
+		ovl->fixups = fixups;
+		ovl->fixup_cap = cap;
+	}
+	ovl->fixups[ovl->fixup_count++] = (ovl_fixup_t){ .offset = offset, .target = target, .type = type };
+	return 0;
+}
+
+// Resident address that calls `offset` inside `group`
+static uint32_t stub_for(elf_overlay_t* ovl, uint32_t group, uint32_t offset) {
+	for (uint32_t i = 0; i < ovl->stub_count; i++) {
+		if (ovl->stubs[i].group == group && ovl->stubs[i].offset == offset) {
+			return (uint32_t)s_trampolines[ovl->stubs[i].trampoline];
+		}
+	}
+
+	if (ovl->stub_count == ovl->stub_cap) {
+		uint32_t cap = ovl->stub_cap ? ovl->stub_cap * 2 : 16;
+		ovl_stub_t* stubs = realloc(ovl->stubs, cap * sizeof(ovl_stub_t));
+		if (!stubs) return 0;
+		ovl->stubs = stubs;
+		ovl->stub_cap = cap;
+	}
+
+	int n = trampoline_alloc(ovl, ovl->stub_count);
+	if (n < 0) {
+		printf("[ovl] ERROR: Out of trampolines (%d)\n", ELF_OVERLAY_TRAMPOLINES);
+		return 0;
+	}
+	ovl->stubs[ovl->stub_count++] = (ovl_stub_t){ .group = group, .trampoline = n, .offset = offset };
+	return (uint32_t)s_trampolines[n];
+}
+
+static int is_function_entry(elf_overlay_t* ovl, uint32_t shndx, uint32_t value) {
+	uint64_t key = ((uint64_t)shndx << 32) | value;
+	uint32_t lo = 0;
+	uint32_t hi = ovl->entry_count;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (ovl->entries[mid] < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo < ovl->entry_count && ovl->entries[lo] == key;
+}
+
+static int is_call(elf_context_t* ctx, uint32_t target_idx, const Elf32_Rela* rela) {
+	if ((rela->r_info & 0xFF) != R_XTENSA_SLOT0_OP) return 0;
+	const uint8_t* p = ctx->elf_data + ctx->shdrs[target_idx].sh_offset + rela->r_offset;
+	return (p[0] & 0x0F) == 0x05;
+}
+
+int elf_overlay_relocate(elf_context_t* ctx, uint32_t target_idx, const Elf32_Rela* rela, uint32_t* symbol_address) {
+	elf_overlay_t* ovl = ctx->overlay;
+	uint32_t sym_idx = rela->r_info >> 8;
+	int type = rela->r_info & 0xFF;
+	if (type == R_XTENSA_NONE || type == R_XTENSA_ASM_EXPAND) return 0;
+
+	if (!(ctx->shdrs[target_idx].sh_flags & SHF_ALLOC)) return 0;
+
+	// Fixups are tagged with their group until elf_overlay_finish() splits them
+	int from_group = ovl->section_group[target_idx];
+	uint32_t patch_offset = ((uint32_t)from_group << 24) | (ovl->section_offset[target_idx] + rela->r_offset);
+
+	const Elf32_Sym* sym = &ctx->symtab[sym_idx];
+	int to_group = (sym->st_shndx != SHN_UNDEF && sym->st_shndx < ctx->section_count) ?
+				   ovl->section_group[sym->st_shndx] : -1;
+
+	if (to_group < 0) {
+		// Resident target: only PC-relative calls out of a group depend on the slot
+		if (from_group >= 0 && is_call(ctx, target_idx, rela)) {
+			if (add_fixup(ovl, patch_offset, FIX_CALL, *symbol_address + rela->r_addend) != 0) return -1;
+		}
+		return 0;
+	}
+
+	uint32_t value = (ELF32_ST_TYPE(sym->st_info) == STT_SECTION ? 0 : sym->st_value) + rela->r_addend;
+	int entry = is_function_entry(ovl, sym->st_shndx, value);
+
+	if (from_group == to_group) {
+		if (type == R_XTENSA_32) {
+			if (entry) {
+				uint32_t stub = stub_for(ovl, to_group, ovl->section_offset[sym->st_shndx] + value);
+				if (!stub) return -1;
+				*symbol_address = stub - rela->r_addend;
+			} else if (add_fixup(ovl, patch_offset, FIX_ABS, 0) != 0) {
+				return -1;
+			}
+		}
+		// L32R and calls inside a group are position independent
+		return 0;
+	}
+
+	if (!entry || (type != R_XTENSA_32 && !is_call(ctx, target_idx, rela))) {
+		printf("[ovl] ERROR: Section %lu references the middle of overlaid section %u\n",
+			   target_idx, sym->st_shndx);
+		return -1;
+	}
+
+	uint32_t stub = stub_for(ovl, to_group, ovl->section_offset[sym->st_shndx] + value);
+	if (!stub) return -1;
+	*symbol_address = stub - rela->r_addend;
+
+	if (from_group >= 0 && type != R_XTENSA_32) {
+		if (add_fixup(ovl, patch_offset, FIX_CALL, stub) != 0) return -1;
+	}
+	return 0;
+}
+
+void* elf_overlay_entry(elf_context_t* ctx, uint32_t shndx, uint32_t value) {
+	elf_overlay_t* ovl = ctx->overlay;
+	int group = ovl->section_group[shndx];
+	return (void*)stub_for(ovl, group, ovl->section_offset[shndx] + value);
+}
+
+/* ---------- Backing store ---------- */
+
+static int compare_fixups(const void* a, const void* b) {
+	const ovl_fixup_t* fa = (const ovl_fixup_t*)a;
+	const ovl_fixup_t* fb = (const ovl_fixup_t*)b;
+	return (fa->offset > fb->offset) - (fa->offset < fb->offset);
+}
+
+static int write_backing(elf_overlay_t* ovl, uint32_t offset, const void* src, size_t len) {
+	if (ovl->backing_file) {
+		if (fseek(ovl->backing_file, offset, SEEK_SET) != 0) return -1;
+		return fwrite(src, 1, len, ovl->backing_file) == len ? 0 : -1;
+	}
+	memcpy(ovl->backing + offset, src, len);
+	return 0;
+}
+
+static int read_backing(elf_overlay_t* ovl, uint32_t offset, void* dst, size_t len) {
+	if (ovl->backing_file) {
+		if (fseek(ovl->backing_file, offset, SEEK_SET) != 0) return -1;
+		return fread(dst, 1, len, ovl->backing_file) == len ? 0 : -1;
+	}
+	memcpy(dst, ovl->backing + offset, len);
+	return 0;
+}
+
+int elf_overlay_finish(elf_context_t* ctx, const char* backing_path) {
+	elf_overlay_t* ovl = ctx->overlay;
+
+	free(ovl->entries);
+	ovl->entries = NULL;
+	qsort(ovl->fixups, ovl->fixup_count, sizeof(ovl_fixup_t), compare_fixups);
+
+	uint32_t total = 0;
+	uint32_t f = 0;
+	for (uint32_t g = 0; g < ovl->group_count; g++) {
+		ovl_group_t* group = &ovl->groups[g];
+		group->backing_offset = total;
+		total += ALIGNUP(4, group->size);
+
+		group->fixup_start = f;
+		while (f < ovl->fixup_count && (ovl->fixups[f].offset >> 24) == g) {
+			ovl->fixups[f].offset &= 0xFFFFFF;
+			f++;
+		}
+		group->fixup_count = f - group->fixup_start;
+	}
+	ovl->backing_size = total;
+
+	ovl->staging = malloc(ovl->slot_size);
+	ovl->window = heap_caps_malloc(ovl->slot_size * ovl->slot_count, MALLOC_CAP_EXEC | MALLOC_CAP_32BIT);
+	ovl->slot_group = malloc(ovl->slot_count * sizeof(int));
+	if (!ovl->staging || !ovl->window || !ovl->slot_group) {
+		printf("[ovl] ERROR: Failed to allocate overlay window\n");
+		return ELF_ERR_NO_MEMORY;
+	}
+	for (uint32_t s = 0; s < ovl->slot_count; s++) {
+		ovl->slot_group[s] = -1;
+	}
+
+	if (backing_path) {
+		ovl->backing_file = fopen(backing_path, "w+b");
+		if (!ovl->backing_file) {
+			printf("[ovl] WARNING: Can't open %s, keeping overlays in RAM\n", backing_path);
+		} else {
+			ovl->backing_path = strdup(backing_path);
+		}
+	}
+	if (!ovl->backing_file) {
+		ovl->backing = malloc(total);
+		if (!ovl->backing) {
+			printf("[ovl] ERROR: Failed to allocate %lu bytes of backing store\n", total);
+			return ELF_ERR_NO_MEMORY;
+		}
+	}
+
+	// Relocations were applied in place, so the images come straight from elf_data
+	for (uint32_t s = 0; s < ctx->section_count; s++) {
+		int g = ovl->section_group[s];
+		if (g < 0) continue;
+		const Elf32_Shdr* shdr = &ctx->shdrs[s];
+		uint32_t offset = ovl->groups[g].backing_offset + ovl->section_offset[s];
+		if (write_backing(ovl, offset, ctx->elf_data + shdr->sh_offset, shdr->sh_size) != 0) {
+			printf("[ovl] ERROR: Failed to write backing store\n");
+			return ELF_ERR_NO_MEMORY;
+		}
+	}
+	if (ovl->backing_file) {
+		fflush(ovl->backing_file);
+	}
+
+	ctx->iram_block = ovl->window;
+	ctx->iram_size = ovl->slot_size * ovl->slot_count;
+	ovl->stats.group_count = ovl->group_count;
+	ovl->stats.slot_count = ovl->slot_count;
+	ovl->stats.slot_size = ovl->slot_size;
+	ovl->stats.backing_size = total;
+
+	if (ctx->debug >= 1) {
+		printf("[ovl] %lu stubs, %lu fixups, %lu bytes of backing store%s\n",
+			   ovl->stub_count, ovl->fixup_count, total, ovl->backing_file ? " on disk" : "");
+	}
+	return ELF_OK;
+}
+
+/* ---------- Run time ---------- */
+
+static void apply_fixups(elf_overlay_t* ovl, ovl_group_t* group, uint32_t base) {
+	for (uint32_t i = 0; i < group->fixup_count; i++) {
+		const ovl_fixup_t* fix = &ovl->fixups[group->fixup_start + i];
+		uint8_t* p = ovl->staging + fix->offset;
+
+		if (fix->type == FIX_ABS) {
+			elf_write32(p, elf_read32(p) + base);
+		} else {
+			uint32_t pc = base + fix->offset;
+			int32_t offset_words = (int32_t)(fix->target - ((pc + 4) & ~3)) >> 2;
+			uint32_t inst = elf_read24(p);
+			inst = (inst & 0x3F) | ((offset_words & 0x3FFFF) << 6);
+			elf_write24(p, inst);
+		}
+	}
+}
+
+static int pick_slot(elf_overlay_t* ovl) {
+	int best = -1;
+	uint32_t best_lru = UINT32_MAX;
+	for (uint32_t s = 0; s < ovl->slot_count; s++) {
+		int g = ovl->slot_group[s];
+		if (g < 0) return s;
+		if (!ovl->groups[g].active && ovl->groups[g].lru < best_lru) {
+			best = s;
+			best_lru = ovl->groups[g].lru;
+		}
+	}
+	return best;
+}
+
+static int load_group(elf_overlay_t* ovl, uint32_t g) {
+	ovl_group_t* group = &ovl->groups[g];
+
+	int slot = pick_slot(ovl);
+	if (slot < 0) {
+		printf("[ovl] ERROR: All %lu slots are busy\n", ovl->slot_count);
+		return -1;
+	}
+
+	int64_t start = esp_timer_get_time();
+
+	int old = ovl->slot_group[slot];
+	if (old >= 0) {
+		ovl->groups[old].slot = -1;
+		ovl->stats.evictions++;
+	}
+	ovl->slot_group[slot] = -1;
+
+	if (read_backing(ovl, group->backing_offset, ovl->staging, group->size) != 0) {
+		printf("[ovl] ERROR: Failed to read group %lu\n", g);
+		return -1;
+	}
+
+	uint8_t* base = ovl->window + slot * ovl->slot_size;
+	apply_fixups(ovl, group, (uint32_t)base);
+	// IRAM is not behind the cache, the copy is visible to instruction fetch right away
+	elf_iram_memcpy(base, ovl->staging, group->size);
+
+	ovl->slot_group[slot] = g;
+	group->slot = slot;
+	ovl->stats.bytes_loaded += group->size;
+	ovl->stats.load_us += esp_timer_get_time() - start;
+	return 0;
+}
+
+uint64_t elf_overlay_dispatch(int n, uint32_t a, uint32_t b, uint32_t c, uint32_t d, uint32_t e, uint32_t f) {
+	elf_overlay_t* ovl = s_tramp_owner[n];
+	if (!ovl) {
+		printf("[ovl] ERROR: Call through released trampoline %d\n", n);
+		__builtin_trap();
+	}
+	const ovl_stub_t* stub = &ovl->stubs[s_tramp_stub[n]];
+	ovl_group_t* group = &ovl->groups[stub->group];
+
+	xSemaphoreTake(ovl->lock, portMAX_DELAY);
+	if (group->slot >= 0) {
+		ovl->stats.hits++;
+	} else {
+		ovl->stats.misses++;
+		if (load_group(ovl, stub->group) != 0) {
+			xSemaphoreGive(ovl->lock);
+			__builtin_trap();
+		}
+	}
+	group->active++;
+	group->lru = ++ovl->lru_clock;
+	uint32_t target = (uint32_t)ovl->window + group->slot * ovl->slot_size + stub->offset;
+	xSemaphoreGive(ovl->lock);
+
+	uint64_t result = ((ovl_trampoline_t)target)(a, b, c, d, e, f);
+
+	xSemaphoreTake(ovl->lock, portMAX_DELAY);
+	group->active--;
+	xSemaphoreGive(ovl->lock);
+
+	return result;
+}
+
+void elf_overlay_get_stats(const elf_overlay_t* ovl, elf_overlay_stats_t* out) {
+	*out = ovl->stats;
+	out->stub_count = ovl->stub_count;
+
+	uint32_t resident = 0;
+	for (uint32_t s = 0; s < ovl->slot_count; s++) {
+		if (ovl->slot_group[s] >= 0) resident++;
+	}
+	out->resident_groups = resident;
+}
+
+IRAM_ATTR bool elf_overlay_owns_pc(const elf_overlay_t* ovl, uint32_t pc) {
+	uint32_t window = (uint32_t)ovl->window;
+	return window && pc >= window && pc < window + ovl->slot_size * ovl->slot_count;
+}
+
+// Against whatever group sits in the slot now, 0 for an empty one
+uint32_t elf_overlay_symbol_key(const elf_overlay_t* ovl, uint32_t pc) {
+	if (!elf_overlay_owns_pc(ovl, pc)) return 0;
+	uint32_t rel = pc - (uint32_t)ovl->window;
+	int g = ovl->slot_group[rel / ovl->slot_size];
+	if (g < 0 || g >= ELF_OVERLAY_SYMBOL_GROUPS) return 0;
+	return ELF_OVERLAY_SYMBOL(g, rel % ovl->slot_size);
+}
+
+bool elf_overlay_uses_backing(const elf_overlay_t* ovl, const char* path) {
+	return ovl->backing_path && strcmp(ovl->backing_path, path) == 0;
+}
+
+void elf_overlay_destroy(elf_overlay_t* ovl) {
+	if (!ovl) return;
+
+	trampoline_release_all(ovl);
+	if (ovl->window) heap_caps_free(ovl->window);
+	if (ovl->backing_file) fclose(ovl->backing_file);
+	if (ovl->backing_path) remove(ovl->backing_path);
+	free(ovl->backing_path);
+	if (ovl->lock) vSemaphoreDelete(ovl->lock);
+	free(ovl->backing);
+	free(ovl->staging);
+	free(ovl->slot_group);
+	free(ovl->stubs);
+	free(ovl->fixups);
+	free(ovl->entries);
+	free(ovl->groups);
+	free(ovl->section_group);
+	free(ovl->section_offset);
+	free(ovl);
+}
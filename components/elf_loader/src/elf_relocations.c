@@ -50,12 +50,22 @@ int elf_apply_relocations(elf_context_t* ctx) {
 			uint32_t final_address = ctx->shdrs[target_idx].sh_addr + rela->r_offset;
 
 			uint32_t symbol_address = elf_resolve_symbol(ctx, idx);
+			int overlaid = idx < ctx->symtab_count &&
+						   elf_overlay_section_group(ctx, ctx->symtab[idx].st_shndx) >= 0;
 
-			if (symbol_address == 0 && idx != 0) {
+			if (symbol_address == 0 && idx != 0 && !overlaid) {
 				printf("[rel] ERROR: Failed to resolve symbol %u\n", idx);
 				return -1;
 			}
 
+			if (ctx->overlay && elf_overlay_relocate(ctx, target_idx, rela, &symbol_address) != 0) {
+				return -1;
+			}
+
+			if (ctx->record_fixups && elf_image_record(ctx, target_idx, rela, symbol_address) != 0) {
+				return -1;
+			}
+
 			uint32_t value = symbol_address + rela->r_addend;
 
 			switch (type) {
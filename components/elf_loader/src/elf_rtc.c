@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_attr.h"
+#include "esp_cpu.h"
+#include "esp_ipc.h"
+#include "xtensa_context.h"
+
+#include "elf_specific.h"
+#include "elf_loader.h"
+
+/*
+ * RTC fast memory: 8 KB, executable, but only the PRO CPU reaches it, on
+ * either bus. The firmware reserves a pool of it at link time, after the RTC
+ * code of ESP-IDF, and modules get blocks of it for .iram.hot.* sections.
+ * Code runs from the instruction bus alias; contents are written through the
+ * data bus, from core 0.
+ */
+
+#define RTC_IBUS_OFFSET		0x140000	// 0x3FF80000 (data) -> 0x400C0000 (instruction)
+
+typedef struct {
+	uint16_t offset;
+	uint16_t size;
+} rtc_block_t;
+
+static RTC_FAST_ATTR uint32_t pool[ELF_RTC_POOL_SIZE / 4];
+static rtc_block_t blocks[ELF_RTC_MAX_BLOCKS];	// sorted by offset
+static int block_count = 0;
+static portMUX_TYPE pool_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// First gap that fits, the blocks are few
+static int find_gap(size_t size, uint32_t* out_offset, size_t* out_largest) {
+	uint32_t pos = 0;
+	size_t largest = 0;
+	int found = -1;
+	for (int i = 0; i <= block_count; i++) {
+		uint32_t end = i < block_count ? blocks[i].offset : ELF_RTC_POOL_SIZE;
+		if (end - pos > largest) largest = end - pos;
+		if (found < 0 && size && end - pos >= size) {
+			found = i;
+			*out_offset = pos;
+		}
+		if (i < block_count) pos = blocks[i].offset + blocks[i].size;
+	}
+	if (out_largest) *out_largest = largest;
+	return found;
+}
+
+void* elf_rtc_alloc(size_t size) {
+	size = ALIGNUP(4, size);
+	void* mem = NULL;
+	taskENTER_CRITICAL(&pool_lock);
+	uint32_t offset;
+	int at = block_count < ELF_RTC_MAX_BLOCKS ? find_gap(size, &offset, NULL) : -1;
+	if (at >= 0) {
+		memmove(&blocks[at + 1], &blocks[at], (block_count - at) * sizeof(rtc_block_t));
+		blocks[at].offset = offset;
+		blocks[at].size = size;
+		block_count++;
+		mem = (uint8_t*)pool + offset + RTC_IBUS_OFFSET;
+	}
+	taskEXIT_CRITICAL(&pool_lock);
+	return mem;
+}
+
+void elf_rtc_free(void* mem) {
+	if (!mem) return;
+	uint32_t offset = (uint32_t)mem - RTC_IBUS_OFFSET - (uint32_t)pool;
+	taskENTER_CRITICAL(&pool_lock);
+	for (int i = 0; i < block_count; i++) {
+		if (blocks[i].offset != offset) continue;
+		memmove(&blocks[i], &blocks[i + 1], (block_count - i - 1) * sizeof(rtc_block_t));
+		block_count--;
+		break;
+	}
+	taskEXIT_CRITICAL(&pool_lock);
+}
+
+size_t elf_rtc_largest_free(void) {
+	size_t largest = 0;
+	uint32_t offset;
+	taskENTER_CRITICAL(&pool_lock);
+	if (block_count < ELF_RTC_MAX_BLOCKS) find_gap(0, &offset, &largest);
+	taskEXIT_CRITICAL(&pool_lock);
+	return largest;
+}
+
+void elf_rtc_get_usage(size_t* used, size_t* total) {
+	*used = 0;
+	*total = ELF_RTC_POOL_SIZE;
+	taskENTER_CRITICAL(&pool_lock);
+	for (int i = 0; i < block_count; i++) {
+		*used += blocks[i].size;
+	}
+	taskEXIT_CRITICAL(&pool_lock);
+}
+
+typedef struct {
+	void* dst;
+	const void* src;
+	size_t len;
+} rtc_write_t;
+
+static void write_on_pro_cpu(void* arg) {
+	rtc_write_t* w = arg;
+	memcpy(w->dst, w->src, w->len);
+}
+
+void elf_rtc_write(void* dst, const void* src, size_t len) {
+	rtc_write_t w = {
+		.dst = (uint8_t*)dst - RTC_IBUS_OFFSET,
+		.src = src,
+		.len = len,
+	};
+	if (esp_cpu_get_core_id() == 0) {
+		write_on_pro_cpu(&w);
+	} else {
+		esp_ipc_call_blocking(0, write_on_pro_cpu, &w);
+	}
+}
@@ -1,11 +1,25 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
 #include <elf.h>
 #include "elf_specific.h"
 #include "elf_loader.h"
+#include "guest_console.h"
+#include "guest_pipe.h"
+#include "task_pool.h"
+#include "guest_hooks.h"
+#include "guest_string.h"
+#include "guest_perf.h"
+#include "guest_coro.h"
+#include "sdcard.h"
+#include "esp_cpu.h"
+#include "esp_timer.h"
+#include "esp_dsp.h"
+#include <stdatomic.h>
 
 typedef struct {
 	const char* name;
@@ -16,34 +30,348 @@ void delay(uint32_t ms) {
 	vTaskDelay(pdMS_TO_TICKS(ms));
 }
 
+void elf_module_bind(elf_module_t* module) {
+	vTaskSetThreadLocalStoragePointer(NULL, ELF_TLS_INDEX, module);
+}
+
+elf_module_t* elf_module_current(void) {
+	return (elf_module_t*)pvTaskGetThreadLocalStoragePointer(NULL, ELF_TLS_INDEX);
+}
+
+static elf_arena_t* current_arena(void) {
+	elf_module_t* module = elf_module_current();
+	return module ? module->arena : NULL;
+}
+
+static void* guest_malloc(size_t size) {
+	elf_arena_t* arena = current_arena();
+	return arena ? elf_arena_malloc(arena, size) : malloc(size);
+}
+
+static void guest_free(void* ptr) {
+	elf_arena_t* arena = current_arena();
+	if (arena) {
+		elf_arena_free(arena, ptr);
+	} else {
+		free(ptr);
+	}
+}
+
+static void* guest_calloc(size_t num, size_t size) {
+	elf_arena_t* arena = current_arena();
+	return arena ? elf_arena_calloc(arena, num, size) : calloc(num, size);
+}
+
+static void* guest_realloc(void* ptr, size_t size) {
+	elf_arena_t* arena = current_arena();
+	return arena ? elf_arena_realloc(arena, ptr, size) : realloc(ptr, size);
+}
+
+// Workers bind the submitting module through the same TLS slot
+_Static_assert(TASK_POOL_TLS_OWNER == ELF_TLS_INDEX, "task pool owner slot");
+
+/*
+ * There is a worker on each core, and the APP CPU can't fetch from RTC fast
+ * memory. Modules with code there run their work on the caller, which is
+ * pinned to core 0; a NULL group is what task_wait expects for that.
+ */
+static int guest_parallel_for(int begin, int end, int grain, task_range_fn_t fn, void* ctx) {
+	elf_module_t* module = elf_module_current();
+	if (module && module->rtc_mem) {
+		if (end > begin) fn(begin, end, ctx);
+		return 0;
+	}
+	return task_pool_for(module, begin, end, grain, fn, ctx);
+}
+
+static task_group_t* guest_task_spawn(task_fn_t fn, void* ctx) {
+	elf_module_t* module = elf_module_current();
+	if (module && module->rtc_mem) {
+		fn(ctx);
+		return NULL;
+	}
+	return task_pool_spawn(module, fn, ctx);
+}
+
+_Static_assert(GUEST_HOOKS_TLS_OWNER == ELF_TLS_INDEX, "hook owner slot");
+
+// Overlay code may be swapped out when a callback fires
+static elf_module_t* hook_owner(void) {
+	elf_module_t* module = elf_module_current();
+	return (module && !module->overlay) ? module : NULL;
+}
+
+static int guest_timer_start(uint32_t period_us, hook_fn_t fn, void* arg, int flags) {
+	elf_module_t* module = hook_owner();
+	return module ? guest_hooks_timer(module, period_us, fn, arg, flags) : -1;
+}
+
+static int guest_gpio_isr_attach(int pin, int edge, hook_fn_t fn, void* arg) {
+	elf_module_t* module = hook_owner();
+	return module ? guest_hooks_gpio(module, pin, edge, fn, arg) : -1;
+}
+
+static int guest_hook_remove(int id) {
+	return guest_hooks_remove(elf_module_current(), id);
+}
+
+// Suspended stacks hold return addresses into code an overlay could evict
+static guest_coro_t* guest_coro_create(guest_coro_fn_t fn, void* arg, size_t stack) {
+	elf_module_t* module = elf_module_current();
+	if (!module || module->overlay) return NULL;
+	if (!stack) stack = GUEST_CORO_STACK_DEFAULT;
+	if (stack < GUEST_CORO_STACK_MIN) stack = GUEST_CORO_STACK_MIN;
+
+	size_t size = guest_coro_mem_size(stack);
+	void* mem = guest_malloc(size);
+	guest_coro_t* co = guest_coro_init(mem, size, fn, arg);
+	if (!co) guest_free(mem);
+	return co;
+}
+
+static int guest_coro_free(guest_coro_t* co) {
+	if (!co || !guest_coro_freeable(co)) return -1;
+	guest_free(co);
+	return 0;
+}
+
+static int guest_coro_resume_current(guest_coro_t* co) {
+	return guest_coro_resume(elf_module_current(), co);
+}
+
+static void guest_coro_yield_current(void) {
+	guest_coro_yield(elf_module_current());
+}
+
+static guest_coro_t* guest_coro_self_current(void) {
+	return guest_coro_self(elf_module_current());
+}
+
+static int guest_coro_is_done(guest_coro_t* co) {
+	return co ? guest_coro_done(co) : 1;
+}
+
+static int guest_coro_spawn_current(guest_coro_fn_t fn, void* arg, size_t stack) {
+	guest_coro_t* co = guest_coro_create(fn, arg, stack);
+	if (!co) return -1;
+	if (guest_coro_spawn(elf_module_current(), co) != 0) {
+		guest_free(co);
+		return -1;
+	}
+	return 0;
+}
+
+static void guest_coro_sleep_us(uint32_t us) {
+	guest_coro_sleep(elf_module_current(), us);
+}
+
+static int guest_coro_wait_current(guest_coro_event_t* ev) {
+	return guest_coro_wait(elf_module_current(), ev);
+}
+
+static void release_coro(guest_coro_t* co, void* ctx) {
+	guest_free(co);
+}
+
+static int guest_coro_run_current(void) {
+	return guest_coro_run(elf_module_current(), release_coro, NULL);
+}
+
+static const void* guest_asset_map(const char* name, size_t* size) {
+	return elf_asset_map(elf_module_current(), name, size);
+}
+
+/*
+ * Guest FILEs are recorded per module, so a fault or an unload doesn't leave
+ * FATFS handles (there are few) or hostfs slots behind.
+ */
+static portMUX_TYPE files_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static FILE* guest_fopen(const char* path, const char* mode) {
+	elf_module_t* module = elf_module_current();
+	const char* sd = sdcard_get_mount_point();
+	// The card may still be mounting in the background
+	if (strncmp(path, sd, strlen(sd)) == 0 && !sdcard_ensure()) return NULL;
+	if (!module) return fopen(path, mode);
+
+	int slot = -1;
+	taskENTER_CRITICAL(&files_lock);
+	for (int i = 0; i < ELF_MAX_FILES && slot < 0; i++) {
+		if (!module->file_tasks[i]) slot = i;
+	}
+	if (slot >= 0) module->file_tasks[slot] = xTaskGetCurrentTaskHandle();
+	taskEXIT_CRITICAL(&files_lock);
+	if (slot < 0) {
+		errno = EMFILE;
+		return NULL;
+	}
+
+	FILE* f = fopen(path, mode);
+	taskENTER_CRITICAL(&files_lock);
+	module->files[slot] = f;
+	if (!f) module->file_tasks[slot] = NULL;
+	taskEXIT_CRITICAL(&files_lock);
+	return f;
+}
+
+static int guest_fclose(FILE* f) {
+	elf_module_t* module = elf_module_current();
+	if (module && f) {
+		taskENTER_CRITICAL(&files_lock);
+		for (int i = 0; i < ELF_MAX_FILES; i++) {
+			if (module->files[i] == f) {
+				module->files[i] = NULL;
+				module->file_tasks[i] = NULL;
+				break;
+			}
+		}
+		taskEXIT_CRITICAL(&files_lock);
+	}
+	return fclose(f);
+}
+
+void elf_module_close_files(elf_module_t* module, void* task) {
+	for (int i = 0; i < ELF_MAX_FILES; i++) {
+		FILE* f = NULL;
+		taskENTER_CRITICAL(&files_lock);
+		if (module->files[i] && (!task || module->file_tasks[i] == task)) {
+			f = module->files[i];
+			module->files[i] = NULL;
+			module->file_tasks[i] = NULL;
+		}
+		taskEXIT_CRITICAL(&files_lock);
+		if (f) fclose(f);
+	}
+}
+
+static void guest_perf_region_begin(int id) {
+	guest_perf_begin(elf_module_current(), id);
+}
+
+static void guest_perf_region_end(int id) {
+	guest_perf_end(elf_module_current(), id);
+}
+
+static void guest_perf_region_name(int id, const char* name) {
+	guest_perf_name(elf_module_current(), id, name);
+}
+
+static uint32_t guest_cycles(void) {
+	return esp_cpu_get_cycle_count();
+}
+
+// Guests reserve fir_f32_t as opaque words, see esp_guest.h
+#define GUEST_FIR_WORDS		12
+_Static_assert(sizeof(fir_f32_t) <= GUEST_FIR_WORDS * sizeof(uint32_t), "guest fir_f32_t too small");
+
+// Twiddle table (CONFIG_DSP_MAX_FFT_SIZE) is built on first use, once
+static atomic_int fft_state = 0;	// 0 - none, 1 - building, 2 - ready
+
+static int guest_fft2r_fc32(float* data, int n) {
+	int expected = 0;
+	if (atomic_compare_exchange_strong(&fft_state, &expected, 1)) {
+		esp_err_t err = dsps_fft2r_init_fc32(NULL, CONFIG_DSP_MAX_FFT_SIZE);
+		atomic_store(&fft_state, err == ESP_OK ? 2 : 0);
+		if (err != ESP_OK) return err;
+	}
+	while (atomic_load(&fft_state) == 1) {
+		vTaskDelay(1);
+	}
+	if (atomic_load(&fft_state) != 2) return ESP_ERR_DSP_UNINITIALIZED;
+	return dsps_fft2r_fc32(data, n);
+}
+
 static const export_entry_t g_exports[] = {
 	// Вывод
-	{"printf",		(void*)&printf},
+	{"printf",		(void*)&guest_console_printf},
 	{"sprintf",		(void*)&sprintf},
 	{"snprintf",	(void*)&snprintf},
-	{"puts",		(void*)&puts},
-	{"putchar",		(void*)&putchar},
+	{"puts",		(void*)&guest_console_puts},
+	{"putchar",		(void*)&guest_console_putchar},
 	
 	// Память
-	{"malloc",		(void*)&malloc},
-	{"free",		(void*)&free},
-	{"calloc",		(void*)&calloc},
-	{"realloc",		(void*)&realloc},
-	{"memcpy",		(void*)&memcpy},
-	{"memset",		(void*)&memset},
-	{"memmove",		(void*)&memmove},
-	{"memcmp",		(void*)&memcmp},
+	{"malloc",		(void*)&guest_malloc},
+	{"free",		(void*)&guest_free},
+	{"calloc",		(void*)&guest_calloc},
+	{"realloc",		(void*)&guest_realloc},
+	{"memcpy",		(void*)&guest_memcpy},
+	{"memset",		(void*)&guest_memset},
+	{"memmove",		(void*)&guest_memmove},
+	{"memcmp",		(void*)&guest_memcmp},
 	
-	// Строки
-	{"strlen",		(void*)&strlen},
-	{"strcmp",		(void*)&strcmp},
-	{"strncmp",		(void*)&strncmp},
-	{"strcpy",		(void*)&strcpy},
+	// Строки (guest_* лежат в IRAM)
+	{"strlen",		(void*)&guest_strlen},
+	{"strcmp",		(void*)&guest_strcmp},
+	{"strncmp",		(void*)&guest_strncmp},
+	{"strcpy",		(void*)&guest_strcpy},
 	{"strncpy",		(void*)&strncpy},
 	{"strcat",		(void*)&strcat},
-	{"strchr",		(void*)&strchr},
+	{"strchr",		(void*)&guest_strchr},
 	{"strstr",		(void*)&strstr},
 	
+	// Файлы
+	{"fopen",		(void*)&guest_fopen},
+	{"fclose",		(void*)&guest_fclose},
+	{"fread",		(void*)&fread},
+	{"fwrite",		(void*)&fwrite},
+	{"fseek",		(void*)&fseek},
+	{"ftell",		(void*)&ftell},
+	{"fgets",		(void*)&fgets},
+	
+	// Ресурсы
+	{"asset_map",	(void*)&guest_asset_map},
+
+	// Каналы
+	{"pipe_write_acquire",	(void*)&pipe_write_acquire},
+	{"pipe_write_commit",	(void*)&pipe_write_commit},
+	{"pipe_read_acquire",	(void*)&pipe_read_acquire},
+	{"pipe_read_release",	(void*)&pipe_read_release},
+
+	// Задачи
+	{"parallel_for",	(void*)&guest_parallel_for},
+	{"task_spawn",		(void*)&guest_task_spawn},
+	{"task_wait",		(void*)&task_pool_wait},
+
+	// Сопрограммы
+	{"coro_create",		(void*)&guest_coro_create},
+	{"coro_free",		(void*)&guest_coro_free},
+	{"coro_resume",		(void*)&guest_coro_resume_current},
+	{"coro_yield",		(void*)&guest_coro_yield_current},
+	{"coro_self",		(void*)&guest_coro_self_current},
+	{"coro_done",		(void*)&guest_coro_is_done},
+	{"coro_spawn",		(void*)&guest_coro_spawn_current},
+	{"coro_sleep_us",	(void*)&guest_coro_sleep_us},
+	{"coro_wait",		(void*)&guest_coro_wait_current},
+	{"coro_signal",		(void*)&guest_coro_signal},
+	{"coro_run",		(void*)&guest_coro_run_current},
+
+	// Таймеры и прерывания
+	{"timer_start",		(void*)&guest_timer_start},
+	{"timer_stop",		(void*)&guest_hook_remove},
+	{"gpio_isr_attach",	(void*)&guest_gpio_isr_attach},
+	{"gpio_isr_detach",	(void*)&guest_hook_remove},
+	{"micros",			(void*)&esp_timer_get_time},
+
+	// Замеры
+	{"perf_region_begin",	(void*)&guest_perf_region_begin},
+	{"perf_region_end",		(void*)&guest_perf_region_end},
+	{"perf_region_name",	(void*)&guest_perf_region_name},
+	{"cycles",				(void*)&guest_cycles},
+
+	// DSP (esp-dsp, оптимизированные под ESP32 версии)
+	{"dsps_dotprod_f32",		(void*)&dsps_dotprod_f32},
+	{"dsps_dotprod_s16",		(void*)&dsps_dotprod_s16},
+	{"dsps_fir_init_f32",		(void*)&dsps_fir_init_f32},
+	{"dsps_fir_f32",			(void*)&dsps_fir_f32},
+	{"dsps_biquad_f32",			(void*)&dsps_biquad_f32},
+	{"dsps_biquad_gen_lpf_f32",	(void*)&dsps_biquad_gen_lpf_f32},
+	{"dsps_biquad_gen_hpf_f32",	(void*)&dsps_biquad_gen_hpf_f32},
+	{"dsps_fft2r_fc32",			(void*)&guest_fft2r_fc32},
+	{"dsps_bit_rev_fc32",		(void*)&dsps_bit_rev_fc32},
+	{"dsps_cplx2reC_fc32",		(void*)&dsps_cplx2reC_fc32},
+	{"dsps_wind_hann_f32",		(void*)&dsps_wind_hann_f32},
+	{"dspm_mult_f32",			(void*)&dspm_mult_f32},
+
 	// FreeRTOS
 	{"delay",		(void*)&delay},
 
@@ -103,12 +431,12 @@ static void guest_delay_ms(uint32_t ms) {
 
 guest_api_t guest_api_get_default(void) {
 	guest_api_t api = {
-		.printf = printf,
-		.puts = puts,
-		.putchar = putchar,
+		.printf = guest_console_printf,
+		.puts = guest_console_puts,
+		.putchar = guest_console_putchar,
 		.delay_ms = guest_delay_ms,
-		.malloc = malloc,
-		.free = free,
+		.malloc = guest_malloc,
+		.free = guest_free,
 		.gpio_set_level = NULL,  // TODO: реализовать
 		.gpio_get_level = NULL,
 	};
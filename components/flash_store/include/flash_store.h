@@ -0,0 +1,48 @@
+#ifndef FLASH_STORE_H
+#define FLASH_STORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#define FLASH_STORE_PARTITION	"store"
+#define FLASH_STORE_MAX_FILES	32
+#define FLASH_STORE_NAME_LEN	24
+#define FLASH_STORE_SECTOR		4096
+#define FLASH_STORE_MAX_MAPS	16
+
+typedef struct {
+	char name[FLASH_STORE_NAME_LEN];
+	uint32_t offset;			// from the start of the partition, sector aligned
+	uint32_t size;
+	uint32_t crc;				// of the contents
+} flash_store_file_t;
+
+/*
+ * Files in a raw data partition, for booting without a card. The directory
+ * is kept twice (sectors 0 and 1) and written alternately, so losing power
+ * while saving leaves the previous directory intact.
+ */
+esp_err_t flash_store_init(void);
+
+esp_err_t flash_store_write(const char* name, const void* data, size_t size);
+// Caller frees *out_data
+esp_err_t flash_store_read(const char* name, uint8_t** out_data, size_t* out_size);
+// Fails with ESP_ERR_INVALID_STATE while the file is mapped
+esp_err_t flash_store_remove(const char* name);
+// Every file whose name starts with `prefix` and isn't mapped; returns how many
+int flash_store_remove_prefix(const char* prefix);
+
+/*
+ * Maps a file read-only into the data address space, through the flash
+ * cache, without copying it. Returns a map id for flash_store_munmap().
+ * Mapped memory can't be read with the cache disabled (from IRAM-only
+ * interrupt handlers).
+ */
+int flash_store_mmap(const char* name, const void** out_data, size_t* out_size);
+void flash_store_munmap(int id);
+
+int flash_store_list(flash_store_file_t* out, int max);
+void flash_store_usage(size_t* used, size_t* total);
+
+#endif
@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "flash_store.h"
+
+#define DIR_MAGIC		0x31545346	// "FST1"
+#define DIR_SECTORS		2
+#define ALIGN_UP(x, a)	(((x) + (a) - 1) & ~((a) - 1))
+
+typedef struct {
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t count;
+	flash_store_file_t files[FLASH_STORE_MAX_FILES];
+	uint32_t crc;				// of everything above
+} store_dir_t;
+
+_Static_assert(sizeof(store_dir_t) <= FLASH_STORE_SECTOR, "directory must fit a sector");
+
+static const esp_partition_t* part = NULL;
+static store_dir_t dir;
+static int dir_sector = -1;		// the one holding the current directory
+
+typedef struct {
+	uint32_t offset;			// of the mapped file, 0 = free
+	uint32_t refs;
+	esp_partition_mmap_handle_t handle;
+	const void* data;
+} store_map_t;
+
+// Guests map assets from their own tasks
+static SemaphoreHandle_t lock = NULL;
+static store_map_t maps[FLASH_STORE_MAX_MAPS];
+
+static uint32_t dir_crc(const store_dir_t* d) {
+	return esp_rom_crc32_le(0, (const uint8_t*)d, offsetof(store_dir_t, crc));
+}
+
+static bool dir_valid(const store_dir_t* d) {
+	return d->magic == DIR_MAGIC && d->count <= FLASH_STORE_MAX_FILES && d->crc == dir_crc(d);
+}
+
+esp_err_t flash_store_init(void) {
+	if (!lock) {
+		lock = xSemaphoreCreateMutex();
+	}
+	part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, FLASH_STORE_PARTITION);
+	if (!part) {
+		printf("[fst] No '%s' partition\n", FLASH_STORE_PARTITION);
+		return ESP_ERR_NOT_FOUND;
+	}
+
+	// Newest valid copy wins; the other one is the previous generation.
+	// A directory is too big for the main task's stack.
+	static store_dir_t copy;
+	memset(&dir, 0, sizeof(dir));
+	dir_sector = -1;
+	for (int i = 0; i < DIR_SECTORS; i++) {
+		if (esp_partition_read(part, i * FLASH_STORE_SECTOR, &copy, sizeof(copy)) != ESP_OK) continue;
+		if (!dir_valid(&copy)) continue;
+		if (dir_sector < 0 || copy.seq > dir.seq) {
+			dir = copy;
+			dir_sector = i;
+		}
+	}
+
+	if (dir_sector < 0) {
+		dir.magic = DIR_MAGIC;
+		printf("[fst] Empty store (%lu KB)\n", part->size / 1024);
+	}
+	return ESP_OK;
+}
+
+// Under the lock, which also guards the static copy
+static esp_err_t dir_commit(void) {
+	static store_dir_t next;
+	next = dir;
+	next.seq++;
+	next.crc = dir_crc(&next);
+
+	int sector = dir_sector < 0 ? 0 : (dir_sector + 1) % DIR_SECTORS;
+	esp_err_t err = esp_partition_erase_range(part, sector * FLASH_STORE_SECTOR, FLASH_STORE_SECTOR);
+	if (err == ESP_OK) {
+		err = esp_partition_write(part, sector * FLASH_STORE_SECTOR, &next, sizeof(next));
+	}
+	if (err != ESP_OK) {
+		printf("[fst] Directory write failed: %s\n", esp_err_to_name(err));
+		return err;
+	}
+
+	dir = next;
+	dir_sector = sector;
+	return ESP_OK;
+}
+
+static int find(const char* name) {
+	for (uint32_t i = 0; i < dir.count; i++) {
+		if (strncmp(dir.files[i].name, name, FLASH_STORE_NAME_LEN) == 0) return i;
+	}
+	return -1;
+}
+
+// First gap between the files (kept sorted by offset) that fits `size`
+static uint32_t find_space(uint32_t size, int skip) {
+	uint32_t pos = DIR_SECTORS * FLASH_STORE_SECTOR;
+	for (uint32_t i = 0; i < dir.count; i++) {
+		if ((int)i == skip) continue;
+		if (dir.files[i].offset >= pos + size) break;
+		uint32_t end = ALIGN_UP(dir.files[i].offset + dir.files[i].size, FLASH_STORE_SECTOR);
+		if (end > pos) pos = end;
+	}
+	return pos + size <= part->size ? pos : 0;
+}
+
+static void remove_entry(int index) {
+	memmove(&dir.files[index], &dir.files[index + 1], (dir.count - index - 1) * sizeof(flash_store_file_t));
+	dir.count--;
+}
+
+static void insert_sorted(const flash_store_file_t* file) {
+	uint32_t i = 0;
+	while (i < dir.count && dir.files[i].offset < file->offset) i++;
+	memmove(&dir.files[i + 1], &dir.files[i], (dir.count - i) * sizeof(flash_store_file_t));
+	dir.files[i] = *file;
+	dir.count++;
+}
+
+static esp_err_t store_write(const char* name, const void* data, size_t size) {
+	if (!name[0] || strlen(name) >= FLASH_STORE_NAME_LEN) return ESP_ERR_INVALID_ARG;
+
+	int old = find(name);
+	if (old < 0 && dir.count >= FLASH_STORE_MAX_FILES) {
+		printf("[fst] Directory full\n");
+		return ESP_ERR_NO_MEM;
+	}
+
+	// The old copy stays valid until the new directory is written
+	uint32_t span = ALIGN_UP(size ? size : 1, FLASH_STORE_SECTOR);
+	uint32_t offset = find_space(span, -1);
+	if (!offset) {
+		printf("[fst] No space for %u bytes\n", size);
+		return ESP_ERR_NO_MEM;
+	}
+
+	esp_err_t err = esp_partition_erase_range(part, offset, span);
+	if (err == ESP_OK && size) {
+		err = esp_partition_write(part, offset, data, size);
+	}
+	if (err != ESP_OK) {
+		printf("[fst] Write failed: %s\n", esp_err_to_name(err));
+		return err;
+	}
+
+	flash_store_file_t file = {
+		.offset = offset,
+		.size = size,
+		.crc = esp_rom_crc32_le(0, data, size),
+	};
+	strncpy(file.name, name, FLASH_STORE_NAME_LEN - 1);
+
+	if (old >= 0) remove_entry(old);
+	insert_sorted(&file);
+	return dir_commit();
+}
+
+static esp_err_t store_read(const char* name, uint8_t** out_data, size_t* out_size) {
+	int index = find(name);
+	if (index < 0) return ESP_ERR_NOT_FOUND;
+	const flash_store_file_t* file = &dir.files[index];
+
+	uint8_t* data = malloc(file->size ? file->size : 1);
+	if (!data) {
+		printf("[fst] Failed to allocate %lu bytes\n", file->size);
+		return ESP_ERR_NO_MEM;
+	}
+
+	esp_err_t err = esp_partition_read(part, file->offset, data, file->size);
+	if (err == ESP_OK && esp_rom_crc32_le(0, data, file->size) != file->crc) {
+		printf("[fst] %s: CRC mismatch\n", name);
+		err = ESP_ERR_INVALID_CRC;
+	}
+	if (err != ESP_OK) {
+		free(data);
+		return err;
+	}
+
+	*out_data = data;
+	*out_size = file->size;
+	return ESP_OK;
+}
+
+static bool is_mapped(uint32_t offset) {
+	for (int i = 0; i < FLASH_STORE_MAX_MAPS; i++) {
+		if (maps[i].refs && maps[i].offset == offset) return true;
+	}
+	return false;
+}
+
+static esp_err_t store_remove(const char* name) {
+	int index = find(name);
+	if (index < 0) return ESP_ERR_NOT_FOUND;
+	if (is_mapped(dir.files[index].offset)) return ESP_ERR_INVALID_STATE;
+
+	// Data sectors are erased by whoever reuses them
+	remove_entry(index);
+	return dir_commit();
+}
+
+esp_err_t flash_store_write(const char* name, const void* data, size_t size) {
+	if (!part) return ESP_ERR_INVALID_STATE;
+	xSemaphoreTake(lock, portMAX_DELAY);
+	int old = find(name);
+	esp_err_t err = (old >= 0 && is_mapped(dir.files[old].offset)) ?
+		ESP_ERR_INVALID_STATE : store_write(name, data, size);
+	xSemaphoreGive(lock);
+	return err;
+}
+
+esp_err_t flash_store_read(const char* name, uint8_t** out_data, size_t* out_size) {
+	if (!part) return ESP_ERR_INVALID_STATE;
+	xSemaphoreTake(lock, portMAX_DELAY);
+	esp_err_t err = store_read(name, out_data, out_size);
+	xSemaphoreGive(lock);
+	return err;
+}
+
+esp_err_t flash_store_remove(const char* name) {
+	if (!part) return ESP_ERR_INVALID_STATE;
+	xSemaphoreTake(lock, portMAX_DELAY);
+	esp_err_t err = store_remove(name);
+	xSemaphoreGive(lock);
+	return err;
+}
+
+int flash_store_remove_prefix(const char* prefix) {
+	if (!part) return 0;
+	size_t len = strlen(prefix);
+	xSemaphoreTake(lock, portMAX_DELAY);
+	int removed = 0;
+	for (uint32_t i = 0; i < dir.count;) {
+		if (strncmp(dir.files[i].name, prefix, len) == 0 && !is_mapped(dir.files[i].offset)) {
+			remove_entry(i);
+			removed++;
+		} else {
+			i++;
+		}
+	}
+	if (removed && dir_commit() != ESP_OK) removed = 0;
+	xSemaphoreGive(lock);
+	return removed;
+}
+
+static int map_file(const flash_store_file_t* file, const void** out_data) {
+	int free_slot = -1;
+	for (int i = 0; i < FLASH_STORE_MAX_MAPS; i++) {
+		if (maps[i].refs && maps[i].offset == file->offset) {
+			maps[i].refs++;
+			*out_data = maps[i].data;
+			return i;
+		}
+		if (!maps[i].refs && free_slot < 0) free_slot = i;
+	}
+	if (free_slot < 0) return -1;
+
+	// The partition API maps whole MMU pages and returns our offset inside them
+	store_map_t* map = &maps[free_slot];
+	esp_err_t err = esp_partition_mmap(part, file->offset, file->size ? file->size : 1,
+									   ESP_PARTITION_MMAP_DATA, &map->data, &map->handle);
+	if (err != ESP_OK) {
+		printf("[fst] mmap failed: %s\n", esp_err_to_name(err));
+		return -1;
+	}
+
+	// Checked once here, later users of the mapping trust it
+	if (esp_rom_crc32_le(0, map->data, file->size) != file->crc) {
+		printf("[fst] %s: CRC mismatch\n", file->name);
+		esp_partition_munmap(map->handle);
+		return -1;
+	}
+
+	map->offset = file->offset;
+	map->refs = 1;
+	*out_data = map->data;
+	return free_slot;
+}
+
+int flash_store_mmap(const char* name, const void** out_data, size_t* out_size) {
+	if (!part) return -1;
+	xSemaphoreTake(lock, portMAX_DELAY);
+	int id = -1;
+	int index = find(name);
+	if (index >= 0) {
+		id = map_file(&dir.files[index], out_data);
+		if (id >= 0 && out_size) *out_size = dir.files[index].size;
+	}
+	xSemaphoreGive(lock);
+	return id;
+}
+
+void flash_store_munmap(int id) {
+	if (id < 0 || id >= FLASH_STORE_MAX_MAPS) return;
+	xSemaphoreTake(lock, portMAX_DELAY);
+	store_map_t* map = &maps[id];
+	if (map->refs && --map->refs == 0) {
+		esp_partition_munmap(map->handle);
+		map->offset = 0;
+		map->data = NULL;
+	}
+	xSemaphoreGive(lock);
+}
+
+int flash_store_list(flash_store_file_t* out, int max) {
+	int n = 0;
+	for (uint32_t i = 0; i < dir.count && n < max; i++) {
+		out[n++] = dir.files[i];
+	}
+	return n;
+}
+
+void flash_store_usage(size_t* used, size_t* total) {
+	*used = 0;
+	*total = part ? part->size - DIR_SECTORS * FLASH_STORE_SECTOR : 0;
+	for (uint32_t i = 0; i < dir.count; i++) {
+		*used += ALIGN_UP(dir.files[i].size, FLASH_STORE_SECTOR);
+	}
+}
@@ -0,0 +1,56 @@
+#ifndef GUEST_CONSOLE_H
+#define GUEST_CONSOLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define CONSOLE_BUFFER_SIZE		(16 * 1024)		// power of two
+#define CONSOLE_LINE_SIZE		256
+#define CONSOLE_TASK_PRIORITY	5
+
+typedef enum {
+	CONSOLE_FULL_BLOCK = 0,		// wait for the TX task to make room
+	CONSOLE_FULL_DROP,			// discard what doesn't fit
+	CONSOLE_FULL_COUNT,			// discard and report the dropped byte count
+} console_full_policy_t;
+
+typedef struct {
+	uint32_t bytes_written;
+	uint32_t bytes_dropped;
+	uint32_t blocked_count;
+	uint32_t high_water;
+	uint32_t buffered;
+	uint32_t baud_rate;
+	console_full_policy_t policy;
+} console_stats_t;
+
+void guest_console_init(void);
+
+size_t guest_console_write(const char* data, size_t len);
+void guest_console_flush(void);
+// For a writer that will never finish: its unpublished output is skipped
+void guest_console_abandon(TaskHandle_t task);
+
+int guest_console_printf(const char* fmt, ...);
+int guest_console_vprintf(const char* fmt, va_list args);
+int guest_console_puts(const char* s);
+int guest_console_putchar(int c);
+
+void guest_console_lock(void);
+void guest_console_unlock(void);
+
+// While capturing, output isn't sent but kept for guest_console_read()
+void guest_console_capture(bool on);
+size_t guest_console_read(char* out, size_t max);
+
+void guest_console_set_policy(console_full_policy_t policy);
+int guest_console_set_baud(uint32_t baud);
+void guest_console_get_stats(console_stats_t* out);
+
+const char* guest_console_policy_name(console_full_policy_t policy);
+
+#endif
@@ -0,0 +1,420 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "driver/uart.h"
+
+#include "uart_receiver.h"
+#include "guest_console.h"
+#include "trace.h"
+
+#define RING_MASK (CONSOLE_BUFFER_SIZE - 1)
+#define COMMIT_SPINS 64
+#define WRITER_SLOTS 8
+
+/*
+ * Multi-producer, single-consumer byte ring. Producers reserve space by
+ * advancing `reserve` with a CAS, copy their bytes, then publish them in
+ * reservation order by advancing `commit`. The TX task consumes up to
+ * `commit` and advances `tail`.
+ *
+ * A writer first claims a slot (a CAS as well) and bids its head there
+ * before the reserve CAS, so every reservation is tracked; with no slot free
+ * it backs off or drops. One whose task dies before publishing becomes
+ * padding: it is committed over so later writers don't wait for it forever,
+ * and readers skip its bytes. Only padding takes the lock.
+ */
+static uint8_t s_ring[CONSOLE_BUFFER_SIZE];
+static atomic_uint s_reserve;
+static atomic_uint s_commit;
+static atomic_uint s_tail;
+
+static atomic_uint s_written;
+static atomic_uint s_dropped;
+static atomic_uint s_dropped_pending;
+static atomic_uint s_blocked;
+static atomic_uint s_high_water;
+
+#define SLOT_FREE	0
+#define SLOT_PAD	1			// abandoned, never sent
+
+typedef struct {
+	atomic_uintptr_t owner;		// SLOT_FREE, SLOT_PAD or the writing task
+	atomic_bool reserved;		// head and len are taken in the ring, not only a bid
+	unsigned head;
+	unsigned len;
+} writer_slot_t;
+
+static writer_slot_t s_slots[WRITER_SLOTS];
+static portMUX_TYPE s_slots_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static volatile console_full_policy_t s_policy = CONSOLE_FULL_BLOCK;
+static volatile bool s_capture = false;	// output stays in the ring for guest_console_read()
+static TaskHandle_t s_tx_task = NULL;
+static SemaphoreHandle_t s_space = NULL;
+static SemaphoreHandle_t s_drained = NULL;
+static SemaphoreHandle_t s_tx_lock = NULL;
+
+static void write_marker(uint32_t dropped) {
+	char marker[48];
+	int len = snprintf(marker, sizeof(marker), "\n[console: %lu bytes dropped]\n", dropped);
+	uart_write_bytes(UART_NUM, marker, len);
+}
+
+// Skips padding at tail; out_len is how much may be read before the next one
+static unsigned skip_padding(unsigned tail, unsigned commit, unsigned* out_len) {
+	taskENTER_CRITICAL(&s_slots_lock);
+	for (int i = 0; i < WRITER_SLOTS; i++) {
+		writer_slot_t* w = &s_slots[i];
+		if (atomic_load(&w->owner) == SLOT_PAD && w->head == tail && tail != commit) {
+			tail += w->len;
+			atomic_store(&w->owner, SLOT_FREE);
+			i = -1;		// padding may follow padding
+		}
+	}
+	unsigned len = commit - tail;
+	for (int i = 0; i < WRITER_SLOTS; i++) {
+		writer_slot_t* w = &s_slots[i];
+		if (atomic_load(&w->owner) == SLOT_PAD && w->head - tail < len) len = w->head - tail;
+	}
+	taskEXIT_CRITICAL(&s_slots_lock);
+	*out_len = len;
+	return tail;
+}
+
+// Commits over padding that is next in line; false if there is none
+static bool commit_padding(void) {
+	bool moved = false;
+	taskENTER_CRITICAL(&s_slots_lock);
+	unsigned commit = atomic_load(&s_commit);
+	for (int i = 0; i < WRITER_SLOTS; i++) {
+		writer_slot_t* w = &s_slots[i];
+		if (atomic_load(&w->owner) == SLOT_PAD && w->head == commit) {
+			commit += w->len;
+			atomic_store(&s_commit, commit);
+			moved = true;
+			i = -1;
+		}
+	}
+	taskEXIT_CRITICAL(&s_slots_lock);
+	return moved;
+}
+
+static void console_tx_task(void* arg) {
+	while (1) {
+		ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(10));
+		if (s_capture) continue;
+
+		unsigned tail = atomic_load(&s_tail);
+		unsigned commit = atomic_load(&s_commit);
+
+		while (tail != commit) {
+			unsigned len;
+			tail = skip_padding(tail, commit, &len);
+			unsigned offset = tail & RING_MASK;
+			if (len > CONSOLE_BUFFER_SIZE - offset) {
+				len = CONSOLE_BUFFER_SIZE - offset;
+			}
+
+			if (len) {
+				trace_begin("console_tx");
+				xSemaphoreTake(s_tx_lock, portMAX_DELAY);
+				uart_write_bytes(UART_NUM, (const char*)&s_ring[offset], len);
+				xSemaphoreGive(s_tx_lock);
+				trace_end("console_tx");
+				trace_counter("console_bytes", len);
+				tail += len;
+			}
+			atomic_store(&s_tail, tail);
+			xSemaphoreGive(s_space);
+
+			commit = atomic_load(&s_commit);
+		}
+
+		unsigned dropped = atomic_exchange(&s_dropped_pending, 0);
+		if (dropped) {
+			xSemaphoreTake(s_tx_lock, portMAX_DELAY);
+			write_marker(dropped);
+			xSemaphoreGive(s_tx_lock);
+		}
+
+		if (atomic_load(&s_reserve) == tail) {
+			xSemaphoreGive(s_drained);
+		}
+	}
+}
+
+void guest_console_init(void) {
+	if (s_tx_task) return;
+
+	s_space = xSemaphoreCreateBinary();
+	s_drained = xSemaphoreCreateBinary();
+	s_tx_lock = xSemaphoreCreateMutex();
+	xTaskCreate(console_tx_task, "console", 2048, NULL, CONSOLE_TASK_PRIORITY, &s_tx_task);
+}
+
+static int claim_slot(void) {
+	uintptr_t self = (uintptr_t)xTaskGetCurrentTaskHandle();
+	for (int i = 0; i < WRITER_SLOTS; i++) {
+		uintptr_t expected = SLOT_FREE;
+		if (atomic_compare_exchange_strong(&s_slots[i].owner, &expected, self)) return i;
+	}
+	return -1;
+}
+
+static int reserve_space(size_t len, unsigned* out_head, int* out_slot) {
+	// An untracked reservation whose writer died would hold up commit for good
+	int slot = claim_slot();
+	while (slot < 0) {
+		if (s_policy != CONSOLE_FULL_BLOCK) return 0;
+		atomic_fetch_add(&s_blocked, 1);
+		vTaskDelay(1);
+		slot = claim_slot();
+	}
+	writer_slot_t* w = &s_slots[slot];
+
+	while (1) {
+		unsigned head = atomic_load(&s_reserve);
+		unsigned used = head - atomic_load(&s_tail);
+
+		if (used + len > CONSOLE_BUFFER_SIZE) {
+			// Nobody drains a captured ring while the guest runs
+			if (s_policy != CONSOLE_FULL_BLOCK || s_capture || !s_tx_task) {
+				atomic_store(&w->owner, SLOT_FREE);
+				return 0;
+			}
+			atomic_fetch_add(&s_blocked, 1);
+			xTaskNotifyGive(s_tx_task);
+			xSemaphoreTake(s_space, pdMS_TO_TICKS(10));
+			continue;
+		}
+
+		// The bid is in the slot before the CAS can make it a reservation
+		w->head = head;
+		w->len = len;
+		unsigned expected = head;
+		if (atomic_compare_exchange_weak(&s_reserve, &expected, head + len)) {
+			// No guest code runs in between, so a recovered fault can't land here
+			atomic_store(&w->reserved, true);
+			unsigned level = used + len;
+			unsigned high = atomic_load(&s_high_water);
+			while (level > high && !atomic_compare_exchange_weak(&s_high_water, &high, level));
+			*out_head = head;
+			*out_slot = slot;
+			return 1;
+		}
+	}
+}
+
+static void publish(unsigned head, size_t len, int slot) {
+	// Earlier reservations have to be published first
+	int spins = 0;
+	while (atomic_load(&s_commit) != head) {
+		if (commit_padding()) continue;
+		if (++spins > COMMIT_SPINS) {
+			vTaskDelay(1);
+			spins = 0;
+		}
+	}
+	atomic_store(&s_commit, head + len);
+	atomic_store(&s_slots[slot].reserved, false);
+	atomic_store(&s_slots[slot].owner, SLOT_FREE);
+}
+
+size_t guest_console_write(const char* data, size_t len) {
+	if (!len) return 0;
+
+	if (len > CONSOLE_BUFFER_SIZE) {
+		data += len - CONSOLE_BUFFER_SIZE;
+		atomic_fetch_add(&s_dropped, len - CONSOLE_BUFFER_SIZE);
+		len = CONSOLE_BUFFER_SIZE;
+	}
+
+	unsigned head;
+	int slot;
+	if (!reserve_space(len, &head, &slot)) {
+		atomic_fetch_add(&s_dropped, len);
+		if (s_policy == CONSOLE_FULL_COUNT) {
+			atomic_fetch_add(&s_dropped_pending, len);
+		}
+		return 0;
+	}
+
+	unsigned offset = head & RING_MASK;
+	size_t first = CONSOLE_BUFFER_SIZE - offset;
+	if (first > len) first = len;
+	memcpy(&s_ring[offset], data, first);
+	memcpy(&s_ring[0], data + first, len - first);
+
+	publish(head, len, slot);
+	atomic_fetch_add(&s_written, len);
+
+	if (s_tx_task) {
+		xTaskNotifyGive(s_tx_task);
+	}
+	return len;
+}
+
+void guest_console_abandon(TaskHandle_t task) {
+	bool found = false;
+	taskENTER_CRITICAL(&s_slots_lock);
+	for (int i = 0; i < WRITER_SLOTS; i++) {
+		writer_slot_t* w = &s_slots[i];
+		if (atomic_load(&w->owner) != (uintptr_t)task) continue;
+		// A slot claimed without a reservation holds nothing up
+		if (atomic_exchange(&w->reserved, false)) {
+			atomic_store(&w->owner, SLOT_PAD);
+			found = true;
+		} else {
+			atomic_store(&w->owner, SLOT_FREE);
+		}
+	}
+	taskEXIT_CRITICAL(&s_slots_lock);
+	if (!found) return;
+
+	while (commit_padding());
+	if (s_tx_task) {
+		xTaskNotifyGive(s_tx_task);
+	}
+}
+
+void guest_console_flush(void) {
+	if (!s_tx_task || s_capture) return;
+
+	while (atomic_load(&s_tail) != atomic_load(&s_reserve)) {
+		xTaskNotifyGive(s_tx_task);
+		xSemaphoreTake(s_drained, pdMS_TO_TICKS(10));
+	}
+	uart_wait_tx_done(UART_NUM, pdMS_TO_TICKS(100));
+}
+
+int guest_console_vprintf(const char* fmt, va_list args) {
+	char line[CONSOLE_LINE_SIZE];
+	va_list copy;
+	va_copy(copy, args);
+	int len = vsnprintf(line, sizeof(line), fmt, copy);
+	va_end(copy);
+
+	if (len < 0) return len;
+	if (len < sizeof(line)) {
+		guest_console_write(line, len);
+		return len;
+	}
+
+	char* big = malloc(len + 1);
+	if (!big) {
+		guest_console_write(line, sizeof(line) - 1);
+		return len;
+	}
+	vsnprintf(big, len + 1, fmt, args);
+	guest_console_write(big, len);
+	free(big);
+	return len;
+}
+
+int guest_console_printf(const char* fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	int len = guest_console_vprintf(fmt, args);
+	va_end(args);
+	return len;
+}
+
+int guest_console_puts(const char* s) {
+	guest_console_write(s, strlen(s));
+	guest_console_write("\n", 1);
+	return 1;
+}
+
+int guest_console_putchar(int c) {
+	char ch = (char)c;
+	guest_console_write(&ch, 1);
+	return (unsigned char)c;
+}
+
+// Keeps the TX task off the UART while someone else writes framed data to it
+void guest_console_lock(void) {
+	if (s_tx_lock) xSemaphoreTake(s_tx_lock, portMAX_DELAY);
+}
+
+void guest_console_unlock(void) {
+	if (s_tx_lock) xSemaphoreGive(s_tx_lock);
+}
+
+void guest_console_capture(bool on) {
+	if (on) {
+		guest_console_flush();
+		s_capture = true;
+		return;
+	}
+	// Whatever wasn't read is dropped, it belongs to the other side
+	s_capture = false;
+	unsigned tail = atomic_load(&s_tail);
+	unsigned commit = atomic_load(&s_commit);
+	taskENTER_CRITICAL(&s_slots_lock);
+	for (int i = 0; i < WRITER_SLOTS; i++) {
+		writer_slot_t* w = &s_slots[i];
+		if (atomic_load(&w->owner) == SLOT_PAD && w->head - tail < commit - tail) {
+			atomic_store(&w->owner, SLOT_FREE);
+		}
+	}
+	taskEXIT_CRITICAL(&s_slots_lock);
+	atomic_store(&s_tail, commit);
+	xSemaphoreGive(s_space);
+}
+
+size_t guest_console_read(char* out, size_t max) {
+	unsigned tail = atomic_load(&s_tail);
+	unsigned commit = atomic_load(&s_commit);
+	unsigned sendable;
+	tail = skip_padding(tail, commit, &sendable);
+	size_t len = sendable;
+	if (len > max) len = max;
+
+	unsigned offset = tail & RING_MASK;
+	size_t first = CONSOLE_BUFFER_SIZE - offset;
+	if (first > len) first = len;
+	memcpy(out, &s_ring[offset], first);
+	memcpy(out + first, &s_ring[0], len - first);
+
+	atomic_store(&s_tail, tail + len);
+	xSemaphoreGive(s_space);
+	return len;
+}
+
+void guest_console_set_policy(console_full_policy_t policy) {
+	s_policy = policy;
+}
+
+int guest_console_set_baud(uint32_t baud) {
+	guest_console_flush();
+	fflush(stdout);
+	uart_wait_tx_done(UART_NUM, pdMS_TO_TICKS(100));
+	return uart_set_baudrate(UART_NUM, baud) == ESP_OK ? 0 : -1;
+}
+
+void guest_console_get_stats(console_stats_t* out) {
+	out->bytes_written = atomic_load(&s_written);
+	out->bytes_dropped = atomic_load(&s_dropped);
+	out->blocked_count = atomic_load(&s_blocked);
+	out->high_water = atomic_load(&s_high_water);
+	out->buffered = atomic_load(&s_reserve) - atomic_load(&s_tail);
+	out->policy = s_policy;
+
+	uint32_t baud = 0;
+	uart_get_baudrate(UART_NUM, &baud);
+	out->baud_rate = baud;
+}
+
+const char* guest_console_policy_name(console_full_policy_t policy) {
+	switch (policy) {
+		case CONSOLE_FULL_BLOCK:	return "block";
+		case CONSOLE_FULL_DROP:		return "drop";
+		case CONSOLE_FULL_COUNT:	return "count";
+		default:					return "unknown";
+	}
+}
@@ -0,0 +1,68 @@
+#ifndef GUEST_CORO_H
+#define GUEST_CORO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define GUEST_CORO_TASKS		4		// guest tasks with coroutines at the same time
+#define GUEST_CORO_STACK_DEFAULT	1024
+#define GUEST_CORO_STACK_MIN	512
+
+typedef void (*guest_coro_fn_t)(void* arg);
+typedef struct guest_coro guest_coro_t;
+
+// Zeroed by the guest; only for coroutines of the same task
+typedef struct {
+	guest_coro_t* waiters;
+	int set;					// signalled with nobody waiting
+} guest_coro_event_t;
+
+typedef struct {
+	uint32_t live;				// spawned and not finished
+	uint32_t waiting;			// on events
+	uint32_t switches;
+	uint32_t overflows;			// stack guard found overwritten
+} guest_coro_stats_t;
+
+/*
+ * Stackful coroutines inside one guest task. A switch spills the register
+ * windows onto the stack being left and swaps a0/a1, nothing else; there is
+ * no TCB and the stack comes from the caller (the module's heap), so a few
+ * hundred of them fit in a module and a switch stays well under a
+ * microsecond. Each task of an owner has its own scheduler, and the TLS
+ * module binding is the same in all of its coroutines.
+ */
+
+// Bytes to hand guest_coro_init for a stack of `stack` bytes
+size_t guest_coro_mem_size(size_t stack);
+// The coroutine is at the start of mem; it starts on the first resume
+guest_coro_t* guest_coro_init(void* mem, size_t size, guest_coro_fn_t fn, void* arg);
+// Runs co until it yields or returns; 1 if it can be resumed again, 0 if done, -1 if it can't run
+int guest_coro_resume(const void* owner, guest_coro_t* co);
+// Back to whoever resumed the running coroutine; nothing outside one
+void guest_coro_yield(const void* owner);
+guest_coro_t* guest_coro_self(const void* owner);
+bool guest_coro_done(const guest_coro_t* co);
+// Not running and not spawned: its memory may go
+bool guest_coro_freeable(const guest_coro_t* co);
+
+/*
+ * The scheduler: spawned coroutines take turns in guest_coro_run, which
+ * returns once none is ready or sleeping. Outside a spawned coroutine sleep
+ * blocks the whole task and wait fails, nothing could signal it.
+ */
+int guest_coro_spawn(const void* owner, guest_coro_t* co);
+void guest_coro_sleep(const void* owner, uint32_t us);
+int guest_coro_wait(const void* owner, guest_coro_event_t* ev);
+void guest_coro_signal(guest_coro_event_t* ev);
+// Finished coroutines go to release; returns how many are left waiting on events
+int guest_coro_run(const void* owner, void (*release)(guest_coro_t* co, void* ctx), void* ctx);
+
+void guest_coro_get_stats(const void* owner, guest_coro_stats_t* out);
+// All of the owner's schedulers are free for other tasks afterwards
+void guest_coro_release(const void* owner);
+// Just the calling task's, before it exits or goes back to other work; NULL for every owner
+void guest_coro_release_task(const void* owner);
+
+#endif
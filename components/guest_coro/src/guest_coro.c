@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "esp_rom_sys.h"
+#include "xtensa_context.h"
+
+#include "guest_coro.h"
+
+#define CORO_GUARD		0xC0DEC0DE
+#define CORO_CALL4		(1u << 30)		// window increment retw takes from a0[31:30]
+#define CORO_HEAD		ALIGNUP(16, sizeof(guest_coro_t))
+
+// Layout shared with guest_coro_switch.S
+typedef struct {
+	uint32_t a0;
+	uint32_t sp;
+} guest_coro_ctx_t;
+
+typedef enum {
+	CORO_SUSPENDED = 0,
+	CORO_RUNNING,
+	CORO_SLEEPING,
+	CORO_WAITING,
+	CORO_DONE,
+} coro_state_t;
+
+typedef struct coro_sched coro_sched_t;
+
+struct guest_coro {
+	guest_coro_ctx_t ctx;		// the coroutine while it is away
+	guest_coro_ctx_t caller;	// whoever resumed it, while it runs
+	guest_coro_t* parent;		// the coroutine that did, NULL for the task's own stack
+	coro_sched_t* sched;
+	guest_coro_fn_t fn;
+	void* arg;
+	coro_state_t state;
+	bool spawned;
+	guest_coro_t* next;			// ready, sleeping or event list
+	int64_t wake_us;
+	uint32_t* guard;			// lowest word of the stack
+};
+
+struct coro_sched {
+	const void* owner;
+	TaskHandle_t task;
+	guest_coro_t* current;
+	guest_coro_t* ready_head;
+	guest_coro_t* ready_tail;
+	guest_coro_t* sleeping;		// by wake time
+	guest_coro_stats_t stats;
+};
+
+static coro_sched_t scheds[GUEST_CORO_TASKS];
+static portMUX_TYPE scheds_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void guest_coro_switch(guest_coro_ctx_t* save, const guest_coro_ctx_t* load);
+void guest_coro_trampoline(void);
+void guest_coro_entry(guest_coro_t* co);
+
+static IRAM_ATTR coro_sched_t* find_sched(const void* owner) {
+	TaskHandle_t task = xTaskGetCurrentTaskHandle();
+	for (int i = 0; i < GUEST_CORO_TASKS; i++) {
+		if (scheds[i].owner == owner && scheds[i].task == task) return &scheds[i];
+	}
+	return NULL;
+}
+
+// Once per task, on its first resume or spawn
+static coro_sched_t* claim_sched(const void* owner) {
+	coro_sched_t* s = NULL;
+	taskENTER_CRITICAL(&scheds_lock);
+	s = find_sched(owner);
+	for (int i = 0; !s && i < GUEST_CORO_TASKS; i++) {
+		if (!scheds[i].owner) {
+			s = &scheds[i];
+			memset(s, 0, sizeof(*s));
+			s->owner = owner;
+			s->task = xTaskGetCurrentTaskHandle();
+		}
+	}
+	taskEXIT_CRITICAL(&scheds_lock);
+	if (!s) printf("[coro] ERROR: More than %d tasks with coroutines\n", GUEST_CORO_TASKS);
+	return s;
+}
+
+// First and last frame on every coroutine stack
+void guest_coro_entry(guest_coro_t* co) {
+	co->fn(co->arg);
+	co->state = CORO_DONE;
+	co->sched->current = co->parent;
+	// Done coroutines are never resumed, this switch doesn't come back
+	guest_coro_switch(&co->ctx, &co->caller);
+}
+
+size_t guest_coro_mem_size(size_t stack) {
+	return CORO_HEAD + ALIGNUP(16, stack);
+}
+
+guest_coro_t* guest_coro_init(void* mem, size_t size, guest_coro_fn_t fn, void* arg) {
+	if (!mem || !fn || size < guest_coro_mem_size(GUEST_CORO_STACK_MIN)) return NULL;
+	guest_coro_t* co = mem;
+	memset(co, 0, sizeof(*co));
+	co->fn = fn;
+	co->arg = arg;
+	co->guard = (uint32_t*)((uint8_t*)mem + CORO_HEAD);
+	*co->guard = CORO_GUARD;
+
+	// The first switch returns into the trampoline; the window underflow takes
+	// its a0-a3 from below the stack pointer
+	uint32_t sp = (((uint32_t)mem + size) & ~15u) - 16;
+	uint32_t* regs = (uint32_t*)(sp - 16);
+	regs[0] = 0;				// a0, ends backtraces
+	regs[1] = sp;				// a1
+	regs[2] = (uint32_t)co;		// a2, for guest_coro_entry
+	regs[3] = 0;
+	co->ctx.a0 = CORO_CALL4 | ((uint32_t)&guest_coro_trampoline & 0x3FFFFFFF);
+	co->ctx.sp = sp;
+	return co;
+}
+
+static IRAM_ATTR int run_coro(coro_sched_t* s, guest_coro_t* co) {
+	co->sched = s;
+	co->parent = s->current;
+	co->state = CORO_RUNNING;
+	s->current = co;
+	s->stats.switches++;
+	guest_coro_switch(&co->caller, &co->ctx);
+
+	if (*co->guard != CORO_GUARD) {
+		// Whatever lies below the stack is damaged too, the coroutine can't go on
+		printf("[coro] ERROR: Stack overflow in coroutine %p\n", co);
+		s->stats.overflows++;
+		co->state = CORO_DONE;
+	}
+	return co->state != CORO_DONE;
+}
+
+static IRAM_ATTR void suspend(coro_sched_t* s, guest_coro_t* co, coro_state_t state) {
+	co->state = state;
+	s->current = co->parent;
+	s->stats.switches++;
+	guest_coro_switch(&co->ctx, &co->caller);
+}
+
+IRAM_ATTR int guest_coro_resume(const void* owner, guest_coro_t* co) {
+	if (!co || co->state == CORO_DONE) return 0;
+	// Spawned ones belong to the scheduler
+	if (!owner || co->spawned || co->state != CORO_SUSPENDED || xPortInIsrContext()) return -1;
+	coro_sched_t* s = find_sched(owner);
+	if (!s && !(s = claim_sched(owner))) return -1;
+	return run_coro(s, co);
+}
+
+IRAM_ATTR void guest_coro_yield(const void* owner) {
+	coro_sched_t* s = find_sched(owner);
+	if (s && s->current) suspend(s, s->current, CORO_SUSPENDED);
+}
+
+guest_coro_t* guest_coro_self(const void* owner) {
+	coro_sched_t* s = find_sched(owner);
+	return s ? s->current : NULL;
+}
+
+bool guest_coro_done(const guest_coro_t* co) {
+	return co->state == CORO_DONE;
+}
+
+bool guest_coro_freeable(const guest_coro_t* co) {
+	return !co->spawned && (co->state == CORO_SUSPENDED || co->state == CORO_DONE);
+}
+
+static void push_ready(coro_sched_t* s, guest_coro_t* co) {
+	co->next = NULL;
+	if (s->ready_tail) {
+		s->ready_tail->next = co;
+	} else {
+		s->ready_head = co;
+	}
+	s->ready_tail = co;
+}
+
+static guest_coro_t* pop_ready(coro_sched_t* s) {
+	guest_coro_t* co = s->ready_head;
+	if (co) {
+		s->ready_head = co->next;
+		if (!s->ready_head) s->ready_tail = NULL;
+	}
+	return co;
+}
+
+int guest_coro_spawn(const void* owner, guest_coro_t* co) {
+	if (!owner || !co || co->spawned || co->state != CORO_SUSPENDED) return -1;
+	coro_sched_t* s = find_sched(owner);
+	if (!s && !(s = claim_sched(owner))) return -1;
+	co->spawned = true;
+	co->sched = s;
+	push_ready(s, co);
+	s->stats.live++;
+	return 0;
+}
+
+void guest_coro_sleep(const void* owner, uint32_t us) {
+	coro_sched_t* s = find_sched(owner);
+	guest_coro_t* co = s ? s->current : NULL;
+	if (!co || !co->spawned) {
+		if (us >= portTICK_PERIOD_MS * 1000) {
+			vTaskDelay(pdMS_TO_TICKS(us / 1000));
+		} else {
+			esp_rom_delay_us(us);
+		}
+		return;
+	}
+
+	co->wake_us = esp_timer_get_time() + us;
+	guest_coro_t** p = &s->sleeping;
+	while (*p && (*p)->wake_us <= co->wake_us) p = &(*p)->next;
+	co->next = *p;
+	*p = co;
+	suspend(s, co, CORO_SLEEPING);
+}
+
+int guest_coro_wait(const void* owner, guest_coro_event_t* ev) {
+	if (ev->set) {
+		ev->set = 0;
+		return 0;
+	}
+	coro_sched_t* s = find_sched(owner);
+	guest_coro_t* co = s ? s->current : NULL;
+	if (!co || !co->spawned) return -1;
+
+	co->next = ev->waiters;
+	ev->waiters = co;
+	s->stats.waiting++;
+	suspend(s, co, CORO_WAITING);
+	return 0;
+}
+
+void guest_coro_signal(guest_coro_event_t* ev) {
+	if (!ev->waiters) {
+		ev->set = 1;
+		return;
+	}
+	// Waiters were pushed in front, they become ready in the order they came
+	guest_coro_t* fifo = NULL;
+	for (guest_coro_t* co = ev->waiters; co; ) {
+		guest_coro_t* next = co->next;
+		co->next = fifo;
+		fifo = co;
+		co = next;
+	}
+	ev->waiters = NULL;
+	while (fifo) {
+		guest_coro_t* next = fifo->next;
+		fifo->state = CORO_SUSPENDED;
+		fifo->sched->stats.waiting--;
+		push_ready(fifo->sched, fifo);
+		fifo = next;
+	}
+}
+
+static void wake_sleepers(coro_sched_t* s) {
+	int64_t now = esp_timer_get_time();
+	while (s->sleeping && s->sleeping->wake_us <= now) {
+		guest_coro_t* co = s->sleeping;
+		s->sleeping = co->next;
+		co->state = CORO_SUSPENDED;
+		push_ready(s, co);
+	}
+}
+
+int guest_coro_run(const void* owner, void (*release)(guest_coro_t* co, void* ctx), void* ctx) {
+	coro_sched_t* s = find_sched(owner);
+	if (!s) return 0;
+
+	for (;;) {
+		if (s->sleeping) wake_sleepers(s);
+		guest_coro_t* co = pop_ready(s);
+		if (!co) {
+			if (!s->sleeping) break;
+			// Everybody sleeps: give the CPU away for whole ticks, spin for the rest
+			int64_t wait = s->sleeping->wake_us - esp_timer_get_time();
+			if (wait >= portTICK_PERIOD_MS * 1000) {
+				vTaskDelay(wait / (portTICK_PERIOD_MS * 1000));
+			} else if (wait > 0) {
+				esp_rom_delay_us(wait);
+			}
+			continue;
+		}
+
+		run_coro(s, co);
+		if (co->state == CORO_DONE) {
+			s->stats.live--;
+			if (release) release(co, ctx);
+		} else if (co->state == CORO_SUSPENDED) {
+			push_ready(s, co);
+		}
+	}
+	return s->stats.waiting;
+}
+
+void guest_coro_get_stats(const void* owner, guest_coro_stats_t* out) {
+	memset(out, 0, sizeof(*out));
+	taskENTER_CRITICAL(&scheds_lock);
+	for (int i = 0; i < GUEST_CORO_TASKS; i++) {
+		if (scheds[i].owner != owner) continue;
+		out->live += scheds[i].stats.live;
+		out->waiting += scheds[i].stats.waiting;
+		out->switches += scheds[i].stats.switches;
+		out->overflows += scheds[i].stats.overflows;
+	}
+	taskEXIT_CRITICAL(&scheds_lock);
+}
+
+void guest_coro_release(const void* owner) {
+	if (!owner) return;
+	taskENTER_CRITICAL(&scheds_lock);
+	for (int i = 0; i < GUEST_CORO_TASKS; i++) {
+		if (scheds[i].owner == owner) memset(&scheds[i], 0, sizeof(scheds[i]));
+	}
+	taskEXIT_CRITICAL(&scheds_lock);
+}
+
+void guest_coro_release_task(const void* owner) {
+	TaskHandle_t task = xTaskGetCurrentTaskHandle();
+	taskENTER_CRITICAL(&scheds_lock);
+	for (int i = 0; i < GUEST_CORO_TASKS; i++) {
+		if (!scheds[i].owner || scheds[i].task != task) continue;
+		if (!owner || scheds[i].owner == owner) memset(&scheds[i], 0, sizeof(scheds[i]));
+	}
+	taskEXIT_CRITICAL(&scheds_lock);
+}
@@ -0,0 +1,49 @@
+#ifndef GUEST_HOOKS_H
+#define GUEST_HOOKS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define GUEST_HOOKS_MAX			16
+#define GUEST_HOOKS_TLS_OWNER	1		// same slot as the loader's current module
+
+#define HOOK_TIMER_ONESHOT		1
+#define HOOK_TIMER_ISR			2		// run from the timer interrupt, code must be in IRAM
+
+typedef enum {
+	HOOK_FREE = 0,
+	HOOK_TIMER,
+	HOOK_GPIO,
+} hook_type_t;
+
+typedef void (*hook_fn_t)(void* arg);
+
+typedef struct {
+	hook_type_t type;
+	const void* owner;
+	uint32_t period_us;			// timers
+	int pin;					// GPIO
+	int flags;
+	uint32_t calls;
+	int64_t max_late_us;		// timers, how far past the deadline a call ran
+} guest_hook_info_t;
+
+/*
+ * High-resolution timers and GPIO interrupt hooks on behalf of a guest
+ * module. All of a module's hooks are removed with it. Task-context timer
+ * callbacks run in the esp_timer task with the owner bound like in a guest
+ * task; interrupt hooks get nothing but their argument. A one-shot timer
+ * gives its slot back once its callback has returned.
+ */
+int guest_hooks_timer(const void* owner, uint32_t period_us, hook_fn_t fn, void* arg, int flags);
+// GPIO_INTR_POSEDGE, NEGEDGE or ANYEDGE
+int guest_hooks_gpio(const void* owner, int pin, int edge, hook_fn_t fn, void* arg);
+// Not from interrupt hooks; from a task-context callback it only stops it
+int guest_hooks_remove(const void* owner, int id);
+// Waits for callbacks in flight, afterwards the owner's code can go away
+void guest_hooks_release(const void* owner);
+
+int guest_hooks_list(guest_hook_info_t* out, int max);
+int guest_hooks_count(const void* owner);
+
+#endif
@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "esp_memory_utils.h"
+#include "driver/gpio.h"
+
+#include "guest_hooks.h"
+
+#define TIMER_MIN_PERIOD_US	50
+
+typedef struct {
+	hook_type_t type;
+	const void* owner;
+	hook_fn_t fn;
+	void* arg;
+	int flags;
+	uint32_t period_us;
+	int pin;
+	esp_timer_handle_t timer;
+
+	int64_t deadline;
+	int64_t max_late_us;
+	volatile uint32_t calls;
+
+	// A slot is only freed once no callback is running in it. `active` and
+	// `removing` change together under hooks_lock, so a dispatch either sees
+	// the removal or is waited for
+	atomic_int active;
+	volatile bool removing;
+	volatile bool expired;		// a one-shot that has fired, reclaimed by the next allocation
+	TaskHandle_t caller;		// task running a task-context callback
+} hook_t;
+
+static hook_t hooks[GUEST_HOOKS_MAX];
+static portMUX_TYPE hooks_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool isr_service = false;
+
+static IRAM_ATTR void note_call(hook_t* hook) {
+	if (hook->type == HOOK_TIMER) {
+		int64_t late = esp_timer_get_time() - hook->deadline;
+		if (late > hook->max_late_us) hook->max_late_us = late;
+		hook->deadline += hook->period_us;
+	}
+	hook->calls++;
+}
+
+static IRAM_ATTR bool enter_hook(hook_t* hook) {
+	portENTER_CRITICAL_SAFE(&hooks_lock);
+	bool live = !hook->removing;
+	if (live) atomic_fetch_add(&hook->active, 1);
+	portEXIT_CRITICAL_SAFE(&hooks_lock);
+	return live;
+}
+
+static IRAM_ATTR void leave_hook(hook_t* hook) {
+	portENTER_CRITICAL_SAFE(&hooks_lock);
+	if (hook->type == HOOK_TIMER && (hook->flags & HOOK_TIMER_ONESHOT)) {
+		hook->expired = true;
+	}
+	atomic_fetch_sub(&hook->active, 1);
+	portEXIT_CRITICAL_SAFE(&hooks_lock);
+}
+
+static void timer_dispatch(void* p) {
+	hook_t* hook = (hook_t*)p;
+	if (enter_hook(hook)) {
+		note_call(hook);
+		hook->caller = xTaskGetCurrentTaskHandle();
+
+		// Guest code expects its module bound, for malloc and the task pool
+		void* prev = pvTaskGetThreadLocalStoragePointer(NULL, GUEST_HOOKS_TLS_OWNER);
+		vTaskSetThreadLocalStoragePointer(NULL, GUEST_HOOKS_TLS_OWNER, (void*)hook->owner);
+		hook->fn(hook->arg);
+		vTaskSetThreadLocalStoragePointer(NULL, GUEST_HOOKS_TLS_OWNER, prev);
+
+		hook->caller = NULL;
+		leave_hook(hook);
+	}
+}
+
+static IRAM_ATTR void isr_dispatch(void* p) {
+	hook_t* hook = (hook_t*)p;
+	if (enter_hook(hook)) {
+		note_call(hook);
+		hook->fn(hook->arg);
+		leave_hook(hook);
+	}
+}
+
+static void free_hook(hook_t* hook) {
+	taskENTER_CRITICAL(&hooks_lock);
+	hook->type = HOOK_FREE;
+	taskEXIT_CRITICAL(&hooks_lock);
+}
+
+/*
+ * The timer can't be deleted from its own callback, so fired one-shots are
+ * reaped here. The slot is freed under the lock, so a concurrent remove
+ * never sees it; a fired one-shot doesn't dispatch again.
+ */
+static void reap_expired(void) {
+	for (int i = 0; i < GUEST_HOOKS_MAX; i++) {
+		hook_t* hook = &hooks[i];
+		esp_timer_handle_t timer = NULL;
+		taskENTER_CRITICAL(&hooks_lock);
+		if (hook->type == HOOK_TIMER && hook->expired && !hook->removing && !atomic_load(&hook->active)) {
+			timer = hook->timer;
+			hook->type = HOOK_FREE;
+		}
+		taskEXIT_CRITICAL(&hooks_lock);
+
+		if (timer) esp_timer_delete(timer);
+	}
+}
+
+static hook_t* alloc_hook(hook_type_t type, const void* owner, hook_fn_t fn, void* arg) {
+	reap_expired();
+
+	hook_t* hook = NULL;
+	taskENTER_CRITICAL(&hooks_lock);
+	for (int i = 0; i < GUEST_HOOKS_MAX; i++) {
+		if (hooks[i].type == HOOK_FREE) {
+			hook = &hooks[i];
+			memset(hook, 0, sizeof(*hook));
+			hook->type = type;
+			hook->owner = owner;
+			hook->fn = fn;
+			hook->arg = arg;
+			break;
+		}
+	}
+	taskEXIT_CRITICAL(&hooks_lock);
+	return hook;
+}
+
+// Code that runs with the cache off has to be in IRAM, its data in DRAM
+static bool isr_safe(hook_fn_t fn, void* arg) {
+	return esp_ptr_in_iram(fn) && (!arg || esp_ptr_internal(arg));
+}
+
+int guest_hooks_timer(const void* owner, uint32_t period_us, hook_fn_t fn, void* arg, int flags) {
+	if (!fn || period_us < TIMER_MIN_PERIOD_US) return -1;
+
+	bool in_isr = flags & HOOK_TIMER_ISR;
+#if !CONFIG_ESP_TIMER_SUPPORTS_ISR_DISPATCH_METHOD
+	if (in_isr) return -1;
+#endif
+	if (in_isr && !isr_safe(fn, arg)) return -1;
+
+	hook_t* hook = alloc_hook(HOOK_TIMER, owner, fn, arg);
+	if (!hook) return -1;
+	hook->flags = flags;
+	hook->period_us = period_us;
+
+	esp_timer_create_args_t args = {
+		.callback = in_isr ? isr_dispatch : timer_dispatch,
+		.arg = hook,
+		.name = "guest",
+#if CONFIG_ESP_TIMER_SUPPORTS_ISR_DISPATCH_METHOD
+		.dispatch_method = in_isr ? ESP_TIMER_ISR : ESP_TIMER_TASK,
+#endif
+	};
+	if (esp_timer_create(&args, &hook->timer) != ESP_OK) {
+		free_hook(hook);
+		return -1;
+	}
+
+	hook->deadline = esp_timer_get_time() + period_us;
+	esp_err_t err = (flags & HOOK_TIMER_ONESHOT) ?
+		esp_timer_start_once(hook->timer, period_us) :
+		esp_timer_start_periodic(hook->timer, period_us);
+	if (err != ESP_OK) {
+		esp_timer_delete(hook->timer);
+		free_hook(hook);
+		return -1;
+	}
+	return hook - hooks;
+}
+
+int guest_hooks_gpio(const void* owner, int pin, int edge, hook_fn_t fn, void* arg) {
+	if (!fn || !GPIO_IS_VALID_GPIO(pin)) return -1;
+	if (edge != GPIO_INTR_POSEDGE && edge != GPIO_INTR_NEGEDGE && edge != GPIO_INTR_ANYEDGE) return -1;
+	if (!isr_safe(fn, arg)) return -1;
+
+	for (int i = 0; i < GUEST_HOOKS_MAX; i++) {
+		if (hooks[i].type == HOOK_GPIO && hooks[i].pin == pin) return -1;
+	}
+
+	if (!isr_service) {
+		esp_err_t err = gpio_install_isr_service(ESP_INTR_FLAG_IRAM);
+		// Someone else may have installed it already
+		if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) return -1;
+		isr_service = true;
+	}
+
+	hook_t* hook = alloc_hook(HOOK_GPIO, owner, fn, arg);
+	if (!hook) return -1;
+	hook->pin = pin;
+	hook->flags = edge;
+
+	gpio_config_t cfg = {
+		.pin_bit_mask = 1ULL << pin,
+		.mode = GPIO_MODE_INPUT,
+		.intr_type = edge,
+	};
+	if (gpio_config(&cfg) != ESP_OK || gpio_isr_handler_add(pin, isr_dispatch, hook) != ESP_OK) {
+		free_hook(hook);
+		return -1;
+	}
+	return hook - hooks;
+}
+
+static void remove_hook(hook_t* hook) {
+	taskENTER_CRITICAL(&hooks_lock);
+	hook->removing = true;
+	taskEXIT_CRITICAL(&hooks_lock);
+	if (hook->type == HOOK_TIMER) {
+		esp_timer_stop(hook->timer);
+	} else {
+		gpio_isr_handler_remove(hook->pin);
+		gpio_set_intr_type(hook->pin, GPIO_INTR_DISABLE);
+	}
+
+	// A callback removing its own hook can't wait for itself; the slot is
+	// reclaimed when the owner is released
+	if (hook->caller == xTaskGetCurrentTaskHandle()) return;
+
+	while (atomic_load(&hook->active)) {
+		vTaskDelay(1);
+	}
+	if (hook->type == HOOK_TIMER) {
+		esp_timer_delete(hook->timer);
+	}
+	free_hook(hook);
+}
+
+int guest_hooks_remove(const void* owner, int id) {
+	if (id < 0 || id >= GUEST_HOOKS_MAX) return -1;
+	hook_t* hook = &hooks[id];
+	if (hook->type == HOOK_FREE || hook->owner != owner || hook->removing) return -1;
+	remove_hook(hook);
+	return 0;
+}
+
+void guest_hooks_release(const void* owner) {
+	for (int i = 0; i < GUEST_HOOKS_MAX; i++) {
+		hook_t* hook = &hooks[i];
+		if (hook->type != HOOK_FREE && hook->owner == owner) {
+			hook->caller = NULL;
+			remove_hook(hook);
+		}
+	}
+}
+
+int guest_hooks_list(guest_hook_info_t* out, int max) {
+	int n = 0;
+	for (int i = 0; i < GUEST_HOOKS_MAX && n < max; i++) {
+		hook_t* hook = &hooks[i];
+		if (hook->type == HOOK_FREE || hook->expired) continue;
+		out[n++] = (guest_hook_info_t){
+			.type = hook->type,
+			.owner = hook->owner,
+			.period_us = hook->period_us,
+			.pin = hook->pin,
+			.flags = hook->flags,
+			.calls = hook->calls,
+			.max_late_us = hook->max_late_us,
+		};
+	}
+	return n;
+}
+
+int guest_hooks_count(const void* owner) {
+	int n = 0;
+	for (int i = 0; i < GUEST_HOOKS_MAX; i++) {
+		if (hooks[i].type != HOOK_FREE && !hooks[i].expired && hooks[i].owner == owner) n++;
+	}
+	return n;
+}
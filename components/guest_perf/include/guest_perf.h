@@ -0,0 +1,46 @@
+#ifndef GUEST_PERF_H
+#define GUEST_PERF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define GUEST_PERF_OWNERS		5		// modules with regions at once, DOS_MAX_MODULES + 1
+#define GUEST_PERF_REGIONS		16		// region ids per module
+#define GUEST_PERF_OPEN			8		// regions open at once per module, over all its tasks
+#define GUEST_PERF_COUNTERS		3		// Xtensa performance counters sampled
+#define GUEST_PERF_NAME_LEN		16
+
+typedef struct {
+	int id;
+	char name[GUEST_PERF_NAME_LEN];		// empty if never named
+	uint32_t count;
+	uint64_t cycles;			// CCOUNT, summed over both cores
+	uint32_t min;
+	uint32_t max;
+	uint64_t counters[GUEST_PERF_COUNTERS];	// only while counters are on
+} guest_perf_region_t;
+
+/*
+ * Per-module timing of guest code regions. An open region belongs to the
+ * task that began it, so the guest task and its pool workers can time the
+ * same id at once. begin/end take the table's spinlock for a few loads and
+ * stores, nothing is allocated once the module has its table. A region
+ * that ends on another core than it began on (the task migrated) is
+ * dropped, the counters aren't comparable. Not for interrupt hooks.
+ */
+void guest_perf_begin(const void* owner, int id);
+void guest_perf_end(const void* owner, int id);
+void guest_perf_name(const void* owner, int id, const char* name);
+
+// Regions with at least one sample, by id
+int guest_perf_get(const void* owner, guest_perf_region_t* out, int max);
+void guest_perf_reset(const void* owner);
+// The owner's table is free for another module afterwards
+void guest_perf_release(const void* owner);
+
+// Instructions and I/D cache miss stalls, sampled by begin/end on both cores
+bool guest_perf_counters(bool on);
+bool guest_perf_counters_enabled(void);
+const char* guest_perf_counter_name(int index);
+
+#endif
@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_attr.h"
+#include "esp_cpu.h"
+#include "esp_ipc.h"
+#include "xtensa_perfmon_access.h"
+#include "xtensa_perfmon_masks.h"
+
+#include "guest_perf.h"
+
+typedef struct {
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint64_t cycles;
+	uint64_t counters[GUEST_PERF_COUNTERS];
+} perf_stat_t;
+
+// A region between begin and end, owned by the task that began it
+typedef struct {
+	TaskHandle_t task;			// NULL when the entry is free
+	int id;
+	int core;
+	uint32_t start;
+	uint32_t counter_start[GUEST_PERF_COUNTERS];
+} perf_open_t;
+
+typedef struct {
+	const void* owner;
+	portMUX_TYPE lock;			// stats and open entries
+	char names[GUEST_PERF_REGIONS][GUEST_PERF_NAME_LEN];	// copied, guest data may move
+	perf_stat_t stats[GUEST_PERF_REGIONS];
+	perf_open_t open[GUEST_PERF_OPEN];
+} perf_table_t;
+
+static perf_table_t tables[GUEST_PERF_OWNERS];
+static portMUX_TYPE tables_lock = portMUX_INITIALIZER_UNLOCKED;
+static volatile bool counters_on = false;
+
+static const struct {
+	const char* name;
+	uint16_t select;
+	uint16_t mask;
+} counter_events[GUEST_PERF_COUNTERS] = {
+	{"insn",		XTPERF_CNT_INSN,	XTPERF_MASK_INSN_ALL},
+	{"i-miss",		XTPERF_CNT_I_STALL,	XTPERF_MASK_I_STALL_CACHE_MISS},
+	{"d-miss",		XTPERF_CNT_D_STALL,	XTPERF_MASK_D_STALL_CACHE_MISS},
+};
+
+static IRAM_ATTR perf_table_t* find_table(const void* owner) {
+	for (int i = 0; i < GUEST_PERF_OWNERS; i++) {
+		if (tables[i].owner == owner) return &tables[i];
+	}
+	return NULL;
+}
+
+// Once per module, on its first region
+static perf_table_t* claim_table(const void* owner) {
+	perf_table_t* table = NULL;
+	taskENTER_CRITICAL(&tables_lock);
+	table = find_table(owner);
+	for (int i = 0; !table && i < GUEST_PERF_OWNERS; i++) {
+		if (!tables[i].owner) {
+			table = &tables[i];
+			memset(table, 0, sizeof(*table));
+			portMUX_INITIALIZE(&table->lock);
+			table->owner = owner;
+		}
+	}
+	taskEXIT_CRITICAL(&tables_lock);
+	return table;
+}
+
+IRAM_ATTR void guest_perf_begin(const void* owner, int id) {
+	if (!owner || (unsigned)id >= GUEST_PERF_REGIONS || xPortInIsrContext()) return;
+	perf_table_t* table = find_table(owner);
+	if (!table && !(table = claim_table(owner))) return;
+
+	TaskHandle_t task = xTaskGetCurrentTaskHandle();
+	perf_open_t* o = NULL;
+	taskENTER_CRITICAL(&table->lock);
+	for (int i = 0; i < GUEST_PERF_OPEN; i++) {
+		perf_open_t* e = &table->open[i];
+		// Beginning an open region again restarts it
+		if (e->task == task && e->id == id) {
+			o = e;
+			break;
+		}
+		if (!o && !e->task) o = e;
+	}
+	if (o) {
+		o->task = task;
+		o->id = id;
+	}
+	taskEXIT_CRITICAL(&table->lock);
+	if (!o) return;
+
+	// The entry is this task's now, the rest needs no lock
+	o->core = esp_cpu_get_core_id();
+	if (counters_on) {
+		for (int c = 0; c < GUEST_PERF_COUNTERS; c++) {
+			o->counter_start[c] = xtensa_perfmon_value(c);
+		}
+	}
+	// Last, so the bookkeeping above isn't timed
+	o->start = esp_cpu_get_cycle_count();
+}
+
+IRAM_ATTR void guest_perf_end(const void* owner, int id) {
+	uint32_t now = esp_cpu_get_cycle_count();
+	if (!owner || (unsigned)id >= GUEST_PERF_REGIONS || xPortInIsrContext()) return;
+	perf_table_t* table = find_table(owner);
+	if (!table) return;
+
+	uint32_t counter_now[GUEST_PERF_COUNTERS] = {0};
+	bool counting = counters_on;
+	if (counting) {
+		for (int c = 0; c < GUEST_PERF_COUNTERS; c++) {
+			counter_now[c] = xtensa_perfmon_value(c);
+		}
+	}
+
+	TaskHandle_t task = xTaskGetCurrentTaskHandle();
+	int core = esp_cpu_get_core_id();
+	taskENTER_CRITICAL(&table->lock);
+	for (int i = 0; i < GUEST_PERF_OPEN; i++) {
+		perf_open_t* o = &table->open[i];
+		if (o->task != task || o->id != id) continue;
+		o->task = NULL;
+		if (o->core != core) break;
+
+		perf_stat_t* s = &table->stats[id];
+		uint32_t cycles = now - o->start;
+		if (!s->count || cycles < s->min) s->min = cycles;
+		if (cycles > s->max) s->max = cycles;
+		s->cycles += cycles;
+		s->count++;
+		if (counting) {
+			for (int c = 0; c < GUEST_PERF_COUNTERS; c++) {
+				s->counters[c] += counter_now[c] - o->counter_start[c];
+			}
+		}
+		break;
+	}
+	taskEXIT_CRITICAL(&table->lock);
+}
+
+void guest_perf_name(const void* owner, int id, const char* name) {
+	if (!owner || (unsigned)id >= GUEST_PERF_REGIONS) return;
+	perf_table_t* table = find_table(owner);
+	if (!table && !(table = claim_table(owner))) return;
+	snprintf(table->names[id], GUEST_PERF_NAME_LEN, "%s", name ? name : "");
+}
+
+int guest_perf_get(const void* owner, guest_perf_region_t* out, int max) {
+	perf_table_t* table = find_table(owner);
+	if (!table) return 0;
+
+	int n = 0;
+	for (int id = 0; id < GUEST_PERF_REGIONS && n < max; id++) {
+		// Copied under the lock, the 64-bit sums could tear otherwise
+		perf_stat_t s;
+		taskENTER_CRITICAL(&table->lock);
+		s = table->stats[id];
+		taskEXIT_CRITICAL(&table->lock);
+		if (!s.count) continue;
+
+		guest_perf_region_t* r = &out[n++];
+		memset(r, 0, sizeof(*r));
+		r->id = id;
+		memcpy(r->name, table->names[id], GUEST_PERF_NAME_LEN);
+		r->count = s.count;
+		r->cycles = s.cycles;
+		r->min = s.min;
+		r->max = s.max;
+		memcpy(r->counters, s.counters, sizeof(r->counters));
+	}
+	return n;
+}
+
+void guest_perf_reset(const void* owner) {
+	perf_table_t* table = find_table(owner);
+	if (table) {
+		taskENTER_CRITICAL(&table->lock);
+		memset(table->stats, 0, sizeof(table->stats));
+		taskEXIT_CRITICAL(&table->lock);
+	}
+}
+
+void guest_perf_release(const void* owner) {
+	taskENTER_CRITICAL(&tables_lock);
+	perf_table_t* table = find_table(owner);
+	if (table) {
+		table->owner = NULL;
+	}
+	taskEXIT_CRITICAL(&tables_lock);
+}
+
+// The counters are per core and only reachable from the core itself
+static void counters_setup(void* arg) {
+	xtensa_perfmon_stop();
+	if (!arg) return;
+	for (int c = 0; c < GUEST_PERF_COUNTERS; c++) {
+		xtensa_perfmon_init(c, counter_events[c].select, counter_events[c].mask, 0, -1);
+		xtensa_perfmon_reset(c);
+	}
+	xtensa_perfmon_start();
+}
+
+bool guest_perf_counters(bool on) {
+	for (int core = 0; core < portNUM_PROCESSORS; core++) {
+		if (esp_ipc_call_blocking(core, counters_setup, on ? (void*)1 : NULL) != ESP_OK) {
+			printf("[perf] Failed to set up counters on core %d\n", core);
+			on = false;
+		}
+	}
+	counters_on = on;
+	return on;
+}
+
+bool guest_perf_counters_enabled(void) {
+	return counters_on;
+}
+
+const char* guest_perf_counter_name(int index) {
+	return (index >= 0 && index < GUEST_PERF_COUNTERS) ? counter_events[index].name : "?";
+}
@@ -0,0 +1,45 @@
+#ifndef GUEST_PIPE_H
+#define GUEST_PIPE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PIPE_BUFFER_SIZE	(16 * 1024)		// power of two
+#define PIPE_SPINS			200				// before a blocked side sleeps
+#define PIPE_TLS_IN			2
+#define PIPE_TLS_OUT		3
+
+typedef struct guest_pipe guest_pipe_t;
+
+typedef struct {
+	uint32_t bytes;
+	uint32_t writer_waits;		// writer had to sleep on a full pipe
+	uint32_t reader_waits;		// reader had to sleep on an empty pipe
+	uint32_t high_water;
+} guest_pipe_stats_t;
+
+guest_pipe_t* guest_pipe_create(size_t size);
+void guest_pipe_destroy(guest_pipe_t* pipe);
+
+// Makes `in`/`out` the calling task's pipes, either may be NULL
+void guest_pipe_bind(guest_pipe_t* in, guest_pipe_t* out);
+// Drops the calling task's ends: readers see EOF, writers a broken pipe
+void guest_pipe_unbind(void);
+void guest_pipe_close(guest_pipe_t* pipe);
+
+void guest_pipe_get_stats(guest_pipe_t* pipe, guest_pipe_stats_t* out);
+
+/*
+ * Guest side. Acquire hands out a contiguous region of the ring (never more
+ * than `want`, never past the end of the buffer) and blocks until there is
+ * at least one byte. Commit/release then publish or free part of it; a
+ * length beyond what is left of the acquired region is clamped to it.
+ * pipe_write_acquire returns NULL once the reader is gone, pipe_read_acquire
+ * returns NULL at end of stream.
+ */
+void* pipe_write_acquire(size_t want, size_t* got);
+void pipe_write_commit(size_t len);
+const void* pipe_read_acquire(size_t want, size_t* got);
+void pipe_read_release(size_t len);
+
+#endif
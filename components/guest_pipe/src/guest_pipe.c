@@ -0,0 +1,249 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "guest_pipe.h"
+
+/*
+ * Single-producer, single-consumer ring. The writer only advances `head`,
+ * the reader only advances `tail`, so neither side takes a lock on the fast
+ * path. A side that runs out of data or space spins for a while, then sets
+ * its waiting flag and sleeps on its task notification; the other side
+ * checks the flag after publishing and wakes it.
+ */
+struct guest_pipe {
+	uint8_t* buffer;
+	uint32_t mask;
+
+	atomic_uint head;
+	atomic_uint tail;
+	atomic_bool write_closed;
+	atomic_bool read_closed;
+	atomic_bool writer_waiting;
+	atomic_bool reader_waiting;
+
+	// What the last acquire handed out, each only touched by its own side
+	uint32_t write_granted;
+	uint32_t read_granted;
+
+	// Cleared under the lock before a task goes away, so it's never woken after.
+	// `wakers` counts notifications in flight outside the lock
+	portMUX_TYPE lock;
+	TaskHandle_t writer;
+	TaskHandle_t reader;
+	atomic_uint wakers;
+
+	atomic_uint writer_waits;
+	atomic_uint reader_waits;
+	atomic_uint high_water;
+};
+
+guest_pipe_t* guest_pipe_create(size_t size) {
+	if (!size) size = PIPE_BUFFER_SIZE;
+	if (size & (size - 1)) return NULL;
+
+	guest_pipe_t* pipe = calloc(1, sizeof(guest_pipe_t));
+	if (!pipe) return NULL;
+
+	pipe->buffer = malloc(size);
+	if (!pipe->buffer) {
+		free(pipe);
+		return NULL;
+	}
+	pipe->mask = size - 1;
+	portMUX_INITIALIZE(&pipe->lock);
+	return pipe;
+}
+
+void guest_pipe_destroy(guest_pipe_t* pipe) {
+	if (!pipe) return;
+	free(pipe->buffer);
+	free(pipe);
+}
+
+static void wake(guest_pipe_t* pipe, TaskHandle_t* task) {
+	taskENTER_CRITICAL(&pipe->lock);
+	TaskHandle_t target = *task;
+	if (target) atomic_fetch_add(&pipe->wakers, 1);
+	taskEXIT_CRITICAL(&pipe->lock);
+
+	// Notifying can switch to the woken task, so it's done outside the lock
+	if (target) {
+		xTaskNotifyGive(target);
+		atomic_fetch_sub(&pipe->wakers, 1);
+	}
+}
+
+// Called after clearing our handle: once no wake is in flight, nobody holds it
+static void drain_wakers(guest_pipe_t* pipe) {
+	while (atomic_load(&pipe->wakers)) {
+		vTaskDelay(1);
+	}
+}
+
+void guest_pipe_bind(guest_pipe_t* in, guest_pipe_t* out) {
+	TaskHandle_t self = xTaskGetCurrentTaskHandle();
+	if (in) {
+		taskENTER_CRITICAL(&in->lock);
+		in->reader = self;
+		taskEXIT_CRITICAL(&in->lock);
+	}
+	if (out) {
+		taskENTER_CRITICAL(&out->lock);
+		out->writer = self;
+		taskEXIT_CRITICAL(&out->lock);
+	}
+	vTaskSetThreadLocalStoragePointer(NULL, PIPE_TLS_IN, in);
+	vTaskSetThreadLocalStoragePointer(NULL, PIPE_TLS_OUT, out);
+}
+
+void guest_pipe_unbind(void) {
+	guest_pipe_t* in = pvTaskGetThreadLocalStoragePointer(NULL, PIPE_TLS_IN);
+	guest_pipe_t* out = pvTaskGetThreadLocalStoragePointer(NULL, PIPE_TLS_OUT);
+
+	if (in) {
+		taskENTER_CRITICAL(&in->lock);
+		in->reader = NULL;
+		taskEXIT_CRITICAL(&in->lock);
+		atomic_store(&in->read_closed, true);
+		wake(in, &in->writer);
+		drain_wakers(in);
+	}
+	if (out) {
+		taskENTER_CRITICAL(&out->lock);
+		out->writer = NULL;
+		taskEXIT_CRITICAL(&out->lock);
+		atomic_store(&out->write_closed, true);
+		wake(out, &out->reader);
+		drain_wakers(out);
+	}
+	vTaskSetThreadLocalStoragePointer(NULL, PIPE_TLS_IN, NULL);
+	vTaskSetThreadLocalStoragePointer(NULL, PIPE_TLS_OUT, NULL);
+}
+
+// Ends the stream from the outside, for stages that never got to run
+void guest_pipe_close(guest_pipe_t* pipe) {
+	atomic_store(&pipe->write_closed, true);
+	atomic_store(&pipe->read_closed, true);
+	wake(pipe, &pipe->reader);
+	wake(pipe, &pipe->writer);
+}
+
+void guest_pipe_get_stats(guest_pipe_t* pipe, guest_pipe_stats_t* out) {
+	out->bytes = atomic_load(&pipe->head);
+	out->writer_waits = atomic_load(&pipe->writer_waits);
+	out->reader_waits = atomic_load(&pipe->reader_waits);
+	out->high_water = atomic_load(&pipe->high_water);
+}
+
+void* pipe_write_acquire(size_t want, size_t* got) {
+	guest_pipe_t* pipe = pvTaskGetThreadLocalStoragePointer(NULL, PIPE_TLS_OUT);
+	*got = 0;
+	if (!pipe || !want) return NULL;
+
+	uint32_t size = pipe->mask + 1;
+	uint32_t head = atomic_load_explicit(&pipe->head, memory_order_relaxed);
+
+	for (int spins = 0;; spins++) {
+		if (atomic_load(&pipe->read_closed)) return NULL;
+
+		uint32_t space = size - (head - atomic_load(&pipe->tail));
+		if (space) {
+			uint32_t offset = head & pipe->mask;
+			uint32_t len = size - offset;
+			if (len > space) len = space;
+			if (len > want) len = want;
+			pipe->write_granted = len;
+			*got = len;
+			return pipe->buffer + offset;
+		}
+
+		if (spins < PIPE_SPINS) continue;
+
+		atomic_fetch_add(&pipe->writer_waits, 1);
+		atomic_store(&pipe->writer_waiting, true);
+		// Re-check, the reader may have freed space before seeing the flag
+		if (atomic_load(&pipe->tail) == head - size && !atomic_load(&pipe->read_closed)) {
+			ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(10));
+		}
+		atomic_store(&pipe->writer_waiting, false);
+		spins = 0;
+	}
+}
+
+void pipe_write_commit(size_t len) {
+	guest_pipe_t* pipe = pvTaskGetThreadLocalStoragePointer(NULL, PIPE_TLS_OUT);
+	if (!pipe) return;
+
+	// More than was acquired would publish bytes the guest never wrote, or
+	// run the head past the tail
+	if (len > pipe->write_granted) len = pipe->write_granted;
+	pipe->write_granted -= len;
+	if (!len) return;
+
+	uint32_t head = atomic_load_explicit(&pipe->head, memory_order_relaxed) + len;
+	atomic_store(&pipe->head, head);
+
+	uint32_t level = head - atomic_load(&pipe->tail);
+	if (level > atomic_load_explicit(&pipe->high_water, memory_order_relaxed)) {
+		atomic_store_explicit(&pipe->high_water, level, memory_order_relaxed);
+	}
+
+	if (atomic_load(&pipe->reader_waiting)) {
+		wake(pipe, &pipe->reader);
+	}
+}
+
+const void* pipe_read_acquire(size_t want, size_t* got) {
+	guest_pipe_t* pipe = pvTaskGetThreadLocalStoragePointer(NULL, PIPE_TLS_IN);
+	*got = 0;
+	if (!pipe || !want) return NULL;
+
+	uint32_t size = pipe->mask + 1;
+	uint32_t tail = atomic_load_explicit(&pipe->tail, memory_order_relaxed);
+
+	for (int spins = 0;; spins++) {
+		// Load the close flag first so a final commit before it isn't missed
+		bool closed = atomic_load(&pipe->write_closed);
+		uint32_t avail = atomic_load(&pipe->head) - tail;
+		if (avail) {
+			uint32_t offset = tail & pipe->mask;
+			uint32_t len = size - offset;
+			if (len > avail) len = avail;
+			if (len > want) len = want;
+			pipe->read_granted = len;
+			*got = len;
+			return pipe->buffer + offset;
+		}
+		if (closed) return NULL;
+
+		if (spins < PIPE_SPINS) continue;
+
+		atomic_fetch_add(&pipe->reader_waits, 1);
+		atomic_store(&pipe->reader_waiting, true);
+		if (atomic_load(&pipe->head) == tail && !atomic_load(&pipe->write_closed)) {
+			ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(10));
+		}
+		atomic_store(&pipe->reader_waiting, false);
+		spins = 0;
+	}
+}
+
+void pipe_read_release(size_t len) {
+	guest_pipe_t* pipe = pvTaskGetThreadLocalStoragePointer(NULL, PIPE_TLS_IN);
+	if (!pipe) return;
+
+	// Freeing more than was acquired would hand the writer unread bytes
+	if (len > pipe->read_granted) len = pipe->read_granted;
+	pipe->read_granted -= len;
+	if (!len) return;
+
+	atomic_store(&pipe->tail, atomic_load_explicit(&pipe->tail, memory_order_relaxed) + len);
+
+	if (atomic_load(&pipe->writer_waiting)) {
+		wake(pipe, &pipe->writer);
+	}
+}
@@ -0,0 +1,56 @@
+#ifndef GUEST_RUNNER_H
+#define GUEST_RUNNER_H
+
+#include <stdint.h>
+#include "elf_loader.h"
+
+#define GUEST_STACK_SIZE	8192
+#define GUEST_STACK_GUARD	256
+#define GUEST_MAX_RUNS		4
+
+typedef enum {
+	GUEST_OK = 0,
+	GUEST_ERR_FAULT = -1,
+	GUEST_ERR_NO_MEMORY = -2,
+	GUEST_ERR_NOT_LOADED = -3,
+	GUEST_ERR_CORE = -4,		// code in RTC fast memory, only core 0 can run it
+} guest_error_t;
+
+typedef struct {
+	int exit_code;
+	int64_t elapsed_us;
+
+	int faulted;
+	int stack_overflow;
+	uint32_t fault_cause;
+	uint32_t fault_pc;
+	uint32_t fault_vaddr;
+	int64_t recovery_us;	// from the fault to the guest task being gone
+	size_t stack_free;		// high water mark, bytes
+} guest_result_t;
+
+typedef struct {
+	uint32_t stack_size;
+	int core;				// -1 = no affinity; modules with RTC code get core 0
+	int priority;
+
+	void (*on_start)(void* arg);	// in the guest task, before the entry point
+	void (*on_exit)(void* arg);		// in the guest task, also after a fault
+	void* hook_arg;
+} guest_run_options_t;
+
+typedef struct guest_run guest_run_t;
+
+void guest_runner_init(void);
+
+int guest_run(elf_module_t* module, int argc, char** argv, const guest_run_options_t* opts, guest_result_t* out);
+
+// Same as guest_run(), split so several guests can run at once
+int guest_start(elf_module_t* module, int argc, char** argv, const guest_run_options_t* opts, guest_run_t** out_run);
+int guest_wait(guest_run_t* run, guest_result_t* out);
+
+const char* guest_fault_name(uint32_t cause);
+
+void guest_print_fault(const elf_module_t* module, const guest_result_t* result);
+
+#endif
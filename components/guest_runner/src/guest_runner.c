@@ -0,0 +1,296 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "xtensa_api.h"
+#include "xtensa_context.h"
+#include "xtensa/corebits.h"
+
+#include "guest_runner.h"
+#include "guest_console.h"
+#include "guest_coro.h"
+
+struct guest_run {
+	TaskHandle_t task;
+	SemaphoreHandle_t done;
+
+	elf_module_t* module;
+	int argc;
+	char** argv;
+	uint32_t stack_size;
+	uint32_t stack_bottom;
+	uint32_t stack_top;
+
+	void (*on_start)(void* arg);
+	void (*on_exit)(void* arg);
+	void* hook_arg;
+
+	int64_t start_time;
+	int64_t fault_time;
+	guest_result_t result;
+};
+
+static const int s_fault_causes[] = {
+	EXCCAUSE_ILLEGAL,
+	EXCCAUSE_INSTR_ERROR,
+	EXCCAUSE_LOAD_STORE_ERROR,
+	EXCCAUSE_DIVIDE_BY_ZERO,
+	EXCCAUSE_UNALIGNED,
+	EXCCAUSE_INSTR_PROHIBITED,
+	EXCCAUSE_LOAD_PROHIBITED,
+	EXCCAUSE_STORE_PROHIBITED,
+};
+
+#define FAULT_CAUSE_COUNT (sizeof(s_fault_causes) / sizeof(s_fault_causes[0]))
+
+static DRAM_ATTR xt_exc_handler s_prev_handlers[FAULT_CAUSE_COUNT];
+static DRAM_ATTR guest_run_t* volatile s_runs[GUEST_MAX_RUNS];
+static portMUX_TYPE s_runs_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool s_initialized = false;
+
+static void guest_fault_exit(guest_run_t* run);
+
+static IRAM_ATTR guest_run_t* find_run(TaskHandle_t task) {
+	for (int i = 0; i < GUEST_MAX_RUNS; i++) {
+		guest_run_t* run = s_runs[i];
+		if (run && run->task == task) return run;
+	}
+	return NULL;
+}
+
+static int register_run(guest_run_t* run) {
+	int slot = -1;
+	taskENTER_CRITICAL(&s_runs_lock);
+	for (int i = 0; i < GUEST_MAX_RUNS; i++) {
+		if (!s_runs[i]) {
+			s_runs[i] = run;
+			slot = i;
+			break;
+		}
+	}
+	taskEXIT_CRITICAL(&s_runs_lock);
+	return slot;
+}
+
+static void unregister_run(guest_run_t* run) {
+	taskENTER_CRITICAL(&s_runs_lock);
+	for (int i = 0; i < GUEST_MAX_RUNS; i++) {
+		if (s_runs[i] == run) s_runs[i] = NULL;
+	}
+	taskEXIT_CRITICAL(&s_runs_lock);
+}
+
+static void IRAM_ATTR chain_fault(XtExcFrame* frame) {
+	for (int i = 0; i < FAULT_CAUSE_COUNT; i++) {
+		if (s_fault_causes[i] == frame->exccause && s_prev_handlers[i]) {
+			s_prev_handlers[i](frame);
+			return;
+		}
+	}
+	// Returning would only fault again on the same instruction
+	abort();
+}
+
+/*
+ * Runs from the exception dispatcher. A fault in guest code is turned into a
+ * call to guest_fault_exit() on a fresh stack; everything else goes to the
+ * handler that was installed before us (the panic handler by default).
+ */
+static void IRAM_ATTR guest_exception_handler(XtExcFrame* frame) {
+	guest_run_t* run = find_run(xTaskGetCurrentTaskHandle());
+	if (!run || !elf_module_owns_fault(run->module, frame->pc, frame->a0)) {
+		chain_fault(frame);
+		return;
+	}
+
+	run->result.faulted = 1;
+	run->result.fault_cause = frame->exccause;
+	run->result.fault_pc = frame->pc;
+	run->result.fault_vaddr = frame->excvaddr;
+
+	if (frame->a1 < run->stack_bottom + GUEST_STACK_GUARD) {
+		run->result.stack_overflow = 1;
+	}
+
+	// Resume as if the faulting code did "call4 guest_fault_exit(run)"
+	frame->pc = (uint32_t)&guest_fault_exit;
+	frame->a1 = run->stack_top;
+	frame->a6 = (uint32_t)run;
+	frame->ps = (frame->ps & ~PS_CALLINC_MASK) | (1 << PS_CALLINC_SHIFT);
+}
+
+static void finish_run(guest_run_t* run) {
+	run->result.stack_free = uxTaskGetStackHighWaterMark(NULL) * sizeof(StackType_t);
+	if (run->result.stack_free < GUEST_STACK_GUARD) {
+		run->result.stack_overflow = 1;
+	}
+	if (run->on_exit) {
+		run->on_exit(run->hook_arg);
+	}
+	// The TCB may come back as another task of the same module
+	guest_coro_release_task(run->module);
+	xSemaphoreGive(run->done);
+	vTaskDelete(NULL);
+}
+
+static void guest_fault_exit(guest_run_t* run) {
+	run->fault_time = esp_timer_get_time();
+	// Output it reserved but never published would hold up every other writer
+	guest_console_abandon(run->task);
+	elf_module_close_files(run->module, run->task);
+	finish_run(run);
+}
+
+static void guest_task(void* arg) {
+	guest_run_t* run = (guest_run_t*)arg;
+
+	run->task = xTaskGetCurrentTaskHandle();
+	run->stack_bottom = (uint32_t)pxTaskGetStackStart(NULL);
+	run->stack_top = ((run->stack_bottom + run->stack_size) & ~15) - 64;
+	elf_module_bind(run->module);
+	if (run->on_start) {
+		run->on_start(run->hook_arg);
+	}
+
+	run->result.exit_code = run->module->entry_point(run->argc, run->argv);
+	finish_run(run);
+}
+
+void guest_runner_init(void) {
+	if (s_initialized) return;
+
+	for (int i = 0; i < FAULT_CAUSE_COUNT; i++) {
+		s_prev_handlers[i] = xt_set_exception_handler(s_fault_causes[i], guest_exception_handler);
+	}
+	s_initialized = true;
+}
+
+int guest_start(elf_module_t* module, int argc, char** argv, const guest_run_options_t* opts, guest_run_t** out_run) {
+	if (!module || !module->entry_point) {
+		return GUEST_ERR_NOT_LOADED;
+	}
+	guest_runner_init();
+
+	int core = opts ? opts->core : -1;
+	// The APP CPU can't fetch from RTC fast memory
+	if (module->rtc_mem && core > 0) {
+		printf("[guest] ERROR: Module has code in RTC fast memory, it can't run on core %d\n", core);
+		return GUEST_ERR_CORE;
+	}
+	if (module->rtc_mem) core = 0;
+
+	guest_run_t* run = calloc(1, sizeof(guest_run_t));
+	if (!run) {
+		return GUEST_ERR_NO_MEMORY;
+	}
+	run->module = module;
+	run->argc = argc;
+	run->argv = argv;
+	run->stack_size = (opts && opts->stack_size) ? opts->stack_size : GUEST_STACK_SIZE;
+	if (opts) {
+		run->on_start = opts->on_start;
+		run->on_exit = opts->on_exit;
+		run->hook_arg = opts->hook_arg;
+	}
+
+	int priority = (opts && opts->priority) ? opts->priority : uxTaskPriorityGet(NULL);
+
+	run->done = xSemaphoreCreateBinary();
+	if (!run->done) {
+		free(run);
+		return GUEST_ERR_NO_MEMORY;
+	}
+	if (register_run(run) < 0) {
+		vSemaphoreDelete(run->done);
+		free(run);
+		return GUEST_ERR_NO_MEMORY;
+	}
+
+	run->start_time = esp_timer_get_time();
+
+	BaseType_t ok = xTaskCreatePinnedToCore(guest_task, "guest", run->stack_size, run, priority,
+											NULL, core < 0 ? tskNO_AFFINITY : core);
+
+	if (ok != pdPASS) {
+		unregister_run(run);
+		vSemaphoreDelete(run->done);
+		free(run);
+		return GUEST_ERR_NO_MEMORY;
+	}
+
+	*out_run = run;
+	return GUEST_OK;
+}
+
+int guest_wait(guest_run_t* run, guest_result_t* out) {
+	xSemaphoreTake(run->done, portMAX_DELAY);
+	int64_t end = esp_timer_get_time();
+
+	unregister_run(run);
+	vSemaphoreDelete(run->done);
+
+	run->result.elapsed_us = (run->result.faulted ? run->fault_time : end) - run->start_time;
+	if (run->result.faulted) {
+		run->result.recovery_us = end - run->fault_time;
+	}
+	if (out) *out = run->result;
+
+	int err = run->result.faulted ? GUEST_ERR_FAULT : GUEST_OK;
+	free(run);
+	return err;
+}
+
+int guest_run(elf_module_t* module, int argc, char** argv, const guest_run_options_t* opts, guest_result_t* out) {
+	guest_run_t* run;
+	int err = guest_start(module, argc, argv, opts, &run);
+	if (err != GUEST_OK) {
+		return err;
+	}
+	return guest_wait(run, out);
+}
+
+const char* guest_fault_name(uint32_t cause) {
+	switch (cause) {
+		case EXCCAUSE_ILLEGAL:				return "IllegalInstruction";
+		case EXCCAUSE_INSTR_ERROR:			return "InstructionFetchError";
+		case EXCCAUSE_LOAD_STORE_ERROR:		return "LoadStoreError";
+		case EXCCAUSE_DIVIDE_BY_ZERO:		return "IntegerDivideByZero";
+		case EXCCAUSE_UNALIGNED:			return "LoadStoreAlignment";
+		case EXCCAUSE_INSTR_PROHIBITED:		return "InstrFetchProhibited";
+		case EXCCAUSE_LOAD_PROHIBITED:		return "LoadProhibited";
+		case EXCCAUSE_STORE_PROHIBITED:		return "StoreProhibited";
+		default:							return "Unknown";
+	}
+}
+
+void guest_print_fault(const elf_module_t* module, const guest_result_t* result) {
+	uint32_t pc = result->fault_pc;
+	uint32_t text = (uint32_t)module->text_mem;
+
+	printf("Guest fault: %s at 0x%08lx", guest_fault_name(result->fault_cause), pc);
+
+	uint32_t offset = 0;
+	const char* name = NULL;
+	if (elf_module_owns_pc(module, pc)) {
+		// Text, RTC fast memory or the group resident in the overlay slot
+		name = elf_symbolize(module, pc, &offset);
+		if (name) {
+			printf(" (%s+0x%lx)", name, offset);
+		} else if (pc >= text && pc < text + module->text_size) {
+			printf(" (module+0x%lx)", pc - text);
+		} else {
+			printf(" (module)");
+		}
+	} else {
+		printf(" (firmware)");
+	}
+	printf(", address 0x%08lx\n", result->fault_vaddr);
+
+	if (result->stack_overflow) {
+		printf("Guest stack overflow (%u bytes free)\n", result->stack_free);
+	}
+}
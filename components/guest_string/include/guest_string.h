@@ -0,0 +1,25 @@
+#ifndef GUEST_STRING_H
+#define GUEST_STRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * mem/str routines for guests, kept in IRAM so a guest's hot loop doesn't
+ * miss the flash cache on every call. Same contracts as the C library.
+ */
+void* guest_memcpy(void* dst, const void* src, size_t n);
+void* guest_memmove(void* dst, const void* src, size_t n);
+void* guest_memset(void* dst, int c, size_t n);
+int guest_memcmp(const void* a, const void* b, size_t n);
+size_t guest_strlen(const char* s);
+int guest_strcmp(const char* a, const char* b);
+int guest_strncmp(const char* a, const char* b, size_t n);
+char* guest_strcpy(char* dst, const char* src);
+char* guest_strchr(const char* s, int c);
+
+// They take no locks, so a guest's bad pointer faulting in one is the guest's
+bool guest_string_owns_pc(uint32_t pc);
+
+#endif
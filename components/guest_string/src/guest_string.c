@@ -0,0 +1,241 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "guest_string.h"
+
+/*
+ * Word at a time once the pointers are aligned, four words per iteration.
+ * Aligned word loads never cross into another page or MMU block, so the
+ * string routines may read up to three bytes past the terminator.
+ */
+#define ONES		0x01010101u
+#define HIGHS		0x80808080u
+#define HAS_ZERO(w)	(((w) - ONES) & ~(w) & HIGHS)
+#define MISALIGN(p)	((uintptr_t)(p) & 3)
+
+// linker.lf puts all of this file's code in IRAM, between these two
+extern const char _guest_string_start[];
+extern const char _guest_string_end[];
+
+bool guest_string_owns_pc(uint32_t pc) {
+	return pc >= (uint32_t)_guest_string_start && pc < (uint32_t)_guest_string_end;
+}
+
+void* guest_memcpy(void* dst, const void* src, size_t n) {
+	uint8_t* d = dst;
+	const uint8_t* s = src;
+
+	while (n && MISALIGN(d)) {
+		*d++ = *s++;
+		n--;
+	}
+
+	if (!MISALIGN(s)) {
+		uint32_t* dw = (uint32_t*)d;
+		const uint32_t* sw = (const uint32_t*)s;
+		for (; n >= 16; n -= 16) {
+			uint32_t a = sw[0], b = sw[1], c = sw[2], e = sw[3];
+			dw[0] = a; dw[1] = b; dw[2] = c; dw[3] = e;
+			dw += 4;
+			sw += 4;
+		}
+		for (; n >= 4; n -= 4) *dw++ = *sw++;
+		d = (uint8_t*)dw;
+		s = (const uint8_t*)sw;
+	} else if (n >= 8) {
+		// Aligned loads from the source, shifted together (SSR/SRC on Xtensa)
+		uint32_t shift = MISALIGN(s) * 8;
+		const uint32_t* sw = (const uint32_t*)(s - MISALIGN(s));
+		uint32_t* dw = (uint32_t*)d;
+		uint32_t lo = *sw++;
+		// Stop a word early so the last load stays inside the source
+		for (; n >= 8; n -= 4) {
+			uint32_t hi = *sw++;
+			*dw++ = (lo >> shift) | (hi << (32 - shift));
+			lo = hi;
+		}
+		d = (uint8_t*)dw;
+		s = (const uint8_t*)(sw - 1) + shift / 8;
+	}
+
+	while (n--) *d++ = *s++;
+	return dst;
+}
+
+void* guest_memmove(void* dst, const void* src, size_t n) {
+	uint8_t* d = dst;
+	const uint8_t* s = src;
+	if (d <= s || d >= s + n) return guest_memcpy(dst, src, n);
+
+	// Overlapping with dst above src: copy from the end
+	d += n;
+	s += n;
+	while (n && MISALIGN(d)) {
+		*--d = *--s;
+		n--;
+	}
+	if (!MISALIGN(s)) {
+		uint32_t* dw = (uint32_t*)d;
+		const uint32_t* sw = (const uint32_t*)s;
+		for (; n >= 16; n -= 16) {
+			dw -= 4;
+			sw -= 4;
+			uint32_t a = sw[0], b = sw[1], c = sw[2], e = sw[3];
+			dw[0] = a; dw[1] = b; dw[2] = c; dw[3] = e;
+		}
+		for (; n >= 4; n -= 4) *--dw = *--sw;
+		d = (uint8_t*)dw;
+		s = (const uint8_t*)sw;
+	}
+	while (n--) *--d = *--s;
+	return dst;
+}
+
+void* guest_memset(void* dst, int c, size_t n) {
+	uint8_t* d = dst;
+	uint8_t b = c;
+
+	while (n && MISALIGN(d)) {
+		*d++ = b;
+		n--;
+	}
+
+	uint32_t w = b * ONES;
+	uint32_t* dw = (uint32_t*)d;
+	for (; n >= 16; n -= 16) {
+		dw[0] = w; dw[1] = w; dw[2] = w; dw[3] = w;
+		dw += 4;
+	}
+	for (; n >= 4; n -= 4) *dw++ = w;
+
+	d = (uint8_t*)dw;
+	while (n--) *d++ = b;
+	return dst;
+}
+
+int guest_memcmp(const void* a, const void* b, size_t n) {
+	const uint8_t* pa = a;
+	const uint8_t* pb = b;
+
+	// Only worth it when both can be aligned together
+	if (MISALIGN(pa) == MISALIGN(pb)) {
+		while (n && MISALIGN(pa)) {
+			if (*pa != *pb) return *pa - *pb;
+			pa++; pb++; n--;
+		}
+		const uint32_t* wa = (const uint32_t*)pa;
+		const uint32_t* wb = (const uint32_t*)pb;
+		for (; n >= 4 && *wa == *wb; n -= 4) {
+			wa++;
+			wb++;
+		}
+		pa = (const uint8_t*)wa;
+		pb = (const uint8_t*)wb;
+	}
+
+	for (; n; n--, pa++, pb++) {
+		if (*pa != *pb) return *pa - *pb;
+	}
+	return 0;
+}
+
+size_t guest_strlen(const char* s) {
+	const char* p = s;
+	while (MISALIGN(p)) {
+		if (!*p) return p - s;
+		p++;
+	}
+
+	const uint32_t* w = (const uint32_t*)p;
+	for (;;) {
+		if (HAS_ZERO(w[0])) break;
+		if (HAS_ZERO(w[1])) { w += 1; break; }
+		if (HAS_ZERO(w[2])) { w += 2; break; }
+		if (HAS_ZERO(w[3])) { w += 3; break; }
+		w += 4;
+	}
+
+	p = (const char*)w;
+	while (*p) p++;
+	return p - s;
+}
+
+int guest_strcmp(const char* a, const char* b) {
+	if (MISALIGN(a) == MISALIGN(b)) {
+		while (MISALIGN(a)) {
+			if (*a != *b || !*a) return (uint8_t)*a - (uint8_t)*b;
+			a++; b++;
+		}
+		// Equal words without a terminator: move on
+		const uint32_t* wa = (const uint32_t*)a;
+		const uint32_t* wb = (const uint32_t*)b;
+		while (*wa == *wb && !HAS_ZERO(*wa)) {
+			wa++;
+			wb++;
+		}
+		a = (const char*)wa;
+		b = (const char*)wb;
+	}
+
+	while (*a && *a == *b) {
+		a++; b++;
+	}
+	return (uint8_t)*a - (uint8_t)*b;
+}
+
+int guest_strncmp(const char* a, const char* b, size_t n) {
+	if (MISALIGN(a) == MISALIGN(b)) {
+		while (n && MISALIGN(a)) {
+			if (*a != *b || !*a) return (uint8_t)*a - (uint8_t)*b;
+			a++; b++; n--;
+		}
+		const uint32_t* wa = (const uint32_t*)a;
+		const uint32_t* wb = (const uint32_t*)b;
+		for (; n >= 4 && *wa == *wb && !HAS_ZERO(*wa); n -= 4) {
+			wa++;
+			wb++;
+		}
+		a = (const char*)wa;
+		b = (const char*)wb;
+	}
+
+	for (; n; n--, a++, b++) {
+		if (*a != *b || !*a) return (uint8_t)*a - (uint8_t)*b;
+	}
+	return 0;
+}
+
+char* guest_strcpy(char* dst, const char* src) {
+	char* d = dst;
+	if (MISALIGN(d) == MISALIGN(src)) {
+		while (MISALIGN(src)) {
+			if (!(*d++ = *src++)) return dst;
+		}
+		uint32_t* dw = (uint32_t*)d;
+		const uint32_t* sw = (const uint32_t*)src;
+		while (!HAS_ZERO(*sw)) *dw++ = *sw++;
+		d = (char*)dw;
+		src = (const char*)sw;
+	}
+	while ((*d++ = *src++));
+	return dst;
+}
+
+char* guest_strchr(const char* s, int c) {
+	char ch = c;
+	while (MISALIGN(s)) {
+		if (*s == ch) return (char*)s;
+		if (!*s) return NULL;
+		s++;
+	}
+
+	// A byte equal to ch shows up as a zero byte after the XOR
+	uint32_t mask = (uint8_t)ch * ONES;
+	const uint32_t* w = (const uint32_t*)s;
+	while (!HAS_ZERO(*w) && !HAS_ZERO(*w ^ mask)) w++;
+
+	for (s = (const char*)w; ; s++) {
+		if (*s == ch) return (char*)s;
+		if (!*s) return NULL;
+	}
+}
@@ -0,0 +1,33 @@
+#ifndef HOSTFS_H
+#define HOSTFS_H
+
+#include "esp_err.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+#define HOSTFS_MOUNT_POINT	"/host"
+#define HOSTFS_MAX_FILES	8
+#define HOSTFS_BLOCK_SIZE	2048
+#define HOSTFS_CACHE_BLOCKS	8
+#define HOSTFS_MAX_READAHEAD 4		// blocks per request
+#define HOSTFS_TIMEOUT_MS	1000
+
+typedef struct {
+	uint32_t requests;
+	uint32_t timeouts;
+	uint32_t cache_hits;
+	uint32_t cache_misses;
+	uint32_t bytes_fetched;
+	uint32_t bytes_read;
+} hostfs_stats_t;
+
+esp_err_t hostfs_mount(void);
+void hostfs_unmount(void);
+void hostfs_get_stats(hostfs_stats_t* out);
+
+// While another task reads the console UART, hostfs frames reach the link through it
+void hostfs_link_attach(bool on);
+// True if the byte belonged to a hostfs frame and was taken
+bool hostfs_link_feed(uint8_t c);
+
+#endif
@@ -0,0 +1,464 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_vfs.h"
+#include "esp_heap_caps.h"
+
+#include "hostfs.h"
+#include "hostfs_link.h"
+
+typedef struct {
+	int used;
+	int32_t handle;
+	uint32_t size;
+	uint32_t pos;
+	uint32_t next_block;
+	int readahead;
+} hostfs_file_t;
+
+typedef struct {
+	int fd;				// -1 when free
+	uint32_t block;
+	uint32_t len;
+	uint32_t lru;
+	uint8_t* data;
+} cache_block_t;
+
+typedef struct {
+	DIR dir;
+	int32_t handle;
+	struct dirent entry;
+} hostfs_dir_t;
+
+typedef struct {
+	int32_t status;
+	uint8_t data[HOSTFS_MAX_PAYLOAD];
+} hostfs_response_t;
+
+static hostfs_file_t s_files[HOSTFS_MAX_FILES];
+static cache_block_t s_cache[HOSTFS_CACHE_BLOCKS];
+static uint32_t s_lru_clock = 0;
+static hostfs_stats_t s_stats;
+static SemaphoreHandle_t s_lock = NULL;
+static hostfs_response_t* s_resp = NULL;	// with the cache, from the first request on
+static bool s_mounted = false;
+
+static void put32(uint8_t* p, uint32_t v) {
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static uint32_t get32(const uint8_t* p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void* buffer_alloc(size_t size) {
+	return heap_caps_malloc_prefer(size, 2, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, MALLOC_CAP_8BIT);
+}
+
+// A mount costs nothing until /host is used
+static bool buffers_ready(void) {
+	if (s_resp) return true;
+	for (int i = 0; i < HOSTFS_CACHE_BLOCKS; i++) {
+		if (!s_cache[i].data && !(s_cache[i].data = buffer_alloc(HOSTFS_BLOCK_SIZE))) return false;
+	}
+	s_resp = buffer_alloc(sizeof(hostfs_response_t));
+	return s_resp != NULL;
+}
+
+static void buffers_free(void) {
+	for (int i = 0; i < HOSTFS_CACHE_BLOCKS; i++) {
+		free(s_cache[i].data);
+		s_cache[i].data = NULL;
+		s_cache[i].fd = -1;
+	}
+	free(s_resp);
+	s_resp = NULL;
+}
+
+// Returns the response status (negative errno from the host) or -EIO on link failure
+static int32_t request(uint8_t op, const void* req, size_t req_len, size_t* data_len) {
+	size_t len = 0;
+	if (!buffers_ready()) return -ENOMEM;
+	s_stats.requests++;
+	if (hostfs_request(op, req, req_len, s_resp, sizeof(*s_resp), &len) != 0 || len < 4) {
+		s_stats.timeouts++;
+		return -EIO;
+	}
+	if (data_len) *data_len = len - 4;
+	return s_resp->status;
+}
+
+static int32_t path_request(uint8_t op, const char* path, size_t* data_len) {
+	return request(op, path, strlen(path), data_len);
+}
+
+static int fail(int32_t status) {
+	errno = -status;
+	return -1;
+}
+
+static cache_block_t* cache_find(int fd, uint32_t block) {
+	for (int i = 0; i < HOSTFS_CACHE_BLOCKS; i++) {
+		if (s_cache[i].fd == fd && s_cache[i].block == block) {
+			s_cache[i].lru = ++s_lru_clock;
+			return &s_cache[i];
+		}
+	}
+	return NULL;
+}
+
+static cache_block_t* cache_victim(void) {
+	cache_block_t* victim = &s_cache[0];
+	for (int i = 0; i < HOSTFS_CACHE_BLOCKS; i++) {
+		if (s_cache[i].fd < 0) return &s_cache[i];
+		if (s_cache[i].lru < victim->lru) victim = &s_cache[i];
+	}
+	return victim;
+}
+
+static void cache_invalidate(int fd) {
+	for (int i = 0; i < HOSTFS_CACHE_BLOCKS; i++) {
+		if (s_cache[i].fd == fd) s_cache[i].fd = -1;
+	}
+}
+
+// Fetches `block` and up to readahead-1 following blocks in one request
+static cache_block_t* cache_fill(int fd, uint32_t block) {
+	hostfs_file_t* file = &s_files[fd];
+
+	if (block == file->next_block) {
+		if (file->readahead < HOSTFS_MAX_READAHEAD) file->readahead *= 2;
+	} else {
+		file->readahead = 1;
+	}
+	int count = file->readahead;
+
+	uint32_t blocks_in_file = (file->size + HOSTFS_BLOCK_SIZE - 1) / HOSTFS_BLOCK_SIZE;
+	if (block + count > blocks_in_file) count = blocks_in_file - block;
+	if (count <= 0) return NULL;
+
+	uint8_t req[12];
+	put32(req, file->handle);
+	put32(req + 4, block * HOSTFS_BLOCK_SIZE);
+	put32(req + 8, count * HOSTFS_BLOCK_SIZE);
+
+	size_t len = 0;
+	int32_t status = request(HOSTFS_OP_READ, req, sizeof(req), &len);
+	if (status < 0) {
+		errno = -status;
+		return NULL;
+	}
+	s_stats.bytes_fetched += len;
+
+	cache_block_t* first = NULL;
+	for (int i = 0; i < count && i * HOSTFS_BLOCK_SIZE < len; i++) {
+		cache_block_t* entry = cache_find(fd, block + i);
+		if (!entry) entry = cache_victim();
+
+		uint32_t chunk = len - i * HOSTFS_BLOCK_SIZE;
+		if (chunk > HOSTFS_BLOCK_SIZE) chunk = HOSTFS_BLOCK_SIZE;
+
+		memcpy(entry->data, s_resp->data + i * HOSTFS_BLOCK_SIZE, chunk);
+		entry->fd = fd;
+		entry->block = block + i;
+		entry->len = chunk;
+		entry->lru = ++s_lru_clock;
+		if (i == 0) first = entry;
+	}
+	file->next_block = block + count;
+	return first;
+}
+
+static hostfs_file_t* get_file(int fd) {
+	if (fd < 0 || fd >= HOSTFS_MAX_FILES || !s_files[fd].used) {
+		errno = EBADF;
+		return NULL;
+	}
+	return &s_files[fd];
+}
+
+static int hostfs_open(const char* path, int flags, int mode) {
+	if ((flags & O_ACCMODE) != O_RDONLY) {
+		errno = EROFS;
+		return -1;
+	}
+
+	xSemaphoreTake(s_lock, portMAX_DELAY);
+
+	int fd = -1;
+	for (int i = 0; i < HOSTFS_MAX_FILES; i++) {
+		if (!s_files[i].used) {
+			fd = i;
+			break;
+		}
+	}
+	if (fd < 0) {
+		xSemaphoreGive(s_lock);
+		errno = ENFILE;
+		return -1;
+	}
+
+	size_t len = 0;
+	int32_t status = path_request(HOSTFS_OP_OPEN, path, &len);
+	if (status < 0 || len < 4) {
+		xSemaphoreGive(s_lock);
+		return fail(status < 0 ? status : -EIO);
+	}
+
+	hostfs_file_t* file = &s_files[fd];
+	memset(file, 0, sizeof(*file));
+	file->used = 1;
+	file->handle = status;
+	file->size = get32(s_resp->data);
+	file->readahead = 1;
+	file->next_block = 0;
+	cache_invalidate(fd);
+
+	xSemaphoreGive(s_lock);
+	return fd;
+}
+
+static ssize_t hostfs_read(int fd, void* dst, size_t size) {
+	xSemaphoreTake(s_lock, portMAX_DELAY);
+
+	hostfs_file_t* file = get_file(fd);
+	if (!file) {
+		xSemaphoreGive(s_lock);
+		return -1;
+	}
+
+	size_t done = 0;
+	while (done < size && file->pos < file->size) {
+		uint32_t block = file->pos / HOSTFS_BLOCK_SIZE;
+		uint32_t offset = file->pos % HOSTFS_BLOCK_SIZE;
+
+		cache_block_t* entry = cache_find(fd, block);
+		if (entry) {
+			s_stats.cache_hits++;
+		} else {
+			s_stats.cache_misses++;
+			entry = cache_fill(fd, block);
+			if (!entry) break;
+		}
+		if (offset >= entry->len) break;
+
+		size_t chunk = entry->len - offset;
+		if (chunk > size - done) chunk = size - done;
+		memcpy((uint8_t*)dst + done, entry->data + offset, chunk);
+		done += chunk;
+		file->pos += chunk;
+	}
+	s_stats.bytes_read += done;
+
+	xSemaphoreGive(s_lock);
+	return (done || size == 0 || file->pos >= file->size) ? (ssize_t)done : -1;
+}
+
+static off_t hostfs_lseek(int fd, off_t offset, int whence) {
+	xSemaphoreTake(s_lock, portMAX_DELAY);
+
+	hostfs_file_t* file = get_file(fd);
+	if (!file) {
+		xSemaphoreGive(s_lock);
+		return -1;
+	}
+
+	off_t pos;
+	switch (whence) {
+		case SEEK_SET: pos = offset; break;
+		case SEEK_CUR: pos = file->pos + offset; break;
+		case SEEK_END: pos = file->size + offset; break;
+		default: pos = -1; break;
+	}
+	if (pos < 0) {
+		xSemaphoreGive(s_lock);
+		errno = EINVAL;
+		return -1;
+	}
+	file->pos = pos;
+
+	xSemaphoreGive(s_lock);
+	return pos;
+}
+
+static int hostfs_close(int fd) {
+	xSemaphoreTake(s_lock, portMAX_DELAY);
+
+	hostfs_file_t* file = get_file(fd);
+	if (!file) {
+		xSemaphoreGive(s_lock);
+		return -1;
+	}
+
+	uint8_t req[4];
+	put32(req, file->handle);
+	request(HOSTFS_OP_CLOSE, req, sizeof(req), NULL);
+
+	cache_invalidate(fd);
+	file->used = 0;
+
+	xSemaphoreGive(s_lock);
+	return 0;
+}
+
+static int hostfs_fstat(int fd, struct stat* st) {
+	xSemaphoreTake(s_lock, portMAX_DELAY);
+
+	hostfs_file_t* file = get_file(fd);
+	if (file) {
+		memset(st, 0, sizeof(*st));
+		st->st_mode = S_IFREG | 0444;
+		st->st_size = file->size;
+		st->st_blksize = HOSTFS_BLOCK_SIZE;
+	}
+
+	xSemaphoreGive(s_lock);
+	return file ? 0 : -1;
+}
+
+static int hostfs_stat(const char* path, struct stat* st) {
+	xSemaphoreTake(s_lock, portMAX_DELAY);
+
+	size_t len = 0;
+	int32_t status = path_request(HOSTFS_OP_STAT, path, &len);
+	if (status < 0 || len < 12) {
+		xSemaphoreGive(s_lock);
+		return fail(status < 0 ? status : -EIO);
+	}
+
+	memset(st, 0, sizeof(*st));
+	st->st_mode = get32(s_resp->data);
+	st->st_size = get32(s_resp->data + 4);
+	st->st_mtime = get32(s_resp->data + 8);
+	st->st_blksize = HOSTFS_BLOCK_SIZE;
+
+	xSemaphoreGive(s_lock);
+	return 0;
+}
+
+static DIR* hostfs_opendir(const char* path) {
+	hostfs_dir_t* dir = calloc(1, sizeof(hostfs_dir_t));
+	if (!dir) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	xSemaphoreTake(s_lock, portMAX_DELAY);
+	int32_t status = path_request(HOSTFS_OP_OPENDIR, path, NULL);
+	xSemaphoreGive(s_lock);
+
+	if (status < 0) {
+		free(dir);
+		errno = -status;
+		return NULL;
+	}
+	dir->handle = status;
+	return (DIR*)dir;
+}
+
+static struct dirent* hostfs_readdir(DIR* pdir) {
+	hostfs_dir_t* dir = (hostfs_dir_t*)pdir;
+
+	uint8_t req[4];
+	put32(req, dir->handle);
+
+	xSemaphoreTake(s_lock, portMAX_DELAY);
+	size_t len = 0;
+	int32_t status = request(HOSTFS_OP_READDIR, req, sizeof(req), &len);
+	if (status <= 0 || len < 1) {
+		xSemaphoreGive(s_lock);
+		if (status < 0) errno = -status;
+		return NULL;
+	}
+
+	size_t name_len = len - 1;
+	if (name_len > sizeof(dir->entry.d_name) - 1) {
+		name_len = sizeof(dir->entry.d_name) - 1;
+	}
+	dir->entry.d_type = s_resp->data[0];
+	memcpy(dir->entry.d_name, s_resp->data + 1, name_len);
+	dir->entry.d_name[name_len] = '\0';
+	xSemaphoreGive(s_lock);
+
+	return &dir->entry;
+}
+
+static int hostfs_closedir(DIR* pdir) {
+	hostfs_dir_t* dir = (hostfs_dir_t*)pdir;
+
+	uint8_t req[4];
+	put32(req, dir->handle);
+
+	xSemaphoreTake(s_lock, portMAX_DELAY);
+	request(HOSTFS_OP_CLOSEDIR, req, sizeof(req), NULL);
+	xSemaphoreGive(s_lock);
+
+	free(dir);
+	return 0;
+}
+
+static const esp_vfs_dir_ops_t s_dir_ops = {
+	.stat = hostfs_stat,
+	.opendir = hostfs_opendir,
+	.readdir = hostfs_readdir,
+	.closedir = hostfs_closedir,
+};
+
+static const esp_vfs_fs_ops_t s_vfs_ops = {
+	.open = hostfs_open,
+	.read = hostfs_read,
+	.lseek = hostfs_lseek,
+	.close = hostfs_close,
+	.fstat = hostfs_fstat,
+	.dir = &s_dir_ops,
+};
+
+esp_err_t hostfs_mount(void) {
+	if (s_mounted) return ESP_OK;
+
+	if (hostfs_link_init() != 0) {
+		return ESP_ERR_NO_MEM;
+	}
+	s_lock = xSemaphoreCreateMutex();
+	if (!s_lock) {
+		return ESP_ERR_NO_MEM;
+	}
+
+	for (int i = 0; i < HOSTFS_CACHE_BLOCKS; i++) {
+		s_cache[i].fd = -1;
+	}
+
+	esp_err_t err = esp_vfs_register_fs(HOSTFS_MOUNT_POINT, &s_vfs_ops,
+										ESP_VFS_FLAG_READONLY_FS | ESP_VFS_FLAG_STATIC, NULL);
+	if (err != ESP_OK) {
+		printf("[hfs] VFS register failed: %s\n", esp_err_to_name(err));
+		hostfs_unmount();
+		return err;
+	}
+
+	s_mounted = true;
+	printf("[hfs] Mounted at %s\n", HOSTFS_MOUNT_POINT);
+	return ESP_OK;
+}
+
+void hostfs_unmount(void) {
+	if (s_mounted) {
+		esp_vfs_unregister(HOSTFS_MOUNT_POINT);
+		s_mounted = false;
+	}
+	buffers_free();
+	if (s_lock) {
+		vSemaphoreDelete(s_lock);
+		s_lock = NULL;
+	}
+}
+
+void hostfs_get_stats(hostfs_stats_t* out) {
+	*out = s_stats;
+}
@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "driver/uart.h"
+
+#include "uart_receiver.h"
+#include "guest_console.h"
+#include "hostfs_link.h"
+
+static SemaphoreHandle_t s_link_lock = NULL;
+static uint8_t s_seq = 0;
+
+/*
+ * While another task reads the console UART (the rpc reader), it hands
+ * hostfs frames over byte by byte instead of both of them reading and each
+ * swallowing the other's data. The response goes straight to the waiting
+ * request's buffer.
+ */
+typedef enum { RX_IDLE, RX_SYNC, RX_HEADER, RX_BODY } rx_state_t;
+
+typedef struct {
+	bool armed;
+	uint32_t gen;				// which request the buffer belongs to
+	uint8_t op;
+	uint8_t seq;
+	uint8_t* dst;
+	size_t cap;
+	size_t len;
+} rx_wait_t;
+
+static volatile bool s_attached = false;
+static SemaphoreHandle_t s_rx_done = NULL;
+static portMUX_TYPE s_rx_lock = portMUX_INITIALIZER_UNLOCKED;
+static rx_wait_t s_wait;
+static rx_state_t s_rx_state = RX_IDLE;
+static uint8_t s_rx_header[4];
+static uint8_t s_rx_trailer[2];
+static size_t s_rx_pos;
+static size_t s_rx_len;
+static uint16_t s_rx_crc;
+static bool s_rx_keep;
+static uint32_t s_rx_gen;
+
+static uint16_t crc16(uint16_t crc, const uint8_t* data, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		crc ^= (uint16_t)data[i] << 8;
+		for (int b = 0; b < 8; b++) {
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+int hostfs_link_init(void) {
+	if (!s_link_lock) {
+		s_link_lock = xSemaphoreCreateMutex();
+	}
+	if (!s_rx_done) {
+		s_rx_done = xSemaphoreCreateBinary();
+	}
+	return s_link_lock && s_rx_done ? 0 : -1;
+}
+
+static void send_frame(uint8_t op, uint8_t seq, const void* payload, size_t len) {
+	uint8_t header[6] = { HOSTFS_SYNC0, HOSTFS_SYNC1, op, seq, len & 0xFF, len >> 8 };
+	uint16_t crc = crc16(0xFFFF, header + 2, 4);
+	crc = crc16(crc, payload, len);
+	uint8_t trailer[2] = { crc & 0xFF, crc >> 8 };
+
+	guest_console_lock();
+	uart_write_bytes(UART_NUM, header, sizeof(header));
+	if (len) uart_write_bytes(UART_NUM, payload, len);
+	uart_write_bytes(UART_NUM, trailer, sizeof(trailer));
+	guest_console_unlock();
+}
+
+static int read_exact(uint8_t* dst, size_t len, TickType_t deadline) {
+	size_t got = 0;
+	while (got < len) {
+		TickType_t now = xTaskGetTickCount();
+		if ((int32_t)(deadline - now) <= 0) return -1;
+		int n = uart_read_bytes(UART_NUM, dst + got, len - got, deadline - now);
+		if (n > 0) got += n;
+	}
+	return 0;
+}
+
+// Skips anything that isn't a well-formed response to `op`/`seq`; its payload goes straight to dst
+static int recv_frame(uint8_t op, uint8_t seq, uint8_t* dst, size_t cap, size_t* out_len, TickType_t deadline) {
+	while (1) {
+		uint8_t c;
+		if (read_exact(&c, 1, deadline) != 0) return -1;
+		if (c != HOSTFS_SYNC0) continue;
+		if (read_exact(&c, 1, deadline) != 0) return -1;
+		if (c != HOSTFS_SYNC1) continue;
+
+		uint8_t header[4];
+		if (read_exact(header, 4, deadline) != 0) return -1;
+		size_t len = header[2] | (header[3] << 8);
+		if (len > HOSTFS_MAX_PAYLOAD) continue;
+
+		// Anything that isn't ours, or doesn't fit, still has to pass through the crc
+		bool keep = header[0] == (op | 0x80) && header[1] == seq;
+		uint16_t crc = crc16(0xFFFF, header, 4);
+		for (size_t got = 0; got < len; ) {
+			uint8_t skip[32];
+			uint8_t* to = skip;
+			size_t n = len - got;
+			if (keep && got < cap) {
+				to = dst + got;
+				if (n > cap - got) n = cap - got;
+			} else if (n > sizeof(skip)) {
+				n = sizeof(skip);
+			}
+			if (read_exact(to, n, deadline) != 0) return -1;
+			crc = crc16(crc, to, n);
+			got += n;
+		}
+
+		uint8_t trailer[2];
+		if (read_exact(trailer, 2, deadline) != 0) return -1;
+		if (crc != (trailer[0] | (trailer[1] << 8))) continue;
+		if (!keep) continue;
+
+		*out_len = len < cap ? len : cap;
+		return 0;
+	}
+}
+
+void hostfs_link_attach(bool on) {
+	// Never in the middle of a request
+	if (s_link_lock) xSemaphoreTake(s_link_lock, portMAX_DELAY);
+	s_attached = on;
+	s_rx_state = RX_IDLE;
+	if (s_link_lock) xSemaphoreGive(s_link_lock);
+}
+
+bool hostfs_link_feed(uint8_t c) {
+	switch (s_rx_state) {
+		case RX_IDLE:
+			if (c != HOSTFS_SYNC0) return false;
+			s_rx_state = RX_SYNC;
+			return true;
+
+		case RX_SYNC:
+			if (c == HOSTFS_SYNC0) return true;
+			if (c != HOSTFS_SYNC1) {
+				s_rx_state = RX_IDLE;
+				return false;
+			}
+			s_rx_state = RX_HEADER;
+			s_rx_pos = 0;
+			return true;
+
+		case RX_HEADER:
+			s_rx_header[s_rx_pos++] = c;
+			if (s_rx_pos < 4) return true;
+			s_rx_len = s_rx_header[2] | (s_rx_header[3] << 8);
+			if (s_rx_len > HOSTFS_MAX_PAYLOAD) {
+				s_rx_state = RX_IDLE;
+				return true;
+			}
+			s_rx_crc = crc16(0xFFFF, s_rx_header, 4);
+			taskENTER_CRITICAL(&s_rx_lock);
+			s_rx_keep = s_wait.armed && s_rx_header[0] == (s_wait.op | 0x80) && s_rx_header[1] == s_wait.seq;
+			s_rx_gen = s_wait.gen;
+			taskEXIT_CRITICAL(&s_rx_lock);
+			s_rx_state = RX_BODY;
+			s_rx_pos = 0;
+			return true;
+
+		case RX_BODY:
+			if (s_rx_pos < s_rx_len) {
+				s_rx_crc = crc16(s_rx_crc, &c, 1);
+				if (s_rx_keep) {
+					// The request may have timed out and its buffer gone
+					taskENTER_CRITICAL(&s_rx_lock);
+					if (s_wait.armed && s_wait.gen == s_rx_gen && s_rx_pos < s_wait.cap) s_wait.dst[s_rx_pos] = c;
+					taskEXIT_CRITICAL(&s_rx_lock);
+				}
+			} else {
+				s_rx_trailer[s_rx_pos - s_rx_len] = c;
+			}
+			if (++s_rx_pos < s_rx_len + 2) return true;
+
+			s_rx_state = RX_IDLE;
+			if (!s_rx_keep || s_rx_crc != (s_rx_trailer[0] | (s_rx_trailer[1] << 8))) return true;
+			taskENTER_CRITICAL(&s_rx_lock);
+			bool done = s_wait.armed && s_wait.gen == s_rx_gen;
+			if (done) {
+				s_wait.armed = false;
+				s_wait.len = s_rx_len < s_wait.cap ? s_rx_len : s_wait.cap;
+			}
+			taskEXIT_CRITICAL(&s_rx_lock);
+			if (done) xSemaphoreGive(s_rx_done);
+			return true;
+	}
+	return false;
+}
+
+static int request_attached(uint8_t op, uint8_t seq, const void* req, size_t req_len, void* resp, size_t resp_cap, size_t* resp_len) {
+	xSemaphoreTake(s_rx_done, 0);
+	taskENTER_CRITICAL(&s_rx_lock);
+	s_wait.armed = true;
+	s_wait.gen++;
+	s_wait.op = op;
+	s_wait.seq = seq;
+	s_wait.dst = resp;
+	s_wait.cap = resp_cap;
+	taskEXIT_CRITICAL(&s_rx_lock);
+
+	send_frame(op, seq, req, req_len);
+
+	int err = xSemaphoreTake(s_rx_done, pdMS_TO_TICKS(HOSTFS_TIMEOUT_MS)) == pdTRUE ? 0 : -1;
+	taskENTER_CRITICAL(&s_rx_lock);
+	s_wait.armed = false;
+	if (err == 0 && resp_len) *resp_len = s_wait.len;
+	taskEXIT_CRITICAL(&s_rx_lock);
+	return err;
+}
+
+int hostfs_request(uint8_t op, const void* req, size_t req_len, void* resp, size_t resp_cap, size_t* resp_len) {
+	if (!s_link_lock) return -1;
+
+	xSemaphoreTake(s_link_lock, portMAX_DELAY);
+
+	uint8_t seq = ++s_seq;
+	int err;
+	if (s_attached) {
+		err = request_attached(op, seq, req, req_len, resp, resp_cap, resp_len);
+	} else {
+		send_frame(op, seq, req, req_len);
+
+		size_t len = 0;
+		TickType_t deadline = xTaskGetTickCount() + pdMS_TO_TICKS(HOSTFS_TIMEOUT_MS);
+		err = recv_frame(op, seq, resp, resp_cap, &len, deadline);
+		if (err == 0 && resp_len) *resp_len = len;
+	}
+
+	xSemaphoreGive(s_link_lock);
+	return err;
+}
@@ -0,0 +1,30 @@
+#ifndef HOSTFS_LINK_H
+#define HOSTFS_LINK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "hostfs.h"
+
+/*
+ * Frame: 0x16 'H' | op | seq | len (u16 LE) | payload | crc16 (LE)
+ * The crc is CRC-16/CCITT-FALSE over op, seq, len and payload.
+ * Responses carry the request op with the top bit set.
+ */
+#define HOSTFS_SYNC0		0x16
+#define HOSTFS_SYNC1		'H'
+#define HOSTFS_MAX_PAYLOAD	(HOSTFS_BLOCK_SIZE * HOSTFS_MAX_READAHEAD + 16)
+
+typedef enum {
+	HOSTFS_OP_OPEN = 1,
+	HOSTFS_OP_CLOSE = 2,
+	HOSTFS_OP_READ = 3,
+	HOSTFS_OP_STAT = 4,
+	HOSTFS_OP_OPENDIR = 5,
+	HOSTFS_OP_READDIR = 6,
+	HOSTFS_OP_CLOSEDIR = 7,
+} hostfs_op_t;
+
+int hostfs_link_init(void);
+int hostfs_request(uint8_t op, const void* req, size_t req_len, void* resp, size_t resp_cap, size_t* resp_len);
+
+#endif
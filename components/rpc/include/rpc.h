@@ -0,0 +1,76 @@
+#ifndef RPC_H
+#define RPC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define RPC_LINE_SIZE		4096	// longest request line
+#define RPC_QUEUE_DEPTH		16		// requests read ahead while one executes
+#define RPC_MAX_PARAMS		8
+#define RPC_MAX_ITEMS		16		// string array elements
+
+/*
+ * JSON lines over the console UART. One request per line:
+ *   {"id":7,"method":"run","params":{"name":"foo","args":["-n","3"]}}
+ * answered, in request order, by
+ *   {"id":7,"ok":true,"code":0,"us":1234}
+ * or {"id":7,"ok":false,"error":"..."}. Lines that aren't JSON objects
+ * (log output) may appear in between and are to be skipped by the client.
+ * A request whose id couldn't be read (too long, no id) is answered with
+ * "id":null, still in order.
+ *
+ * Only the subset the methods need is parsed: a flat "params" object with
+ * integer, boolean, string and string array values.
+ */
+
+typedef enum {
+	RPC_NONE = 0,
+	RPC_INT,
+	RPC_BOOL,
+	RPC_STRING,
+	RPC_ARRAY,
+} rpc_type_t;
+
+typedef struct {
+	rpc_type_t type;
+	int32_t number;				// RPC_INT, RPC_BOOL
+	char* string;				// RPC_STRING, unescaped in place
+	size_t length;
+	int count;					// RPC_ARRAY
+	char* items[RPC_MAX_ITEMS + 1];	// NULL terminated, usable as argv
+} rpc_value_t;
+
+typedef struct {
+	int32_t id;
+	bool has_id;
+	char* method;
+	int param_count;
+	char* keys[RPC_MAX_PARAMS];
+	rpc_value_t params[RPC_MAX_PARAMS];
+} rpc_request_t;
+
+// Adds fields to the reply with rpc_reply_*; returns NULL or an error message
+typedef const char* (*rpc_handler_t)(const rpc_request_t* req);
+
+typedef struct {
+	const char* name;
+	rpc_handler_t handler;
+} rpc_method_t;
+
+int rpc_parse(char* line, rpc_request_t* out);
+size_t rpc_base64_decode(const char* in, size_t len, uint8_t* out);
+
+const rpc_value_t* rpc_param(const rpc_request_t* req, const char* key, rpc_type_t type);
+const char* rpc_param_str(const rpc_request_t* req, const char* key);
+int32_t rpc_param_int(const rpc_request_t* req, const char* key, int32_t def);
+
+void rpc_reply_int(const char* key, int64_t value);
+void rpc_reply_bool(const char* key, bool value);
+void rpc_reply_str(const char* key, const char* value);
+void rpc_reply_bytes(const char* key, const char* data, size_t len);
+
+// Serves requests until the "exit" method
+void rpc_serve(const rpc_method_t* methods, int count);
+
+#endif
@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "driver/uart.h"
+
+#include "uart_receiver.h"
+#include "hostfs.h"
+#include "rpc.h"
+
+/*
+ * A reader task splits the UART stream into lines and queues them, so the
+ * client can keep sending while a request executes; the queue filling up
+ * pushes back through the UART buffer. Replies are built in memory and
+ * written as one line, so log output from a handler can't split them.
+ * hostfs frames on the same UART are picked out here and handed to the
+ * link, which would otherwise race the reader for them.
+ */
+static QueueHandle_t s_queue = NULL;
+static SemaphoreHandle_t s_reader_done = NULL;
+static volatile bool s_running = false;
+
+static char* s_reply = NULL;
+static size_t s_reply_len = 0;
+static size_t s_reply_cap = 0;
+static bool s_reply_lost;		// didn't fit in memory, reply_end() sends an error instead
+static char s_reply_id[16];
+
+static void queue_line(const char* line, size_t len) {
+	char* copy = malloc(len + 1);
+	if (!copy) return;
+	memcpy(copy, line, len);
+	copy[len] = '\0';
+	if (xQueueSend(s_queue, &copy, portMAX_DELAY) != pdTRUE) {
+		free(copy);
+	}
+}
+
+static void reader_task(void* arg) {
+	char* line = malloc(RPC_LINE_SIZE);
+	size_t pos = 0;
+	bool overflow = false;
+	uint8_t chunk[128];
+
+	while (s_running && line) {
+		size_t avail = 0;
+		uart_get_buffered_data_len(UART_NUM, &avail);
+		if (avail > sizeof(chunk)) avail = sizeof(chunk);
+		int n = uart_read_bytes(UART_NUM, chunk, avail ? avail : 1, avail ? 0 : pdMS_TO_TICKS(10));
+
+		for (int i = 0; i < n; i++) {
+			// A guest's /host access waits for its frames here
+			if (hostfs_link_feed(chunk[i])) continue;
+			char c = chunk[i];
+			if (c == '\r' || c == '\n') {
+				// An oversized line is passed on empty and fails to parse
+				if (pos || overflow) queue_line(line, overflow ? 0 : pos);
+				pos = 0;
+				overflow = false;
+			} else if (pos < RPC_LINE_SIZE - 1) {
+				line[pos++] = c;
+			} else {
+				overflow = true;
+			}
+		}
+	}
+
+	free(line);
+	xSemaphoreGive(s_reader_done);
+	vTaskDelete(NULL);
+}
+
+static void reply_append(const char* data, size_t len) {
+	if (s_reply_lost) return;
+	if (s_reply_len + len > s_reply_cap) {
+		size_t cap = s_reply_cap ? s_reply_cap : 256;
+		while (cap < s_reply_len + len) cap *= 2;
+		char* grown = realloc(s_reply, cap);
+		if (!grown) {
+			s_reply_lost = true;
+			return;
+		}
+		s_reply = grown;
+		s_reply_cap = cap;
+	}
+	memcpy(s_reply + s_reply_len, data, len);
+	s_reply_len += len;
+}
+
+static void reply_escaped(const char* data, size_t len) {
+	reply_append("\"", 1);
+	size_t run = 0;
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = data[i];
+		if (c >= 0x20 && c < 0x7F && c != '"' && c != '\\') {
+			run++;
+			continue;
+		}
+		reply_append(data + i - run, run);
+		run = 0;
+
+		char esc[8];
+		switch (c) {
+			case '"':	reply_append("\\\"", 2); break;
+			case '\\':	reply_append("\\\\", 2); break;
+			case '\n':	reply_append("\\n", 2); break;
+			case '\r':	reply_append("\\r", 2); break;
+			case '\t':	reply_append("\\t", 2); break;
+			default:
+				// Raw bytes come out as code points 0-255
+				snprintf(esc, sizeof(esc), "\\u%04x", c);
+				reply_append(esc, 6);
+				break;
+		}
+	}
+	reply_append(data + len - run, run);
+	reply_append("\"", 1);
+}
+
+static void reply_key(const char* key) {
+	reply_append(",", 1);
+	reply_escaped(key, strlen(key));
+	reply_append(":", 1);
+}
+
+void rpc_reply_int(const char* key, int64_t value) {
+	char num[24];
+	int len = snprintf(num, sizeof(num), "%lld", value);
+	reply_key(key);
+	reply_append(num, len);
+}
+
+void rpc_reply_bool(const char* key, bool value) {
+	reply_key(key);
+	reply_append(value ? "true" : "false", value ? 4 : 5);
+}
+
+void rpc_reply_str(const char* key, const char* value) {
+	reply_key(key);
+	reply_escaped(value, strlen(value));
+}
+
+void rpc_reply_bytes(const char* key, const char* data, size_t len) {
+	reply_key(key);
+	reply_escaped(data, len);
+}
+
+static void reply_begin(const rpc_request_t* req) {
+	if (req->has_id) {
+		snprintf(s_reply_id, sizeof(s_reply_id), "%ld", (long)req->id);
+	} else {
+		strcpy(s_reply_id, "null");
+	}
+	s_reply_len = 0;
+	s_reply_lost = false;
+	reply_append("{\"id\":", 6);
+	reply_append(s_reply_id, strlen(s_reply_id));
+}
+
+static void reply_end(const char* error) {
+	if (error) {
+		rpc_reply_bool("ok", false);
+		rpc_reply_str("error", error);
+	} else {
+		rpc_reply_bool("ok", true);
+	}
+	reply_append("}\n", 2);
+
+	fflush(stdout);
+	if (s_reply_lost) {
+		// A cut-off reply would look complete to the client
+		printf("{\"id\":%s,\"ok\":false,\"error\":\"out of memory for the reply\"}\n", s_reply_id);
+	} else {
+		fwrite(s_reply, 1, s_reply_len, stdout);
+	}
+	fflush(stdout);
+}
+
+static void handle(char* line, const rpc_method_t* methods, int count, bool* done) {
+	rpc_request_t req;
+	if (rpc_parse(line, &req)) {
+		reply_begin(&req);
+		reply_end("bad request");
+		return;
+	}
+
+	reply_begin(&req);
+	if (strcmp(req.method, "exit") == 0) {
+		*done = true;
+		reply_end(NULL);
+		return;
+	}
+
+	for (int i = 0; i < count; i++) {
+		if (strcmp(methods[i].name, req.method) == 0) {
+			reply_end(methods[i].handler(&req));
+			return;
+		}
+	}
+	reply_end("unknown method");
+}
+
+void rpc_serve(const rpc_method_t* methods, int count) {
+	s_queue = xQueueCreate(RPC_QUEUE_DEPTH, sizeof(char*));
+	s_reader_done = xSemaphoreCreateBinary();
+	if (!s_queue || !s_reader_done) {
+		printf("[rpc] Out of memory\n");
+		goto cleanup;
+	}
+
+	s_running = true;
+	hostfs_link_attach(true);
+	if (xTaskCreate(reader_task, "rpc_rx", 3072, NULL, tskIDLE_PRIORITY + 2, NULL) != pdPASS) {
+		printf("[rpc] Failed to start the reader\n");
+		goto cleanup;
+	}
+
+	printf("{\"ready\":true,\"version\":1}\n");
+	fflush(stdout);
+
+	bool done = false;
+	while (!done) {
+		char* line;
+		xQueueReceive(s_queue, &line, portMAX_DELAY);
+		handle(line, methods, count, &done);
+		free(line);
+	}
+
+	// The reader may be blocked on a full queue, keep draining until it's gone
+	s_running = false;
+	while (xSemaphoreTake(s_reader_done, pdMS_TO_TICKS(10)) != pdTRUE) {
+		char* line;
+		while (xQueueReceive(s_queue, &line, 0) == pdTRUE) free(line);
+	}
+	char* line;
+	while (xQueueReceive(s_queue, &line, 0) == pdTRUE) free(line);
+
+cleanup:
+	s_running = false;
+	hostfs_link_attach(false);
+	if (s_queue) vQueueDelete(s_queue);
+	if (s_reader_done) vSemaphoreDelete(s_reader_done);
+	s_queue = NULL;
+	s_reader_done = NULL;
+	free(s_reply);
+	s_reply = NULL;
+	s_reply_len = s_reply_cap = 0;
+}
@@ -0,0 +1,245 @@
+#include <string.h>
+
+#include "rpc.h"
+
+typedef struct {
+	char* p;
+} parser_t;
+
+static void skip_ws(parser_t* ps) {
+	while (*ps->p == ' ' || *ps->p == '\t' || *ps->p == '\r' || *ps->p == '\n') ps->p++;
+}
+
+static int expect(parser_t* ps, char c) {
+	skip_ws(ps);
+	if (*ps->p != c) return -1;
+	ps->p++;
+	return 0;
+}
+
+static int hex_digit(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+// Unescapes in place; the result is never longer than the source
+static int parse_string(parser_t* ps, char** out, size_t* out_len) {
+	if (expect(ps, '"')) return -1;
+
+	char* start = ps->p;
+	char* w = start;
+	while (*ps->p != '"') {
+		char c = *ps->p++;
+		if (!c) return -1;
+		if (c != '\\') {
+			*w++ = c;
+			continue;
+		}
+
+		c = *ps->p++;
+		switch (c) {
+			case '"':	*w++ = '"';	break;
+			case '\\':	*w++ = '\\'; break;
+			case '/':	*w++ = '/';	break;
+			case 'b':	*w++ = '\b'; break;
+			case 'f':	*w++ = '\f'; break;
+			case 'n':	*w++ = '\n'; break;
+			case 'r':	*w++ = '\r'; break;
+			case 't':	*w++ = '\t'; break;
+			case 'u': {
+				int code = 0;
+				for (int i = 0; i < 4; i++) {
+					int d = hex_digit(*ps->p++);
+					if (d < 0) return -1;
+					code = (code << 4) | d;
+				}
+				// Nothing here needs more than ASCII
+				*w++ = code < 0x80 ? code : '?';
+				break;
+			}
+			default:
+				return -1;
+		}
+	}
+	ps->p++;
+	*w = '\0';
+
+	*out = start;
+	if (out_len) *out_len = w - start;
+	return 0;
+}
+
+static int parse_int(parser_t* ps, int32_t* out) {
+	skip_ws(ps);
+	int negative = 0;
+	if (*ps->p == '-') {
+		negative = 1;
+		ps->p++;
+	}
+	if (*ps->p < '0' || *ps->p > '9') return -1;
+
+	int64_t value = 0;
+	while (*ps->p >= '0' && *ps->p <= '9') {
+		value = value * 10 + (*ps->p++ - '0');
+		if (value > INT32_MAX) return -1;
+	}
+	*out = negative ? -value : value;
+	return 0;
+}
+
+static int parse_value(parser_t* ps, rpc_value_t* out) {
+	memset(out, 0, sizeof(*out));
+	skip_ws(ps);
+
+	char c = *ps->p;
+	if (c == '"') {
+		out->type = RPC_STRING;
+		return parse_string(ps, &out->string, &out->length);
+	}
+	if (c == '-' || (c >= '0' && c <= '9')) {
+		out->type = RPC_INT;
+		return parse_int(ps, &out->number);
+	}
+	if (strncmp(ps->p, "true", 4) == 0 || strncmp(ps->p, "false", 5) == 0) {
+		out->type = RPC_BOOL;
+		out->number = c == 't';
+		ps->p += c == 't' ? 4 : 5;
+		return 0;
+	}
+	if (strncmp(ps->p, "null", 4) == 0) {
+		ps->p += 4;
+		return 0;
+	}
+	if (c == '[') {
+		ps->p++;
+		out->type = RPC_ARRAY;
+		skip_ws(ps);
+		if (*ps->p == ']') {
+			ps->p++;
+			return 0;
+		}
+		while (1) {
+			if (out->count == RPC_MAX_ITEMS) return -1;
+			if (parse_string(ps, &out->items[out->count++], NULL)) return -1;
+			skip_ws(ps);
+			if (*ps->p == ']') break;
+			if (*ps->p++ != ',') return -1;
+		}
+		ps->p++;
+		out->items[out->count] = NULL;
+		return 0;
+	}
+	return -1;
+}
+
+static int parse_params(parser_t* ps, rpc_request_t* out) {
+	if (expect(ps, '{')) return -1;
+	skip_ws(ps);
+	if (*ps->p == '}') {
+		ps->p++;
+		return 0;
+	}
+
+	while (1) {
+		if (out->param_count == RPC_MAX_PARAMS) return -1;
+		int i = out->param_count++;
+		if (parse_string(ps, &out->keys[i], NULL)) return -1;
+		if (expect(ps, ':')) return -1;
+		if (parse_value(ps, &out->params[i])) return -1;
+
+		skip_ws(ps);
+		if (*ps->p == '}') break;
+		if (*ps->p++ != ',') return -1;
+	}
+	ps->p++;
+	return 0;
+}
+
+int rpc_parse(char* line, rpc_request_t* out) {
+	memset(out, 0, sizeof(*out));
+
+	parser_t ps = { .p = line };
+	if (expect(&ps, '{')) return -1;
+	skip_ws(&ps);
+	if (*ps.p == '}') return -1;
+
+	while (1) {
+		char* key;
+		if (parse_string(&ps, &key, NULL)) return -1;
+		if (expect(&ps, ':')) return -1;
+
+		if (strcmp(key, "id") == 0) {
+			if (parse_int(&ps, &out->id)) return -1;
+			out->has_id = true;
+		} else if (strcmp(key, "method") == 0) {
+			if (parse_string(&ps, &out->method, NULL)) return -1;
+		} else if (strcmp(key, "params") == 0) {
+			if (parse_params(&ps, out)) return -1;
+		} else {
+			rpc_value_t ignored;
+			if (parse_value(&ps, &ignored)) return -1;
+		}
+
+		skip_ws(&ps);
+		if (*ps.p == '}') break;
+		if (*ps.p++ != ',') return -1;
+	}
+	return out->method ? 0 : -1;
+}
+
+static int base64_value(char c) {
+	if (c >= 'A' && c <= 'Z') return c - 'A';
+	if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+	if (c >= '0' && c <= '9') return c - '0' + 52;
+	if (c == '+') return 62;
+	if (c == '/') return 63;
+	return -1;
+}
+
+// `out` needs len * 3 / 4 bytes; stops at padding or the first bad character
+size_t rpc_base64_decode(const char* in, size_t len, uint8_t* out) {
+	size_t n = 0;
+	uint32_t bits = 0;
+	int count = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		int v = base64_value(in[i]);
+		if (v < 0) break;
+		bits = (bits << 6) | v;
+		if (++count == 4) {
+			out[n++] = bits >> 16;
+			out[n++] = bits >> 8;
+			out[n++] = bits;
+			bits = 0;
+			count = 0;
+		}
+	}
+	if (count == 3) {
+		out[n++] = bits >> 10;
+		out[n++] = bits >> 2;
+	} else if (count == 2) {
+		out[n++] = bits >> 4;
+	}
+	return n;
+}
+
+const rpc_value_t* rpc_param(const rpc_request_t* req, const char* key, rpc_type_t type) {
+	for (int i = 0; i < req->param_count; i++) {
+		if (strcmp(req->keys[i], key) == 0) {
+			return req->params[i].type == type ? &req->params[i] : NULL;
+		}
+	}
+	return NULL;
+}
+
+const char* rpc_param_str(const rpc_request_t* req, const char* key) {
+	const rpc_value_t* v = rpc_param(req, key, RPC_STRING);
+	return v ? v->string : NULL;
+}
+
+int32_t rpc_param_int(const rpc_request_t* req, const char* key, int32_t def) {
+	const rpc_value_t* v = rpc_param(req, key, RPC_INT);
+	return v ? v->number : def;
+}
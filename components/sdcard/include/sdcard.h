@@ -3,11 +3,17 @@
 
 #include "esp_err.h"
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
 
 esp_err_t sdcard_init(void);
+// Mounts in a background task, sdcard_ensure() waits for it
+void sdcard_start(void);
+bool sdcard_ensure(void);
 void sdcard_deinit(void);
 bool sdcard_is_mounted(void);
 const char* sdcard_get_mount_point(void);
+esp_err_t sdcard_get_fs_info(size_t* cluster_size, uint64_t* free_bytes);
 esp_err_t sdcard_read_file(const char* path, uint8_t** out_data, size_t* out_size);
 
 #endif
@@ -1,7 +1,14 @@
+#include <string.h>
 #include "driver/spi_common.h"
 #include "driver/sdspi_host.h"
 #include "esp_vfs_fat.h"
 #include "sdmmc_cmd.h"
+#include "diskio_sdmmc.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "trace.h"
 
 #define MOUNT_POINT "/sd"
 
@@ -10,10 +17,16 @@
 #define PIN_CLK		GPIO_NUM_18
 #define PIN_CS		GPIO_NUM_5
 
+// A failed lazy mount isn't retried more often than this
+#define RETRY_INTERVAL_US	(2 * 1000 * 1000)
+
 static sdmmc_card_t *card = NULL;
 static bool mounted = false;
+static bool bus_ready = false;
+static int64_t last_attempt = 0;
+static SemaphoreHandle_t mount_lock = NULL;
 
-esp_err_t sdcard_init(void) {
+static esp_err_t mount(void) {
 
 	spi_bus_config_t bus_cfg = {
 		.mosi_io_num = PIN_MOSI,
@@ -24,10 +37,14 @@ esp_err_t sdcard_init(void) {
 		.max_transfer_sz = 4000
 	};
 
-	esp_err_t err = spi_bus_initialize(SPI2_HOST, &bus_cfg, SPI_DMA_CH_AUTO);
-	if (err != ESP_OK) {
-		printf("[sdc] SPI bus init failed: %s\n", esp_err_to_name(err));
-		return err;
+	esp_err_t err;
+	if (!bus_ready) {
+		err = spi_bus_initialize(SPI2_HOST, &bus_cfg, SPI_DMA_CH_AUTO);
+		if (err != ESP_OK) {
+			printf("[sdc] SPI bus init failed: %s\n", esp_err_to_name(err));
+			return err;
+		}
+		bus_ready = true;
 	}
 
 	esp_vfs_fat_sdmmc_mount_config_t mount_cfg = {
@@ -56,6 +73,55 @@ esp_err_t sdcard_init(void) {
 	return ESP_OK;
 }
 
+static void lock_init(void) {
+	// Called from app_main before any other task can race on it
+	if (!mount_lock) {
+		mount_lock = xSemaphoreCreateMutex();
+	}
+}
+
+esp_err_t sdcard_init(void) {
+	lock_init();
+	xSemaphoreTake(mount_lock, portMAX_DELAY);
+	trace_begin("sd_mount");
+	esp_err_t err = mounted ? ESP_OK : mount();
+	trace_end("sd_mount");
+	last_attempt = esp_timer_get_time();
+	xSemaphoreGive(mount_lock);
+	return err;
+}
+
+static void mount_task(void* arg) {
+	sdcard_init();
+	vTaskDelete(NULL);
+}
+
+/*
+ * Card detection and FAT mount take a few hundred ms, most of it waiting on
+ * the card. Boot doesn't need the card, so it's mounted in the background and
+ * whoever needs it first waits in sdcard_ensure().
+ */
+void sdcard_start(void) {
+	lock_init();
+	if (xTaskCreate(mount_task, "sd_mount", 4096, NULL, tskIDLE_PRIORITY + 1, NULL) != pdPASS) {
+		sdcard_init();
+	}
+}
+
+bool sdcard_ensure(void) {
+	if (mounted) return true;
+	lock_init();
+
+	// Blocks while the background mount is still going
+	xSemaphoreTake(mount_lock, portMAX_DELAY);
+	if (!mounted && esp_timer_get_time() - last_attempt >= RETRY_INTERVAL_US) {
+		mount();
+		last_attempt = esp_timer_get_time();
+	}
+	xSemaphoreGive(mount_lock);
+	return mounted;
+}
+
 void sdcard_deinit(void) {
 	if (!mounted) {
 		return;
@@ -63,6 +129,7 @@ void sdcard_deinit(void) {
 
 	esp_vfs_fat_sdcard_unmount(MOUNT_POINT, card);
 	spi_bus_free(SPI2_HOST);
+	bus_ready = false;
 	card = NULL;
 	mounted = false;
 	printf("[sdc] Unmounted\n");
@@ -76,8 +143,27 @@ const char* sdcard_get_mount_point(void) {
 	return MOUNT_POINT;
 }
 
+esp_err_t sdcard_get_fs_info(size_t* cluster_size, uint64_t* free_bytes) {
+	if (!sdcard_ensure()) return ESP_ERR_INVALID_STATE;
+
+	char drive[3] = { '0' + ff_diskio_get_pdrv_card(card), ':', 0 };
+	FATFS* fs;
+	DWORD free_clusters;
+	if (f_getfree(drive, &free_clusters, &fs) != FR_OK) return ESP_FAIL;
+
+#if FF_MAX_SS != FF_MIN_SS
+	size_t sector = fs->ssize;
+#else
+	size_t sector = FF_MAX_SS;
+#endif
+	*cluster_size = fs->csize * sector;
+	*free_bytes = (uint64_t)free_clusters * *cluster_size;
+	return ESP_OK;
+}
+
 esp_err_t sdcard_read_file(const char* path, uint8_t** out_data, size_t* out_size) {
-	if (!mounted) {
+	// Other mounts (e.g. /host) go through the same VFS path
+	if (strncmp(path, MOUNT_POINT, strlen(MOUNT_POINT)) == 0 && !sdcard_ensure()) {
 		printf("[sdc] Not mounted\n");
 		return ESP_ERR_INVALID_STATE;
 	}
@@ -99,8 +185,11 @@ esp_err_t sdcard_read_file(const char* path, uint8_t** out_data, size_t* out_siz
 		return ESP_ERR_NO_MEM;
 	}
 
+	trace_begin("sd_read");
 	size_t read = fread(data, 1, size, f);
 	fclose(f);
+	trace_end("sd_read");
+	trace_counter("sd_bytes", read);
 
 	if (read != size) {
 		printf("[sdc] Read error: Invalid size: %u/%u bytes\n", read, size);
@@ -3,6 +3,8 @@
 
 #include <stddef.h>
 
+#define SHELL_MAX_ARGS	16
+
 int shell_read_line(char* buffer, size_t size);
 int shell_parse_args(char* line, char** argv);
 
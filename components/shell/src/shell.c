@@ -41,10 +41,12 @@ int shell_parse_args(char* line, char** argv) {
 	int argc = 0;
 	char* token = strtok(line, " \t");
 
-	while (token) {
+	// One slot stays free for the terminating NULL
+	while (token && argc < SHELL_MAX_ARGS - 1) {
 		argv[argc++] = token;
 		token = strtok(NULL, " \t");
 	}
+	argv[argc] = NULL;
 	return argc;
 }
 
@@ -0,0 +1,67 @@
+#ifndef TASK_POOL_H
+#define TASK_POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+
+#define TASK_POOL_STACK_SIZE	8192		// guest code runs on the workers
+#define TASK_POOL_DEQUE_SIZE	256			// power of two
+#define TASK_POOL_INJECT_SIZE	32			// work from outside the pool
+#define TASK_POOL_SPINS			500			// before an idle worker sleeps
+#define TASK_POOL_MAX_OWNERS	8
+#define TASK_POOL_TLS_OWNER		1			// same slot as ELF_TLS_INDEX
+
+typedef struct task_group task_group_t;
+
+typedef void (*task_fn_t)(void* ctx);
+typedef void (*task_range_fn_t)(int begin, int end, void* ctx);
+// Called from the exception handler, so it has to be in IRAM
+typedef bool (*task_pool_owns_fn_t)(void* owner, uint32_t pc, uint32_t a0);
+typedef void (*task_pool_cleanup_fn_t)(void* owner);
+
+typedef struct {
+	uint32_t executed;		// items run
+	uint32_t stolen;		// of those, taken from another worker
+	uint32_t sleeps;
+	uint32_t faults;
+	uint32_t fault_cause;	// of the last fault
+	uint32_t fault_pc;
+} task_worker_stats_t;
+
+typedef struct {
+	int workers;
+	task_worker_stats_t worker[portNUM_PROCESSORS];
+	uint32_t injected;		// submitted by tasks outside the pool
+	uint32_t inline_runs;	// no room in the pool, ran on the caller
+} task_pool_stats_t;
+
+// One worker per core. Called lazily by the first submission as well
+int task_pool_init(void);
+
+/*
+ * Decides whether a fault on a worker is in the owner's code and may be
+ * recovered. Without it every fault goes to the previous handler.
+ */
+void task_pool_set_fault_filter(task_pool_owns_fn_t fn);
+// Runs on the worker after a recovered fault, once per item it abandons
+void task_pool_set_fault_cleanup(task_pool_cleanup_fn_t fn);
+
+/*
+ * `owner` is what the workers put into TASK_POOL_TLS_OWNER while they run
+ * the work, so guest exports see the module that submitted it. The wait
+ * functions return -1 if any part of the work faulted or was cancelled.
+ */
+int task_pool_for(void* owner, int begin, int end, int grain, task_range_fn_t fn, void* ctx);
+// NULL means the task already ran on the caller, task_pool_wait accepts it
+task_group_t* task_pool_spawn(void* owner, task_fn_t fn, void* ctx);
+// Once per group; a group already waited for (or cancelled) is rejected with -1
+int task_pool_wait(task_group_t* group);
+
+// Drops the owner's queued work and waits for the running part to finish
+void task_pool_cancel(void* owner);
+
+void task_pool_get_stats(task_pool_stats_t* out);
+
+#endif
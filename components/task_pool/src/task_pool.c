@@ -0,0 +1,659 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_attr.h"
+#include "xtensa_api.h"
+#include "xtensa_context.h"
+#include "xtensa/corebits.h"
+
+#include "task_pool.h"
+#include "guest_console.h"
+#include "guest_coro.h"
+
+#define TASK_POOL_PRIORITY		(tskIDLE_PRIORITY + 1)
+#define TASK_POOL_MAX_DEPTH		8		// nested waits a worker helps with
+#define DEQUE_MASK				(TASK_POOL_DEQUE_SIZE - 1)
+
+typedef struct {
+	void* owner;
+	bool used;
+	int starting;				// start_group() calls holding the slot, under s_lock
+	task_group_t* groups;		// not waited for yet, under s_lock
+	atomic_int outstanding;		// items queued or running
+	atomic_bool cancelled;
+} owner_slot_t;
+
+struct task_group {
+	task_range_fn_t range;		// parallel_for
+	task_fn_t fn;				// task_spawn
+	void* ctx;
+	int grain;
+	owner_slot_t* slot;
+
+	atomic_int pending;			// iterations not finished yet
+	atomic_int refs;			// one for the waiter, one for the work
+	atomic_bool faulted;
+	TaskHandle_t waiter;		// under s_lock
+	atomic_bool notifying;		// waiter is being notified outside the lock
+	task_group_t* next;			// in slot->groups
+};
+
+typedef struct {
+	task_group_t* group;
+	int begin;
+	int end;					// shrinks as the worker splits off right halves
+} task_item_t;
+
+/*
+ * Chase-Lev deque. The owning worker pushes and pops at the bottom without
+ * atomics read-modify-write, thieves take the oldest (largest) items from
+ * the top with a CAS. Fixed size; a full deque just stops splitting.
+ */
+typedef struct {
+	atomic_int top;
+	atomic_int bottom;
+	task_item_t* _Atomic items[TASK_POOL_DEQUE_SIZE];
+} task_deque_t;
+
+typedef struct {
+	TaskHandle_t task;
+	int index;
+	uint32_t stack_top;
+	atomic_bool sleeping;
+	task_deque_t deque;
+
+	// What the worker is in the middle of, innermost last; a fault fails all of it
+	task_item_t* active[TASK_POOL_MAX_DEPTH];
+	int depth;
+	// Groups it's waiting for while helping, abandoned along with the items
+	task_group_t* waits[TASK_POOL_MAX_DEPTH];
+	int wait_depth;
+
+	task_worker_stats_t stats;
+} task_worker_t;
+
+static const int s_fault_causes[] = {
+	EXCCAUSE_ILLEGAL,
+	EXCCAUSE_INSTR_ERROR,
+	EXCCAUSE_LOAD_STORE_ERROR,
+	EXCCAUSE_DIVIDE_BY_ZERO,
+	EXCCAUSE_UNALIGNED,
+	EXCCAUSE_INSTR_PROHIBITED,
+	EXCCAUSE_LOAD_PROHIBITED,
+	EXCCAUSE_STORE_PROHIBITED,
+};
+
+#define FAULT_CAUSE_COUNT (sizeof(s_fault_causes) / sizeof(s_fault_causes[0]))
+
+static DRAM_ATTR xt_exc_handler s_prev_handlers[FAULT_CAUSE_COUNT];
+static DRAM_ATTR task_worker_t s_workers[portNUM_PROCESSORS];
+static int s_worker_count;
+static task_pool_owns_fn_t s_owns_fault;
+static task_pool_cleanup_fn_t s_fault_cleanup;
+static atomic_int s_state;		// 0 not started, 1 starting, 2 running, -1 failed
+
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static owner_slot_t s_owners[TASK_POOL_MAX_OWNERS];
+static task_item_t* s_inject[TASK_POOL_INJECT_SIZE];
+static uint32_t s_inject_head;
+static uint32_t s_inject_tail;
+static uint32_t s_injected;
+static uint32_t s_inline_runs;
+
+static void worker_loop(task_worker_t* w) __attribute__((noreturn));
+
+static bool deque_push(task_deque_t* q, task_item_t* item) {
+	int b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+	int t = atomic_load_explicit(&q->top, memory_order_acquire);
+	if (b - t >= TASK_POOL_DEQUE_SIZE) return false;
+
+	atomic_store_explicit(&q->items[b & DEQUE_MASK], item, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+	return true;
+}
+
+static task_item_t* deque_pop(task_deque_t* q) {
+	int b = atomic_load_explicit(&q->bottom, memory_order_relaxed) - 1;
+	atomic_store_explicit(&q->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	int t = atomic_load_explicit(&q->top, memory_order_relaxed);
+
+	if (t > b) {
+		atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+		return NULL;
+	}
+	task_item_t* item = atomic_load_explicit(&q->items[b & DEQUE_MASK], memory_order_relaxed);
+	if (t == b) {
+		// Last item, race the thieves for it
+		if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+				memory_order_seq_cst, memory_order_relaxed)) {
+			item = NULL;
+		}
+		atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+	}
+	return item;
+}
+
+static task_item_t* deque_steal(task_deque_t* q) {
+	int t = atomic_load_explicit(&q->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	int b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+	if (t >= b) return NULL;
+
+	task_item_t* item = atomic_load_explicit(&q->items[t & DEQUE_MASK], memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+			memory_order_seq_cst, memory_order_relaxed)) {
+		return NULL;
+	}
+	return item;
+}
+
+static bool inject_push(task_item_t* item) {
+	bool ok = false;
+	taskENTER_CRITICAL(&s_lock);
+	if (s_inject_head - s_inject_tail < TASK_POOL_INJECT_SIZE) {
+		s_inject[s_inject_head++ % TASK_POOL_INJECT_SIZE] = item;
+		s_injected++;
+		ok = true;
+	}
+	taskEXIT_CRITICAL(&s_lock);
+	return ok;
+}
+
+static task_item_t* inject_pop(void) {
+	task_item_t* item = NULL;
+	taskENTER_CRITICAL(&s_lock);
+	if (s_inject_head != s_inject_tail) {
+		item = s_inject[s_inject_tail++ % TASK_POOL_INJECT_SIZE];
+	}
+	taskEXIT_CRITICAL(&s_lock);
+	return item;
+}
+
+static IRAM_ATTR task_worker_t* find_worker(TaskHandle_t task) {
+	for (int i = 0; i < s_worker_count; i++) {
+		if (s_workers[i].task == task) return &s_workers[i];
+	}
+	return NULL;
+}
+
+static void wake_idle(task_worker_t* self) {
+	for (int i = 0; i < s_worker_count; i++) {
+		task_worker_t* w = &s_workers[i];
+		if (w != self && w->task && atomic_load(&w->sleeping)) {
+			xTaskNotifyGive(w->task);
+		}
+	}
+}
+
+static owner_slot_t* acquire_slot(void* owner) {
+	owner_slot_t* found = NULL;
+	taskENTER_CRITICAL(&s_lock);
+	for (int i = 0; i < TASK_POOL_MAX_OWNERS && !found; i++) {
+		owner_slot_t* slot = &s_owners[i];
+		if (slot->used && slot->owner == owner && !atomic_load(&slot->cancelled)) found = slot;
+	}
+	for (int i = 0; i < TASK_POOL_MAX_OWNERS && !found; i++) {
+		owner_slot_t* slot = &s_owners[i];
+		if (!slot->used) {
+			slot->used = true;
+			slot->owner = owner;
+			found = slot;
+		}
+	}
+	if (found) found->starting++;
+	taskEXIT_CRITICAL(&s_lock);
+	return found;
+}
+
+// Publishes the new group to the owner, or gives back a slot left with nothing in it
+static void end_start(owner_slot_t* slot, task_group_t* group) {
+	taskENTER_CRITICAL(&s_lock);
+	slot->starting--;
+	if (group) {
+		group->next = slot->groups;
+		slot->groups = group;
+	} else if (!slot->starting && !slot->groups && !atomic_load(&slot->outstanding) &&
+			   !atomic_load(&slot->cancelled)) {
+		slot->owner = NULL;
+		slot->used = false;
+	}
+	taskEXIT_CRITICAL(&s_lock);
+}
+
+// Unlinks a group the caller may wait for; anything else is stale or foreign
+static bool take_group(task_group_t* group) {
+	bool found = false;
+	taskENTER_CRITICAL(&s_lock);
+	for (int i = 0; i < TASK_POOL_MAX_OWNERS && !found; i++) {
+		if (!s_owners[i].used) continue;
+		for (task_group_t** link = &s_owners[i].groups; *link; link = &(*link)->next) {
+			if (*link == group) {
+				*link = group->next;
+				found = true;
+				break;
+			}
+		}
+	}
+	taskEXIT_CRITICAL(&s_lock);
+	return found;
+}
+
+static task_item_t* new_item(task_group_t* group, int begin, int end) {
+	task_item_t* item = malloc(sizeof(task_item_t));
+	if (!item) return NULL;
+	item->group = group;
+	item->begin = begin;
+	item->end = end;
+	atomic_fetch_add(&group->slot->outstanding, 1);
+	return item;
+}
+
+static void drop_item(task_item_t* item) {
+	atomic_fetch_sub(&item->group->slot->outstanding, 1);
+	free(item);
+}
+
+static void release_group(task_group_t* group) {
+	if (atomic_fetch_sub(&group->refs, 1) == 1) {
+		free(group);
+	}
+}
+
+static void set_waiter(task_group_t* group, TaskHandle_t task) {
+	taskENTER_CRITICAL(&s_lock);
+	group->waiter = task;
+	taskEXIT_CRITICAL(&s_lock);
+}
+
+// Drops the waiter's reference, once no notify to it is still in flight
+static int end_wait(task_group_t* group) {
+	set_waiter(group, NULL);
+	while (atomic_load(&group->notifying)) {
+	}
+	int err = atomic_load(&group->faulted) ? -1 : 0;
+	release_group(group);
+	return err;
+}
+
+static void finish_item(task_item_t* item, bool faulted) {
+	task_group_t* group = item->group;
+	owner_slot_t* slot = group->slot;
+	int count = item->end - item->begin;
+	free(item);
+
+	if (faulted) {
+		atomic_store(&group->faulted, true);
+	}
+	if (atomic_fetch_sub(&group->pending, count) == count) {
+		// Not preempted while the flag is up, so end_wait() only spins briefly
+		vTaskSuspendAll();
+		taskENTER_CRITICAL(&s_lock);
+		TaskHandle_t waiter = group->waiter;
+		if (waiter) atomic_store(&group->notifying, true);
+		taskEXIT_CRITICAL(&s_lock);
+
+		// Outside the lock, the notify may switch to the waiter
+		if (waiter) {
+			xTaskNotifyGive(waiter);
+			atomic_store(&group->notifying, false);
+		}
+		xTaskResumeAll();
+		release_group(group);
+	}
+	// Last, so task_pool_cancel() returns only once the groups are settled
+	atomic_fetch_sub(&slot->outstanding, 1);
+}
+
+static bool owner_active(task_worker_t* w, const void* owner) {
+	for (int i = 0; i < w->depth; i++) {
+		if (w->active[i]->group->slot->owner == owner) return true;
+	}
+	return false;
+}
+
+static void run_item(task_worker_t* w, task_item_t* item) {
+	task_group_t* group = item->group;
+	if (atomic_load(&group->slot->cancelled)) {
+		finish_item(item, true);
+		return;
+	}
+
+	void* prev = pvTaskGetThreadLocalStoragePointer(NULL, TASK_POOL_TLS_OWNER);
+	vTaskSetThreadLocalStoragePointer(NULL, TASK_POOL_TLS_OWNER, group->slot->owner);
+	w->active[w->depth++] = item;
+
+	if (group->range) {
+		// Keep the left half, leave the right half for the other workers
+		while (item->end - item->begin > group->grain) {
+			int mid = item->begin + (item->end - item->begin) / 2;
+			task_item_t* right = new_item(group, mid, item->end);
+			if (!right) break;
+
+			int end = item->end;
+			item->end = mid;
+			if (!deque_push(&w->deque, right)) {
+				item->end = end;
+				drop_item(right);
+				break;
+			}
+			wake_idle(w);
+		}
+		group->range(item->begin, item->end, group->ctx);
+	} else {
+		group->fn(group->ctx);
+	}
+
+	w->depth--;
+	w->stats.executed++;
+	// Workers outlive modules; keep the scheduler only while an outer item of the owner runs
+	if (!owner_active(w, group->slot->owner)) {
+		guest_coro_release_task(group->slot->owner);
+	}
+	vTaskSetThreadLocalStoragePointer(NULL, TASK_POOL_TLS_OWNER, prev);
+	finish_item(item, false);
+}
+
+static task_item_t* find_work(task_worker_t* w) {
+	task_item_t* item = deque_pop(&w->deque);
+	if (item) return item;
+
+	item = inject_pop();
+	if (item) return item;
+
+	for (int i = 1; i < s_worker_count; i++) {
+		task_worker_t* victim = &s_workers[(w->index + i) % s_worker_count];
+		item = deque_steal(&victim->deque);
+		if (item) {
+			w->stats.stolen++;
+			return item;
+		}
+	}
+	return NULL;
+}
+
+static void worker_loop(task_worker_t* w) {
+	int idle = 0;
+	for (;;) {
+		task_item_t* item = find_work(w);
+		if (item) {
+			run_item(w, item);
+			idle = 0;
+			continue;
+		}
+		if (++idle < TASK_POOL_SPINS) continue;
+		idle = 0;
+
+		// Publish the flag before the last look, so a push either sees it or is seen
+		atomic_store(&w->sleeping, true);
+		item = find_work(w);
+		if (item) {
+			atomic_store(&w->sleeping, false);
+			run_item(w, item);
+			continue;
+		}
+		w->stats.sleeps++;
+		ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+		atomic_store(&w->sleeping, false);
+	}
+}
+
+/*
+ * Entered on a fresh stack instead of the faulting guest code. Everything
+ * the worker was running is failed, so its waiters wake up with an error,
+ * and the worker goes back to looking for work.
+ */
+static void worker_fault_exit(task_worker_t* w) {
+	guest_console_abandon(w->task);
+	while (w->depth) {
+		task_item_t* item = w->active[--w->depth];
+		if (s_fault_cleanup) s_fault_cleanup(item->group->slot->owner);
+		finish_item(item, true);
+	}
+	while (w->wait_depth) {
+		end_wait(w->waits[--w->wait_depth]);
+	}
+	guest_coro_release_task(NULL);
+	vTaskSetThreadLocalStoragePointer(NULL, TASK_POOL_TLS_OWNER, NULL);
+	worker_loop(w);
+}
+
+static void IRAM_ATTR chain_fault(XtExcFrame* frame) {
+	for (int i = 0; i < FAULT_CAUSE_COUNT; i++) {
+		if (s_fault_causes[i] == frame->exccause && s_prev_handlers[i]) {
+			s_prev_handlers[i](frame);
+			return;
+		}
+	}
+	// Returning would only fault again on the same instruction
+	abort();
+}
+
+// The innermost item's owner decides, it's the code that was running
+static bool IRAM_ATTR worker_owns_fault(task_worker_t* w, const XtExcFrame* frame) {
+	if (!w || !w->depth || !s_owns_fault) return false;
+	void* owner = w->active[w->depth - 1]->group->slot->owner;
+	return s_owns_fault(owner, frame->pc, frame->a0);
+}
+
+static void IRAM_ATTR pool_exception_handler(XtExcFrame* frame) {
+	task_worker_t* w = find_worker(xTaskGetCurrentTaskHandle());
+	if (!worker_owns_fault(w, frame)) {
+		chain_fault(frame);
+		return;
+	}
+
+	w->stats.faults++;
+	w->stats.fault_cause = frame->exccause;
+	w->stats.fault_pc = frame->pc;
+
+	// Resume as if the faulting code did "call4 worker_fault_exit(w)"
+	frame->pc = (uint32_t)&worker_fault_exit;
+	frame->a1 = w->stack_top;
+	frame->a6 = (uint32_t)w;
+	frame->ps = (frame->ps & ~PS_CALLINC_MASK) | (1 << PS_CALLINC_SHIFT);
+}
+
+static void worker_task(void* arg) {
+	task_worker_t* w = (task_worker_t*)arg;
+	uint32_t stack_bottom = (uint32_t)pxTaskGetStackStart(NULL);
+	w->stack_top = ((stack_bottom + TASK_POOL_STACK_SIZE) & ~15) - 64;
+	w->task = xTaskGetCurrentTaskHandle();
+	worker_loop(w);
+}
+
+void task_pool_set_fault_filter(task_pool_owns_fn_t fn) {
+	s_owns_fault = fn;
+}
+
+void task_pool_set_fault_cleanup(task_pool_cleanup_fn_t fn) {
+	s_fault_cleanup = fn;
+}
+
+int task_pool_init(void) {
+	int expected = 0;
+	if (!atomic_compare_exchange_strong(&s_state, &expected, 1)) {
+		while (atomic_load(&s_state) == 1) {
+			vTaskDelay(1);
+		}
+		return atomic_load(&s_state) == 2 ? 0 : -1;
+	}
+
+	for (int i = 0; i < FAULT_CAUSE_COUNT; i++) {
+		s_prev_handlers[i] = xt_set_exception_handler(s_fault_causes[i], pool_exception_handler);
+	}
+
+	s_worker_count = portNUM_PROCESSORS;
+	for (int i = 0; i < portNUM_PROCESSORS; i++) {
+		s_workers[i].index = i;
+		BaseType_t ok = xTaskCreatePinnedToCore(worker_task, "pool", TASK_POOL_STACK_SIZE, &s_workers[i],
+												TASK_POOL_PRIORITY, NULL, i);
+		if (ok != pdPASS) {
+			// Workers can't be stopped once running; keep the ones that started
+			s_worker_count = i;
+			break;
+		}
+	}
+	for (int i = 0; i < s_worker_count; i++) {
+		while (!s_workers[i].task) {
+			vTaskDelay(1);
+		}
+	}
+
+	atomic_store(&s_state, s_worker_count ? 2 : -1);
+	return s_worker_count ? 0 : -1;
+}
+
+static task_group_t* start_group(void* owner, task_range_fn_t range, task_fn_t fn, void* ctx,
+								 int begin, int end, int grain) {
+	if (task_pool_init() != 0) return NULL;
+
+	owner_slot_t* slot = acquire_slot(owner);
+	if (!slot) return NULL;
+
+	task_group_t* group = calloc(1, sizeof(task_group_t));
+	if (!group) {
+		end_start(slot, NULL);
+		return NULL;
+	}
+	group->range = range;
+	group->fn = fn;
+	group->ctx = ctx;
+	group->grain = grain;
+	group->slot = slot;
+	atomic_store(&group->pending, end - begin);
+	atomic_store(&group->refs, 2);
+
+	task_item_t* item = new_item(group, begin, end);
+	if (!item) {
+		free(group);
+		end_start(slot, NULL);
+		return NULL;
+	}
+
+	task_worker_t* w = find_worker(xTaskGetCurrentTaskHandle());
+	bool queued = w ? deque_push(&w->deque, item) : inject_push(item);
+	if (!queued) {
+		drop_item(item);
+		free(group);
+		end_start(slot, NULL);
+		return NULL;
+	}
+	// The work may be done already, the waiter's reference keeps the group
+	end_start(slot, group);
+	wake_idle(w);
+	return group;
+}
+
+int task_pool_for(void* owner, int begin, int end, int grain, task_range_fn_t fn, void* ctx) {
+	if (end <= begin) return 0;
+
+	if (grain <= 0) {
+		// A few chunks per worker, enough to even out uneven iterations
+		int chunks = 8 * portNUM_PROCESSORS;
+		grain = (end - begin + chunks - 1) / chunks;
+	}
+
+	task_group_t* group = start_group(owner, fn, NULL, ctx, begin, end, grain);
+	if (!group) {
+		s_inline_runs++;
+		fn(begin, end, ctx);
+		return 0;
+	}
+	return task_pool_wait(group);
+}
+
+task_group_t* task_pool_spawn(void* owner, task_fn_t fn, void* ctx) {
+	task_group_t* group = start_group(owner, NULL, fn, ctx, 0, 1, 1);
+	if (!group) {
+		s_inline_runs++;
+		fn(ctx);
+	}
+	return group;
+}
+
+int task_pool_wait(task_group_t* group) {
+	if (!group) return 0;
+
+	// A group is waited for once; after that the pointer may already be freed
+	if (!take_group(group)) {
+		printf("[pool] ERROR: Wait on a group that isn't pending (%p)\n", group);
+		return -1;
+	}
+	set_waiter(group, xTaskGetCurrentTaskHandle());
+
+	task_worker_t* w = find_worker(xTaskGetCurrentTaskHandle());
+	if (w && w->depth < TASK_POOL_MAX_DEPTH) {
+		// A worker doesn't block on its own queue, it runs items until the group is done
+		w->waits[w->wait_depth++] = group;
+		int spins = 0;
+		while (atomic_load(&group->pending) > 0) {
+			task_item_t* item = find_work(w);
+			if (item) {
+				run_item(w, item);
+				spins = 0;
+			} else if (++spins >= TASK_POOL_SPINS) {
+				ulTaskNotifyTake(pdTRUE, 1);
+				spins = 0;
+			}
+		}
+		w->wait_depth--;
+	} else {
+		while (atomic_load(&group->pending) > 0) {
+			ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(10));
+		}
+	}
+
+	return end_wait(group);
+}
+
+void task_pool_cancel(void* owner) {
+	if (atomic_load(&s_state) != 2) return;
+
+	owner_slot_t* slot = NULL;
+	taskENTER_CRITICAL(&s_lock);
+	for (int i = 0; i < TASK_POOL_MAX_OWNERS; i++) {
+		if (s_owners[i].used && s_owners[i].owner == owner) {
+			slot = &s_owners[i];
+			atomic_store(&slot->cancelled, true);
+			break;
+		}
+	}
+	taskEXIT_CRITICAL(&s_lock);
+	if (!slot) return;
+
+	// Queued items are skipped as they come up; running ones can't be stopped
+	while (atomic_load(&slot->outstanding) > 0 || slot->starting) {
+		vTaskDelay(1);
+	}
+
+	taskENTER_CRITICAL(&s_lock);
+	task_group_t* unwaited = slot->groups;
+	slot->groups = NULL;
+	slot->owner = NULL;
+	slot->used = false;
+	atomic_store(&slot->cancelled, false);
+	taskEXIT_CRITICAL(&s_lock);
+
+	// Spawned but never waited for; their work is done, so this frees them
+	while (unwaited) {
+		task_group_t* next = unwaited->next;
+		release_group(unwaited);
+		unwaited = next;
+	}
+}
+
+void task_pool_get_stats(task_pool_stats_t* out) {
+	memset(out, 0, sizeof(*out));
+	out->workers = s_worker_count;
+	for (int i = 0; i < s_worker_count; i++) {
+		out->worker[i] = s_workers[i].stats;
+	}
+	out->injected = s_injected;
+	out->inline_runs = s_inline_runs;
+}
@@ -0,0 +1,63 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define TRACE_EVENTS		512		// per core, power of two
+#define TRACE_VALUE_MAX		((1 << 23) - 1)
+
+typedef enum {
+	TRACE_BEGIN,
+	TRACE_END,
+	TRACE_COUNTER,
+	TRACE_INSTANT,
+} trace_type_t;
+
+typedef struct {
+	uint32_t ccount;
+	const char* name;			// must outlive the trace, normally a literal
+	uint32_t type : 8;
+	int32_t value : 24;			// counters only, saturates at TRACE_VALUE_MAX
+	TaskHandle_t task;			// NULL in an interrupt
+} trace_event_t;
+
+typedef struct {
+	bool enabled;
+	uint32_t events[portNUM_PROCESSORS];	// recorded since the last clear, per core
+	uint32_t lost[portNUM_PROCESSORS];		// overwritten before being dumped
+} trace_stats_t;
+
+extern volatile bool trace_enabled;
+
+void trace_emit(const char* name, trace_type_t type, int32_t value);
+
+/*
+ * Trace points are meant to stay in the code: when tracing is off they are
+ * one load and a branch.
+ */
+static inline void trace_begin(const char* name) {
+	if (trace_enabled) trace_emit(name, TRACE_BEGIN, 0);
+}
+
+static inline void trace_end(const char* name) {
+	if (trace_enabled) trace_emit(name, TRACE_END, 0);
+}
+
+static inline void trace_counter(const char* name, int32_t value) {
+	if (trace_enabled) trace_emit(name, TRACE_COUNTER, value);
+}
+
+static inline void trace_instant(const char* name) {
+	if (trace_enabled) trace_emit(name, TRACE_INSTANT, 0);
+}
+
+void trace_enable(bool on);
+void trace_clear(void);
+// Prints the rings in the format tools/trace2json.py reads
+void trace_dump(void);
+void trace_get_stats(trace_stats_t* out);
+
+#endif
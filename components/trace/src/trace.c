@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_cpu.h"
+#include "esp_rom_sys.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+
+#include "trace.h"
+
+#define TRACE_MASK (TRACE_EVENTS - 1)
+#define TRACE_TASKS 16			// names kept per core
+
+/*
+ * One ring per core, so recording never contends across cores. Interrupts
+ * are masked while a slot is taken, which makes trace points usable from
+ * ISRs. CCOUNT isn't synchronised between the cores, so the first event on
+ * each core after a clear also stores an esp_timer timestamp to align them.
+ *
+ * Events carry the task that emitted them, so begin/end pairs nest per task
+ * even when tasks preempt each other. A task's name is copied the first
+ * time it shows up, the task may be gone by the time the trace is dumped.
+ */
+typedef struct {
+	TaskHandle_t task;
+	char name[configMAX_TASK_NAME_LEN];
+} trace_task_t;
+
+typedef struct {
+	trace_event_t events[TRACE_EVENTS];
+	uint32_t head;
+	bool synced;
+	uint32_t base_ccount;
+	int64_t base_us;
+
+	trace_task_t tasks[TRACE_TASKS];
+	uint32_t task_count;
+	TaskHandle_t last_task;		// skips the lookup while the same task keeps emitting
+} trace_ring_t;
+
+volatile bool trace_enabled = false;
+static trace_ring_t rings[portNUM_PROCESSORS];
+
+static void remember_task(trace_ring_t* ring, TaskHandle_t task) {
+	for (uint32_t i = 0; i < ring->task_count; i++) {
+		if (ring->tasks[i].task == task) return;
+	}
+	if (ring->task_count == TRACE_TASKS) return;
+
+	trace_task_t* entry = &ring->tasks[ring->task_count++];
+	entry->task = task;
+	strlcpy(entry->name, pcTaskGetName(task), sizeof(entry->name));
+}
+
+// From ISRs too, so it stays out of flash
+IRAM_ATTR void trace_emit(const char* name, trace_type_t type, int32_t value) {
+	if (value > TRACE_VALUE_MAX) value = TRACE_VALUE_MAX;
+	if (value < -TRACE_VALUE_MAX - 1) value = -TRACE_VALUE_MAX - 1;
+
+	UBaseType_t state = portSET_INTERRUPT_MASK_FROM_ISR();
+	trace_ring_t* ring = &rings[xPortGetCoreID()];
+	uint32_t ccount = esp_cpu_get_cycle_count();
+
+	TaskHandle_t task = xPortInIsrContext() ? NULL : xTaskGetCurrentTaskHandle();
+	if (task && task != ring->last_task) {
+		remember_task(ring, task);
+		ring->last_task = task;
+	}
+
+	if (!ring->synced) {
+		ring->base_us = esp_timer_get_time();
+		ring->base_ccount = ccount;
+		ring->synced = true;
+	}
+
+	trace_event_t* event = &ring->events[ring->head++ & TRACE_MASK];
+	event->ccount = ccount;
+	event->name = name;
+	event->type = type;
+	event->value = value;
+	event->task = task;
+	portCLEAR_INTERRUPT_MASK_FROM_ISR(state);
+}
+
+void trace_enable(bool on) {
+	trace_enabled = on;
+}
+
+void trace_clear(void) {
+	bool was = trace_enabled;
+	trace_enabled = false;
+	// Let a trace point that already passed the check finish
+	vTaskDelay(1);
+	memset(rings, 0, sizeof(rings));
+	trace_enabled = was;
+}
+
+static const char type_names[] = "BECI";
+
+void trace_dump(void) {
+	bool was = trace_enabled;
+	trace_enabled = false;
+	vTaskDelay(1);
+
+	uint32_t total = 0;
+	printf("=== Trace: %lu MHz\n", (unsigned long)esp_rom_get_cpu_ticks_per_us());
+	for (int core = 0; core < portNUM_PROCESSORS; core++) {
+		trace_ring_t* ring = &rings[core];
+		if (!ring->synced) continue;
+		printf("S %d %lu %lld\n", core, ring->base_ccount, ring->base_us);
+		for (uint32_t i = 0; i < ring->task_count; i++) {
+			printf("T %lx %s\n", (uint32_t)ring->tasks[i].task, ring->tasks[i].name);
+		}
+
+		uint32_t count = ring->head < TRACE_EVENTS ? ring->head : TRACE_EVENTS;
+		for (uint32_t i = ring->head - count; i != ring->head; i++) {
+			trace_event_t* event = &ring->events[i & TRACE_MASK];
+			printf("E %d %lu %c %ld %lx %s\n", core, event->ccount, type_names[event->type],
+				   (long)event->value, (uint32_t)event->task, event->name);
+		}
+		total += count;
+	}
+	printf("=== End of trace (%lu events)\n", total);
+
+	trace_enabled = was;
+}
+
+void trace_get_stats(trace_stats_t* out) {
+	memset(out, 0, sizeof(*out));
+	out->enabled = trace_enabled;
+	for (int core = 0; core < portNUM_PROCESSORS; core++) {
+		out->events[core] = rings[core].head;
+		out->lost[core] = rings[core].head > TRACE_EVENTS ? rings[core].head - TRACE_EVENTS : 0;
+	}
+}
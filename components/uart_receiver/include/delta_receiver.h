@@ -0,0 +1,32 @@
+#ifndef DELTA_RECEIVER_H
+#define DELTA_RECEIVER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DELTA_BLOCK_SIZE_MIN	64
+#define DELTA_BLOCK_SIZE_MAX	4096
+#define DELTA_MAX_SIZE			(1024 * 1024)
+#define DELTA_STRONG_SIZE		8		// bytes of SHA-256 kept per block
+#define DELTA_WAIT_MS			30000	// for the host to start
+#define DELTA_TIMEOUT_MS		2000	// between bytes once it has
+
+typedef struct {
+	uint32_t size;
+	uint32_t block_size;
+	uint32_t block_count;
+	uint32_t blocks_reused;
+	uint32_t blocks_sent;
+	uint32_t wire_bytes;		// everything the host had to send
+	int64_t elapsed_us;
+} delta_stats_t;
+
+/*
+ * Receives a new image as a delta against `base`. Blocks the host already
+ * has on the device (at any offset in `base`) are copied locally, the rest
+ * come over the wire. Returns a malloc'd buffer whose SHA-256 matched the
+ * host's, or NULL.
+ */
+uint8_t* delta_receive_data(const uint8_t* base, size_t base_size, size_t* out_size, delta_stats_t* stats);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef STREAM_RECEIVER_H
+#define STREAM_RECEIVER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define STREAM_BUFFER_MAX		(32 * 1024)	// per buffer, halved while malloc fails
+#define STREAM_BUFFER_MIN		4096
+#define STREAM_WAIT_MS			30000		// for the host to start
+#define STREAM_TIMEOUT_MS		2000		// between bytes once it has
+#define STREAM_WRITE_TIMEOUT_MS	10000		// for the card to take a buffer
+
+typedef struct {
+	uint32_t size;
+	uint32_t buffer_size;
+	uint32_t cluster_size;
+	uint32_t buffers;			// handed to the writer
+	uint32_t receive_stalls;	// times reception waited for the card
+	int preallocated;			// the file was created contiguous
+	int64_t write_us;			// spent in fwrite
+	int64_t elapsed_us;
+} stream_stats_t;
+
+/*
+ * Receives a file of any size straight to `path`. Two buffers alternate: one
+ * is filled from the UART while the other is written by a separate task, and
+ * the host only sends a buffer's worth when the device grants it, so a slow
+ * card throttles the link instead of overrunning it. Returns 0 once the whole
+ * file is on the card with the CRC-32 the host sent.
+ */
+int stream_receive_file(const char* path, stream_stats_t* stats);
+
+#endif
@@ -0,0 +1,326 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/uart.h"
+#include "esp_timer.h"
+#include "psa/crypto.h"
+
+#include "uart_receiver.h"
+#include "delta_receiver.h"
+
+/*
+ * Host -> device	"DLT1" | size u32 | block size u32 | sha256[32]
+ *					| per block: weak u32 | strong[DELTA_STRONG_SIZE]
+ * Device -> host	"DLTN" | needed u32 | bitmap of blocks to send
+ * Host -> device	the requested blocks, in order
+ * Device -> host	"DLTD" | status u8
+ *
+ * All integers are little endian. The weak sum is the rsync rolling
+ * checksum, so a block is found in the old image even if an earlier
+ * section grew or shrank and moved it.
+ */
+
+#define MAGIC_HEADER	"DLT1"
+#define MAGIC_NEED		"DLTN"
+#define MAGIC_DONE		"DLTD"
+
+typedef enum {
+	DELTA_OK = 0,
+	DELTA_BAD_HASH = 1,
+	DELTA_NO_MEMORY = 2,
+	DELTA_TIMEOUT = 3,
+	DELTA_BAD_HEADER = 4,
+} delta_status_t;
+
+typedef struct {
+	uint32_t weak;
+	uint32_t block;
+} weak_entry_t;
+
+static uint32_t get_le32(const uint8_t* p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le32(uint8_t* p, uint32_t value) {
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+	p[3] = value >> 24;
+}
+
+static int read_exact(void* dst, size_t len, int timeout_ms) {
+	uint8_t* p = dst;
+	while (len) {
+		int n = uart_read_bytes(UART_NUM, p, len, pdMS_TO_TICKS(timeout_ms));
+		if (n <= 0) return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int wait_magic(const char* magic, int timeout_ms) {
+	size_t matched = 0;
+	while (matched < 4) {
+		uint8_t c;
+		if (uart_read_bytes(UART_NUM, &c, 1, pdMS_TO_TICKS(timeout_ms)) <= 0) return -1;
+		if (c == (uint8_t)magic[matched]) {
+			matched++;
+		} else {
+			matched = (c == (uint8_t)magic[0]);
+		}
+	}
+	return 0;
+}
+
+// Throws away whatever the host is still sending after we gave up
+static void drain_input(void) {
+	uint8_t scratch[64];
+	while (uart_read_bytes(UART_NUM, scratch, sizeof(scratch), pdMS_TO_TICKS(100)) > 0);
+}
+
+static void send_done(delta_status_t status) {
+	uint8_t frame[5];
+	memcpy(frame, MAGIC_DONE, 4);
+	frame[4] = status;
+	uart_write_bytes(UART_NUM, (const char*)frame, sizeof(frame));
+	uart_wait_tx_done(UART_NUM, pdMS_TO_TICKS(100));
+}
+
+static void fail(delta_status_t status, const char* message) {
+	drain_input();
+	send_done(status);
+	printf("Error: %s\n", message);
+}
+
+static void sha256(const uint8_t* data, size_t len, uint8_t* out) {
+	size_t out_len;
+	psa_hash_compute(PSA_ALG_SHA_256, data, len, out, 32, &out_len);
+}
+
+static uint32_t weak_sum(const uint8_t* p, size_t len, uint32_t* a_out, uint32_t* b_out) {
+	uint32_t a = 0;
+	uint32_t b = 0;
+	for (size_t i = 0; i < len; i++) {
+		a += p[i];
+		b += (len - i) * p[i];
+	}
+	*a_out = a & 0xFFFF;
+	*b_out = b & 0xFFFF;
+	return *a_out | (*b_out << 16);
+}
+
+static int compare_weak(const void* x, const void* y) {
+	const weak_entry_t* a = (const weak_entry_t*)x;
+	const weak_entry_t* b = (const weak_entry_t*)y;
+	return (a->weak > b->weak) - (a->weak < b->weak);
+}
+
+static int is_needed(const uint8_t* bitmap, uint32_t block) {
+	return bitmap[block / 8] & (1 << (block % 8));
+}
+
+static void clear_needed(uint8_t* bitmap, uint32_t block) {
+	bitmap[block / 8] &= ~(1 << (block % 8));
+}
+
+typedef struct {
+	uint32_t size;
+	uint32_t block_size;
+	uint32_t count;
+	uint32_t needed;
+	uint8_t* out;
+	uint8_t* bitmap;
+	uint8_t* strong;			// DELTA_STRONG_SIZE per block
+	weak_entry_t* index;		// sorted by weak sum
+} delta_job_t;
+
+static uint32_t block_len(const delta_job_t* job, uint32_t block) {
+	uint32_t offset = block * job->block_size;
+	uint32_t len = job->size - offset;
+	return len < job->block_size ? len : job->block_size;
+}
+
+// Copies `src` into every still-missing block it matches
+static void try_match(delta_job_t* job, const uint8_t* src, uint32_t weak) {
+	weak_entry_t key = { .weak = weak };
+	weak_entry_t* hit = bsearch(&key, job->index, job->count, sizeof(weak_entry_t), compare_weak);
+	if (!hit) return;
+	while (hit > job->index && hit[-1].weak == weak) hit--;
+
+	uint8_t digest[32];
+	int hashed = 0;
+	for (; hit < job->index + job->count && hit->weak == weak; hit++) {
+		uint32_t block = hit->block;
+		if (!is_needed(job->bitmap, block) || block_len(job, block) != job->block_size) continue;
+
+		if (!hashed) {
+			sha256(src, job->block_size, digest);
+			hashed = 1;
+		}
+		if (memcmp(digest, job->strong + block * DELTA_STRONG_SIZE, DELTA_STRONG_SIZE) == 0) {
+			memcpy(job->out + block * job->block_size, src, job->block_size);
+			clear_needed(job->bitmap, block);
+			job->needed--;
+		}
+	}
+}
+
+static void search_base(delta_job_t* job, const uint8_t* base, size_t base_size) {
+	uint32_t bs = job->block_size;
+
+	if (base_size >= bs) {
+		uint32_t a, b;
+		uint32_t weak = weak_sum(base, bs, &a, &b);
+		for (size_t offset = 0; job->needed; offset++) {
+			try_match(job, base + offset, weak);
+			if (offset + bs >= base_size) break;
+
+			// Roll the window one byte forward
+			uint8_t out = base[offset];
+			uint8_t in = base[offset + bs];
+			a = (a - out + in) & 0xFFFF;
+			b = (b - bs * out + a) & 0xFFFF;
+			weak = a | (b << 16);
+		}
+	}
+
+	// A short last block can only sit where it was or at the end of the old image
+	uint32_t last = job->count - 1;
+	uint32_t len = block_len(job, last);
+	if (len == bs || !is_needed(job->bitmap, last)) return;
+
+	size_t candidates[2] = { last * bs, base_size - len };
+	for (int i = 0; i < 2; i++) {
+		size_t offset = candidates[i];
+		if (base_size < len || offset + len > base_size) continue;
+
+		uint8_t digest[32];
+		sha256(base + offset, len, digest);
+		if (memcmp(digest, job->strong + last * DELTA_STRONG_SIZE, DELTA_STRONG_SIZE) == 0) {
+			memcpy(job->out + last * bs, base + offset, len);
+			clear_needed(job->bitmap, last);
+			job->needed--;
+			return;
+		}
+	}
+}
+
+static void free_job(delta_job_t* job) {
+	free(job->bitmap);
+	free(job->strong);
+	free(job->index);
+}
+
+uint8_t* delta_receive_data(const uint8_t* base, size_t base_size, size_t* out_size, delta_stats_t* stats) {
+	memset(stats, 0, sizeof(*stats));
+	*out_size = 0;
+	psa_crypto_init();
+
+	printf("Waiting for delta upload...\n");
+	fflush(stdout);
+
+	vTaskDelay(pdMS_TO_TICKS(100));
+
+	uart_flush_input(UART_NUM);
+
+	if (wait_magic(MAGIC_HEADER, DELTA_WAIT_MS) != 0) {
+		printf("Error: No data received.\n");
+		return NULL;
+	}
+	int64_t start = esp_timer_get_time();
+
+	uint8_t header[8 + 32];
+	if (read_exact(header, sizeof(header), DELTA_TIMEOUT_MS) != 0) {
+		fail(DELTA_TIMEOUT, "Delta header timed out.");
+		return NULL;
+	}
+
+	delta_job_t job = {0};
+	job.size = get_le32(header);
+	job.block_size = get_le32(header + 4);
+	const uint8_t* expected = header + 8;
+
+	uint32_t bs = job.block_size;
+	if (!job.size || job.size > DELTA_MAX_SIZE ||
+		bs < DELTA_BLOCK_SIZE_MIN || bs > DELTA_BLOCK_SIZE_MAX || (bs & (bs - 1))) {
+		fail(DELTA_BAD_HEADER, "Bad delta header.");
+		return NULL;
+	}
+	job.count = (job.size + bs - 1) / bs;
+	job.needed = job.count;
+
+	job.out = malloc(job.size);
+	job.bitmap = malloc((job.count + 7) / 8);
+	job.strong = malloc(job.count * DELTA_STRONG_SIZE);
+	job.index = malloc(job.count * sizeof(weak_entry_t));
+	if (!job.out || !job.bitmap || !job.strong || !job.index) {
+		free(job.out);
+		free_job(&job);
+		fail(DELTA_NO_MEMORY, "Failed to allocate buffer.");
+		return NULL;
+	}
+	memset(job.bitmap, 0xFF, (job.count + 7) / 8);
+
+	for (uint32_t i = 0; i < job.count; i++) {
+		uint8_t entry[4 + DELTA_STRONG_SIZE];
+		if (read_exact(entry, sizeof(entry), DELTA_TIMEOUT_MS) != 0) {
+			free(job.out);
+			free_job(&job);
+			fail(DELTA_TIMEOUT, "Block sums timed out.");
+			return NULL;
+		}
+		job.index[i].weak = get_le32(entry);
+		job.index[i].block = i;
+		memcpy(job.strong + i * DELTA_STRONG_SIZE, entry + 4, DELTA_STRONG_SIZE);
+	}
+	qsort(job.index, job.count, sizeof(weak_entry_t), compare_weak);
+
+	if (base && base_size) {
+		search_base(&job, base, base_size);
+	}
+
+	uint8_t need[8];
+	memcpy(need, MAGIC_NEED, 4);
+	put_le32(need + 4, job.needed);
+	uart_write_bytes(UART_NUM, (const char*)need, sizeof(need));
+	uart_write_bytes(UART_NUM, (const char*)job.bitmap, (job.count + 7) / 8);
+
+	stats->wire_bytes = 4 + sizeof(header) + job.count * (4 + DELTA_STRONG_SIZE);
+	for (uint32_t i = 0; i < job.count; i++) {
+		if (!is_needed(job.bitmap, i)) continue;
+
+		uint32_t len = block_len(&job, i);
+		if (read_exact(job.out + i * bs, len, DELTA_TIMEOUT_MS) != 0) {
+			free(job.out);
+			free_job(&job);
+			fail(DELTA_TIMEOUT, "Block data timed out.");
+			return NULL;
+		}
+		stats->wire_bytes += len;
+		stats->blocks_sent++;
+	}
+
+	uint8_t digest[32];
+	sha256(job.out, job.size, digest);
+	if (memcmp(digest, expected, 32) != 0) {
+		free(job.out);
+		free_job(&job);
+		send_done(DELTA_BAD_HASH);
+		printf("Error: Image hash mismatch, send the full module.\n");
+		return NULL;
+	}
+	send_done(DELTA_OK);
+
+	stats->size = job.size;
+	stats->block_size = bs;
+	stats->block_count = job.count;
+	stats->blocks_reused = job.count - stats->blocks_sent;
+	stats->elapsed_us = esp_timer_get_time() - start;
+
+	free_job(&job);
+	*out_size = job.size;
+	return job.out;
+}
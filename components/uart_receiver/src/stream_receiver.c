@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "driver/uart.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+#include "esp_vfs_fat.h"
+
+#include "uart_receiver.h"
+#include "stream_receiver.h"
+#include "sdcard.h"
+#include "trace.h"
+
+/*
+ * Host -> device	"RCV1" | size u32 | crc32 u32
+ * Device -> host	"RCVA" | status u8 | buffer size u32
+ * Device -> host	"RCVK" for each buffer the host may send; two to begin with
+ * Host -> device	the file in buffer-size pieces, the last one shorter
+ * Device -> host	"RCVD" | status u8
+ *
+ * All integers are little endian. Buffers are powers of two from
+ * STREAM_BUFFER_MAX down, so with clusters up to that size every fwrite
+ * starts and ends on a cluster boundary of the preallocated file.
+ */
+
+#define MAGIC_HEADER	"RCV1"
+#define MAGIC_ACCEPT	"RCVA"
+#define MAGIC_CREDIT	"RCVK"
+#define MAGIC_DONE		"RCVD"
+#define BUFFER_COUNT	2
+
+typedef enum {
+	STREAM_OK = 0,
+	STREAM_BAD_CRC = 1,
+	STREAM_NO_MEMORY = 2,
+	STREAM_TIMEOUT = 3,
+	STREAM_NO_SPACE = 4,
+	STREAM_WRITE_FAILED = 5,
+} stream_status_t;
+
+typedef struct {
+	uint8_t* data;
+	size_t len;					// 0 tells the writer to stop
+} stream_buffer_t;
+
+typedef struct {
+	FILE* file;
+	QueueHandle_t full;
+	QueueHandle_t empty;
+	TaskHandle_t caller;
+	volatile int failed;
+	int64_t write_us;
+} stream_writer_t;
+
+static uint32_t get_le32(const uint8_t* p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le32(uint8_t* p, uint32_t value) {
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+	p[3] = value >> 24;
+}
+
+static int read_exact(void* dst, size_t len, int timeout_ms) {
+	uint8_t* p = dst;
+	while (len) {
+		int n = uart_read_bytes(UART_NUM, p, len, pdMS_TO_TICKS(timeout_ms));
+		if (n <= 0) return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int wait_magic(const char* magic, int timeout_ms) {
+	size_t matched = 0;
+	while (matched < 4) {
+		uint8_t c;
+		if (uart_read_bytes(UART_NUM, &c, 1, pdMS_TO_TICKS(timeout_ms)) <= 0) return -1;
+		if (c == (uint8_t)magic[matched]) {
+			matched++;
+		} else {
+			matched = (c == (uint8_t)magic[0]);
+		}
+	}
+	return 0;
+}
+
+static void send_frame(const char* magic, const uint8_t* payload, size_t len) {
+	uart_write_bytes(UART_NUM, magic, 4);
+	if (len) uart_write_bytes(UART_NUM, (const char*)payload, len);
+}
+
+static void send_status(const char* magic, stream_status_t status) {
+	uint8_t s = status;
+	send_frame(magic, &s, 1);
+	uart_wait_tx_done(UART_NUM, pdMS_TO_TICKS(100));
+}
+
+static void drain_input(void) {
+	uint8_t scratch[64];
+	while (uart_read_bytes(UART_NUM, scratch, sizeof(scratch), pdMS_TO_TICKS(100)) > 0);
+}
+
+static void writer_task(void* arg) {
+	stream_writer_t* w = arg;
+	stream_buffer_t buf;
+	while (xQueueReceive(w->full, &buf, portMAX_DELAY) == pdTRUE && buf.len) {
+		if (!w->failed) {
+			int64_t t = esp_timer_get_time();
+			if (fwrite(buf.data, 1, buf.len, w->file) != buf.len) w->failed = 1;
+			w->write_us += esp_timer_get_time() - t;
+		}
+		xQueueSend(w->empty, &buf, portMAX_DELAY);
+		// The host sends the next piece only now, so the UART never overruns
+		if (!w->failed) send_frame(MAGIC_CREDIT, NULL, 0);
+	}
+	xTaskNotifyGive(w->caller);
+	vTaskDelete(NULL);
+}
+
+// Powers of two, so from the cluster size up every buffer is whole clusters
+static uint8_t* alloc_buffers(size_t* out_size) {
+	for (size_t size = STREAM_BUFFER_MAX; size >= STREAM_BUFFER_MIN; size /= 2) {
+		uint8_t* mem = malloc(size * BUFFER_COUNT);
+		if (mem) {
+			*out_size = size;
+			return mem;
+		}
+	}
+	return NULL;
+}
+
+static FILE* open_preallocated(const char* path, uint32_t size, int* preallocated) {
+	// A contiguous, already allocated file: no FAT updates while streaming
+	*preallocated = esp_vfs_fat_create_contiguous_file(sdcard_get_mount_point(), path, size, true) == ESP_OK;
+	FILE* f = fopen(path, *preallocated ? "r+b" : "wb");
+	if (f) {
+		// Whole buffers go straight to FATFS without newlib's copy
+		setvbuf(f, NULL, _IONBF, 0);
+	}
+	return f;
+}
+
+int stream_receive_file(const char* path, stream_stats_t* stats) {
+	memset(stats, 0, sizeof(*stats));
+
+	size_t cluster = 0;
+	uint64_t free_bytes = 0;
+	if (sdcard_get_fs_info(&cluster, &free_bytes) != ESP_OK) {
+		printf("Error: Card not mounted.\n");
+		return -1;
+	}
+
+	printf("Waiting for stream upload...\n");
+	fflush(stdout);
+	vTaskDelay(pdMS_TO_TICKS(100));
+	uart_flush_input(UART_NUM);
+
+	if (wait_magic(MAGIC_HEADER, STREAM_WAIT_MS) != 0) {
+		printf("Error: No data received.\n");
+		return -1;
+	}
+	int64_t start = esp_timer_get_time();
+
+	uint8_t header[8];
+	if (read_exact(header, sizeof(header), STREAM_TIMEOUT_MS) != 0) {
+		drain_input();
+		send_status(MAGIC_ACCEPT, STREAM_TIMEOUT);
+		printf("Error: Stream header timed out.\n");
+		return -1;
+	}
+	uint32_t size = get_le32(header);
+	uint32_t expected_crc = get_le32(header + 4);
+
+	stream_status_t status = STREAM_OK;
+	size_t buffer_size = 0;
+	uint8_t* buffers = NULL;
+	FILE* f = NULL;
+	if (size > free_bytes) {
+		status = STREAM_NO_SPACE;
+	} else if (!(buffers = alloc_buffers(&buffer_size))) {
+		status = STREAM_NO_MEMORY;
+	} else if (!(f = open_preallocated(path, size, &stats->preallocated))) {
+		status = STREAM_WRITE_FAILED;
+	}
+
+	uint8_t accept[5];
+	accept[0] = status;
+	put_le32(accept + 1, buffer_size);
+	send_frame(MAGIC_ACCEPT, accept, sizeof(accept));
+	if (status != STREAM_OK) {
+		free(buffers);
+		printf("Error: %s.\n", status == STREAM_NO_SPACE ? "Not enough space on the card" :
+			   status == STREAM_NO_MEMORY ? "Failed to allocate buffer" : "Failed to create the file");
+		return -1;
+	}
+
+	stream_writer_t w = {
+		.file = f,
+		.full = xQueueCreate(BUFFER_COUNT + 1, sizeof(stream_buffer_t)),
+		.empty = xQueueCreate(BUFFER_COUNT, sizeof(stream_buffer_t)),
+		.caller = xTaskGetCurrentTaskHandle(),
+	};
+	// Same priority as the receiver, it blocks on the card most of the time
+	if (!w.full || !w.empty ||
+		xTaskCreate(writer_task, "recv_wr", 4096, &w, uxTaskPriorityGet(NULL), NULL) != pdPASS) {
+		if (w.full) vQueueDelete(w.full);
+		if (w.empty) vQueueDelete(w.empty);
+		fclose(f);
+		free(buffers);
+		send_status(MAGIC_DONE, STREAM_NO_MEMORY);
+		printf("Error: Failed to start the writer.\n");
+		return -1;
+	}
+	for (int i = 0; i < BUFFER_COUNT; i++) {
+		stream_buffer_t buf = { .data = buffers + i * buffer_size };
+		xQueueSend(w.empty, &buf, 0);
+		send_frame(MAGIC_CREDIT, NULL, 0);
+	}
+
+	trace_begin("uart_stream");
+	uint32_t crc = 0;
+	uint32_t received = 0;
+	while (received < size && status == STREAM_OK) {
+		stream_buffer_t buf;
+		if (xQueueReceive(w.empty, &buf, 0) != pdTRUE) {
+			// Both buffers are with the card, the host is waiting for a credit
+			stats->receive_stalls++;
+			if (xQueueReceive(w.empty, &buf, pdMS_TO_TICKS(STREAM_WRITE_TIMEOUT_MS)) != pdTRUE) {
+				status = STREAM_WRITE_FAILED;
+				break;
+			}
+		}
+		if (w.failed) {
+			status = STREAM_WRITE_FAILED;
+			break;
+		}
+
+		buf.len = size - received < buffer_size ? size - received : buffer_size;
+		if (read_exact(buf.data, buf.len, STREAM_TIMEOUT_MS) != 0) {
+			status = STREAM_TIMEOUT;
+			break;
+		}
+		crc = esp_rom_crc32_le(crc, buf.data, buf.len);
+		received += buf.len;
+		xQueueSend(w.full, &buf, portMAX_DELAY);
+		stats->buffers++;
+	}
+	trace_end("uart_stream");
+	// Streams outgrow a trace value, so in KB
+	trace_counter("uart_kb", received / 1024);
+
+	stream_buffer_t stop = { .len = 0 };
+	xQueueSend(w.full, &stop, portMAX_DELAY);
+	ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+	vQueueDelete(w.full);
+	vQueueDelete(w.empty);
+	free(buffers);
+
+	if (fclose(f) != 0 || w.failed) status = STREAM_WRITE_FAILED;
+	if (status == STREAM_OK && crc != expected_crc) status = STREAM_BAD_CRC;
+	if (status != STREAM_OK) {
+		drain_input();
+		remove(path);
+	}
+	send_status(MAGIC_DONE, status);
+
+	stats->size = received;
+	stats->buffer_size = buffer_size;
+	stats->cluster_size = cluster;
+	stats->write_us = w.write_us;
+	stats->elapsed_us = esp_timer_get_time() - start;
+
+	if (status != STREAM_OK) {
+		static const char* messages[] = {
+			[STREAM_BAD_CRC] = "CRC mismatch",
+			[STREAM_TIMEOUT] = "Transfer timed out",
+			[STREAM_WRITE_FAILED] = "Card write failed",
+		};
+		printf("Error: %s, %s removed.\n", messages[status] ? messages[status] : "Transfer failed", path);
+		return -1;
+	}
+	return 0;
+}
@@ -6,6 +6,7 @@
 #include "driver/uart.h"
 
 #include "uart_receiver.h"
+#include "trace.h"
 
 void uart_receiver_init(void) {
 	uart_config_t uart_config = {
@@ -37,6 +38,7 @@ uint8_t* uart_receive_data(size_t* out_size) {
 	vTaskDelay(pdMS_TO_TICKS(100));
 	
 	uart_flush_input(UART_NUM);
+	trace_begin("uart_receive");
 	
 	size_t received = 0;
 	int timeout = 0;
@@ -61,6 +63,8 @@ uint8_t* uart_receive_data(size_t* out_size) {
 			}
 		}
 	}
+	trace_end("uart_receive");
+	trace_counter("uart_bytes", received);
 	*out_size = received;
 	return buffer;
 }
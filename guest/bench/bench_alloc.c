@@ -0,0 +1,49 @@
+#include "esp_guest.h"
+
+// Фрагментация кучи: случайные malloc/free/realloc разных размеров
+
+#define LIVE	64
+#define STEPS	20000
+
+int guest_main(int argc, char** argv) {
+	void* live[LIVE] = {0};
+	uint32_t sizes[LIVE] = {0};
+	uint32_t seed = 7;
+	uint32_t check = 0;
+	uint32_t failed = 0;
+
+	for (int s = 0; s < STEPS; s++) {
+		seed = seed * 1103515245 + 12345;
+		int slot = (seed >> 16) % LIVE;
+		uint32_t size = 8 + ((seed >> 4) & 0x1FF);
+
+		if (!live[slot]) {
+			live[slot] = malloc(size);
+			sizes[slot] = size;
+		} else if ((seed & 0x8000) && sizes[slot] < 4096) {
+			void* grown = realloc(live[slot], sizes[slot] * 2);
+			if (grown) {
+				live[slot] = grown;
+				sizes[slot] *= 2;
+			}
+		} else {
+			free(live[slot]);
+			live[slot] = NULL;
+			continue;
+		}
+
+		if (!live[slot]) {
+			failed++;
+			continue;
+		}
+		((uint8_t*)live[slot])[0] = s;
+		check += sizes[slot];
+	}
+
+	for (int i = 0; i < LIVE; i++) {
+		free(live[i]);
+	}
+
+	printf("bench alloc: check=%08x failed=%u\n", check, failed);
+	return 0;
+}
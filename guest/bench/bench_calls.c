@@ -0,0 +1,30 @@
+#include "esp_guest.h"
+
+// Вызовы: экспортированные функции прошивки и указатели на функции модуля
+
+#define ROUNDS 20000
+
+typedef uint32_t (*op_t)(uint32_t, uint32_t);
+
+static uint32_t op_add(uint32_t a, uint32_t b) { return a + b; }
+static uint32_t op_xor(uint32_t a, uint32_t b) { return a ^ b; }
+static uint32_t op_mix(uint32_t a, uint32_t b) { return (a << 5) - a + b; }
+
+static const op_t s_ops[] = { op_add, op_xor, op_mix };
+static const char* s_words[] = { "alpha", "beta", "gamma", "delta" };
+
+int guest_main(int argc, char** argv) {
+	srand(1);
+
+	uint32_t check = 0;
+	for (int i = 0; i < ROUNDS; i++) {
+		const char* word = s_words[i & 3];
+		check += strlen(word);
+		check += abs(strcmp(word, s_words[(i + 1) & 3]));
+		check += memcmp(word, "alpha", 3) == 0;
+		check = s_ops[i % 3](check, rand() & 0xFF);
+	}
+
+	printf("bench calls: check=%08x\n", check);
+	return 0;
+}
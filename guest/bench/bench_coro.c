@@ -0,0 +1,59 @@
+#include "esp_guest.h"
+
+// Сопрограммы: COROS штук по кругу через coro_yield, затем пинг-понг
+// через события. Печатает такты на одно переключение.
+
+#define COROS	200
+#define ROUNDS	50
+#define PINGS	2000
+
+static uint32_t s_check;
+static coro_event_t s_ping;
+static coro_event_t s_pong;
+
+static void spinner(void* arg) {
+	uint32_t id = (uint32_t)arg;
+	for (int i = 0; i < ROUNDS; i++) {
+		s_check = (s_check << 5) - s_check + id;
+		coro_yield();
+	}
+}
+
+static void pinger(void* arg) {
+	for (int i = 0; i < PINGS; i++) {
+		coro_signal(&s_ping);
+		coro_wait(&s_pong);
+	}
+}
+
+static void ponger(void* arg) {
+	for (int i = 0; i < PINGS; i++) {
+		coro_wait(&s_ping);
+		s_check++;
+		coro_signal(&s_pong);
+	}
+}
+
+int guest_main(int argc, char** argv) {
+	for (uint32_t i = 0; i < COROS; i++) {
+		if (coro_spawn(spinner, (void*)i, 512) != 0) {
+			printf("bench coro: spawn %u failed\n", (unsigned)i);
+			return 1;
+		}
+	}
+	uint32_t start = cycles();
+	coro_run();
+	uint32_t ring = cycles() - start;
+
+	coro_spawn(pinger, 0, 512);
+	coro_spawn(ponger, 0, 512);
+	start = cycles();
+	int stuck = coro_run();
+	uint32_t ping = cycles() - start;
+
+	// Туда и обратно через планировщик — два переключения на yield
+	printf("bench coro: %d coroutines, yield %u cycles, ping-pong %u cycles, stuck %d, check=%08x\n",
+		   COROS, (unsigned)(ring / (COROS * (ROUNDS + 1) * 2)),
+		   (unsigned)(ping / (PINGS * 2)), stuck, (unsigned)s_check);
+	return 0;
+}
@@ -0,0 +1,216 @@
+#include "esp_guest.h"
+
+// Ядра esp-dsp против того же на простом C: скалярное произведение, FIR,
+// биквад, FFT и умножение матриц. Печатает время и расхождение результатов.
+// Без деления во float, как и bench_float.
+
+#define LEN			1024
+#define TAPS		32
+#define MAT_N		16
+#define ROUNDS		16
+
+static float s_x[LEN];
+static float s_y[LEN];
+static float s_out[LEN];
+static float s_ref[LEN];
+static float s_coeffs[TAPS];
+static float s_delay[TAPS];
+static float s_fft[LEN * 2];
+static float s_fft_ref[LEN * 2];
+static float s_a[MAT_N * MAT_N];
+static float s_b[MAT_N * MAT_N];
+static float s_c[MAT_N * MAT_N];
+static float s_c_ref[MAT_N * MAT_N];
+
+static float max_diff(const float* a, const float* b, int n) {
+	float worst = 0.0f;
+	for (int i = 0; i < n; i++) {
+		float d = a[i] - b[i];
+		if (d < 0) d = -d;
+		if (d > worst) worst = d;
+	}
+	return worst;
+}
+
+// Время в int: 64-битного деления (libgcc) гостям не экспортируется
+static void report(const char* name, int c_us, int dsp_us, float diff) {
+	if (dsp_us < 1) dsp_us = 1;
+	int ratio = c_us * 100 / dsp_us;
+	printf("  %-8s c %6d us  dsp %6d us  x%d.%02d  diff %de-6\n", name, c_us, dsp_us,
+		   ratio / 100, ratio % 100, (int)(diff * 1000000.0f));
+}
+
+static float c_dot(const float* a, const float* b, int n) {
+	float sum = 0.0f;
+	for (int i = 0; i < n; i++) {
+		sum += a[i] * b[i];
+	}
+	return sum;
+}
+
+static void c_fir(const float* in, float* out, int n) {
+	for (int i = 0; i < n; i++) {
+		float sum = 0.0f;
+		for (int k = 0; k < TAPS; k++) {
+			if (i - k >= 0) sum += s_coeffs[k] * in[i - k];
+		}
+		out[i] = sum;
+	}
+}
+
+static void c_biquad(const float* in, float* out, int n, const float* coef, float* w) {
+	for (int i = 0; i < n; i++) {
+		float d0 = in[i] - coef[3] * w[0] - coef[4] * w[1];
+		out[i] = coef[0] * d0 + coef[1] * w[0] + coef[2] * w[1];
+		w[1] = w[0];
+		w[0] = d0;
+	}
+}
+
+// Радикс-2 на месте: сначала перестановка, поворотные множители — рекурсией
+static void c_fft(float* data, int n) {
+	for (int i = 1, j = 0; i < n; i++) {
+		int bit = n >> 1;
+		for (; j & bit; bit >>= 1) j ^= bit;
+		j ^= bit;
+		if (i < j) {
+			float t = data[2 * i]; data[2 * i] = data[2 * j]; data[2 * j] = t;
+			t = data[2 * i + 1]; data[2 * i + 1] = data[2 * j + 1]; data[2 * j + 1] = t;
+		}
+	}
+	// cos/sin(pi / len) для len = 2, 4, ..., 4096
+	static const float half_cos[] = {
+		-1.0f, 0.0f, 0.70710678f, 0.92387953f, 0.98078528f, 0.99518473f, 0.99879546f,
+		0.99969882f, 0.99992470f, 0.99998118f, 0.99999529f, 0.99999882f, 0.99999971f,
+	};
+	static const float half_sin[] = {
+		0.0f, 1.0f, 0.70710678f, 0.38268343f, 0.19509032f, 0.09801714f, 0.04906767f,
+		0.02454123f, 0.01227154f, 0.00613588f, 0.00306796f, 0.00153398f, 0.00076699f,
+	};
+	for (int len = 2, step = 0; len <= n; len <<= 1, step++) {
+		float wr = half_cos[step];
+		float wi = -half_sin[step];
+		for (int i = 0; i < n; i += len) {
+			float cr = 1.0f, ci = 0.0f;
+			for (int k = 0; k < len / 2; k++) {
+				float* u = &data[2 * (i + k)];
+				float* v = &data[2 * (i + k + len / 2)];
+				float tr = v[0] * cr - v[1] * ci;
+				float ti = v[0] * ci + v[1] * cr;
+				v[0] = u[0] - tr;
+				v[1] = u[1] - ti;
+				u[0] += tr;
+				u[1] += ti;
+				float t = cr * wr - ci * wi;
+				ci = cr * wi + ci * wr;
+				cr = t;
+			}
+		}
+	}
+}
+
+static void c_matmul(const float* a, const float* b, float* c, int n) {
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < n; j++) {
+			float sum = 0.0f;
+			for (int k = 0; k < n; k++) {
+				sum += a[i * n + k] * b[k * n + j];
+			}
+			c[i * n + j] = sum;
+		}
+	}
+}
+
+int guest_main(int argc, char** argv) {
+	srand(1);
+	for (int i = 0; i < LEN; i++) {
+		s_x[i] = (float)(rand() % 2001 - 1000) * 0.001f;
+		s_y[i] = (float)(rand() % 2001 - 1000) * 0.001f;
+	}
+	for (int i = 0; i < TAPS; i++) {
+		s_coeffs[i] = 0.03125f;		// 1 / TAPS, симметрично: esp-dsp берёт коэффициенты в обратном порядке
+	}
+	for (int i = 0; i < MAT_N * MAT_N; i++) {
+		s_a[i] = (float)(i % 7) * 0.5f;
+		s_b[i] = (float)(i % 5) * 0.25f;
+	}
+	printf("bench dsp: %d samples, %d rounds\n", LEN, ROUNDS);
+
+	// Скалярное произведение
+	float dot_c = 0.0f, dot_dsp = 0.0f;
+	int64_t t0 = micros();
+	for (int r = 0; r < ROUNDS; r++) dot_c = c_dot(s_x, s_y, LEN);
+	int64_t t1 = micros();
+	for (int r = 0; r < ROUNDS; r++) dsps_dotprod_f32(s_x, s_y, &dot_dsp, LEN);
+	int64_t t2 = micros();
+	report("dot", (int)(t1 - t0), (int)(t2 - t1), max_diff(&dot_c, &dot_dsp, 1));
+
+	// FIR: буфер задержки обнуляем перед каждым проходом
+	fir_f32_t fir;
+	t0 = micros();
+	for (int r = 0; r < ROUNDS; r++) c_fir(s_x, s_ref, LEN);
+	t1 = micros();
+	for (int r = 0; r < ROUNDS; r++) {
+		memset(s_delay, 0, sizeof(s_delay));
+		dsps_fir_init_f32(&fir, s_coeffs, s_delay, TAPS);
+		dsps_fir_f32(&fir, s_x, s_out, LEN);
+	}
+	t2 = micros();
+	report("fir", (int)(t1 - t0), (int)(t2 - t1), max_diff(s_ref, s_out, LEN));
+
+	// Биквад (ФНЧ на 0.1 частоты дискретизации)
+	float coef[5];
+	float w[2];
+	dsps_biquad_gen_lpf_f32(coef, 0.1f, 0.707f);
+	t0 = micros();
+	for (int r = 0; r < ROUNDS; r++) {
+		w[0] = w[1] = 0.0f;
+		c_biquad(s_x, s_ref, LEN, coef, w);
+	}
+	t1 = micros();
+	for (int r = 0; r < ROUNDS; r++) {
+		w[0] = w[1] = 0.0f;
+		dsps_biquad_f32(s_x, s_out, LEN, coef, w);
+	}
+	t2 = micros();
+	report("biquad", (int)(t1 - t0), (int)(t2 - t1), max_diff(s_ref, s_out, LEN));
+
+	// FFT: первый вызов строит таблицу, его не считаем
+	for (int i = 0; i < LEN; i++) {
+		s_fft[2 * i] = s_x[i];
+		s_fft[2 * i + 1] = 0.0f;
+	}
+	if (dsps_fft2r_fc32(s_fft, LEN)) {
+		printf("bench dsp: fft init failed\n");
+		return -1;
+	}
+	t0 = micros();
+	for (int r = 0; r < ROUNDS; r++) {
+		for (int i = 0; i < LEN; i++) {
+			s_fft_ref[2 * i] = s_x[i];
+			s_fft_ref[2 * i + 1] = 0.0f;
+		}
+		c_fft(s_fft_ref, LEN);
+	}
+	t1 = micros();
+	for (int r = 0; r < ROUNDS; r++) {
+		for (int i = 0; i < LEN; i++) {
+			s_fft[2 * i] = s_x[i];
+			s_fft[2 * i + 1] = 0.0f;
+		}
+		dsps_fft2r_fc32(s_fft, LEN);
+		dsps_bit_rev_fc32(s_fft, LEN);
+	}
+	t2 = micros();
+	report("fft", (int)(t1 - t0), (int)(t2 - t1), max_diff(s_fft_ref, s_fft, LEN * 2));
+
+	// Матрицы
+	t0 = micros();
+	for (int r = 0; r < ROUNDS; r++) c_matmul(s_a, s_b, s_c_ref, MAT_N);
+	t1 = micros();
+	for (int r = 0; r < ROUNDS; r++) dspm_mult_f32(s_a, s_b, s_c, MAT_N, MAT_N, MAT_N);
+	t2 = micros();
+	report("matmul", (int)(t1 - t0), (int)(t2 - t1), max_diff(s_c_ref, s_c, MAT_N * MAT_N));
+
+	return 0;
+}
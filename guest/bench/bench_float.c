@@ -0,0 +1,69 @@
+#include "esp_guest.h"
+
+// Нагрузка на FPU: множество Мандельброта и умножение матриц (float, без деления)
+
+#define MANDEL_W	64
+#define MANDEL_H	32
+#define MANDEL_ITER	64
+#define MAT_N		24
+#define MAT_ROUNDS	8
+
+static float s_a[MAT_N][MAT_N];
+static float s_b[MAT_N][MAT_N];
+static float s_c[MAT_N][MAT_N];
+
+static uint32_t mandelbrot(void) {
+	uint32_t total = 0;
+	for (int y = 0; y < MANDEL_H; y++) {
+		float ci = -1.0f + y * (2.0f / MANDEL_H);
+		for (int x = 0; x < MANDEL_W; x++) {
+			float cr = -2.0f + x * (3.0f / MANDEL_W);
+			float zr = 0.0f;
+			float zi = 0.0f;
+			int n = 0;
+			while (n < MANDEL_ITER && zr * zr + zi * zi < 4.0f) {
+				float t = zr * zr - zi * zi + cr;
+				zi = 2.0f * zr * zi + ci;
+				zr = t;
+				n++;
+			}
+			total += n;
+		}
+	}
+	return total;
+}
+
+static uint32_t matmul(void) {
+	for (int i = 0; i < MAT_N; i++) {
+		for (int j = 0; j < MAT_N; j++) {
+			float sum = 0.0f;
+			for (int k = 0; k < MAT_N; k++) {
+				sum += s_a[i][k] * s_b[k][j];
+			}
+			s_c[i][j] = sum;
+		}
+	}
+
+	int32_t trace = 0;
+	for (int i = 0; i < MAT_N; i++) {
+		trace += (int32_t)(s_c[i][i] * 16.0f);
+	}
+	return trace;
+}
+
+int guest_main(int argc, char** argv) {
+	for (int i = 0; i < MAT_N; i++) {
+		for (int j = 0; j < MAT_N; j++) {
+			s_a[i][j] = (float)((i * 7 + j * 3) % 11) * 0.25f;
+			s_b[i][j] = (float)((i * 5 + j * 9) % 13) * 0.125f;
+		}
+	}
+
+	uint32_t check = mandelbrot();
+	for (int r = 0; r < MAT_ROUNDS; r++) {
+		check = check * 31 + matmul();
+	}
+
+	printf("bench float: check=%08x\n", check);
+	return 0;
+}
@@ -0,0 +1,60 @@
+#include "esp_guest.h"
+
+// Целочисленная нагрузка: CRC32 побитно и решето Эратосфена
+
+#define CRC_BYTES	4096
+#define CRC_ROUNDS	16
+#define SIEVE_SIZE	8192
+#define SIEVE_ROUNDS 8
+
+static uint8_t s_data[CRC_BYTES];
+static uint8_t s_sieve[SIEVE_SIZE];
+
+static uint32_t crc32(const uint8_t* p, size_t len, uint32_t crc) {
+	crc = ~crc;
+	for (size_t i = 0; i < len; i++) {
+		crc ^= p[i];
+		for (int k = 0; k < 8; k++) {
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+		}
+	}
+	return ~crc;
+}
+
+static uint32_t sieve(void) {
+	memset(s_sieve, 1, sizeof(s_sieve));
+	s_sieve[0] = s_sieve[1] = 0;
+	for (uint32_t i = 2; i * i < SIEVE_SIZE; i++) {
+		if (!s_sieve[i]) continue;
+		for (uint32_t j = i * i; j < SIEVE_SIZE; j += i) {
+			s_sieve[j] = 0;
+		}
+	}
+
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < SIEVE_SIZE; i++) {
+		count += s_sieve[i];
+	}
+	return count;
+}
+
+int guest_main(int argc, char** argv) {
+	uint32_t seed = 12345;
+	for (int i = 0; i < CRC_BYTES; i++) {
+		seed = seed * 1103515245 + 12345;
+		s_data[i] = seed >> 16;
+	}
+
+	uint32_t crc = 0;
+	for (int r = 0; r < CRC_ROUNDS; r++) {
+		crc = crc32(s_data, CRC_BYTES, crc);
+	}
+
+	uint32_t primes = 0;
+	for (int r = 0; r < SIEVE_ROUNDS; r++) {
+		primes += sieve();
+	}
+
+	printf("bench int: check=%08x\n", crc ^ primes);
+	return 0;
+}
@@ -0,0 +1,39 @@
+#include "esp_guest.h"
+
+// Латентность памяти: обход случайной циклической перестановки
+
+#define SLOTS		8192		// 32 KB of indices
+#define STEPS		200000
+
+int guest_main(int argc, char** argv) {
+	uint32_t* next = malloc(SLOTS * sizeof(uint32_t));
+	if (!next) {
+		printf("bench latency: out of memory\n");
+		return -1;
+	}
+
+	// Sattolo's shuffle gives a single cycle through every slot
+	for (uint32_t i = 0; i < SLOTS; i++) {
+		next[i] = i;
+	}
+	uint32_t seed = 42;
+	for (uint32_t i = SLOTS - 1; i > 0; i--) {
+		seed = seed * 1664525 + 1013904223;
+		uint32_t j = (seed >> 8) % i;
+		uint32_t t = next[i];
+		next[i] = next[j];
+		next[j] = t;
+	}
+
+	uint32_t p = 0;
+	uint32_t check = 0;
+	for (uint32_t s = 0; s < STEPS; s++) {
+		p = next[p];
+		check += p;
+	}
+
+	free(next);
+
+	printf("bench latency: check=%08x\n", check);
+	return 0;
+}
@@ -0,0 +1,34 @@
+#include "esp_guest.h"
+
+// Копирование памяти через экспортированные memcpy/memmove/memset
+
+#define BUF_SIZE	8192
+#define ROUNDS		64
+
+int guest_main(int argc, char** argv) {
+	uint8_t* src = malloc(BUF_SIZE);
+	uint8_t* dst = malloc(BUF_SIZE);
+	if (!src || !dst) {
+		printf("bench memcpy: out of memory\n");
+		return -1;
+	}
+
+	for (int i = 0; i < BUF_SIZE; i++) {
+		src[i] = i * 37;
+	}
+
+	uint32_t check = 0;
+	for (int r = 0; r < ROUNDS; r++) {
+		memcpy(dst, src, BUF_SIZE);
+		memmove(dst + 1, dst, BUF_SIZE - 1);			// overlapping
+		memcpy(dst + 3, src + 1, BUF_SIZE / 2);		// unaligned
+		memset(src + (r & 63), r, 64);
+		check = check * 33 + dst[(r * 97) % BUF_SIZE];
+	}
+
+	free(src);
+	free(dst);
+
+	printf("bench memcpy: check=%08x\n", check);
+	return 0;
+}
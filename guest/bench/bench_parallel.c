@@ -0,0 +1,50 @@
+#include "esp_guest.h"
+
+// Мандельброт по строкам через parallel_for. "run bench_parallel serial"
+// считает то же самое в одном потоке — для оценки ускорения на двух ядрах.
+
+#define MANDEL_W	96
+#define MANDEL_H	64
+#define MANDEL_ITER	96
+
+static uint32_t s_rows[MANDEL_H];
+
+static void mandel_rows(int begin, int end, void* ctx) {
+	for (int y = begin; y < end; y++) {
+		float ci = -1.0f + y * (2.0f / MANDEL_H);
+		uint32_t total = 0;
+		for (int x = 0; x < MANDEL_W; x++) {
+			float cr = -2.0f + x * (3.0f / MANDEL_W);
+			float zr = 0.0f;
+			float zi = 0.0f;
+			int n = 0;
+			while (n < MANDEL_ITER && zr * zr + zi * zi < 4.0f) {
+				float t = zr * zr - zi * zi + cr;
+				zi = 2.0f * zr * zi + ci;
+				zr = t;
+				n++;
+			}
+			total += n;
+		}
+		s_rows[y] = total;
+	}
+}
+
+int guest_main(int argc, char** argv) {
+	int serial = argc > 1 && strcmp(argv[1], "serial") == 0;
+
+	if (serial) {
+		mandel_rows(0, MANDEL_H, NULL);
+	} else if (parallel_for(0, MANDEL_H, 2, mandel_rows, NULL) != 0) {
+		printf("bench parallel: worker fault\n");
+		return 1;
+	}
+
+	uint32_t check = 0;
+	for (int y = 0; y < MANDEL_H; y++) {
+		check = check * 31 + s_rows[y];
+	}
+
+	printf("bench parallel: check=%08x\n", check);
+	return 0;
+}
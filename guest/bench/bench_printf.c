@@ -0,0 +1,16 @@
+#include "esp_guest.h"
+
+// Форматированный вывод через консоль гостя
+
+#define LINES 500
+
+int guest_main(int argc, char** argv) {
+	uint32_t check = 0;
+	for (int i = 0; i < LINES; i++) {
+		int len = printf("line %4d: %08x %-8s|%5d\n", i, i * 2654435761u, (i & 1) ? "odd" : "even", -i);
+		check = check * 31 + len;
+	}
+
+	printf("bench printf: check=%08x\n", check);
+	return 0;
+}
@@ -6,6 +6,8 @@
 typedef unsigned int size_t;
 typedef int int32_t;
 typedef unsigned int uint32_t;
+typedef long long int64_t;
+typedef unsigned long long uint64_t;
 typedef short int16_t;
 typedef unsigned short uint16_t;
 typedef signed char int8_t;
@@ -35,6 +37,13 @@ extern void* memset(void* dst, int c, size_t n);
 extern void* memmove(void* dst, const void* src, size_t n);
 extern int memcmp(const void* a, const void* b, size_t n);
 
+// Большие буферы: загрузчик положит такую секцию в PSRAM
+#define EXT_RAM_BSS_ATTR __attribute__((section(".ext_ram.bss")))
+
+// Горячий код: если IRAM не хватает, загрузчик положит его в RTC fast (4 КБ),
+// тогда модуль выполняется только на ядре 0
+#define HOT_ATTR __attribute__((section(".iram.hot")))
+
 /* ============== Строки ============== */
 
 extern size_t strlen(const char* s);
@@ -46,6 +55,134 @@ extern char* strcat(char* dst, const char* src);
 extern char* strchr(const char* s, int c);
 extern char* strstr(const char* haystack, const char* needle);
 
+/* ============== Файлы ============== */
+
+typedef struct __sFILE FILE;
+
+#define SEEK_SET 0
+#define SEEK_CUR 1
+#define SEEK_END 2
+
+extern FILE* fopen(const char* path, const char* mode);
+extern int fclose(FILE* f);
+extern size_t fread(void* dst, size_t size, size_t count, FILE* f);
+extern size_t fwrite(const void* src, size_t size, size_t count, FILE* f);
+extern int fseek(FILE* f, long offset, int whence);
+extern long ftell(FILE* f);
+extern char* fgets(char* buf, int size, FILE* f);
+
+/* ============== Каналы ============== */
+
+// Конвейер "a | b": запись и чтение прямо в буфере канала, без копирования.
+// acquire отдаёт непрерывный кусок (не больше want) и ждёт хотя бы байт;
+// NULL — читатель ушёл (запись) или конец потока (чтение).
+extern void* pipe_write_acquire(size_t want, size_t* got);
+extern void pipe_write_commit(size_t len);
+extern const void* pipe_read_acquire(size_t want, size_t* got);
+extern void pipe_read_release(size_t len);
+
+/* ============== Ресурсы ============== */
+
+// Файл из хранилища во флеше (команда store), отображённый в память без
+// копирования. Только чтение, живёт до выгрузки модуля. NULL, если нет.
+// Из прерываний (TIMER_ISR, gpio_isr_attach) читать нельзя.
+extern const void* asset_map(const char* name, size_t* size);
+
+/* ============== Задачи ============== */
+
+// Пул с одним потоком на ядро, свободные потоки крадут работу у занятых.
+// parallel_for режет [begin, end) на куски не длиннее grain (0 — сам
+// подберёт) и ждёт все; fn может вызываться на обоих ядрах одновременно.
+// Возвращают -1, если код в пуле упал. На каждый task_spawn — task_wait.
+typedef struct task task_t;
+
+extern int parallel_for(int begin, int end, int grain, void (*fn)(int begin, int end, void* ctx), void* ctx);
+extern task_t* task_spawn(void (*fn)(void* ctx), void* ctx);
+extern int task_wait(task_t* task);
+
+/* ============== Сопрограммы ============== */
+
+// Лёгкие потоки внутри одной задачи модуля: без TCB, стек (stack байт,
+// 0 — 1 КБ, не меньше 512) берётся из кучи модуля, переключение быстрее
+// микросекунды. Переключаются только сами — coro_yield, coro_sleep_us,
+// coro_wait. printf и прочее тяжёлое в маленьком стеке не звать.
+// coro_resume выполняет сопрограмму до yield или конца: 1 — ещё жива,
+// 0 — закончилась (тогда coro_free). coro_spawn отдаёт новую планировщику:
+// coro_run крутит все до конца, освобождает их сам и возвращает число
+// застрявших в coro_wait. События — обнулённая coro_event_t, только между
+// сопрограммами одной задачи; signal будит всех ждущих. В оверлейных
+// модулях не работают.
+typedef struct coro coro_t;
+typedef struct {
+	coro_t* waiters;
+	int set;
+} coro_event_t;
+
+extern coro_t* coro_create(void (*fn)(void* arg), void* arg, size_t stack);
+extern int coro_free(coro_t* co);
+extern int coro_resume(coro_t* co);
+extern void coro_yield(void);
+extern coro_t* coro_self(void);
+extern int coro_done(coro_t* co);
+extern int coro_spawn(void (*fn)(void* arg), void* arg, size_t stack);
+extern void coro_sleep_us(uint32_t us);
+extern int coro_wait(coro_event_t* ev);
+extern void coro_signal(coro_event_t* ev);
+extern int coro_run(void);
+
+/* ============== Таймеры и прерывания ============== */
+
+// Колбэк таймера вызывается из задачи esp_timer с точностью до микросекунд,
+// с TIMER_ISR — прямо из прерывания. Прерывания GPIO и TIMER_ISR требуют,
+// чтобы код и arg были во внутренней памяти (не PSRAM и не оверлей) и не
+// трогали malloc/printf. Всё снимается само при выгрузке модуля.
+// Возвращают id или -1.
+#define TIMER_ONESHOT	1
+#define TIMER_ISR		2
+
+#define GPIO_RISING		1
+#define GPIO_FALLING	2
+#define GPIO_ANY		3
+
+extern int timer_start(uint32_t period_us, void (*fn)(void* arg), void* arg, int flags);
+extern int timer_stop(int id);
+extern int gpio_isr_attach(int pin, int edge, void (*fn)(void* arg), void* arg);
+extern int gpio_isr_detach(int id);
+extern int64_t micros(void);
+
+/* ============== Замеры ============== */
+
+// Время участков кода в тактах (CCOUNT), копится в прошивке по каждому
+// модулю: число вызовов, сумма, минимум, максимум. Смотреть командой perf.
+// id от 0 до 15; вложенные участки с разными id можно, один id — нет.
+// Из прерываний не вызывать. cycles() — счётчик тактов текущего ядра.
+extern void perf_region_begin(int id);
+extern void perf_region_end(int id);
+extern void perf_region_name(int id, const char* name);
+extern uint32_t cycles(void);
+
+/* ============== DSP ============== */
+
+// Ядра esp-dsp на ассемблере с MAC16/FPU. Возвращают 0 или код ошибки.
+// FFT на месте над парами (re, im), n — степень двойки до 4096; после
+// него нужен dsps_bit_rev_fc32. Таблица строится при первом вызове.
+typedef struct {
+	uint32_t opaque[12];
+} fir_f32_t;
+
+extern int dsps_dotprod_f32(const float* a, const float* b, float* out, int len);
+extern int dsps_dotprod_s16(const int16_t* a, const int16_t* b, int16_t* out, int len, int8_t shift);
+extern int dsps_fir_init_f32(fir_f32_t* fir, float* coeffs, float* delay, int taps);
+extern int dsps_fir_f32(fir_f32_t* fir, const float* in, float* out, int len);
+extern int dsps_biquad_f32(const float* in, float* out, int len, float* coef, float* w);
+extern int dsps_biquad_gen_lpf_f32(float* coef, float f, float q);
+extern int dsps_biquad_gen_hpf_f32(float* coef, float f, float q);
+extern int dsps_fft2r_fc32(float* data, int n);
+extern int dsps_bit_rev_fc32(float* data, int n);
+extern int dsps_cplx2reC_fc32(float* data, int n);
+extern void dsps_wind_hann_f32(float* window, int len);
+extern int dspm_mult_f32(const float* a, const float* b, float* c, int m, int n, int k);
+
 /* ============== FreeRTOS ============== */
 
 extern void delay(uint32_t ms);
@@ -1,37 +1,165 @@
+import argparse
+import hashlib
+import os
+import struct
 import serial
 import time
 import sys
+import zlib
 
 # Настройки
 PORT = '/dev/ttyUSB0'
 BAUD = 115200
 FILE = 'guest.mod'
+BLOCK_SIZE = 256
+STRONG_SIZE = 8
+TIMEOUT = 30
+
+
+def weak_sum(block):
+    # rsync rolling checksum, same as delta_receiver.c
+    a = 0
+    b = 0
+    n = len(block)
+    for i, byte in enumerate(block):
+        a += byte
+        b += (n - i) * byte
+    return (a & 0xFFFF) | ((b & 0xFFFF) << 16)
+
+
+def wait_magic(ser, magic):
+    # Всё, что устройство печатает до ответа, показываем как есть
+    window = b''
+    deadline = time.time() + TIMEOUT
+    while time.time() < deadline:
+        c = ser.read(1)
+        if not c:
+            continue
+        window = (window + c)[-len(magic):]
+        if window == magic:
+            return True
+        if c not in magic:
+            sys.stdout.write(c.decode('utf-8', errors='ignore'))
+    return False
+
+
+def read_exact(ser, n):
+    data = b''
+    deadline = time.time() + TIMEOUT
+    while len(data) < n and time.time() < deadline:
+        data += ser.read(n - len(data))
+    if len(data) < n:
+        raise TimeoutError("device stopped answering")
+    return data
+
+
+def send_full(ser, data):
+    for byte in data:
+        ser.write(bytes([byte]))
+        time.sleep(0.001)
+
+
+def send_delta(ser, data, block_size):
+    blocks = [data[i:i + block_size] for i in range(0, len(data), block_size)]
+
+    header = b'DLT1' + struct.pack('<II', len(data), block_size) + hashlib.sha256(data).digest()
+    sums = b''.join(struct.pack('<I', weak_sum(b)) + hashlib.sha256(b).digest()[:STRONG_SIZE]
+                    for b in blocks)
+    ser.write(header + sums)
+
+    if not wait_magic(ser, b'DLTN'):
+        raise TimeoutError("no block request from device")
+    needed = struct.unpack('<I', read_exact(ser, 4))[0]
+    bitmap = read_exact(ser, (len(blocks) + 7) // 8)
+
+    sent = 0
+    for i, block in enumerate(blocks):
+        if bitmap[i // 8] & (1 << (i % 8)):
+            ser.write(block)
+            sent += len(block)
+
+    if not wait_magic(ser, b'DLTD'):
+        raise TimeoutError("no final status from device")
+    status = read_exact(ser, 1)[0]
+
+    wire = len(header) + len(sums) + sent
+    print(f"\n{len(blocks) - needed}/{len(blocks)} blocks reused, "
+          f"{wire} of {len(data)} bytes sent ({100 * wire // len(data)}%)")
+    if status != 0:
+        raise RuntimeError(f"device rejected the image (status {status})")
+
+
+def send_stream(ser, path):
+    # Файл читается кусками: он может быть больше, чем память устройства
+    size = os.path.getsize(path)
+    crc = 0
+    with open(path, 'rb') as f:
+        for chunk in iter(lambda: f.read(65536), b''):
+            crc = zlib.crc32(chunk, crc)
+
+    ser.write(b'RCV1' + struct.pack('<II', size, crc))
+    if not wait_magic(ser, b'RCVA'):
+        raise TimeoutError("device did not answer the stream header")
+    status = read_exact(ser, 1)[0]
+    buffer_size = struct.unpack('<I', read_exact(ser, 4))[0]
+    if status != 0:
+        raise RuntimeError(f"device refused the file (status {status})")
+
+    # Следующий кусок уходит только после разрешения (RCVK) от устройства
+    start = time.time()
+    sent = 0
+    with open(path, 'rb') as f:
+        while sent < size:
+            if not wait_magic(ser, b'RCVK'):
+                raise TimeoutError("device stopped granting buffers")
+            piece = f.read(buffer_size)
+            ser.write(piece)
+            sent += len(piece)
+            rate = sent / max(time.time() - start, 0.001) / 1024
+            print(f"\r{sent}/{size} bytes, {rate:.1f} KB/s", end='', flush=True)
+
+    if not wait_magic(ser, b'RCVD'):
+        raise TimeoutError("no final status from device")
+    status = read_exact(ser, 1)[0]
+    print()
+    if status != 0:
+        raise RuntimeError(f"device rejected the file (status {status})")
+
+
+parser = argparse.ArgumentParser(description="Send a module to ESP32-DOS")
+parser.add_argument('file', nargs='?', default=FILE)
+parser.add_argument('--port', default=PORT)
+parser.add_argument('--baud', type=int, default=BAUD)
+parser.add_argument('--delta', action='store_true',
+                    help="send only changed blocks (use the 'dload' command)")
+parser.add_argument('--block-size', type=int, default=BLOCK_SIZE)
+parser.add_argument('--stream', action='store_true',
+                    help="write the file straight to the SD card (use 'recv /sd/<path>')")
+args = parser.parse_args()
 
 try:
-    ser = serial.Serial(PORT, BAUD, timeout=0.1)
-    print(f"Waiting for ESP32 on {PORT}...")
+    ser = serial.Serial(args.port, args.baud, timeout=0.1)
+    print(f"Waiting for ESP32 on {args.port}...")
 
     # Пауза перед стартом
     time.sleep(0.1)
-    
-    # Читаем файл
-    with open(FILE, "rb") as f:
-        data = f.read()
 
-    print(f"Sending {len(data)} bytes...")
+    if args.stream:
+        print(f"Streaming {os.path.getsize(args.file)} bytes...")
+        send_stream(ser, args.file)
+    else:
+        # Читаем файл
+        with open(args.file, "rb") as f:
+            data = f.read()
 
-    for byte in data:
-        ser.write(bytes([byte])) 
-        time.sleep(0.001) 
+        print(f"Sending {len(data)} bytes{' as a delta' if args.delta else ''}...")
+
+        if args.delta:
+            send_delta(ser, data, args.block_size)
+        else:
+            send_full(ser, data)
 
     print("Done!")
-    
-    # print("Done. Listening for result...")
-    # 
-    # while True:
-    #     line = ser.readline().decode('utf-8', errors='ignore')
-    #     if line:
-    #         print(f"[ESP]: {line.strip()}")
 
 except KeyboardInterrupt:
     print("\nExiting...")
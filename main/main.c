@@ -1,24 +1,90 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "esp_rtc_time.h"
+#include "esp_cpu.h"
+#include "esp_rom_sys.h"
+#include "esp_attr.h"
+#include "esp_system.h"
 
 #include "uart_receiver.h"
+#include "delta_receiver.h"
+#include "stream_receiver.h"
 #include "elf_loader.h"
 #include "shell.h"
 #include "sdcard.h"
+#include "guest_runner.h"
+#include "guest_console.h"
+#include "guest_pipe.h"
+#include "task_pool.h"
+#include "guest_hooks.h"
+#include "guest_perf.h"
+#include "guest_coro.h"
+#include "hostfs.h"
+#include "flash_store.h"
+#include "trace.h"
+#include "rpc.h"
+#include "guest_string.h"
 
 #include <dirent.h>
 
+#define DOS_MAX_MODULES		4
+#define DOS_MAX_STAGES		4
+#define DOS_MAX_MARKS		8
+#define DOS_AUTOEXEC		"autoexec"
+#define DOS_AUTOEXEC_WAIT	0		// ms to press a key and skip it, 0 = only keys already typed
+#define DOS_AUTOEXEC_MAGIC	0x4155544F
+#define DOS_SOAK_SLOTS		4		// modules alive at once during 'soak'
+#define DOS_SOAK_FILES		8
+#define DOS_SOAK_WINDOW		100		// iterations per report line
+
+_Static_assert(GUEST_PERF_OWNERS >= DOS_MAX_MODULES + 1, "a perf table for every resident module and a loading one");
+
+typedef struct {
+	char name[16];
+	elf_module_t module;
+} resident_module_t;
+
 typedef struct {
 	uint8_t* loaded_data;
 	size_t loaded_size;
 	elf_module_t module;
+	elf_placement_t placement;
+	size_t flash_rodata;		// see elf_load_options_t, 0 = off
+	bool in_place;				// 'module' consumes the received file
+	bool keep_base;				// the file came from 'dload', keep it pristine for the next one
+	bool movable;				// keep fixups so 'defrag' can move the module
+	elf_hot_mode_t hot;			// where .iram.hot.* sections go
+	resident_module_t resident[DOS_MAX_MODULES];	// named modules, run by name
+	elf_image_t* image;			// shared code for 'inst'
 } dos_context_t;
 dos_context_t dos_context = {0};
 
+typedef struct {
+	const char* name;
+	int64_t us;					// since reset
+} boot_mark_t;
+
+static boot_mark_t boot_marks[DOS_MAX_MARKS];
+static int boot_mark_count = 0;
+static int64_t boot_offset = 0;	// esp_timer starts after the bootloader, the RTC timer at reset
+
+static void boot_mark(const char* name) {
+	if (boot_mark_count == 0) {
+		boot_offset = esp_rtc_get_time_us() - esp_timer_get_time();
+	}
+	if (boot_mark_count < DOS_MAX_MARKS) {
+		boot_marks[boot_mark_count].name = name;
+		boot_marks[boot_mark_count].us = esp_timer_get_time() + boot_offset;
+		boot_mark_count++;
+	}
+}
+
 static void dump_memory(const char* label, void* addr, size_t size) {
 	printf("%s at %p:\n", label, addr);
 	volatile uint32_t* p = (volatile uint32_t*)addr;
@@ -31,6 +97,7 @@ static void dump_memory(const char* label, void* addr, size_t size) {
 }
 
 void free_data() {
+	dos_context.keep_base = false;
 	if (dos_context.loaded_data) {
 		free(dos_context.loaded_data);
 		dos_context.loaded_data = NULL;
@@ -51,6 +118,41 @@ void load_data() {
 	}
 }
 
+void load_delta() {
+	delta_stats_t stats;
+	size_t size;
+	uint8_t* data = delta_receive_data(dos_context.loaded_data, dos_context.loaded_size, &size, &stats);
+	if (!data) {
+		return;
+	}
+
+	free_data();
+	dos_context.loaded_data = data;
+	dos_context.loaded_size = size;
+	dos_context.keep_base = true;
+	printf("Data loaded. Received %d bytes.\n", size);
+	printf("Delta: %lu of %lu blocks reused, %lu bytes sent, %lld ms\n",
+		   stats.blocks_reused, stats.block_count, stats.wire_bytes, stats.elapsed_us / 1000);
+}
+
+// Straight to the card, nothing of the file stays in RAM
+void recv_file(int argc, char** argv) {
+	if (argc < 2 || strncmp(argv[1], "/sd/", 4) != 0) {
+		printf("Usage: recv /sd/<path>\n");
+		return;
+	}
+	stream_stats_t stats;
+	if (stream_receive_file(argv[1], &stats) != 0) {
+		return;
+	}
+	uint32_t ms = stats.elapsed_us / 1000;
+	printf("Received %s: %lu bytes in %lu ms (%lu KB/s)\n", argv[1], stats.size, ms,
+		   ms ? stats.size / ms * 1000 / 1024 : 0);
+	printf("%lu x %lu byte buffers, cluster %lu, %s, card busy %lld ms, %lu waits for the card\n",
+		   stats.buffers, stats.buffer_size, stats.cluster_size,
+		   stats.preallocated ? "preallocated" : "not contiguous", stats.write_us / 1000, stats.receive_stalls);
+}
+
 void read_data(int argc, char** argv) {
 	free_data();
 	esp_err_t err = sdcard_read_file(argv[1], &dos_context.loaded_data, &dos_context.loaded_size);
@@ -61,6 +163,9 @@ void read_data(int argc, char** argv) {
 
 void ls(int argc, char** argv) {
 	const char* path = (argc > 1) ? argv[1] : "/sd";
+	if (strncmp(path, "/sd", 3) == 0) {
+		sdcard_ensure();
+	}
 
 	DIR* dir = opendir(path);
 	if (!dir) {
@@ -81,25 +186,850 @@ void unload_module() {
 	printf("Module unloaded.\n");
 }
 
-void load_module() {
+static resident_module_t* find_resident(const char* name) {
+	for (int i = 0; i < DOS_MAX_MODULES; i++) {
+		resident_module_t* r = &dos_context.resident[i];
+		if (r->module.entry_point && strcmp(r->name, name) == 0) return r;
+	}
+	return NULL;
+}
+
+static elf_module_t* find_module(const char* name) {
+	resident_module_t* r = find_resident(name);
+	return r ? &r->module : NULL;
+}
+
+static resident_module_t* resident_slot(const char* name) {
+	resident_module_t* r = find_resident(name);
+	if (r) return r;
+	for (int i = 0; i < DOS_MAX_MODULES; i++) {
+		r = &dos_context.resident[i];
+		if (!r->module.entry_point) {
+			snprintf(r->name, sizeof(r->name), "%s", name);
+			return r;
+		}
+	}
+	return NULL;
+}
+
+static void print_module(const char* name, const elf_module_t* module) {
+	printf("\n");
+	printf("=== Module loaded: %s ===\n", name);
+	printf("Text: %p (%d bytes%s)\n", module->text_mem, module->text_size, module->image ? ", from image" : "");
+	printf("Data: %p (%d bytes)\n", module->data_mem, module->data_size);
+	if (module->psram_mem) {
+		printf("PSRAM: %p (%d bytes)\n", module->psram_mem, module->psram_size);
+	}
+	if (module->rodata_mem) {
+		printf("Read-only: %p (%d bytes%s)\n", module->rodata_mem, module->rodata_size,
+			   elf_image_shares_rodata(module) ? ", shared" : "");
+	}
+	if (module->file_mem) {
+		printf("In place: %p (%d bytes)\n", module->file_mem, module->file_size);
+	}
+	if (module->rtc_mem) {
+		printf("RTC fast: %p (%d bytes, runs on core 0 only)\n", module->rtc_mem, module->rtc_size);
+	}
+	if (module->movable) {
+		printf("Movable: %lu fixups\n", module->fixup_count);
+	}
+	printf("Entry: %p\n", module->entry_point);
+	if (module->overlay) {
+		printf("Overlays: %p is the window\n", module->text_mem);
+	}
+	printf("\n");
+	for (size_t i = 0; i < module->section_count; i++) {
+		const elf_section_info_t* sec = &module->sections[i];
+		printf("  %-24s 0x%08lx %6lu  %s\n", sec->name, sec->addr, sec->size, elf_region_name(sec->region));
+	}
+	printf("\n");
+}
+
+// Relocation patches the image in place; keep the received one pristine for 'dload'
+static uint8_t* copy_loaded(void) {
+	uint8_t* copy = malloc(dos_context.loaded_size);
+	if (!copy) {
+		copy = heap_caps_malloc(dos_context.loaded_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+	}
+	if (!copy) {
+		printf("Error: Failed to allocate buffer.\n");
+		return NULL;
+	}
+	memcpy(copy, dos_context.loaded_data, dos_context.loaded_size);
+	return copy;
+}
+
+// Replaces `module` with the received data; the old one stays if that fails
+static int load_loaded(elf_module_t* module, const char* name) {
+	// Only a delta base is worth a second copy of the file, otherwise it is relocated as is
+	bool copy = !dos_context.in_place && dos_context.keep_base;
+	uint8_t* image = copy ? copy_loaded() : dos_context.loaded_data;
+	size_t size = dos_context.loaded_size;
+	if (!image) return ELF_ERR_NO_MEMORY;
+	if (dos_context.in_place) {
+		dos_context.loaded_data = NULL;
+		dos_context.loaded_size = 0;
+	}
+
+	char backing[32];
+	snprintf(backing, sizeof(backing), "/sd/.overlay-%s", name);
+	// The old module pages from its file until the new one is in
+	if (module->overlay && elf_overlay_uses_backing(module->overlay, backing)) {
+		strcat(backing, "~");
+	}
+
+	elf_load_options_t opts = {
+		.heap_size = ELF_ARENA_DEFAULT_SIZE,
+		.heap_grow = ELF_ARENA_GROW_SIZE,
+		.placement = dos_context.placement,
+		.overlay = ELF_OVERLAY_AUTO,
+		.overlay_backing = sdcard_is_mounted() ? backing : NULL,
+		.flash_rodata = dos_context.flash_rodata,
+		.in_place = dos_context.in_place,
+		.movable = dos_context.movable,
+		.hot = dos_context.hot,
+	};
+	elf_module_t loaded;
+	int err = elf_load_ex(image, size, &opts, &loaded);
+	if (copy) free(image);
+	if (err != ELF_OK) return err;
+
+	elf_unload(module);
+	*module = loaded;
+	return ELF_OK;
+}
+
+void load_module(int argc, char** argv) {
 	if (!dos_context.loaded_size) {
 		printf("Error: No loaded module.\n");
 		return;
 	}
-	elf_unload(&dos_context.module);
 
-	int err = elf_load(dos_context.loaded_data, dos_context.loaded_size, &dos_context.module);
+	// "module <name>" keeps it resident next to the default one
+	elf_module_t* module = &dos_context.module;
+	const char* name = "main";
+	if (argc > 1) {
+		resident_module_t* r = resident_slot(argv[1]);
+		if (!r) {
+			printf("Error: All %d module slots are in use.\n", DOS_MAX_MODULES);
+			return;
+		}
+		module = &r->module;
+		name = r->name;
+	}
+
+	int err = load_loaded(module, name);
 	if (err != ELF_OK) {
 		printf("Error loading ELF: %s\n", elf_strerror(err));
 		return;
 	}
 
-	printf("\n");
-	printf("=== Module loaded ===\n");
-	printf("Text: %p (%d bytes)\n", dos_context.module.text_mem, dos_context.module.text_size);
-	printf("Data: %p (%d bytes)\n", dos_context.module.data_mem, dos_context.module.data_size);
-	printf("Entry: %p\n", dos_context.module.entry_point);
-	printf("\n");
+	print_module(name, module);
+}
+
+void build_image() {
+	if (!dos_context.loaded_size) {
+		printf("Error: No loaded module.\n");
+		return;
+	}
+	uint8_t* copy = copy_loaded();
+	if (!copy) return;
+
+	elf_load_options_t opts = {
+		.heap_size = ELF_ARENA_DEFAULT_SIZE,
+		.heap_grow = ELF_ARENA_GROW_SIZE,
+		.placement = dos_context.placement,
+	};
+	elf_image_t* image;
+	int err = elf_image_load(copy, dos_context.loaded_size, &opts, &image);
+	free(copy);
+	if (err != ELF_OK) {
+		printf("Error loading ELF: %s\n", elf_strerror(err));
+		return;
+	}
+
+	// Instances of the old image keep it alive until they are unloaded
+	elf_image_release(dos_context.image);
+	dos_context.image = image;
+
+	elf_image_info_t info;
+	elf_image_get_info(image, &info);
+	printf("Image ready: %d bytes text (%s), %d bytes data per instance\n", info.text_size,
+		   info.text_shared ? "shared" : "copied per instance, it references .data", info.data_size);
+	if (info.rodata_size) {
+		printf("Read-only data: %d bytes (%s)\n", info.rodata_size,
+			   info.rodata_shared ? "shared" : "copied per instance, it references .data");
+	}
+	printf("Template: %d bytes, %lu fixups\n", info.template_size, info.fixup_count);
+}
+
+void instantiate(int argc, char** argv) {
+	if (argc < 2) {
+		printf("Usage: inst <name>\n");
+		return;
+	}
+	if (!dos_context.image) {
+		printf("Error: No image, use 'image' first.\n");
+		return;
+	}
+	resident_module_t* r = resident_slot(argv[1]);
+	if (!r) {
+		printf("Error: All %d module slots are in use.\n", DOS_MAX_MODULES);
+		return;
+	}
+	elf_unload(&r->module);
+
+	int64_t start = esp_timer_get_time();
+	int err = elf_image_instantiate(dos_context.image, &r->module);
+	int64_t elapsed = esp_timer_get_time() - start;
+	if (err != ELF_OK) {
+		printf("Error: %s\n", elf_strerror(err));
+		return;
+	}
+
+	print_module(r->name, &r->module);
+	printf("Instance ready in %lld us\n", elapsed);
+}
+
+void set_placement(int argc, char** argv) {
+	if (argc > 1) {
+		if (strcmp(argv[1], "auto") == 0) {
+			dos_context.placement = ELF_PLACE_AUTO;
+		} else if (strcmp(argv[1], "internal") == 0) {
+			dos_context.placement = ELF_PLACE_INTERNAL;
+		} else if (strcmp(argv[1], "psram") == 0) {
+			dos_context.placement = ELF_PLACE_PSRAM;
+		} else if (strcmp(argv[1], "flash") == 0 && argc > 2) {
+			// Read-only data at least this big is mapped from the flash store
+			dos_context.flash_rodata = strcmp(argv[2], "off") == 0 ? 0 : atoi(argv[2]);
+		} else if (strcmp(argv[1], "inplace") == 0 && argc > 2) {
+			dos_context.in_place = strcmp(argv[2], "on") == 0;
+		} else if (strcmp(argv[1], "movable") == 0 && argc > 2) {
+			dos_context.movable = strcmp(argv[2], "on") == 0;
+		} else if (strcmp(argv[1], "hot") == 0 && argc > 2 && strcmp(argv[2], "auto") == 0) {
+			dos_context.hot = ELF_HOT_AUTO;
+		} else if (strcmp(argv[1], "hot") == 0 && argc > 2 && strcmp(argv[2], "off") == 0) {
+			dos_context.hot = ELF_HOT_OFF;
+		} else if (strcmp(argv[1], "hot") == 0 && argc > 2 && strcmp(argv[2], "rtc") == 0) {
+			dos_context.hot = ELF_HOT_RTC;
+		} else {
+			printf("Usage: place [auto|internal|psram|flash <bytes>|flash off|inplace on|off|movable on|off|hot auto|off|rtc]\n");
+			return;
+		}
+	}
+
+	static const char* names[] = { "auto", "internal", "psram" };
+	printf("Placement: %s, free internal: %u, free PSRAM: %u\n", names[dos_context.placement],
+		   heap_caps_get_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT),
+		   heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+	if (dos_context.flash_rodata) {
+		printf("Read-only data from %u bytes up goes to flash.\n", dos_context.flash_rodata);
+	}
+	if (dos_context.in_place) {
+		printf("Data stays in the received file, which 'module' uses up.\n");
+	}
+	if (dos_context.movable) {
+		printf("Modules keep their fixups for 'defrag'.\n");
+	}
+	static const char* hot_names[] = { "IRAM, RTC fast when IRAM is short", "IRAM", "RTC fast" };
+	size_t rtc_used, rtc_total;
+	elf_rtc_get_usage(&rtc_used, &rtc_total);
+	printf("Hot code: %s, RTC fast used: %u of %u\n", hot_names[dos_context.hot], rtc_used, rtc_total);
+	printf("Applies to the next 'module'.\n");
+}
+
+void list_modules() {
+	if (dos_context.module.entry_point) {
+		printf("  %-16s %6d bytes text, %6d bytes data (default)\n", "main",
+			   dos_context.module.text_size, dos_context.module.data_size + dos_context.module.psram_size);
+	}
+	for (int i = 0; i < DOS_MAX_MODULES; i++) {
+		resident_module_t* r = &dos_context.resident[i];
+		if (!r->module.entry_point) continue;
+		printf("  %-16s %6d bytes text, %6d bytes data%s\n", r->name,
+			   r->module.text_size, r->module.data_size + r->module.psram_size,
+			   elf_image_shares_text(&r->module) ? " (shared text)" : "");
+	}
+}
+
+void unload_resident(int argc, char** argv) {
+	resident_module_t* r = argc > 1 ? find_resident(argv[1]) : NULL;
+	if (!r) {
+		printf("Usage: unload <name>\n");
+		return;
+	}
+	elf_unload(&r->module);
+	printf("Module %s unloaded.\n", argv[1]);
+}
+
+void heap_stats() {
+	if (!dos_context.module.arena) {
+		printf("Error: Module not loaded.\n");
+		return;
+	}
+	elf_arena_print_stats(dos_context.module.arena);
+}
+
+void overlay_stats() {
+	if (!dos_context.module.overlay) {
+		printf("Error: Module has no overlays.\n");
+		return;
+	}
+
+	elf_overlay_stats_t stats;
+	elf_overlay_get_stats(dos_context.module.overlay, &stats);
+	printf("Groups: %lu, resident: %lu, slots: %lu x %lu bytes\n",
+		   stats.group_count, stats.resident_groups, stats.slot_count, stats.slot_size);
+	printf("Stubs: %lu, backing store: %lu bytes\n", stats.stub_count, stats.backing_size);
+	printf("Hits: %lu, misses: %lu, evictions: %lu\n", stats.hits, stats.misses, stats.evictions);
+	printf("Loaded: %lu bytes in %lld us\n", stats.bytes_loaded, stats.load_us);
+}
+
+void pool_stats() {
+	task_pool_stats_t stats;
+	task_pool_get_stats(&stats);
+	if (!stats.workers) {
+		printf("Task pool not started.\n");
+		return;
+	}
+	printf("Workers: %d, injected: %lu, ran inline: %lu\n", stats.workers, stats.injected, stats.inline_runs);
+	for (int i = 0; i < stats.workers; i++) {
+		task_worker_stats_t* w = &stats.worker[i];
+		printf("  core %d: %lu items, %lu stolen, %lu sleeps", i, w->executed, w->stolen, w->sleeps);
+		if (w->faults) {
+			printf(", %lu faults (last: cause %lu at 0x%08lx)", w->faults, w->fault_cause, w->fault_pc);
+		}
+		printf("\n");
+	}
+}
+
+static const char* module_name(const void* module) {
+	if (module == &dos_context.module) return "main";
+	for (int i = 0; i < DOS_MAX_MODULES; i++) {
+		if (module == &dos_context.resident[i].module) return dos_context.resident[i].name;
+	}
+	return "?";
+}
+
+void hook_stats() {
+	static guest_hook_info_t hooks[GUEST_HOOKS_MAX];	// off the main task's stack, the shell is single-threaded
+	int count = guest_hooks_list(hooks, GUEST_HOOKS_MAX);
+	if (!count) {
+		printf("No hooks.\n");
+		return;
+	}
+	for (int i = 0; i < count; i++) {
+		guest_hook_info_t* h = &hooks[i];
+		if (h->type == HOOK_TIMER) {
+			printf("  %-16s timer %lu us%s%s, %lu calls, max %lld us late\n", module_name(h->owner), h->period_us,
+				   (h->flags & HOOK_TIMER_ONESHOT) ? " once" : "", (h->flags & HOOK_TIMER_ISR) ? " (isr)" : "",
+				   h->calls, h->max_late_us);
+		} else {
+			printf("  %-16s gpio %d, %lu calls\n", module_name(h->owner), h->pin, h->calls);
+		}
+	}
+}
+
+static int print_perf(const char* name, const void* module) {
+	static guest_perf_region_t regions[GUEST_PERF_REGIONS];	// off the main task's stack
+	int count = guest_perf_get(module, regions, GUEST_PERF_REGIONS);
+	guest_coro_stats_t coro;
+	guest_coro_get_stats(module, &coro);
+	if (!count && !coro.switches) return 0;
+
+	printf("%s:\n", name);
+	if (coro.switches) {
+		printf("  coroutines: %lu live, %lu waiting, %lu switches, %lu overflows\n",
+			   coro.live, coro.waiting, coro.switches, coro.overflows);
+	}
+	if (!count) return 1;
+
+	uint32_t mhz = esp_rom_get_cpu_ticks_per_us();
+	bool counters = guest_perf_counters_enabled();
+	printf("  %-12s %8s %12s %10s %10s %10s", "region", "count", "total us", "avg", "min", "max");
+	for (int c = 0; counters && c < GUEST_PERF_COUNTERS; c++) {
+		printf(" %10s", guest_perf_counter_name(c));
+	}
+	printf("  (cycles, counters per call)\n");
+
+	for (int i = 0; i < count; i++) {
+		guest_perf_region_t* r = &regions[i];
+		char label[16];
+		if (r->name[0]) {
+			snprintf(label, sizeof(label), "%s", r->name);
+		} else {
+			snprintf(label, sizeof(label), "#%d", r->id);
+		}
+		printf("  %-12s %8lu %12llu %10llu %10lu %10lu", label, r->count, r->cycles / mhz,
+			   r->cycles / r->count, r->min, r->max);
+		for (int c = 0; counters && c < GUEST_PERF_COUNTERS; c++) {
+			printf(" %10llu", r->counters[c] / r->count);
+		}
+		printf("\n");
+	}
+	return count;
+}
+
+void perf_command(int argc, char** argv) {
+	if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+		guest_perf_reset(&dos_context.module);
+		for (int i = 0; i < DOS_MAX_MODULES; i++) {
+			guest_perf_reset(&dos_context.resident[i].module);
+		}
+		printf("Regions cleared.\n");
+		return;
+	}
+	if (argc > 2 && strcmp(argv[1], "counters") == 0) {
+		bool on = guest_perf_counters(strcmp(argv[2], "on") == 0);
+		printf("Performance counters %s.\n", on ? "on" : "off");
+		return;
+	}
+	if (argc > 1) {
+		printf("Usage: perf [reset|counters on|off]\n");
+		return;
+	}
+
+	int shown = print_perf("main", &dos_context.module);
+	for (int i = 0; i < DOS_MAX_MODULES; i++) {
+		if (dos_context.resident[i].module.entry_point) {
+			shown += print_perf(dos_context.resident[i].name, &dos_context.resident[i].module);
+		}
+	}
+	if (!shown) {
+		printf("No regions recorded.\n");
+	}
+}
+
+void defrag_command() {
+	elf_module_t* modules[DOS_MAX_MODULES + 1];
+	int count = 0;
+	if (dos_context.module.entry_point) modules[count++] = &dos_context.module;
+	for (int i = 0; i < DOS_MAX_MODULES; i++) {
+		if (dos_context.resident[i].module.entry_point) modules[count++] = &dos_context.resident[i].module;
+	}
+
+	for (int i = 0; i < count; i++) {
+		const char* pinned = elf_module_pinned(modules[i]);
+		if (pinned) {
+			printf("  %-16s stays: %s\n", module_name(modules[i]), pinned);
+		}
+	}
+
+	elf_defrag_result_t result;
+	int err = elf_defrag(modules, count, &result);
+	if (err != ELF_OK) {
+		printf("Error: %s\n", elf_strerror(err));
+		return;
+	}
+
+	printf("Moved %d module(s)%s\n", result.moved, result.data_packed ? "" : ", IRAM only (no PSRAM for copies)");
+	printf("Largest IRAM block: %u -> %u\n", result.iram_largest_before, result.iram_largest_after);
+	printf("Largest DRAM block: %u -> %u\n", result.dram_largest_before, result.dram_largest_after);
+}
+
+void console_settings(int argc, char** argv) {
+	if (argc > 1) {
+		if (strcmp(argv[1], "block") == 0) {
+			guest_console_set_policy(CONSOLE_FULL_BLOCK);
+		} else if (strcmp(argv[1], "drop") == 0) {
+			guest_console_set_policy(CONSOLE_FULL_DROP);
+		} else if (strcmp(argv[1], "count") == 0) {
+			guest_console_set_policy(CONSOLE_FULL_COUNT);
+		} else {
+			printf("Usage: console [block|drop|count]\n");
+			return;
+		}
+	}
+
+	console_stats_t stats;
+	guest_console_get_stats(&stats);
+	printf("Policy: %s, baud: %lu\n", guest_console_policy_name(stats.policy), stats.baud_rate);
+	printf("Written: %lu, dropped: %lu, blocked: %lu\n",
+		   stats.bytes_written, stats.bytes_dropped, stats.blocked_count);
+	printf("Buffered: %lu/%d, high water: %lu\n", stats.buffered, CONSOLE_BUFFER_SIZE, stats.high_water);
+}
+
+void set_baud(int argc, char** argv) {
+	if (argc < 2) {
+		printf("Usage: baud <rate>\n");
+		return;
+	}
+	uint32_t baud = strtoul(argv[1], NULL, 10);
+	if (baud < 1200 || guest_console_set_baud(baud) != 0) {
+		printf("Error: Invalid baud rate.\n");
+		return;
+	}
+	printf("Baud rate set to %lu\n", baud);
+}
+
+void store_files(int argc, char** argv) {
+	if (argc > 2 && strcmp(argv[1], "rm") == 0) {
+		esp_err_t err = flash_store_remove(argv[2]);
+		if (err != ESP_OK) {
+			printf("Error: %s\n", esp_err_to_name(err));
+		}
+		return;
+	}
+
+	if (argc > 1) {
+		if (!dos_context.loaded_data) {
+			printf("Error: No data loaded.\n");
+			return;
+		}
+		esp_err_t err = flash_store_write(argv[1], dos_context.loaded_data, dos_context.loaded_size);
+		if (err != ESP_OK) {
+			printf("Error: %s\n", esp_err_to_name(err));
+			return;
+		}
+		printf("Stored %s (%d bytes).\n", argv[1], dos_context.loaded_size);
+		return;
+	}
+
+	static flash_store_file_t files[FLASH_STORE_MAX_FILES];	// off the main task's stack
+	int count = flash_store_list(files, FLASH_STORE_MAX_FILES);
+	for (int i = 0; i < count; i++) {
+		printf(" %-24s %8lu bytes\n", files[i].name, files[i].size);
+	}
+	size_t used, total;
+	flash_store_usage(&used, &total);
+	printf("%d files, %u of %u KB used\n", count, used / 1024, total / 1024);
+}
+
+void fload_data(int argc, char** argv) {
+	if (argc < 2) {
+		printf("Usage: fload <name>\n");
+		return;
+	}
+
+	free_data();
+	esp_err_t err = flash_store_read(argv[1], &dos_context.loaded_data, &dos_context.loaded_size);
+	if (err != ESP_OK) {
+		printf("Error: %s\n", esp_err_to_name(err));
+		return;
+	}
+	printf("Data loaded. Read %d bytes.\n", dos_context.loaded_size);
+}
+
+// Stored as one line of commands separated by ';'
+void autoexec_settings(int argc, char** argv) {
+	if (argc == 2 && strcmp(argv[1], "off") == 0) {
+		flash_store_remove(DOS_AUTOEXEC);
+		printf("Autoexec off.\n");
+		return;
+	}
+
+	if (argc > 1) {
+		char script[128] = "";
+		for (int i = 1; i < argc; i++) {
+			if (i > 1) strlcat(script, " ", sizeof(script));
+			strlcat(script, argv[i], sizeof(script));
+		}
+		esp_err_t err = flash_store_write(DOS_AUTOEXEC, script, strlen(script));
+		if (err != ESP_OK) {
+			printf("Error: %s\n", esp_err_to_name(err));
+		}
+		return;
+	}
+
+	uint8_t* script;
+	size_t size;
+	if (flash_store_read(DOS_AUTOEXEC, &script, &size) != ESP_OK) {
+		printf("Autoexec: off\n");
+		return;
+	}
+	printf("Autoexec: %.*s\n", (int)size, (char*)script);
+	free(script);
+}
+
+void trace_command(int argc, char** argv) {
+	if (argc > 1) {
+		if (strcmp(argv[1], "on") == 0) {
+			trace_enable(true);
+		} else if (strcmp(argv[1], "off") == 0) {
+			trace_enable(false);
+		} else if (strcmp(argv[1], "clear") == 0) {
+			trace_clear();
+		} else if (strcmp(argv[1], "dump") == 0) {
+			trace_dump();
+			return;
+		} else {
+			printf("Usage: trace [on|off|clear|dump]\n");
+			return;
+		}
+	}
+
+	trace_stats_t stats;
+	trace_get_stats(&stats);
+	printf("Tracing: %s\n", stats.enabled ? "on" : "off");
+	for (int core = 0; core < portNUM_PROCESSORS; core++) {
+		printf("Core %d: %lu events, %lu overwritten\n", core, stats.events[core], stats.lost[core]);
+	}
+}
+
+static size_t rpc_upload_cap = 0;
+
+// {"offset": n, "data": base64, "size": total}, chunks in order from offset 0
+static const char* rpc_upload(const rpc_request_t* req) {
+	const rpc_value_t* data = rpc_param(req, "data", RPC_STRING);
+	int32_t offset = rpc_param_int(req, "offset", 0);
+	if (!data) return "missing data";
+
+	if (offset == 0) {
+		free(dos_context.loaded_data);
+		dos_context.loaded_data = NULL;
+		dos_context.loaded_size = 0;
+		dos_context.keep_base = false;
+		rpc_upload_cap = 0;
+	}
+	if (offset != (int32_t)dos_context.loaded_size) return "offset mismatch";
+
+	size_t need = dos_context.loaded_size + data->length * 3 / 4;
+	if (need > rpc_upload_cap) {
+		size_t cap = rpc_param_int(req, "size", 0);
+		if (cap < need) cap = need;
+		uint8_t* grown = realloc(dos_context.loaded_data, cap);
+		if (!grown) return "out of memory";
+		dos_context.loaded_data = grown;
+		rpc_upload_cap = cap;
+	}
+
+	dos_context.loaded_size += rpc_base64_decode(data->string, data->length,
+												 dos_context.loaded_data + dos_context.loaded_size);
+	rpc_reply_int("size", dos_context.loaded_size);
+	return NULL;
+}
+
+static const char* rpc_load(const rpc_request_t* req) {
+	const char* name = rpc_param_str(req, "name");
+	if (!name) return "missing name";
+	if (!dos_context.loaded_size) return "nothing uploaded";
+
+	resident_module_t* r = resident_slot(name);
+	if (!r) return "all module slots are in use";
+
+	int64_t start = esp_timer_get_time();
+	int err = load_loaded(&r->module, r->name);
+	if (err != ELF_OK) return elf_strerror(err);
+
+	rpc_reply_int("text", r->module.text_size);
+	rpc_reply_int("data", r->module.data_size + r->module.psram_size);
+	rpc_reply_int("us", esp_timer_get_time() - start);
+	return NULL;
+}
+
+static void rpc_reply_output(void) {
+	char* buf = malloc(CONSOLE_BUFFER_SIZE);
+	if (!buf) return;
+	size_t len = guest_console_read(buf, CONSOLE_BUFFER_SIZE);
+	rpc_reply_bytes("output", buf, len);
+	free(buf);
+}
+
+// {"name": module, "args": [...]}; the guest's output comes back with the result
+static const char* rpc_run(const rpc_request_t* req) {
+	const char* name = rpc_param_str(req, "name");
+	elf_module_t* module = name ? find_module(name) : NULL;
+	if (!module) return "no such module";
+
+	char* argv[SHELL_MAX_ARGS];
+	int argc = 0;
+	argv[argc++] = (char*)name;
+	const rpc_value_t* args = rpc_param(req, "args", RPC_ARRAY);
+	for (int i = 0; args && i < args->count && argc < SHELL_MAX_ARGS - 1; i++) {
+		argv[argc++] = args->items[i];
+	}
+	argv[argc] = NULL;
+
+	console_stats_t before, after;
+	guest_console_get_stats(&before);
+
+	guest_result_t result;
+	int err = guest_run(module, argc, argv, NULL, &result);
+	if (err != GUEST_OK && err != GUEST_ERR_FAULT) return "failed to start";
+
+	guest_console_get_stats(&after);
+	rpc_reply_output();
+	rpc_reply_int("dropped", after.bytes_dropped - before.bytes_dropped);
+
+	if (err == GUEST_ERR_FAULT) {
+		rpc_reply_bool("fault", true);
+		rpc_reply_int("cause", result.fault_cause);
+		rpc_reply_int("pc", result.fault_pc);
+		elf_unload(module);
+		return NULL;
+	}
+	rpc_reply_int("code", result.exit_code);
+	rpc_reply_int("us", result.elapsed_us);
+	return NULL;
+}
+
+static const char* rpc_output(const rpc_request_t* req) {
+	rpc_reply_output();
+	return NULL;
+}
+
+static const char* rpc_unload(const rpc_request_t* req) {
+	const char* name = rpc_param_str(req, "name");
+	resident_module_t* r = name ? find_resident(name) : NULL;
+	if (!r) return "no such module";
+	elf_unload(&r->module);
+	return NULL;
+}
+
+static const char* rpc_stats(const rpc_request_t* req) {
+	console_stats_t console;
+	guest_console_get_stats(&console);
+
+	int modules = 0;
+	for (int i = 0; i < DOS_MAX_MODULES; i++) {
+		if (dos_context.resident[i].module.entry_point) modules++;
+	}
+
+	rpc_reply_int("uptime_us", esp_timer_get_time());
+	rpc_reply_int("free_iram", heap_caps_get_free_size(MALLOC_CAP_EXEC));
+	rpc_reply_int("free_dram", heap_caps_get_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT));
+	rpc_reply_int("free_psram", heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+	rpc_reply_int("largest_dram", heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT));
+	rpc_reply_int("modules", modules);
+	rpc_reply_int("console_written", console.bytes_written);
+	rpc_reply_int("console_dropped", console.bytes_dropped);
+	return NULL;
+}
+
+static const rpc_method_t rpc_methods[] = {
+	{ "upload",	rpc_upload },
+	{ "load",	rpc_load },
+	{ "run",	rpc_run },
+	{ "output",	rpc_output },
+	{ "unload",	rpc_unload },
+	{ "stats",	rpc_stats },
+};
+
+// Framed requests for test rigs instead of the echoing prompt, 'exit' leaves
+void rpc_mode() {
+	guest_console_capture(true);
+	rpc_serve(rpc_methods, sizeof(rpc_methods) / sizeof(rpc_methods[0]));
+	guest_console_capture(false);
+	printf("RPC mode off.\n");
+}
+
+void boot_timeline() {
+	int64_t prev = 0;
+	for (int i = 0; i < boot_mark_count; i++) {
+		printf(" %-12s %8lld us  (+%lld)\n", boot_marks[i].name, boot_marks[i].us, boot_marks[i].us - prev);
+		prev = boot_marks[i].us;
+	}
+	printf("SD card: %s\n", sdcard_is_mounted() ? "mounted" : "not mounted");
+}
+
+void hostfs_info() {
+	hostfs_stats_t stats;
+	hostfs_get_stats(&stats);
+	printf("Requests: %lu, timeouts: %lu\n", stats.requests, stats.timeouts);
+	printf("Cache hits: %lu, misses: %lu\n", stats.cache_hits, stats.cache_misses);
+	printf("Fetched: %lu bytes, read: %lu bytes\n", stats.bytes_fetched, stats.bytes_read);
+}
+
+typedef enum { BENCH_COPY, BENCH_SET, BENCH_CMP, BENCH_LEN, BENCH_STRCMP, BENCH_CHR } bench_kind_t;
+
+typedef struct {
+	const char* name;
+	bench_kind_t kind;
+	void* lib;					// what guests used to bind to
+	void* iram;
+} bench_fn_t;
+
+static const bench_fn_t bench_fns[] = {
+	{"memcpy",	BENCH_COPY,		(void*)&memcpy,		(void*)&guest_memcpy},
+	{"memmove",	BENCH_COPY,		(void*)&memmove,	(void*)&guest_memmove},
+	{"memset",	BENCH_SET,		(void*)&memset,		(void*)&guest_memset},
+	{"memcmp",	BENCH_CMP,		(void*)&memcmp,		(void*)&guest_memcmp},
+	{"strlen",	BENCH_LEN,		(void*)&strlen,		(void*)&guest_strlen},
+	{"strcmp",	BENCH_STRCMP,	(void*)&strcmp,		(void*)&guest_strcmp},
+	{"strchr",	BENCH_CHR,		(void*)&strchr,		(void*)&guest_strchr},
+};
+
+static const size_t bench_sizes[] = {8, 32, 128, 512, 2048};
+static const int bench_aligns[][2] = {{0, 0}, {1, 0}, {0, 3}, {2, 2}};	// src, dst
+
+// Cycles per call, best of three; calls go through a pointer like a guest's do
+static uint32_t bench_time(const bench_fn_t* f, void* fn, uint8_t* dst, uint8_t* src, size_t n) {
+	int iters = n >= 1024 ? 16 : 16384 / n;
+	uint32_t best = UINT32_MAX;
+	for (int run = 0; run < 3; run++) {
+		uint32_t start = esp_cpu_get_cycle_count();
+		for (int i = 0; i < iters; i++) {
+			switch (f->kind) {
+				case BENCH_COPY:	((void* (*)(void*, const void*, size_t))fn)(dst, src, n); break;
+				case BENCH_SET:		((void* (*)(void*, int, size_t))fn)(dst, 0x5A, n); break;
+				case BENCH_CMP:		((int (*)(const void*, const void*, size_t))fn)(dst, src, n); break;
+				case BENCH_LEN:		((size_t (*)(const char*))fn)((const char*)src); break;
+				case BENCH_STRCMP:	((int (*)(const char*, const char*))fn)((const char*)dst, (const char*)src); break;
+				case BENCH_CHR:		((char* (*)(const char*, int))fn)((const char*)src, '!'); break;
+			}
+		}
+		uint32_t cycles = (esp_cpu_get_cycle_count() - start) / iters;
+		if (cycles < best) best = cycles;
+	}
+	return best;
+}
+
+// Strings of n - 1 characters, equal in both buffers so compares run to the end
+static void bench_fill(uint8_t* dst, uint8_t* src, size_t n) {
+	memset(src, 'a', n - 1);
+	src[n - 1] = '\0';
+	memcpy(dst, src, n);
+}
+
+static void bench_mem(const char* only) {
+	size_t max = bench_sizes[sizeof(bench_sizes) / sizeof(bench_sizes[0]) - 1];
+	uint8_t* src = heap_caps_malloc(max + 8, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+	uint8_t* dst = heap_caps_malloc(max + 8, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+	if (!src || !dst) {
+		printf("Error: Out of memory.\n");
+		goto cleanup;
+	}
+
+	printf("%-8s %5s %5s %8s %8s  (cycles/call)\n", "", "size", "align", "newlib", "iram");
+	for (size_t f = 0; f < sizeof(bench_fns) / sizeof(bench_fns[0]); f++) {
+		const bench_fn_t* fn = &bench_fns[f];
+		if (only && strcmp(only, fn->name) != 0) continue;
+		for (size_t s = 0; s < sizeof(bench_sizes) / sizeof(bench_sizes[0]); s++) {
+			for (size_t a = 0; a < sizeof(bench_aligns) / sizeof(bench_aligns[0]); a++) {
+				uint8_t* sp = src + bench_aligns[a][0];
+				uint8_t* dp = dst + bench_aligns[a][1];
+				size_t n = bench_sizes[s];
+
+				bench_fill(dp, sp, n);
+				uint32_t lib = bench_time(fn, fn->lib, dp, sp, n);
+				bench_fill(dp, sp, n);
+				uint32_t iram = bench_time(fn, fn->iram, dp, sp, n);
+				printf("%-8s %5u   %d/%d %8lu %8lu  %3lu%%\n", fn->name, n, bench_aligns[a][0], bench_aligns[a][1],
+					   lib, iram, lib ? iram * 100 / lib : 0);
+			}
+		}
+	}
+
+cleanup:
+	free(src);
+	free(dst);
+}
+
+void bench_command(int argc, char** argv) {
+	if (argc >= 2 && strcmp(argv[1], "mem") == 0) {
+		bench_mem(argc >= 3 ? argv[2] : NULL);
+		return;
+	}
+	printf("Usage: bench mem [function]\n");
+}
+
+static void guest_started(void* arg) {
+	static bool seen = false;
+	trace_instant("guest_start");
+	if (!seen) {
+		seen = true;
+		boot_mark("first guest");
+	}
 }
 
 void run_module(int argc, char**  argv) {
@@ -108,23 +1038,560 @@ void run_module(int argc, char**  argv) {
 		return;
 	}
 
-	// printf("Jumping to module code...\n");
-	// printf("--------------------------------\n");
-	typedef int (*entry_func_t)(int,char**);
-	int result = ((entry_func_t)dos_context.module.entry_point)(argc, argv);
-	// printf("--------------------------------\n");
-	printf("\nModule returned with code: %d\n", result);
+	guest_run_options_t opts = {
+		.core = -1,
+		.on_start = guest_started,
+	};
+	guest_result_t result;
+	trace_begin("guest_run");
+	int err = guest_run(&dos_context.module, argc, argv, &opts, &result);
+	guest_console_flush();
+	trace_end("guest_run");
+	if (err == GUEST_ERR_FAULT) {
+		printf("\n");
+		guest_print_fault(&dos_context.module, &result);
+		elf_unload(&dos_context.module);
+		printf("Module unloaded, recovered in %lld us.\n", result.recovery_us);
+		return;
+	}
+	if (err != GUEST_OK) {
+		printf("Error: Failed to start module (%d)\n", err);
+		return;
+	}
+	printf("\nModule returned with code: %d (%lld us)\n", result.exit_code, result.elapsed_us);
+}
+
+/*
+ * Replays reads, loads, runs and unloads of the given files (flash store
+ * names, or /sd paths) into a few slots, picked by a fixed-seed PRNG so a
+ * run under QEMU can be repeated. Every window prints free and largest
+ * IRAM/DRAM, load latency percentiles and failures; tools/soak.py parses
+ * these lines.
+ */
+typedef struct {
+	uint32_t reads;
+	uint32_t loads;
+	uint32_t runs;
+	uint32_t unloads;
+	uint32_t read_failed;
+	uint32_t load_failed;
+	uint32_t run_failed;
+} soak_counts_t;
+
+static uint32_t soak_random(uint32_t* state) {
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static int compare_u32(const void* a, const void* b) {
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+// Quietly, unlike 'read'/'fload'
+static bool soak_read(const char* name) {
+	free(dos_context.loaded_data);
+	dos_context.loaded_data = NULL;
+	dos_context.loaded_size = 0;
+	esp_err_t err = strncmp(name, "/sd", 3) == 0 ?
+		sdcard_read_file(name, &dos_context.loaded_data, &dos_context.loaded_size) :
+		flash_store_read(name, &dos_context.loaded_data, &dos_context.loaded_size);
+	return err == ESP_OK;
+}
+
+static bool soak_run(elf_module_t* module, const char* name) {
+	char* argv[] = { (char*)name, NULL };
+	guest_run_options_t opts = { .core = -1 };
+	guest_result_t result;
+	int err = guest_run(module, 1, argv, &opts, &result);
+	guest_console_flush();
+	if (err == GUEST_ERR_FAULT) {
+		// A faulted module is no good for the next run
+		elf_unload(module);
+	}
+	return err == GUEST_OK;
+}
+
+static void soak_heap(size_t* iram, size_t* iram_largest, size_t* dram, size_t* dram_largest) {
+	*iram = heap_caps_get_free_size(MALLOC_CAP_EXEC | MALLOC_CAP_32BIT);
+	*iram_largest = heap_caps_get_largest_free_block(MALLOC_CAP_EXEC | MALLOC_CAP_32BIT);
+	*dram = heap_caps_get_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+	*dram_largest = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+}
+
+void soak_command(int argc, char** argv) {
+	if (argc < 3) {
+		printf("Usage: soak <iterations> <file>...\n");
+		return;
+	}
+	int iterations = atoi(argv[1]);
+	int file_count = argc - 2 < DOS_SOAK_FILES ? argc - 2 : DOS_SOAK_FILES;
+	char** files = &argv[2];
+
+	static elf_module_t slots[DOS_SOAK_SLOTS];
+	static uint32_t window[DOS_SOAK_WINDOW];
+	char slot_name[DOS_SOAK_SLOTS][8];
+	for (int i = 0; i < DOS_SOAK_SLOTS; i++) {
+		snprintf(slot_name[i], sizeof(slot_name[i]), "soak%d", i);
+	}
+
+	// One round first, so lazily created pools and buffers don't count as leaks
+	for (int f = 0; f < file_count; f++) {
+		if (!soak_read(files[f])) {
+			printf("Error: Can't read %s\n", files[f]);
+			return;
+		}
+		int err = load_loaded(&slots[0], slot_name[0]);
+		if (err != ELF_OK) {
+			printf("Error loading %s: %s\n", files[f], elf_strerror(err));
+			return;
+		}
+		soak_run(&slots[0], files[f]);
+		elf_unload(&slots[0]);
+	}
+	free_data();
+
+	size_t iram0, iram_largest0, dram0, dram_largest0;
+	soak_heap(&iram0, &iram_largest0, &dram0, &dram_largest0);
+	printf("soak start: IRAM %u/%u DRAM %u/%u\n", iram0, iram_largest0, dram0, dram_largest0);
+
+	soak_counts_t counts = {0};
+	uint32_t seed = 1;
+	uint32_t first_p50 = 0;
+	uint32_t last_p50 = 0;
+	int samples = 0;
+	int64_t start = esp_timer_get_time();
+
+	for (int it = 1; it <= iterations; it++) {
+		uint32_t r = soak_random(&seed);
+		int slot = r % DOS_SOAK_SLOTS;
+		elf_module_t* module = &slots[slot];
+
+		// A loaded slot is unloaded one time in four, otherwise replaced
+		if (module->entry_point && (r >> 8) % 4 == 0) {
+			elf_unload(module);
+			counts.unloads++;
+		} else {
+			const char* file = files[(r >> 12) % file_count];
+			counts.reads++;
+			if (!soak_read(file)) {
+				counts.read_failed++;
+			} else {
+				int64_t t = esp_timer_get_time();
+				int err = load_loaded(module, slot_name[slot]);
+				uint32_t us = esp_timer_get_time() - t;
+				counts.loads++;
+				if (err != ELF_OK) {
+					counts.load_failed++;
+				} else {
+					window[samples++] = us;
+					if ((r >> 16) % 8 == 0) {
+						counts.runs++;
+						if (!soak_run(module, file)) counts.run_failed++;
+					}
+				}
+			}
+		}
+
+		if (it % DOS_SOAK_WINDOW && it != iterations) continue;
+
+		uint32_t p50 = 0, p90 = 0, p99 = 0, max = 0;
+		if (samples) {
+			qsort(window, samples, sizeof(window[0]), compare_u32);
+			p50 = window[samples / 2];
+			p90 = window[samples * 9 / 10];
+			p99 = window[samples * 99 / 100];
+			max = window[samples - 1];
+			if (!first_p50) first_p50 = p50;
+			last_p50 = p50;
+		}
+		samples = 0;
+
+		size_t iram, iram_largest, dram, dram_largest;
+		soak_heap(&iram, &iram_largest, &dram, &dram_largest);
+		printf("soak %d: IRAM %u/%u DRAM %u/%u load p50 %lu p90 %lu p99 %lu max %lu us fail %lu/%lu/%lu\n",
+			   it, iram, iram_largest, dram, dram_largest, p50, p90, p99, max,
+			   counts.read_failed, counts.load_failed, counts.run_failed);
+	}
+
+	for (int i = 0; i < DOS_SOAK_SLOTS; i++) {
+		elf_unload(&slots[i]);
+	}
+	free_data();
+
+	size_t iram, iram_largest, dram, dram_largest;
+	soak_heap(&iram, &iram_largest, &dram, &dram_largest);
+	printf("soak done: %lu reads, %lu loads, %lu runs, %lu unloads in %lld ms\n",
+		   counts.reads, counts.loads, counts.runs, counts.unloads, (esp_timer_get_time() - start) / 1000);
+	printf("soak leak: IRAM %d DRAM %d bytes, largest IRAM %u -> %u, DRAM %u -> %u\n",
+		   (int)(iram0 - iram), (int)(dram0 - dram), iram_largest0, iram_largest, dram_largest0, dram_largest);
+	printf("soak drift: load p50 %lu -> %lu us\n", first_p50, last_p50);
+}
+
+typedef struct {
+	elf_module_t* module;
+	int argc;
+	char** argv;
+	guest_pipe_t* in;
+	guest_pipe_t* out;
+	guest_run_t* run;
+	guest_result_t result;
+	int err;
+} pipeline_stage_t;
+
+static void stage_start(void* arg) {
+	pipeline_stage_t* stage = (pipeline_stage_t*)arg;
+	guest_pipe_bind(stage->in, stage->out);
+}
+
+static void stage_exit(void* arg) {
+	guest_pipe_unbind();
+}
+
+// "run <name> args", "<name> args" or plain "run args" for the default module
+static int resolve_stage(pipeline_stage_t* stage, int argc, char** argv) {
+	if (strcmp(argv[0], "run") == 0) {
+		if (argc > 1 && find_module(argv[1])) {
+			stage->module = find_module(argv[1]);
+			stage->argc = argc - 1;
+			stage->argv = argv + 1;
+			return 0;
+		}
+		stage->module = &dos_context.module;
+	} else {
+		stage->module = find_module(argv[0]);
+	}
+	stage->argc = argc;
+	stage->argv = argv;
+
+	if (!stage->module || !stage->module->entry_point) {
+		printf("Error: No module for '%s'.\n", argv[0]);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Runs every stage of "a | b | c" at once, each in its own guest task on
+ * alternating cores, with a pipe between neighbours. A stage that exits or
+ * faults closes its ends, so the others see EOF or a broken pipe.
+ */
+void run_pipeline(int argc, char** argv) {
+	pipeline_stage_t stages[DOS_MAX_STAGES] = {0};
+	guest_pipe_t* pipes[DOS_MAX_STAGES - 1] = {0};
+	int count = 0;
+
+	int first = 0;
+	for (int i = 0; i <= argc; i++) {
+		if (i < argc && strcmp(argv[i], "|") != 0) continue;
+		if (i == first || count == DOS_MAX_STAGES) {
+			printf("Error: Expected 1 to %d commands separated by '|'.\n", DOS_MAX_STAGES);
+			return;
+		}
+		argv[i] = NULL;
+		if (resolve_stage(&stages[count], i - first, argv + first) != 0) return;
+		count++;
+		first = i + 1;
+	}
+
+	for (int i = 0; i < count; i++) {
+		for (int j = 0; j < i; j++) {
+			if (stages[i].module == stages[j].module) {
+				printf("Error: A module can only appear once in a pipeline.\n");
+				return;
+			}
+		}
+	}
+
+	for (int i = 0; i < count - 1; i++) {
+		pipes[i] = guest_pipe_create(PIPE_BUFFER_SIZE);
+		if (!pipes[i]) {
+			printf("Error: Failed to allocate pipe.\n");
+			goto done;
+		}
+		stages[i].out = pipes[i];
+		stages[i + 1].in = pipes[i];
+	}
+
+	for (int i = 0; i < count; i++) {
+		guest_run_options_t opts = {
+			// Stages with code in RTC fast memory can only run on core 0
+			.core = stages[i].module->rtc_mem ? 0 : i % portNUM_PROCESSORS,
+			.on_start = stage_start,
+			.on_exit = stage_exit,
+			.hook_arg = &stages[i],
+		};
+		stages[i].err = guest_start(stages[i].module, stages[i].argc, stages[i].argv, &opts, &stages[i].run);
+		if (stages[i].err != GUEST_OK) {
+			printf("Error: Failed to start stage %d (%d)\n", i + 1, stages[i].err);
+			// Unblock the stages that are already running
+			for (int p = 0; p < count - 1; p++) guest_pipe_close(pipes[p]);
+			break;
+		}
+	}
+
+	for (int i = 0; i < count; i++) {
+		if (stages[i].run) {
+			stages[i].err = guest_wait(stages[i].run, &stages[i].result);
+		}
+	}
+	guest_console_flush();
+
+	printf("\n");
+	for (int i = 0; i < count; i++) {
+		pipeline_stage_t* stage = &stages[i];
+		if (!stage->run) continue;
+
+		if (stage->err == GUEST_ERR_FAULT) {
+			printf("[%d] %s: ", i + 1, stage->argv[0]);
+			guest_print_fault(stage->module, &stage->result);
+			elf_unload(stage->module);
+			printf("[%d] Module unloaded.\n", i + 1);
+			continue;
+		}
+		printf("[%d] %s returned %d (%lld us)\n", i + 1, stage->argv[0], stage->result.exit_code, stage->result.elapsed_us);
+	}
+	for (int i = 0; i < count - 1; i++) {
+		guest_pipe_stats_t stats;
+		guest_pipe_get_stats(pipes[i], &stats);
+		printf("[%d|%d] %lu bytes, high water %lu, waits: writer %lu, reader %lu\n", i + 1, i + 2,
+			   stats.bytes, stats.high_water, stats.writer_waits, stats.reader_waits);
+	}
+
+done:
+	for (int i = 0; i < count - 1; i++) {
+		guest_pipe_destroy(pipes[i]);
+	}
+}
+
+static int has_pipe(int argc, char** argv) {
+	for (int i = 0; i < argc; i++) {
+		if (strcmp(argv[i], "|") == 0) return 1;
+	}
+	return 0;
+}
+
+// Returns false on 'exit'
+static bool execute_line(char* line) {
+	char* argv[SHELL_MAX_ARGS];
+	int argc = shell_parse_args(line, argv);
+	if (!argc) return true;
+
+	if (has_pipe(argc, argv) || find_module(argv[0]) ||
+		(strcmp(argv[0], "run") == 0 && argc > 1 && find_module(argv[1]))) {
+		run_pipeline(argc, argv);
+		return true;
+	}
+
+	if (strcmp(argv[0], "load") == 0) {
+		load_data();
+		return true;
+	}
+	if (strcmp(argv[0], "dload") == 0) {
+		load_delta();
+		return true;
+	}
+	if (strcmp(argv[0], "ls") == 0) {
+		ls(argc, argv);
+		return true;
+	}
+	if (strcmp(argv[0], "recv") == 0) {
+		recv_file(argc, argv);
+		return true;
+	}
+	if (strcmp(argv[0], "read") == 0) {
+		read_data(argc, argv);
+		return true;
+	}
+	if (strcmp(argv[0], "module") == 0) {
+		load_module(argc, argv);
+		return true;
+	}
+	if (strcmp(argv[0], "image") == 0) {
+		build_image();
+		return true;
+	}
+	if (strcmp(argv[0], "inst") == 0) {
+		instantiate(argc, argv);
+		return true;
+	}
+	if (strcmp(argv[0], "mods") == 0) {
+		list_modules();
+		return true;
+	}
+	if (strcmp(argv[0], "unload") == 0) {
+		unload_resident(argc, argv);
+		return true;
+	}
+	if (strcmp(argv[0], "run") == 0) {
+		run_module(argc , argv);
+		return true;
+	}
+	if (strcmp(argv[0], "soak") == 0) {
+		soak_command(argc, argv);
+		return true;
+	}
+	if (strcmp(argv[0], "defrag") == 0) {
+		defrag_command();
+		return true;
+	}
+	if (strcmp(argv[0], "heap") == 0) {
+		heap_stats();
+		return true;
+	}
+	if (strcmp(argv[0], "place") == 0) {
+		set_placement(argc, argv);
+		return true;
+	}
+	if (strcmp(argv[0], "overlay") == 0) {
+		overlay_stats();
+		return true;
+	}
+	if (strcmp(argv[0], "pool") == 0) {
+		pool_stats();
+		return true;
+	}
+	if (strcmp(argv[0], "hooks") == 0) {
+		hook_stats();
+		return true;
+	}
+	if (strcmp(argv[0], "perf") == 0) {
+		perf_command(argc, argv);
+		return true;
+	}
+	if (strcmp(argv[0], "console") == 0) {
+		console_settings(argc, argv);
+		return true;
+	}
+	if (strcmp(argv[0], "baud") == 0) {
+		set_baud(argc, argv);
+		return true;
+	}
+	if (strcmp(argv[0], "hostfs") == 0) {
+		hostfs_info();
+		return true;
+	}
+	if (strcmp(argv[0], "store") == 0) {
+		store_files(argc, argv);
+		return true;
+	}
+	if (strcmp(argv[0], "fload") == 0) {
+		fload_data(argc, argv);
+		return true;
+	}
+	if (strcmp(argv[0], "autoexec") == 0) {
+		autoexec_settings(argc, argv);
+		return true;
+	}
+	if (strcmp(argv[0], "trace") == 0) {
+		trace_command(argc, argv);
+		return true;
+	}
+	if (strcmp(argv[0], "rpc") == 0) {
+		rpc_mode();
+		return true;
+	}
+	if (strcmp(argv[0], "bench") == 0) {
+		bench_command(argc, argv);
+		return true;
+	}
+	if (strcmp(argv[0], "boot") == 0) {
+		boot_timeline();
+		return true;
+	}
+	if (strcmp(argv[0], "exit") == 0) {
+		return false;
+	}
+	printf("Error: No such command.\n");
+	return true;
+}
+
+// Survives a crash reset; set while autoexec runs
+static RTC_NOINIT_ATTR uint32_t autoexec_running;
+
+// A key held through reset (or typed within DOS_AUTOEXEC_WAIT) skips autoexec
+static bool autoexec_skipped(void) {
+	int64_t deadline = esp_timer_get_time() + DOS_AUTOEXEC_WAIT * 1000LL;
+	do {
+		size_t buffered = 0;
+		uart_get_buffered_data_len(UART_NUM, &buffered);
+		if (buffered) {
+			uart_flush_input(UART_NUM);
+			printf("Autoexec skipped.\n");
+			return true;
+		}
+		if (DOS_AUTOEXEC_WAIT) vTaskDelay(pdMS_TO_TICKS(10));
+	} while (esp_timer_get_time() < deadline);
+	printf("Running autoexec, hold a key through reset to skip it.\n");
+	return false;
+}
+
+static void run_autoexec(void) {
+	// Still set after anything but a power-on: the last boot died inside autoexec
+	bool crashed = esp_reset_reason() != ESP_RST_POWERON && autoexec_running == DOS_AUTOEXEC_MAGIC;
+	autoexec_running = 0;
+
+	uint8_t* script;
+	size_t size;
+	if (flash_store_read(DOS_AUTOEXEC, &script, &size) != ESP_OK) {
+		return;
+	}
+	if (crashed) {
+		printf("Autoexec crashed the last boot, skipped this time.\n");
+		free(script);
+		return;
+	}
+	if (autoexec_skipped()) {
+		free(script);
+		return;
+	}
+	autoexec_running = DOS_AUTOEXEC_MAGIC;
+
+	char line[129];
+	size_t pos = 0;
+	while (pos < size) {
+		size_t len = 0;
+		while (pos < size && script[pos] != ';' && len < sizeof(line) - 1) {
+			line[len++] = script[pos++];
+		}
+		line[len] = '\0';
+		pos++;
+
+		printf("AUTOEXEC > %s\n", line);
+		execute_line(line);
+	}
+	free(script);
+	autoexec_running = 0;
+}
+
+// Pool owners are modules; workers recover only faults in the one that submitted the work
+static IRAM_ATTR bool pool_owns_fault(void* owner, uint32_t pc, uint32_t a0) {
+	return owner && elf_module_owns_fault(owner, pc, a0);
+}
+
+static void pool_fault_cleanup(void* owner) {
+	if (owner) elf_module_close_files(owner, xTaskGetCurrentTaskHandle());
 }
 
 void app_main(void) {
 
+	boot_mark("app_main");
 	printf("\033[2J\033[H");
 
 	uart_receiver_init();
+	guest_runner_init();
+	guest_console_init();
+	task_pool_set_fault_filter(pool_owns_fault);
+	task_pool_set_fault_cleanup(pool_fault_cleanup);
 
 	char buf[64];
 	int iram = heap_caps_get_free_size(MALLOC_CAP_EXEC);
-	int dram = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+	int dram = heap_caps_get_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+	int psram = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
 	printf("\n");
 	printf("================================\n");
 	printf("|        ESP32-DOS v0.1        |\n");
@@ -133,12 +1600,20 @@ void app_main(void) {
 	printf("|%-30s|\n", buf);
 	snprintf(buf, sizeof(buf), " Free DRAM: %d bytes", dram);
 	printf("|%-30s|\n", buf);
+	if (psram) {
+		snprintf(buf, sizeof(buf), " Free PSRAM: %d bytes", psram);
+		printf("|%-30s|\n", buf);
+	}
 	printf("================================\n\n");
 
-	sdcard_init();
+	sdcard_start();
+	hostfs_mount();
+	flash_store_init();
+	boot_mark("shell ready");
+
+	run_autoexec();
 
 	char line[128];
-	char* argv[8];
 	while(1) {
 
 		printf("SHELL > ");
@@ -147,33 +1622,7 @@ void app_main(void) {
 		int len = shell_read_line(line, sizeof(line));
 		if (!len) continue;
 
-		int argc = shell_parse_args(line, argv);
-		if (!argc) continue;
-
-		if (strcmp(argv[0], "load") == 0) {
-			load_data();
-			continue;
-		}
-		if (strcmp(argv[0], "ls") == 0) {
-			ls(argc, argv);
-			continue;
-		}
-		if (strcmp(argv[0], "read") == 0) {
-			read_data(argc, argv);
-			continue;
-		}
-		if (strcmp(argv[0], "module") == 0) {
-			load_module();
-			continue;
-		}
-		if (strcmp(argv[0], "run") == 0) {
-			run_module(argc , argv);
-			continue;
-		}
-		if (strcmp(argv[0], "exit") == 0) {
-			break;
-		}
-		printf("Error: No such command.\n");
+		if (!execute_line(line)) break;
 	}
 	// if (guest.text_mem) {
 	// 	dump_memory("IRAM", guest.text_mem, guest.text_size);
@@ -0,0 +1,202 @@
+import argparse
+import glob
+import json
+import os
+import re
+import subprocess
+import sys
+import time
+
+import serial
+
+# Runs the guest/bench modules on the device (ESP32 QEMU by default) and
+# compares the run times with a stored baseline.
+
+PROMPT = b'SHELL > '
+RESULT_RE = re.compile(rb'Module returned with code: (-?\d+) \((\d+) us\)')
+CHECK_RE = re.compile(rb'bench (\S+): check=([0-9a-f]+)')
+
+
+class Device:
+    def __init__(self, url, log):
+        self.ser = serial.serial_for_url(url, baudrate=115200, timeout=0.1)
+        self.log = log
+
+    def read_until(self, token, timeout):
+        data = b''
+        deadline = time.time() + timeout
+        while time.time() < deadline:
+            chunk = self.ser.read(4096)
+            if chunk:
+                data += chunk
+                if self.log:
+                    self.log.write(chunk)
+                if token in data:
+                    return data
+        raise TimeoutError(f'waiting for {token!r}')
+
+    def command(self, line, until=PROMPT, timeout=30):
+        self.ser.write(line.encode() + b'\r')
+        return self.read_until(until, timeout)
+
+    def upload(self, data):
+        self.command('load', until=b'Waiting for binary data...')
+        # The device flushes its input right after the banner
+        time.sleep(0.3)
+        self.ser.write(data)
+        out = self.read_until(PROMPT, 60)
+        if b'Data loaded' not in out:
+            raise RuntimeError('upload failed')
+
+
+def start_qemu(args):
+    cmd = [args.qemu, '-nographic', '-machine', 'esp32',
+           '-drive', f'file={args.flash},if=mtd,format=raw',
+           '-global', 'driver=timer.esp32.timg,property=wdt_disable,value=true',
+           '-serial', f'tcp::{args.tcp_port},server,nowait']
+    if args.psram:
+        cmd += ['-m', '4M']
+    if args.icount is not None:
+        # Deterministic virtual time, so runs are comparable across hosts
+        cmd += ['-icount', f'shift={args.icount}']
+    return subprocess.Popen(cmd, stdin=subprocess.DEVNULL,
+                            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+
+def connect(url, log, timeout=20):
+    deadline = time.time() + timeout
+    while True:
+        try:
+            return Device(url, log)
+        except serial.SerialException:
+            if time.time() > deadline:
+                raise
+            time.sleep(0.2)
+
+
+def run_bench(dev, path, repeat):
+    name = os.path.splitext(os.path.basename(path))[0]
+    with open(path, 'rb') as f:
+        dev.upload(f.read())
+
+    out = dev.command('module')
+    if b'=== Module loaded' not in out:
+        raise RuntimeError(f'{name}: load failed')
+
+    times = []
+    check = None
+    for _ in range(repeat):
+        out = dev.command(f'run {name}', timeout=120)
+        result = RESULT_RE.search(out)
+        if not result:
+            raise RuntimeError(f'{name}: no result (fault?)')
+        if int(result.group(1)) != 0:
+            raise RuntimeError(f'{name}: exit code {result.group(1).decode()}')
+        times.append(int(result.group(2)))
+
+        m = CHECK_RE.search(out)
+        value = m.group(2).decode() if m else None
+        if check is not None and value != check:
+            raise RuntimeError(f'{name}: check value changed between runs')
+        check = value
+
+    return name, {'us': min(times), 'runs': times, 'check': check}
+
+
+def compare(results, baseline, tolerance):
+    failed = False
+    print(f"\n{'bench':<16}{'us':>10}{'baseline':>10}{'change':>9}")
+    for name, res in sorted(results.items()):
+        base = baseline.get(name)
+        if not base:
+            print(f'{name:<16}{res["us"]:>10}{"-":>10}{"new":>9}')
+            continue
+
+        change = (res['us'] - base['us']) / base['us']
+        mark = ''
+        if change > tolerance:
+            mark = '  SLOWER'
+            failed = True
+        if base.get('check') != res['check']:
+            mark += '  CHECK MISMATCH'
+            failed = True
+        print(f'{name:<16}{res["us"]:>10}{base["us"]:>10}{change:>+8.1%}{mark}')
+    return failed
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    root = os.path.dirname(here)
+
+    parser = argparse.ArgumentParser(description='Run the guest benchmark suite')
+    parser.add_argument('modules', nargs='*', help='default: guest/bench/*.mod')
+    parser.add_argument('--url', help='talk to a real device (e.g. /dev/ttyUSB0) instead of QEMU')
+    parser.add_argument('--qemu', default='qemu-system-xtensa')
+    parser.add_argument('--flash', default=os.path.join(root, 'build', 'flash.bin'),
+                        help='merged image: esptool.py --chip esp32 merge_bin --fill-flash-size 4MB '
+                             '-o flash.bin @flash_args (run in build/)')
+    parser.add_argument('--tcp-port', type=int, default=5555)
+    parser.add_argument('--icount', type=int, default=3, help='QEMU -icount shift, -1 for real time')
+    parser.add_argument('--psram', action='store_true', help='give QEMU 4 MB of PSRAM')
+    parser.add_argument('--repeat', type=int, default=3)
+    parser.add_argument('--baseline', default=os.path.join(root, 'guest', 'bench', 'baseline.json'))
+    parser.add_argument('--update-baseline', action='store_true')
+    parser.add_argument('--tolerance', type=float, default=0.10)
+    parser.add_argument('--output', help='write results as JSON')
+    parser.add_argument('--log', help='save the raw serial output')
+    args = parser.parse_args()
+    if args.icount < 0:
+        args.icount = None
+
+    modules = args.modules or sorted(glob.glob(os.path.join(root, 'guest', 'bench', '*.mod')))
+    if not modules:
+        sys.exit('No modules, run "make bench" in guest/ first')
+
+    log = open(args.log, 'wb') if args.log else None
+    qemu = None
+    if not args.url:
+        if not os.path.exists(args.flash):
+            sys.exit(f'No flash image at {args.flash}')
+        qemu = start_qemu(args)
+    url = args.url or f'socket://localhost:{args.tcp_port}'
+
+    results = {}
+    try:
+        dev = connect(url, log)
+        dev.ser.write(b'\r')
+        dev.read_until(PROMPT, 60)
+        # Printing is part of the printf bench, it shouldn't lose output
+        dev.command('console block')
+
+        for path in modules:
+            name, res = run_bench(dev, path, args.repeat)
+            results[name] = res
+            print(f'{name}: {res["us"]} us (check {res["check"]})')
+    finally:
+        if qemu:
+            qemu.terminate()
+            qemu.wait()
+        if log:
+            log.close()
+
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+
+    if args.update_baseline:
+        with open(args.baseline, 'w') as f:
+            json.dump({k: {'us': v['us'], 'check': v['check']} for k, v in results.items()},
+                      f, indent=2, sort_keys=True)
+        print(f'Baseline written to {args.baseline}')
+        return
+
+    baseline = {}
+    if os.path.exists(args.baseline):
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+    if compare(results, baseline, args.tolerance):
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
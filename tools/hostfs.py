@@ -0,0 +1,187 @@
+import argparse
+import errno
+import os
+import stat
+import struct
+import sys
+import threading
+
+import serial
+
+# Serves a host directory to the device's /host mount and works as a plain
+# terminal for everything else on the line.
+
+SYNC = b'\x16H'
+
+OP_OPEN = 1
+OP_CLOSE = 2
+OP_READ = 3
+OP_STAT = 4
+OP_OPENDIR = 5
+OP_READDIR = 6
+OP_CLOSEDIR = 7
+
+DT_REG = 1
+DT_DIR = 2
+
+
+def crc16(data, crc=0xFFFF):
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+            crc &= 0xFFFF
+    return crc
+
+
+def frame(op, seq, payload):
+    body = struct.pack('<BBH', op, seq, len(payload)) + payload
+    return SYNC + body + struct.pack('<H', crc16(body))
+
+
+class HostFs:
+    def __init__(self, root):
+        self.root = os.path.realpath(root)
+        self.files = {}
+        self.dirs = {}
+        self.next_handle = 1
+
+    def resolve(self, path):
+        full = os.path.realpath(os.path.join(self.root, path.lstrip('/')))
+        if full != self.root and not full.startswith(self.root + os.sep):
+            raise OSError(errno.EACCES, 'outside root')
+        return full
+
+    def handle(self):
+        h = self.next_handle
+        self.next_handle += 1
+        return h
+
+    def dispatch(self, op, payload):
+        try:
+            status, data = self.serve(op, payload)
+        except OSError as e:
+            status, data = -(e.errno or errno.EIO), b''
+        except (KeyError, struct.error):
+            status, data = -errno.EBADF, b''
+        return struct.pack('<i', status) + data
+
+    def serve(self, op, payload):
+        if op == OP_OPEN:
+            f = open(self.resolve(payload.decode()), 'rb')
+            size = os.fstat(f.fileno()).st_size
+            h = self.handle()
+            self.files[h] = f
+            return h, struct.pack('<I', size)
+
+        if op == OP_CLOSE:
+            h, = struct.unpack('<I', payload[:4])
+            self.files.pop(h).close()
+            return 0, b''
+
+        if op == OP_READ:
+            h, offset, length = struct.unpack('<III', payload[:12])
+            f = self.files[h]
+            f.seek(offset)
+            data = f.read(length)
+            return len(data), data
+
+        if op == OP_STAT:
+            st = os.stat(self.resolve(payload.decode()))
+            mode = stat.S_IFDIR if stat.S_ISDIR(st.st_mode) else stat.S_IFREG
+            mode |= st.st_mode & 0o777
+            return 0, struct.pack('<III', mode, st.st_size & 0xFFFFFFFF, int(st.st_mtime))
+
+        if op == OP_OPENDIR:
+            path = self.resolve(payload.decode())
+            entries = []
+            for name in sorted(os.listdir(path)):
+                kind = DT_DIR if os.path.isdir(os.path.join(path, name)) else DT_REG
+                entries.append((kind, name))
+            h = self.handle()
+            self.dirs[h] = iter(entries)
+            return h, b''
+
+        if op == OP_READDIR:
+            h, = struct.unpack('<I', payload[:4])
+            entry = next(self.dirs[h], None)
+            if entry is None:
+                return 0, b''
+            kind, name = entry
+            return 1, bytes([kind]) + name.encode()
+
+        if op == OP_CLOSEDIR:
+            h, = struct.unpack('<I', payload[:4])
+            self.dirs.pop(h)
+            return 0, b''
+
+        return -errno.ENOSYS, b''
+
+
+def serve_forever(ser, fs, verbose):
+    buf = b''
+    out = sys.stdout.buffer
+    while True:
+        chunk = ser.read(ser.in_waiting or 1)
+        if not chunk:
+            continue
+        buf += chunk
+
+        while buf:
+            start = buf.find(SYNC)
+            if start < 0:
+                # Keep a trailing sync byte, it may start a frame
+                keep = 1 if buf.endswith(SYNC[:1]) else 0
+                out.write(buf[:len(buf) - keep])
+                buf = buf[len(buf) - keep:]
+                break
+
+            out.write(buf[:start])
+            buf = buf[start:]
+            if len(buf) < 6:
+                break
+
+            op, seq, length = struct.unpack('<BBH', buf[2:6])
+            total = 6 + length + 2
+            if len(buf) < total:
+                break
+
+            body = buf[2:6 + length]
+            crc, = struct.unpack('<H', buf[6 + length:total])
+            buf = buf[total:]
+            if crc != crc16(body):
+                continue
+
+            reply = fs.dispatch(op, body[4:])
+            if verbose:
+                sys.stderr.write(f'[hostfs] op={op} seq={seq} -> {len(reply)} bytes\n')
+            ser.write(frame(op | 0x80, seq, reply))
+        out.flush()
+
+
+def forward_input(ser):
+    for line in sys.stdin:
+        ser.write(line.rstrip('\n').encode() + b'\r')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Serve a directory to the device /host mount')
+    parser.add_argument('root', nargs='?', default='.')
+    parser.add_argument('--port', default='/dev/ttyUSB0', help='serial port or socket://host:port')
+    parser.add_argument('--baud', type=int, default=115200)
+    parser.add_argument('-v', '--verbose', action='store_true')
+    args = parser.parse_args()
+
+    ser = serial.serial_for_url(args.port, args.baud, timeout=0.05)
+    fs = HostFs(args.root)
+    print(f'Serving {fs.root} on {args.port}')
+
+    threading.Thread(target=forward_input, args=(ser,), daemon=True).start()
+    try:
+        serve_forever(ser, fs, args.verbose)
+    except KeyboardInterrupt:
+        print('\nExiting...')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,195 @@
+import argparse
+import base64
+import json
+import os
+import struct
+import sys
+import time
+
+import serial
+
+import hostfs
+
+# Client for the shell's 'rpc' mode: JSON lines with request IDs. Several
+# requests may be in flight, the device answers them in order. Lines that
+# aren't replies (log output) are skipped. With --root the client also
+# serves the device's /host mount, whose frames come on the same line.
+
+CHUNK = 2048        # upload bytes per request, stays under the device's line limit
+WINDOW = 4          # requests in flight
+
+
+class RpcError(Exception):
+    pass
+
+
+class Client:
+    def __init__(self, url, baud=115200, log=None, fs=None):
+        self.ser = serial.serial_for_url(url, baudrate=baud, timeout=0.1)
+        self.log = log
+        self.fs = fs
+        self.next_id = 1
+        self.pending = {}
+        self.replies = {}
+        self.buf = b''
+
+    def enter(self, timeout=10):
+        self.ser.write(b'\rrpc\r')
+        self._read_until(lambda msg: msg.get('ready'), timeout)
+
+    def close(self):
+        self.call('exit')
+        self.ser.close()
+
+    def _serve_frames(self):
+        # Answers complete hostfs frames and cuts them out of the buffer;
+        # returns where an incomplete one starts, lines end before it
+        while True:
+            start = self.buf.find(hostfs.SYNC)
+            if start < 0:
+                return len(self.buf)
+            if len(self.buf) < start + 6:
+                return start
+            op, seq, length = struct.unpack('<BBH', self.buf[start + 2:start + 6])
+            total = 6 + length + 2
+            if len(self.buf) < start + total:
+                return start
+            body = self.buf[start + 2:start + 6 + length]
+            crc, = struct.unpack('<H', self.buf[start + 6 + length:start + total])
+            self.buf = self.buf[:start] + self.buf[start + total:]
+            if crc == hostfs.crc16(body):
+                self.ser.write(hostfs.frame(op | 0x80, seq, self.fs.dispatch(op, body[4:])))
+
+    def _read_line(self, deadline):
+        while True:
+            end = self._serve_frames() if self.fs else len(self.buf)
+            if b'\n' in self.buf[:end]:
+                break
+            if time.time() > deadline:
+                raise TimeoutError('device stopped answering')
+            chunk = self.ser.read(4096)
+            if self.log and chunk:
+                self.log.write(chunk)
+            self.buf += chunk
+        line, self.buf = self.buf.split(b'\n', 1)
+        return line.strip()
+
+    def _read_until(self, match, timeout):
+        deadline = time.time() + timeout
+        while True:
+            line = self._read_line(deadline)
+            if not line.startswith(b'{'):
+                continue
+            try:
+                msg = json.loads(line)
+            except ValueError:
+                continue
+            if match(msg):
+                return msg
+
+    def submit(self, method, **params):
+        rid = self.next_id
+        self.next_id += 1
+        line = json.dumps({'id': rid, 'method': method, 'params': params}, separators=(',', ':'))
+        self.ser.write(line.encode() + b'\n')
+        self.pending[rid] = method
+        return rid
+
+    def _take_reply(self, msg):
+        # Replies come in request order, so one the device couldn't put an
+        # id on answers the oldest request still pending
+        rid = msg.get('id')
+        if rid is None and self.pending:
+            rid = min(self.pending)
+        if rid in self.pending:
+            self.pending.pop(rid)
+            self.replies[rid] = msg
+
+    def result(self, rid, timeout=60):
+        deadline = time.time() + timeout
+        while rid not in self.replies:
+            self._take_reply(self._read_until(lambda m: 'ok' in m, deadline - time.time()))
+        msg = self.replies.pop(rid)
+        if not msg.get('ok'):
+            raise RpcError(f"{msg.get('error')} (request {rid})")
+        return msg
+
+    def call(self, method, timeout=60, **params):
+        return self.result(self.submit(method, **params), timeout)
+
+    def upload(self, data):
+        ids = []
+        for offset in range(0, len(data), CHUNK):
+            chunk = base64.b64encode(data[offset:offset + CHUNK]).decode()
+            ids.append(self.submit('upload', offset=offset, size=len(data), data=chunk))
+            if len(ids) >= WINDOW:
+                self.result(ids.pop(0))
+        for rid in ids:
+            last = self.result(rid)
+        if ids and last['size'] != len(data):
+            raise RpcError('upload size mismatch')
+
+    def run_many(self, name, args, count):
+        # Keep WINDOW runs queued so the device never waits for the host
+        results = []
+        ids = []
+        for _ in range(count):
+            ids.append(self.submit('run', name=name, args=args))
+            if len(ids) >= WINDOW:
+                results.append(self.result(ids.pop(0)))
+        results += [self.result(rid) for rid in ids]
+        return results
+
+
+def output_bytes(msg):
+    # The device escapes raw bytes as code points 0-255
+    return msg.get('output', '').encode('latin-1')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Run a module through the RPC mode')
+    parser.add_argument('module')
+    parser.add_argument('args', nargs='*')
+    parser.add_argument('--url', default='/dev/ttyUSB0')
+    parser.add_argument('--baud', type=int, default=115200)
+    parser.add_argument('--name')
+    parser.add_argument('--count', type=int, default=1)
+    parser.add_argument('--quiet', action='store_true', help="don't print guest output")
+    parser.add_argument('--root', help='serve this directory to the device /host mount')
+    opts = parser.parse_args()
+
+    name = opts.name or os.path.splitext(os.path.basename(opts.module))[0][:15]
+    with open(opts.module, 'rb') as f:
+        data = f.read()
+
+    client = Client(opts.url, opts.baud, fs=hostfs.HostFs(opts.root) if opts.root else None)
+    try:
+        client.enter()
+        client.upload(data)
+        loaded = client.call('load', name=name)
+        print(f"{name}: {loaded['text']} bytes text, {loaded['data']} bytes data, loaded in {loaded['us']} us")
+
+        start = time.time()
+        results = client.run_many(name, opts.args, opts.count)
+        elapsed = time.time() - start
+
+        failed = 0
+        for msg in results:
+            if not opts.quiet:
+                sys.stdout.buffer.write(output_bytes(msg))
+            if msg.get('fault') or msg.get('code'):
+                failed += 1
+        runs = [m['us'] for m in results if 'us' in m]
+        print(f'\n{len(results)} runs, {failed} failed, {len(results) / elapsed * 60:.0f} runs/min')
+        if runs:
+            print(f'guest time: min {min(runs)} us, max {max(runs)} us')
+        print(json.dumps(client.call('stats'), indent=2))
+    finally:
+        client.close()
+
+    if failed:
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
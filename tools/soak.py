@@ -0,0 +1,137 @@
+import argparse
+import csv
+import os
+import re
+import sys
+import time
+
+from bench import PROMPT, connect, start_qemu
+
+# Uploads modules to the flash store and runs the device's 'soak' command
+# over them (ESP32 QEMU by default). Per-window heap and latency figures go
+# to a CSV; leaks, failures and latency drift fail the run.
+
+WINDOW_RE = re.compile(rb'soak (\d+): IRAM (\d+)/(\d+) DRAM (\d+)/(\d+) '
+                       rb'load p50 (\d+) p90 (\d+) p99 (\d+) max (\d+) us fail (\d+)/(\d+)/(\d+)')
+LEAK_RE = re.compile(rb'soak leak: IRAM (-?\d+) DRAM (-?\d+) bytes')
+DRIFT_RE = re.compile(rb'soak drift: load p50 (\d+) -> (\d+) us')
+FIELDS = ['iteration', 'iram_free', 'iram_largest', 'dram_free', 'dram_largest',
+          'p50_us', 'p90_us', 'p99_us', 'max_us', 'read_failed', 'load_failed', 'run_failed']
+
+
+def store_modules(dev, paths):
+    names = []
+    for path in paths:
+        name = os.path.splitext(os.path.basename(path))[0]
+        with open(path, 'rb') as f:
+            dev.upload(f.read())
+        out = dev.command(f'store {name}')
+        if b'Stored' not in out:
+            raise RuntimeError(f'{name}: store failed')
+        names.append(name)
+    return names
+
+
+def soak(dev, names, iterations, writer, timeout):
+    dev.ser.write(f'soak {iterations} {" ".join(names)}'.encode() + b'\r')
+
+    # Line by line: a long soak reports for hours before the prompt comes back
+    data = b''
+    summary = {}
+    deadline = time.time() + timeout
+    while PROMPT not in data:
+        if time.time() > deadline:
+            raise TimeoutError('soak did not finish')
+        chunk = dev.ser.read(4096)
+        if not chunk:
+            continue
+        if dev.log:
+            dev.log.write(chunk)
+        data += chunk
+        while b'\n' in data:
+            line, data = data.split(b'\n', 1)
+            m = WINDOW_RE.search(line)
+            if m:
+                row = [int(v) for v in m.groups()]
+                writer.writerow(row)
+                print(f'{row[0]:>8}: IRAM {row[1]}/{row[2]} DRAM {row[3]}/{row[4]} '
+                      f'p50 {row[5]} p99 {row[7]} us, failures {row[9]}/{row[10]}/{row[11]}')
+                summary['failures'] = sum(row[9:12])
+            m = LEAK_RE.search(line)
+            if m:
+                summary['leak'] = (int(m.group(1)), int(m.group(2)))
+            m = DRIFT_RE.search(line)
+            if m:
+                summary['drift'] = (int(m.group(1)), int(m.group(2)))
+            if b'Error' in line:
+                raise RuntimeError(line.decode(errors='replace').strip())
+    return summary
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    root = os.path.dirname(here)
+
+    parser = argparse.ArgumentParser(description='Load/unload soak test')
+    parser.add_argument('modules', nargs='+', help='module files, several sizes (at most 8)')
+    parser.add_argument('--iterations', type=int, default=5000)
+    parser.add_argument('--url', help='talk to a real device (e.g. /dev/ttyUSB0) instead of QEMU')
+    parser.add_argument('--qemu', default='qemu-system-xtensa')
+    parser.add_argument('--flash', default=os.path.join(root, 'build', 'flash.bin'))
+    parser.add_argument('--tcp-port', type=int, default=5555)
+    parser.add_argument('--icount', type=int, default=-1, help='QEMU -icount shift, -1 for real time')
+    parser.add_argument('--psram', action='store_true', help='give QEMU 4 MB of PSRAM')
+    parser.add_argument('--csv', default='soak.csv')
+    parser.add_argument('--max-leak', type=int, default=0, help='bytes of IRAM or DRAM')
+    parser.add_argument('--max-drift', type=float, default=0.25, help='growth of the load p50')
+    parser.add_argument('--timeout', type=int, default=24 * 3600, help='seconds')
+    parser.add_argument('--log', help='save the raw serial output')
+    args = parser.parse_args()
+    if args.icount < 0:
+        args.icount = None
+
+    log = open(args.log, 'wb') if args.log else None
+    qemu = None
+    if not args.url:
+        if not os.path.exists(args.flash):
+            sys.exit(f'No flash image at {args.flash}')
+        qemu = start_qemu(args)
+    url = args.url or f'socket://localhost:{args.tcp_port}'
+
+    try:
+        dev = connect(url, log)
+        dev.ser.write(b'\r')
+        dev.read_until(PROMPT, 60)
+        # Guest output must not hold up the soak
+        dev.command('console drop')
+        names = store_modules(dev, args.modules)
+        with open(args.csv, 'w', newline='') as f:
+            writer = csv.writer(f)
+            writer.writerow(FIELDS)
+            summary = soak(dev, names, args.iterations, writer, args.timeout)
+    finally:
+        if qemu:
+            qemu.terminate()
+            qemu.wait()
+        if log:
+            log.close()
+
+    failed = False
+    if summary.get('failures'):
+        print(f'{summary["failures"]} failed operations')
+        failed = True
+    leak = summary.get('leak')
+    if leak is None or max(leak) > args.max_leak:
+        print(f'Leak: IRAM {leak[0]}, DRAM {leak[1]} bytes' if leak else 'No leak summary')
+        failed = True
+    drift = summary.get('drift')
+    if drift and drift[0] and (drift[1] - drift[0]) / drift[0] > args.max_drift:
+        print(f'Load p50 drifted from {drift[0]} to {drift[1]} us')
+        failed = True
+    print(f'Windows written to {args.csv}')
+    if failed:
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
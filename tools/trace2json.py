@@ -0,0 +1,109 @@
+import argparse
+import json
+import re
+import sys
+
+# Converts the output of the 'trace dump' shell command into Chrome trace
+# JSON, for chrome://tracing or ui.perfetto.dev. The input may be a whole
+# serial log, everything outside the dump is ignored. Every task gets its own
+# track; events from interrupts go to one track per core.
+
+HEADER_RE = re.compile(r'=== Trace: (\d+) MHz')
+SYNC_RE = re.compile(r'^S (\d+) (\d+) (-?\d+)$')
+TASK_RE = re.compile(r'^T ([0-9a-f]+) (.*)$')
+EVENT_RE = re.compile(r'^E (\d+) (\d+) ([BECI]) (-?\d+) ([0-9a-f]+) (.+)$')
+PHASES = {'B': 'B', 'E': 'E', 'C': 'C', 'I': 'i'}
+
+
+def parse(lines):
+    mhz = None
+    sync = {}
+    tasks = {}
+    events = []
+    for line in lines:
+        line = line.strip()
+        m = HEADER_RE.search(line)
+        if m:
+            # Keep only the last dump in the log
+            mhz = int(m.group(1))
+            sync = {}
+            tasks = {}
+            events = []
+            continue
+        if mhz is None:
+            continue
+        m = SYNC_RE.match(line)
+        if m:
+            sync[int(m.group(1))] = (int(m.group(2)), int(m.group(3)))
+            continue
+        m = TASK_RE.match(line)
+        if m:
+            tasks[int(m.group(1), 16)] = m.group(2)
+            continue
+        m = EVENT_RE.match(line)
+        if m:
+            events.append((int(m.group(1)), int(m.group(2)), m.group(3), int(m.group(4)),
+                           int(m.group(5), 16), m.group(6)))
+    if mhz is None:
+        sys.exit('No trace dump in the input')
+    return mhz, sync, tasks, events
+
+
+def convert(mhz, sync, tasks, events):
+    out = []
+    # CCOUNT is 32 bits and wraps every ~18 s at 240 MHz, events on a core
+    # are in order so a step backwards means a wrap
+    last = {}
+    isr_cores = set()
+    for core, ccount, kind, value, task, name in events:
+        base_ccount, base_us = sync[core]
+        prev_raw, wraps = last.get(core, (base_ccount, 0))
+        if ccount < prev_raw:
+            wraps += 1
+        last[core] = (ccount, wraps)
+
+        # Task handles are RAM addresses, they never collide with core numbers
+        if not task:
+            isr_cores.add(core)
+        cycles = ccount + (wraps << 32) - base_ccount
+        event = {
+            'name': name,
+            'ph': PHASES[kind],
+            'ts': base_us + cycles / mhz,
+            'pid': 0,
+            'tid': task or core,
+        }
+        if kind == 'C':
+            event['args'] = {name: value}
+        elif kind == 'I':
+            event['s'] = 't'
+        out.append(event)
+
+    for task, name in tasks.items():
+        out.append({'name': 'thread_name', 'ph': 'M', 'pid': 0, 'tid': task,
+                    'args': {'name': f'{name} ({task:x})'}})
+    for core in isr_cores:
+        out.append({'name': 'thread_name', 'ph': 'M', 'pid': 0, 'tid': core,
+                    'args': {'name': f'core {core} ISR'}})
+    return out
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Convert an ESP32-DOS trace dump to Chrome trace JSON')
+    parser.add_argument('input', nargs='?', help='saved serial output, default: stdin')
+    parser.add_argument('-o', '--output', default='trace.json')
+    args = parser.parse_args()
+
+    if args.input:
+        with open(args.input, errors='replace') as f:
+            mhz, sync, tasks, events = parse(f)
+    else:
+        mhz, sync, tasks, events = parse(sys.stdin)
+
+    with open(args.output, 'w') as f:
+        json.dump({'traceEvents': convert(mhz, sync, tasks, events), 'displayTimeUnit': 'ns'}, f)
+    print(f'{len(events)} events written to {args.output}')
+
+
+if __name__ == '__main__':
+    main()